@@ -0,0 +1,166 @@
+#ifndef BOARD_H
+#define BOARD_H
+#include "mbed.h"
+#include "instance.h"
+
+// Board traits.
+// What changes from one board to another, as compile time constants:
+// the Sharp interface pins, the SD card SPI pins, the buffer sizes fitting
+// the MCU's RAM, the timing defaults. The pin objects and the buffers of the
+// other modules are all built from the Board selected at the bottom, so that
+// a new board (e.g. one of the alternative designs in the README) needs only
+// a struct here.
+// (MCU peripherals, e.g. the console DMA channel, stay with their module.)
+
+// sizes and timings, per MCU; then the boards, with the pin names of
+// their target
+#if defined TARGET_NUCLEO_L053R8
+struct McuL053R8 {                                   // 8 KB RAM
+    static constexpr int ARENA_SIZE     = 1512;      // in/out/debug buffers (commands.cpp)
+    static constexpr int DEBUG_SIZE     = 1000;      // debug log, at the arena end
+    static constexpr int CONSOLE_RING   = 256;       // console output (console.cpp)
+    static constexpr int DIR_INDEX_SIZE = 0;         // files cached (storage.cpp), 0: none
+    static constexpr int OPEN_FILES     = 1;         // OPEN'ed files at the same time
+    static constexpr int MANIFEST_SLOTS = 256;       // content manifest (storage.cpp)
+    static constexpr int MANIFEST_DIRTY = 2;
+    static constexpr int DEBUG_TIMEOUT  = 2000;      // ms, debug log dump period
+};
+
+// Nucleo L053R8 prototype
+struct BoardL053R8 : McuL053R8 {
+    // Sharp side (inputs)
+    static constexpr PinName BUSY    = PC_0;
+    static constexpr PinName D_OUT   = PC_1;
+    static constexpr PinName X_OUT   = D6;
+    static constexpr PinName D_IN    = D7;
+    static constexpr PinName SEL_1   = D9;
+    static constexpr PinName SEL_2   = D8;
+    // emulator side (outputs)
+    static constexpr PinName ACK     = D10;
+    static constexpr PinName O_D_OUT = D11;
+    static constexpr PinName O_D_IN  = D12;
+    static constexpr PinName O_SEL_1 = D15;
+    static constexpr PinName O_SEL_2 = D14;
+    static constexpr PinName LED     = LED1; // D13
+    static constexpr PinName BUTTON  = USER_BUTTON;
+    // SD card
+    static constexpr PinName SD_MOSI = PB_5;
+    static constexpr PinName SD_MISO = PB_4;
+    static constexpr PinName SD_SCLK = PB_3;
+    static constexpr PinName SD_CS   = PA_10;
+    static constexpr PinName SD_DETECT = NC; // socket switch to GND with a card in, NC: none (probed)
+};
+#endif
+
+#if defined TARGET_NUCLEO_L432KC
+struct McuL432KC {                                   // 64 KB RAM
+    // the arena is what's left of the RAM: the other static buffers below
+    // (and the file pool, console and transfer rings) take about 18 KB, the
+    // mbed runtime, heap and stack want 10 KB
+    static constexpr int ARENA_SIZE     = 36000;
+    static constexpr int DEBUG_SIZE     = 6000;
+    static constexpr int CONSOLE_RING   = 2048;
+    static constexpr int DIR_INDEX_SIZE = 128;
+    static constexpr int OPEN_FILES     = 6;         // MAX_N_FILES, all of them
+    static constexpr int MANIFEST_SLOTS = 1024;
+    static constexpr int MANIFEST_DIRTY = 8;
+    static constexpr int ALIAS_SLOTS    = 256;       // name aliases (storage.cpp)
+    static constexpr int CAPTURE_RING   = 128;       // wire capture records (capture.cpp)
+    static constexpr uint32_t CACHE_BASE = 0x08030000; // flash cache (flashcache.cpp): top 64 KB of the 256
+    static constexpr int CACHE_SLOTS    = 8;
+    static constexpr int CACHE_SLOT     = 8192;      // bytes each, header included: whole flash pages
+    static constexpr int DEBUG_TIMEOUT  = 3000;
+};
+
+// Nucleo L432KC on a breadboard prototype
+struct BoardBreadboard : McuL432KC {
+    static constexpr PinName BUSY    = PA_8;
+    static constexpr PinName D_OUT   = PA_11;
+    static constexpr PinName X_OUT   = PA_0;
+    static constexpr PinName D_IN    = PA_1;
+    static constexpr PinName SEL_1   = PA_12;
+    static constexpr PinName SEL_2   = PB_0;
+    static constexpr PinName ACK     = PB_7;
+    static constexpr PinName O_D_OUT = PB_6;
+    static constexpr PinName O_D_IN  = PB_1;
+    static constexpr PinName O_SEL_1 = PA_9;
+    static constexpr PinName O_SEL_2 = PA_10;
+    static constexpr PinName LED     = LED1;
+    static constexpr PinName BUTTON  = PB_4;
+    // NOTE - SB16 and SB18 has to be open (on board back), to use PA5 and PA6
+    static constexpr PinName SD_MOSI = PA_7;
+    static constexpr PinName SD_MISO = PA_6;
+    static constexpr PinName SD_SCLK = PA_5;
+    static constexpr PinName SD_CS   = PB_5;
+    static constexpr PinName SD_DETECT = NC;
+};
+
+// Nucleo L432KC on the PCB (KiCad_v1)
+struct BoardPcbV1 : McuL432KC {
+    static constexpr PinName BUSY    = PA_9;
+    static constexpr PinName D_OUT   = PA_10;
+    static constexpr PinName X_OUT   = PA_0;
+    static constexpr PinName D_IN    = PA_1;
+    static constexpr PinName SEL_1   = PB_1;
+    static constexpr PinName SEL_2   = PB_6;
+    static constexpr PinName ACK     = PB_7;
+    static constexpr PinName O_D_OUT = PA_12;
+    static constexpr PinName O_D_IN  = PB_0;
+    static constexpr PinName O_SEL_1 = PA_11;
+    static constexpr PinName O_SEL_2 = PA_8;
+    static constexpr PinName LED     = LED1;
+    static constexpr PinName BUTTON  = PB_4;
+    static constexpr PinName SD_MOSI = PA_7;
+    static constexpr PinName SD_MISO = PA_6;
+    static constexpr PinName SD_SCLK = PA_5;
+    static constexpr PinName SD_CS   = PB_5;
+    static constexpr PinName SD_DETECT = NC;
+};
+
+// Host build (tools/host): the PCB, pins being mere numbers to the
+// stand-ins of mbed.h there
+struct BoardHost : BoardPcbV1 {
+};
+#endif
+
+#if defined HOST_BUILD
+typedef BoardHost Board;
+#elif defined TARGET_NUCLEO_L432KC
+//typedef BoardBreadboard Board; // prototype
+typedef BoardPcbV1 Board; // PCB make
+#elif defined TARGET_NUCLEO_L053R8
+typedef BoardL053R8 Board;
+#endif
+
+// Bus lines.
+// The mbed objects set the pins up (mode, pull); reads and writes then go
+// straight to the port registers, address and mask being constants of the
+// pin, instead of through the gpio_t of the object.
+#ifndef HOST_BUILD
+#define LINE_GPIO(p) ((GPIO_TypeDef *)( GPIOA_BASE + ( ( (uint32_t)(p) >> 4 ) & 0xF ) * ( GPIOB_BASE - GPIOA_BASE ) ))
+#define LINE_MASK(p) ( 1u << ( (uint32_t)(p) & 0xF ) )
+#endif
+
+template <PinName P>
+class LineIn : public DigitalIn {
+public:
+    LineIn ( void ) : DigitalIn ( P ) {}
+#ifndef HOST_BUILD
+    int read ( void ) { return ( LINE_GPIO(P)->IDR & LINE_MASK(P) ) ? 1 : 0; }
+    operator int() { return read(); }
+#endif
+};
+
+template <PinName P>
+class LineOut : public DigitalOut {
+public:
+    LineOut ( void ) : DigitalOut ( P ) {}
+#ifndef HOST_BUILD
+    void write ( int value ) { LINE_GPIO(P)->BSRR = value ? LINE_MASK(P) : LINE_MASK(P) << 16; }
+    int  read ( void ) { return ( LINE_GPIO(P)->ODR & LINE_MASK(P) ) ? 1 : 0; }
+    operator int() { return read(); }
+#endif
+    LineOut &operator= ( int value ) { write ( value ); return *this; }
+};
+
+#endif
@@ -0,0 +1,163 @@
+#include "storage.h"
+#include "capture.h"
+
+#ifdef WIRE_CAPTURE
+// from other modules
+extern void debug_log(const char *fmt, ...);
+extern INSTANCE Timer      mainTimer;
+extern INSTANCE LineIn<Board::X_OUT> in_X_OUT;
+extern INSTANCE LineIn<Board::BUSY>  in_BUSY;
+extern INSTANCE LineIn<Board::D_OUT> in_D_OUT;
+extern INSTANCE LineIn<Board::D_IN>  in_D_IN;
+extern INSTANCE LineIn<Board::SEL_1> in_SEL_1;
+extern INSTANCE LineIn<Board::SEL_2> in_SEL_2;
+extern INSTANCE LineOut<Board::ACK>  out_ACK;
+
+// Wire capture.
+// The handlers add a record per bus event into a RAM ring (interrupts held
+// off for the copy only); the main loop writes it to the card, under the
+// card lock, while the Sharp is between two handshakes. Commands sending
+// a long output (LOAD) keep the main loop out for seconds: SendOutputData
+// then flushes the ring itself between two nibbles, which delays the next
+// ACK by the card write (a few ms, once every 16 nibbles or so) - the Sharp
+// waits for it, but the timing of a capture taken there is not the same
+// as without capture. When the ring is full anyway, the records are counted
+// and a CAP_OVERRUN one tells the replay how many are missing.
+INSTANCE volatile bool     captureOn = false;
+INSTANCE volatile bool     captureWanted = false;
+INSTANCE caprec_t          capRing[Board::CAPTURE_RING];
+INSTANCE volatile uint16_t capHead = 0;
+INSTANCE volatile uint16_t capTail = 0;
+INSTANCE volatile uint16_t capLost = 0;
+INSTANCE FIL              *capFile = NULL;
+INSTANCE uint32_t          capSize;
+INSTANCE uint32_t          capRecords;
+#ifdef HOST_BUILD
+INSTANCE void            (*captureTap) ( uint8_t kind, uint16_t aux ) = NULL;
+#endif
+
+uint8_t captureLines ( void ) {
+    return ( in_X_OUT ? CAP_L_XOUT : 0 ) | ( in_BUSY  ? CAP_L_BUSY : 0 )
+         | ( in_D_OUT ? CAP_L_DOUT : 0 ) | ( in_D_IN  ? CAP_L_DIN  : 0 )
+         | ( in_SEL_1 ? CAP_L_SEL1 : 0 ) | ( in_SEL_2 ? CAP_L_SEL2 : 0 )
+         | ( out_ACK  ? CAP_L_ACK  : 0 );
+}
+
+uint16_t captureQueued ( void ) {
+    return ( capHead + Board::CAPTURE_RING - capTail ) % Board::CAPTURE_RING;
+}
+
+void captureEvent ( uint8_t kind, uint16_t aux ) {
+#ifdef HOST_BUILD
+    if ( captureTap )
+        captureTap ( kind, aux );
+#endif
+    if ( capFile == NULL )
+        return;
+    __disable_irq();
+    // room for this one, plus the overrun record if needed
+    if ( captureQueued() >= Board::CAPTURE_RING - ( capLost ? 2 : 1 ) ) {
+        capLost++;
+        __enable_irq();
+        return;
+    }
+    uint32_t now = mainTimer.read_us();
+    uint8_t lines = captureLines();
+    if ( capLost ) {
+        caprec_t *o = &capRing[capHead];
+        o->time = now;
+        o->kind = CAP_OVERRUN;
+        o->lines = lines;
+        o->aux = capLost;
+        capHead = ( capHead + 1 ) % Board::CAPTURE_RING;
+        capLost = 0;
+    }
+    caprec_t *r = &capRing[capHead];
+    r->time = now;
+    r->kind = kind;
+    r->lines = lines;
+    r->aux = aux;
+    capHead = ( capHead + 1 ) % Board::CAPTURE_RING;
+    __enable_irq();
+}
+
+void captureRequest ( bool on ) {
+    captureWanted = on;
+}
+
+// write the queued records (card lock held, or no main loop access going on)
+void captureFlush ( void ) {
+    while ( capFile != NULL && capHead != capTail ) {
+        uint16_t head = capHead;
+        uint16_t n = ( head > capTail ) ? head - capTail : Board::CAPTURE_RING - capTail;
+        int w = storageWrite ( capFile, (const uint8_t *)&capRing[capTail], n * sizeof(caprec_t) );
+        if ( w != (int)(n * sizeof(caprec_t)) ) {
+            debug_log ("capture write error\n");
+            capHead = capTail; // drop
+            captureWanted = false;
+            return;
+        }
+        capSize += w;
+        capRecords += n;
+        capTail = ( capTail + n ) % Board::CAPTURE_RING;
+    }
+}
+
+void captureFlushNow ( void ) {
+    if ( capFile == NULL || storageLocked() || captureQueued() < Board::CAPTURE_RING / 2 )
+        return;
+    captureFlush ();
+}
+
+void captureTask ( void ) {
+    if ( captureWanted && capFile == NULL ) {
+        caphdr_t hdr;
+        uint32_t oldSize = 0;
+        memset ( &hdr, 0, sizeof(hdr) );
+        memcpy ( hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic) );
+        hdr.version = CAPTURE_VERSION;
+        hdr.recSize = sizeof(caprec_t);
+        storageLock();
+        storageStat ( CAPTURE_FILE, &oldSize );
+        capFile = storageOpen ( CAPTURE_FILE, 'w' );
+        if ( capFile != NULL && storageWrite ( capFile, (const uint8_t *)&hdr, sizeof(hdr) ) != sizeof(hdr) ) {
+            storageClose ( capFile );
+            capFile = NULL;
+        }
+        if ( capFile != NULL )
+            storageFileWritten ( CAPTURE_FILE, oldSize, 0 );
+        storageUnlock();
+        if ( capFile == NULL ) {
+            ERR_PRINTOUT ( "capture: can't create " CAPTURE_FILE "\n" );
+            captureWanted = false;
+            return;
+        }
+        capHead = capTail = capLost = 0;
+        capSize = sizeof(hdr);
+        capRecords = 0;
+        captureOn = true;
+        captureEvent ( CAP_START, Board::CAPTURE_RING );
+        consolePrintf ( "capture on\n" );
+        return;
+    }
+    if ( capFile == NULL )
+        return;
+    if ( !captureWanted && captureOn ) {
+        captureOn = false;
+        captureEvent ( CAP_STOP, capLost );
+    }
+    if ( capHead != capTail ) {
+        storageLock();
+        captureFlush ();
+        storageUnlock();
+    }
+    if ( !captureOn ) {
+        storageLock();
+        storageClose ( capFile );
+        storageFileWritten ( CAPTURE_FILE, 0, capSize );
+        storageUnlock();
+        capFile = NULL;
+        consolePrintf ( "capture off: %u records\n", capRecords );
+    }
+}
+#endif
@@ -0,0 +1,81 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdint.h>
+#include "board.h"
+
+// Wire-level capture (see capture.cpp).
+// Bus events as seen by the handshake handlers, timestamped by mainTimer,
+// recorded into a binary file on the card, to be fed back through the same
+// code by the host replay (tools/host/replay.cpp).
+// Started and stopped by the "cap on" / "cap off" console commands.
+#if defined TARGET_NUCLEO_L432KC
+#define WIRE_CAPTURE 1 // ring: Board::CAPTURE_RING records, flushed to the card when half full
+#endif
+
+#define CAPTURE_FILE    "/sd/WIRE.CAP"
+#define CAPTURE_MAGIC   "CE140CAP"
+#define CAPTURE_VERSION 1
+
+// record kinds
+#define CAP_START    0x01 // capture started, lines as found
+#define CAP_STOP     0x02
+#define CAP_OVERRUN  0x03 // aux: records lost (ring full) before this one
+#define CAP_XOUT     0x04 // X_OUT rise (startDeviceCodeSeq)
+#define CAP_BIT_BUSY 0x05 // BUSY rise, device code bit (bitReady)
+#define CAP_BIT      0x06 // aux: device code bit read
+#define CAP_DEVICE   0x07 // aux: device code
+#define CAP_NIB_IN   0x08 // BUSY rise, nibble in (inNibbleReady), aux: nibble
+#define CAP_NIB_ACK  0x09 // BUSY fall, nibble in (inNibbleAck)
+#define CAP_CMD      0x0A // command received, aux: command code
+#define CAP_CMD_DONE 0x0B // command processed, aux: output bytes
+#define CAP_NIB_OUT  0x0C // nibble out on the lines, aux: nibble
+#define CAP_SEEN     0x0D // lines polled by a wait loop, aux: CAP_W_*
+#define CAP_ACK      0x0E // aux: ACK level written
+
+// wait loops (CAP_SEEN)
+#define CAP_W_DOUT      1 // D_OUT up, device code start
+#define CAP_W_XOUT_BUSY 2 // X_OUT and BUSY down, data receive start
+#define CAP_W_OUT_DOWN  3 // BUSY down, before a nibble out
+#define CAP_W_OUT_UP    4 // BUSY up, nibble out taken
+
+// line levels, sampled with each record
+#define CAP_L_XOUT 0x01
+#define CAP_L_BUSY 0x02
+#define CAP_L_DOUT 0x04
+#define CAP_L_DIN  0x08
+#define CAP_L_SEL1 0x10
+#define CAP_L_SEL2 0x20
+#define CAP_L_ACK  0x40
+
+typedef struct {
+    uint32_t time;  // mainTimer, us
+    uint8_t  kind;
+    uint8_t  lines;
+    uint16_t aux;
+} caprec_t;         // 8 bytes, little endian
+
+// file: header, then the records
+typedef struct {
+    char     magic[8];
+    uint16_t version;
+    uint16_t recSize;
+    uint32_t reserved;
+} caphdr_t;         // 16 bytes
+
+#ifdef WIRE_CAPTURE
+extern INSTANCE volatile bool captureOn;
+void captureEvent ( uint8_t kind, uint16_t aux );
+void captureRequest ( bool on );   // console command
+void captureTask ( void );         // main loop: file open/close, flush
+void captureFlushNow ( void );     // from a long handler (SendOutputData)
+#ifdef HOST_BUILD
+// host tools: every event as it happens, captureOn set with no file open
+// for the tap alone (waveform export, tools/host/replay.cpp)
+extern INSTANCE void (*captureTap) ( uint8_t kind, uint16_t aux );
+#endif
+#define CAPTURE(kind, aux) do { if ( captureOn ) captureEvent ( kind, aux ); } while (0)
+#else
+#define CAPTURE(kind, aux) do { } while (0)
+#endif
+
+#endif
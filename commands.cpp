@@ -1,82 +1,136 @@
 #include "commands.h"
 #include "SDFileSystem.h"
+#include "storage.h"
+#include "events.h"
+#include "profile.h"
+#include "memstat.h"
+#include "flashcache.h"
 #include "errno.h"
+#include <ctype.h>
 #include <cstdint>
 
 // from other modules
 extern void debug_log(const char *fmt, ...);
 extern void debug_hex(volatile uint8_t *buf, volatile uint16_t len);
 extern void outDebugDump( void );
-extern RawSerial pc;
-extern volatile uint16_t outDataGetPosition;
-
-// shared over different threads
-volatile uint8_t     inDataBuf[IN_BUF_SIZE];
-volatile uint8_t     outDataBuf[OUT_BUF_SIZE];
-volatile uint16_t    inBufPosition;
-volatile uint16_t    inBufStart;
-volatile uint16_t    outDataPutPosition;
-volatile bool        cmdComplete;
-volatile uint8_t     skipDeviceCode = 0;
-
-// open file pointers
+
+// Buffers arena.
+// inDataBuf, outDataBuf and debugBuf are carved out of a single static block,
+// instead of each one sized for its own worst case:
+// - receive: the command from the Sharp may take all the shared region 
+// - process: the output starts right after the bytes actually received
+// - transmit: the output only (input consumed)
+// while the debug log keeps its own region at the end.
+INSTANCE uint8_t     arena[Board::ARENA_SIZE];
+INSTANCE char       *debugBuf = (char*)arena + IN_BUF_SIZE;
+// high-water marks
+INSTANCE uint16_t             arenaInPeak = 0;
+INSTANCE uint16_t             arenaOutPeak = 0;
+extern INSTANCE volatile uint16_t debugPeak;
+extern INSTANCE volatile uint16_t debugPos;
+// and per command code, what the board's buffers are sized on
+#define ARENA_CODES 16
 typedef struct {
-    uint8_t fn;
-    uint8_t mode;
-    FILE* fp;
-    uint16_t pos;
-} finfo_t ;
-
-finfo_t open_files[MAX_N_FILES];
-
-// locals
-uint8_t  out_checksum = 0;
-FILE    *fp;
-int      fileCount; 
-uint8_t  FileName[17];
-int      file_size;
-int      file_pos = 0;
-
-Timeout  watchdogTimer;
+    uint8_t  code;
+    uint16_t in;
+    uint16_t out;
+    uint16_t debug; // debug log written while processing
+} arenapeak_t;
+INSTANCE arenapeak_t          arenaPeak[ARENA_CODES];
+INSTANCE uint8_t              arenaPeakCount = 0;
+INSTANCE arenapeak_t         *arenaCur = NULL; // this command's, NULL past ARENA_CODES
+INSTANCE uint16_t             arenaDebugMark;
+
+// the command context (commands.h)
+INSTANCE cmdctx_t    ctx;
+
+#define INPUT_LINE 81 // chars per INPUT# reply, the rest of a line with the next one
+
+INSTANCE Timeout  watchdogTimer;
 #define  LOAD_WD_TIMEOUT 3   
 
-// SD Card (SDFileSystem library)
-#if defined TARGET_NUCLEO_L053R8
-//DigitalIn    sdmiso(PB_4);
-uint8_t sdmiso  = 1; // probing pin doesn't work! 
-SDFileSystem sd(PB_5, PB_4, PB_3, PA_10, "sd"); // mosi, miso, sclk, cs
-#endif
-#if defined TARGET_NUCLEO_L432KC
-//DigitalIn    sdmiso(PA_6);
-uint8_t sdmiso  = 1; // probing pin doesn't work! 
-// NOTE - SB16 and SB18 has to be open (on board back), to use PA5 and PA6
-SDFileSystem sd(PA_7, PA_6, PA_5, PB_5, "sd"); // mosi, miso, sclk, cs
-#endif
+// SD Card (SDFileSystem library, pins: see board.h), checked before
+// each command (storageCardCheck)
+INSTANCE SDFileSystem sd(Board::SD_MOSI, Board::SD_MISO, Board::SD_SCLK, Board::SD_CS, "sd");
+
+// process phase: output right after the received command 
+void arenaProcessPhase ( void ) {
+    uint8_t code = ctx.skipDeviceCode ? ctx.skipDeviceCode : ctx.inDataBuf[0];
+    int i;
+    if ( ctx.inBufPosition > arenaInPeak ) 
+        arenaInPeak = ctx.inBufPosition;
+    for ( i=0; i<arenaPeakCount && arenaPeak[i].code != code; i++ )
+        ;
+    arenaCur = NULL;
+    if ( i < ARENA_CODES ) {
+        if ( i == arenaPeakCount ) {
+            arenaPeak[i].code = code;
+            arenaPeakCount++;
+        }
+        arenaCur = &arenaPeak[i];
+        if ( ctx.inBufPosition > arenaCur->in )
+            arenaCur->in = ctx.inBufPosition;
+    }
+    arenaDebugMark = debugPos;
+    // every command parses its input before appending to the output, and
+    // nothing past inBufPosition: the whole rest is the output's
+    ctx.outDataBuf = arena + ((ctx.inBufPosition + 3) & ~3); // word aligned
+    ctx.outBufSize = ( ctx.outDataBuf - arena < IN_BUF_SIZE ) ? IN_BUF_SIZE - (ctx.outDataBuf - arena) : 0;
+}
+
+// transmit phase: the output is complete
+void arenaTransmitPhase ( void ) {
+    if ( ctx.outDataPutPosition > arenaOutPeak ) 
+        arenaOutPeak = ctx.outDataPutPosition;
+    if ( arenaCur == NULL )
+        return;
+    if ( ctx.outDataPutPosition > arenaCur->out )
+        arenaCur->out = ctx.outDataPutPosition;
+    // the log may have been dumped meanwhile: what's there at least
+    uint16_t logged = debugPos >= arenaDebugMark ? debugPos - arenaDebugMark : debugPos;
+    if ( logged > arenaCur->debug )
+        arenaCur->debug = logged;
+}
+
+void arenaReport ( void ) {
+    consolePrintf ("arena %u: in+out %u, debug %u\n", Board::ARENA_SIZE, IN_BUF_SIZE, Board::DEBUG_SIZE);
+    consolePrintf ("peak in %u, out %u, debug %u\n", arenaInPeak, arenaOutPeak, debugPeak);
+    consolePrintf ("console ring %u, dropped %u\n", Board::CONSOLE_RING, consoleDropped());
+    if ( arenaPeakCount )
+        consolePrintf ("code     in    out  debug\n");
+    for ( int i=0; i<arenaPeakCount; i++ )
+        consolePrintf ("0x%02X %6u %6u %6u\n", arenaPeak[i].code, arenaPeak[i].in, arenaPeak[i].out, arenaPeak[i].debug);
+    memReport ();
+}
 
 uint8_t CheckSum(uint8_t b) {
-    out_checksum = (out_checksum + b) & 0xff;
+    ctx.out_checksum = (ctx.out_checksum + b) & 0xff;
     return b;
 }
 
 #ifdef ASYNCHOUT
 void outDataAppend(uint8_t b) {
-    if ( (outDataPutPosition++) == OUT_BUF_SIZE ) {
+    if ( (ctx.outDataPutPosition++) == ctx.outBufSize ) {
         // buffer full - hold until the spooler has reached buffer end
         // (a timeout should be added! in case the spooler hangs...)
-        while ( outDataGetPosition < outDataPutPosition ) 
+        while ( ctx.outDataGetPosition < ctx.outDataPutPosition ) 
             wait(.1); // wait
         // spool complete - reset buffer positions
-        outDataPutPosition = 0;
-        outDataGetPosition = 0;
+        ctx.outDataPutPosition = 0;
+        ctx.outDataGetPosition = 0;
     }
     // ok - add byte to send
-    outDataBuf[ outDataPutPosition ] = b;
+    ctx.outDataBuf[ ctx.outDataPutPosition ] = b;
 }
 #else
 void outDataAppend(uint8_t b) {
 
-    // We should check for buffer full!!
-    outDataBuf[ outDataPutPosition ++ ] = b;
+    if ( ctx.outDataPutPosition >= ctx.outBufSize ) {
+        // buffer full - would overwrite the debug log
+        ERR_PRINTOUT("output buffer full\n");
+        return;
+    }
+    ctx.outDataBuf[ ctx.outDataPutPosition ++ ] = b;
         
 }
 #endif
@@ -103,107 +157,173 @@ uint8_t *formatFileName(char *s) {
     if (p) {
         strncpy ((char*)tmp, (const char*)s, (p-s));
         trim(tmp); // shouldn' be needed... files are stored on SD without blanks
-        sprintf ((char*)FileName, "X:%-8s.BAS ", tmp ); // '%-8s' pads to 8 blanks
-        return FileName;
+        sprintf ((char*)ctx.FileName, "X:%-8s.BAS ", tmp ); // '%-8s' pads to 8 blanks
+        return ctx.FileName;
     } else
         return NULL;
 }
 
+// split a directory entry name into blank-padded 8.3 fields
+bool splitFileName83(const char *s, char *name, char *ext) {
+    const char *p = strchr(s, '.');
+    if ( p == NULL || (p-s) > 8 || strlen(p+1) > 3 )
+        return false;
+    memset(name, ' ', 8);
+    memset(ext, ' ', 3);
+    for (int i=0; i<(p-s); i++)
+        name[i] = toupper(s[i]);
+    for (int i=0; p[i+1]; i++)
+        ext[i] = toupper(p[i+1]);
+    return true;
+}
+
+// compile one field of the Sharp file spec, up to 'stop' or blank
+const uint8_t *compileSpecField(const uint8_t *s, const uint8_t *end,
+                                char *field, int len, char stop) {
+    int i = 0;
+    memset(field, ' ', len);
+    while ( s < end && *s != stop && *s != ' ' ) {
+        if ( *s == '*' ) {
+            while ( i < len ) field[i++] = '?';
+        } else if ( i < len ) {
+            field[i++] = toupper(*s);
+        }
+        s++;
+    }
+    return s;
+}
+
+// file spec as sent by the Sharp, e.g. "A*      .BAS"
+// (an empty spec lists all files, like "*.*")
+void compileFileSpec(const uint8_t *spec, int len, filespec_t *fs) {
+    const uint8_t *end = spec + len;
+    const uint8_t *s = spec;
+    while ( s < end && *s == ' ' ) s++;
+    if ( s == end ) {
+        memset(fs->name, '?', 8);
+        memset(fs->ext, '?', 3);
+        return;
+    }
+    s = compileSpecField(s, end, fs->name, 8, '.');
+    while ( s < end && *s != '.' ) s++;
+    if ( s < end ) s++; // skip '.'
+    compileSpecField(s, end, fs->ext, 3, '.');
+}
+
+bool matchFileSpec(const filespec_t *fs, const char *d_name) {
+    char name[8], ext[3];
+    if ( !splitFileName83(d_name, name, ext) )
+        return false; // not a 8.3 file with extension
+    for (int i=0; i<8; i++)
+        if ( fs->name[i] != '?' && fs->name[i] != name[i] ) return false;
+    for (int i=0; i<3; i++)
+        if ( fs->ext[i] != '?' && fs->ext[i] != ext[i] ) return false;
+    return true;
+}
+
 void process_FILES_LIST(uint8_t cmd) {
     // QString fname;
-    struct dirent* ent;
-    DIR *dir;
+    const char *ent;
     int n_files = -1;
-    uint8_t *ext_pos;
     uint8_t tmp[15];
 
-    pc.putc('f');pc.putc(0x30+cmd);pc.putc('\n');
+    consolePutc('f');consolePutc(0x30+cmd);consolePutc('\n');
     debug_log ("FILES_LIST 0x%02X\n", cmd);
-    outDataAppend(0x00);
-    out_checksum=0;
-    if ( sdmiso == 0 ) {
+    ctx.out_checksum=0;
+    if ( !storageCardPresent() ) {
         ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
+        outDataAppend(0x00);
         outDataAppend(0xFF); // returning an error to Sharp?
-        outDataAppend(out_checksum);
+        outDataAppend(ctx.out_checksum);
         return;
     }
 
     switch (cmd) {
     case 0:
-            fileCount++; // current file number
+            ctx.fileCount++; // current file number
             break;
     case 1:
-            fileCount--;
+            ctx.fileCount--;
             break;
     }
-    debug_log ("file # %d\n", fileCount);
-    if ((dir = opendir (SD_HOME)) != NULL) { 
+    debug_log ("file # %d\n", ctx.fileCount);
+    if ( storageDirOpen () ) { 
         // browse all the files, and stop at 'fileCount'
         // same loop as in process_FILES (which only counts them)
-        // NOTE - We browse the entire SD-card directory each time
-        // so to avoid keeping in memory the entire file list
-        // (256 files x 15 = potentially up to 3Kb)
-        while ((ent = readdir (dir)) != NULL
+        // NOTE - the listing comes from the directory index in RAM, 
+        // when the whole directory fits (see storage.cpp), or else
+        // we browse the entire SD-card directory each time
+        while ((ent = storageDirNext (NULL)) != NULL
             && n_files < 0xFF  // max 255 files 
             ) { 
-            //debug_log("<%s>\n", ent->d_name);
-            if ( (ext_pos = (uint8_t *)strstr (ent->d_name, ".")) != 0 ) {
+            //debug_log("<%s>\n", ent);
+            if ( matchFileSpec (&ctx.filesSpec, ent) ) {
                 n_files++;
                 //debug_log("BAS %d\n", n_files);
+                if ( n_files == ctx.fileCount )
+                    break; // this is the BAS file we're looking for
             }
-            if ( n_files == fileCount )
-                break; // this is the BAS file we're looking for
         }
+        if ( ent == NULL ) {
+            ERR_PRINTOUT(" ERR no more files\n");
+            outDataAppend(0xFF); // send err back, the only byte
+            storageDirClose ();
+            return;
+        }
+        outDataAppend(0x00); // status OK, the name follows
         // 'ent' now points to current file
         // file name expected like "X:A       .BAS "
-        debug_log("<%s>\n", ent->d_name);
-        strcpy((char*)tmp, ent->d_name);
-        const char *p = strstr(ent->d_name, ".");
-        const char *s = ent->d_name;
+        debug_log("<%s>\n", ent);
+        strcpy((char*)tmp, ent);
+        const char *p = strstr(ent, ".");
+        const char *s = ent;
         if (p) {
             strncpy ((char*)tmp, s, (p-s));
             tmp[(p-s)] = 0x00;
             trim(tmp); // shouldn't be needed... files stored on SD without blanks
-            sprintf ((char*)FileName, "X:%-8s%4s ",(char*)tmp, p); // '%-8s' pads to 8 blanks
-            debug_log("<%s>\n", ent->d_name);
+            sprintf ((char*)ctx.FileName, "X:%-8s%4s ",(char*)tmp, p); // '%-8s' pads to 8 blanks
+            debug_log("<%s>\n", ent);
         } else {
             outDataAppend(0xFF); // send err back
             ERR_PRINTOUT(" ERR clean\n");
         }
-        debug_log("formatted <%s>\n", FileName);
+        debug_log("formatted <%s>\n", ctx.FileName);
         // send formatted file name
-        sendString((char*)FileName);
-        outDataAppend(out_checksum);
-        closedir (dir);
+        sendString((char*)ctx.FileName);
+        outDataAppend(ctx.out_checksum);
+        storageDirClose ();
     }
 }
 
 void process_FILES(void) {
     
-    struct dirent* ent;
-    DIR *dir;
+    const char *ent;
     int n_files = 0x00;
-    uint8_t *ext_pos;
     
     debug_log ( "FILES\n" ); 
+    // file spec (e.g. "A*      .BAS") follows the "X:" drive prefix
+    if ( ctx.inBufPosition > 15 )
+        compileFileSpec((const uint8_t *)(ctx.inDataBuf+3), 12, &ctx.filesSpec);
+    else
+        compileFileSpec(NULL, 0, &ctx.filesSpec);
+    debug_log ( "spec <%.8s.%.3s>\n", ctx.filesSpec.name, ctx.filesSpec.ext );
     outDataAppend(CheckSum(0x00));
-    if ( sdmiso == 0 ) {
+    if ( !storageCardPresent() ) {
         ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
         outDataAppend(CheckSum(0x00)); // no files
-        outDataAppend(out_checksum);
+        outDataAppend(ctx.out_checksum);
         return;
     }
-    // file name wildcards (* ?) to be handled, yet ...
-    if ((dir = opendir (SD_HOME)) != NULL) { // ignore files other than BASIC
-        // print all the files and directories within directory
-        while ((ent = readdir (dir)) != NULL
+    if ( storageDirOpen () ) { // (re)builds the directory index
+        // count the files matching the spec (same filter as in FILES_LIST)
+        while ((ent = storageDirNext (NULL)) != NULL
             && n_files < 0xFF ) { // max 255 files
-            //debug_log("<%s>\n", ent->d_name);
-            if ( (ext_pos = (uint8_t *)strstr (ent->d_name, ".")) != 0 ) 
+            //debug_log("<%s>\n", ent);
+            if ( matchFileSpec (&ctx.filesSpec, ent) ) 
                 n_files++; 
         }
-        closedir (dir);
-        fileCount = -1;
+        storageDirClose ();
+        ctx.fileCount = -1;
         if ( n_files > 255 ){
             ERR_PRINTOUT("Number of files greater than 255!\n");
             outDataAppend(0x00);
@@ -216,24 +336,16 @@ void process_FILES(void) {
         ERR_PRINTOUT("Could not open SD home directory!\n");
         outDataAppend(0x00);
     }
-    outDataAppend(out_checksum);
-}
-
-bool file_exists (char *filename) {
-    FILE *file;
-    if ((file = fopen(filename, "r")))
-    {
-        fclose(file);
-        return true;
-    }
-    return false;
+    outDataAppend(ctx.out_checksum);
 }
 
-int getFileSize(FILE *fp) {
-    fseek(fp, 0, SEEK_END);
-    int size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    return size;
+// back to the pool - once only
+int closeLoadSaveFile (void) {
+    int r = 0;
+    if ( ctx.fp != NULL ) 
+        r = storageClose ( ctx.fp );
+    ctx.fp = NULL;
+    return r;
 }
 
 /* Closing a file during ASCII LOAD operations after a timeout
@@ -241,32 +353,50 @@ int getFileSize(FILE *fp) {
 *  any more a 0x12 command to get next line, while the file is open
 */
 void loadWatchdog (void) {
+    eventPost ( EV_LOAD_WD ); // card access: from the main loop
+}
+
+void loadWatchdogTask (void) {
     debug_log ( "loadWatchdog triggered\n");
-    if ( fp != NULL ) { 
-        debug_log ( "closing file <%d>...\n", fp );
-        fclose ( fp );
+    if ( ctx.fp != NULL ) { 
+        debug_log ( "closing file <%d>...\n", ctx.fp );
+        closeLoadSaveFile ();
     }
 }
 
+void getFileName( void );
+
+// no card: a LOAD still goes on from a flash cache copy
+bool loadCached ( uint8_t cmd ) {
+#ifdef FLASH_CACHE
+    if ( cmd != 0x0E )
+        return ( ctx.fp != NULL );
+    getFileName();
+    return ( flashCacheFind ( (char*)ctx.FileName + strlen(SD_HOME), NULL, false ) != NULL );
+#else
+    return false;
+#endif
+}
+
 void process_LOAD(uint8_t cmd) {
     debug_log ( "LOAD 0x%02X\n", cmd); 
     int c=0;
     uint8_t tmpFile[16];
 
-    out_checksum = 0;
-    if ( sdmiso == 0 ) {
+    ctx.out_checksum = 0;
+    if ( !storageCardPresent() && !loadCached(cmd) ) {
         ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
         outDataAppend(0x00); 
         sendString(" "); // ?
         outDataAppend(0x00);
         outDataAppend(0x00); 
         outDataAppend(0x00); // 0-size file
-        outDataAppend(out_checksum);
+        outDataAppend(ctx.out_checksum);
         return;
     }
     switch (cmd) {
         case 0x0E:  { // open file and send file size
-            pc.putc('l');
+            consolePutc('l');
             /*
             for (int i=3;i<15;i++) {
                 s.append(Quint8_t(data.at(i)));
@@ -276,41 +406,39 @@ void process_LOAD(uint8_t cmd) {
                 emit msgError(tr("ERROR opening file : %1").arg(s));
             }
             */
-            strncpy ((char*)tmpFile, (const char *)(inDataBuf+3), 12);
+            strncpy ((char*)tmpFile, (const char *)(ctx.inDataBuf+3), 12);
             tmpFile[12] = '\0'; // terminate
             trim (tmpFile); // remove blanks
-            sprintf ((char*)FileName, "%s%s", SD_HOME, tmpFile);
-            //pc.printf((char*)FileName);
-            debug_log ( "opening <%s>\n", FileName );
-            if ( fp != NULL ) { // just in case...
-                debug_log ( "file alredy open <%d>, closing...\n", fp );
-                if ( fclose ( fp ) != 0 ) 
+            sprintf ((char*)ctx.FileName, "%s%s", SD_HOME, tmpFile);
+            //consolePrintf((char*)FileName);
+            debug_log ( "opening <%s>\n", ctx.FileName );
+            if ( ctx.fp != NULL ) { // just in case...
+                debug_log ( "file alredy open <%d>, closing...\n", ctx.fp );
+                if ( closeLoadSaveFile () != 0 ) 
                    ERR_PRINTOUT("fclose error\n");
             }
-            fp = fopen((char*)FileName, "r"); // this needs to stay open until EOF
-            if ( fp == NULL ) {
+            // size from the directory entry (or index), before opening
+            uint32_t size = 0;
+            if ( !storageStat ( (char*)ctx.FileName, &size ) || size == 0 ) {
+                ERR_PRINTOUT("file not found, or empty\n");
+                consolePutc('x');
+                break;
+            }    
+            ctx.fp = storageOpen((char*)ctx.FileName, 'r'); // this needs to stay open until EOF
+            if ( ctx.fp == NULL ) {
                 ERR_PRINTOUT("fopen error\n");
-                char errstr[20];
-                sprintf (errstr, "errno %d\n", errno);
-                ERR_PRINTOUT(errstr);
                 break;
             }
-            file_size = getFileSize(fp);
-            if ( file_size <= 0 ) {
-                ERR_PRINTOUT("getFileSize error\n");
-                if ( fp != NULL ) fclose ( fp );
-                pc.putc('x');
-                break;
-            }    
-            debug_log ( "size %d\n", file_size);
-            file_pos = 0;
+            ctx.file_size = size;
+            debug_log ( "size %d\n", ctx.file_size);
+            ctx.file_pos = 0;
             outDataAppend(0x00);
             sendString(" "); // ?
             // Send file size : 3 bytes (optimistic!) + checksum
-            outDataAppend(CheckSum(file_size & 0xff));
-            outDataAppend(CheckSum((file_size >> 8) & 0xff));
-            outDataAppend(CheckSum((file_size >> 16) & 0xff));
-            outDataAppend(out_checksum);
+            outDataAppend(CheckSum(ctx.file_size & 0xff));
+            outDataAppend(CheckSum((ctx.file_size >> 8) & 0xff));
+            outDataAppend(CheckSum((ctx.file_size >> 16) & 0xff));
+            outDataAppend(ctx.out_checksum);
             break;
         }
         case 0x17: { // send header bytes
@@ -318,45 +446,46 @@ void process_LOAD(uint8_t cmd) {
             // sending several 0x17 commands, one byte each.
             // For an ASCII file the header is nonexistent
             // and first 0x17 command will returns a uint8_t != 0xFF
-            pc.putc('0');
+            consolePutc('0');
             //ba_load.remove(0,0x0f); // remove first byte 'ff'
             //ba_load.chop(1);
-            c = fgetc(fp);
-            file_pos++;
+            c = storageGetc(ctx.fp);
+            ctx.file_pos++;
             if ( c != EOF ) {
                 outDataAppend(0x00);
                 debug_log ( "first byte 0x%02X\n", c);
                 outDataAppend(CheckSum(c));
-                outDataAppend(out_checksum); 
+                outDataAppend(ctx.out_checksum); 
             } else {
                 ERR_PRINTOUT("fgetc EOF");
                 outDataAppend(0xff); // error to Sharp
-                if ( fp != NULL ) fclose ( fp );
+                closeLoadSaveFile ();
             }
             //ba_load.remove(0,0x10);
             //wait_data_function = 0xfd;
             break;
         }        
         case 0x12: { // ASCII data chunk (one line max)
-            pc.putc('a');
+            consolePutc('a');
             // Envoyer une ligne complete
             // Until end-of-line 0x0D
             // or end-of-file (EOF)
             // Start at 0x10 ??
             outDataAppend(0x00);
-            if (fp == NULL){
+            if (ctx.fp == NULL){
                 ERR_PRINTOUT("File is not open. Watchdog triggered?");
                 outDataAppend(CheckSum(0x1A));  // 0x1A pour fin de fichier
-                outDataAppend(out_checksum);
+                outDataAppend(ctx.out_checksum);
                 outDataAppend(0x00);
                 break;
             }
             // start a watchdog, while waiting for next 0x12 to come
             // (if not received within a timeout, close the file)
             watchdogTimer.attach( &loadWatchdog, LOAD_WD_TIMEOUT ); 
+            eventCancel ( EV_LOAD_WD ); // fired meanwhile: too late now
             do {
-                c=fgetc(fp);
-                file_pos++;
+                c=storageGetc(ctx.fp);
+                ctx.file_pos++;
                 outDataAppend(CheckSum(c));
             } while ((c != EOF) && (c!=0x0d));
             if (c!=0x0d) {
@@ -364,103 +493,104 @@ void process_LOAD(uint8_t cmd) {
                     debug_log ("EOF\n");
                     outDataAppend(CheckSum(0x1A));  // 0x1A pour fin de fichier
                     watchdogTimer.detach(); // remove watchdog
-                    if ( fp != NULL ) fclose ( fp );
+                    eventCancel ( EV_LOAD_WD );
+                    closeLoadSaveFile ();
                 }
             } else
                 debug_log ("line\n");
-            outDataAppend(out_checksum);
+            outDataAppend(ctx.out_checksum);
             outDataAppend(0x00);
             break;
         }
         case 0x0f: { // non-ASCII data stream (single chunk)
-            pc.putc('.');
+            consolePutc('.');
             outDataAppend(0x00);
-            uint16_t data_start = file_pos;
+            uint16_t data_start = ctx.file_pos;
             do {
-                c=fgetc(fp);
-                file_pos++;
+                c=storageGetc(ctx.fp);
+                ctx.file_pos++;
                 //debug_log (" %02X\n", c);
                 outDataAppend(CheckSum(c));
-                if (((file_pos-data_start)%0x100)==0) {
-                    outDataAppend(out_checksum);
-                    out_checksum=0;
+                if (((ctx.file_pos-data_start)%0x100)==0) {
+                    outDataAppend(ctx.out_checksum);
+                    ctx.out_checksum=0;
                 }
-            } while ( c != EOF && file_pos < file_size );
-            outDataAppend(out_checksum);
+            } while ( c != EOF && ctx.file_pos < ctx.file_size );
+            outDataAppend(ctx.out_checksum);
             outDataAppend(0x00);
-            if ( c==EOF && file_pos != file_size ) {
+            if ( c==EOF && ctx.file_pos != ctx.file_size ) {
                 ERR_PRINTOUT("fgetc error during LOAD");
-                if ( fp != NULL ) fclose ( fp );
+                closeLoadSaveFile ();
                 // how to tell Sharp-PC to stop sending more LOAD commands?
             }
-            if ( file_pos == file_size ) {
-                debug_log ("file complete (file_size %d)\n", file_size);
-                if ( fp != NULL ) fclose ( fp );  
+            if ( ctx.file_pos == ctx.file_size ) {
+                debug_log ("file complete (file_size %d)\n", ctx.file_size);
+                closeLoadSaveFile ();  
             } 
             break;
 
         }
         default: {
             ERR_PRINTOUT("unknown LOAD sub-command\n");
-            if ( fp != NULL ) fclose ( fp );
+            closeLoadSaveFile ();
             break;
         }
     }
 }
 
-FILE* openWriteFile( void ){
-    // create (or replace?) file
-    debug_log ("creating <%s>\n", FileName );
-    if ( file_exists ( (char*)FileName ) ) {
-        // file exists, remove it
-        int r = remove ( (char*)FileName );
-        debug_log ("remove: %d\n", r);
-    }
-    if ( fp != NULL ) {
-        int r = fclose ( fp ); // just in case...
+FIL* openWriteFile( void ){
+    uint32_t size = 0;
+    // create (or replace) file - truncated on open, when it exists
+    debug_log ("creating <%s>\n", ctx.FileName );
+    if ( ctx.fp != NULL ) {
+        int r = closeLoadSaveFile (); // just in case...
         debug_log ("fclose: %d\n", r);
     }
-    return fp = fopen((char*)FileName, "w"); // stay open until command complete
+    storageStat ( (char*)ctx.FileName, &size );
+    ctx.fp = storageOpen((char*)ctx.FileName, 'w'); // stay open until command complete
+    if ( ctx.fp != NULL )
+        storageFileWritten ( (char*)ctx.FileName, size, 0 );
+    return ctx.fp;
 }
 
 void getFileName( void ) {
     uint8_t tmpFile[16];
-    strncpy ((char*)tmpFile, (const char *)(inDataBuf+3), 12 );
+    strncpy ((char*)tmpFile, (const char *)(ctx.inDataBuf+3), 12 );
     tmpFile[12]=0; // terminate string
     trim (tmpFile); // remove blanks, for the SD card
-    sprintf ((char*)FileName, "%s%s", SD_HOME, tmpFile);
-    debug_log ("SDcard filename: %s\n", FileName);
+    sprintf ((char*)ctx.FileName, "%s%s", SD_HOME, tmpFile);
+    debug_log ("SDcard filename: %s\n", ctx.FileName);
 }
 
 void process_SAVE(int cmd) {
     debug_log ( "SAVE 0x%02X\n", cmd);
     int c=0;
 
-    out_checksum = 0;
-    if ( sdmiso == 0 ) {
+    ctx.out_checksum = 0;
+    if ( !storageCardPresent() ) {
         ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
         outDataAppend(0xFF); 
         return;
     }
     switch (cmd) {
         case 0x10: { // file name : create (or replace)
-            pc.putc('s');pc.putc('0');
+            consolePutc('s');consolePutc('0');
             getFileName();
             if ( openWriteFile() == NULL ) {
                 ERR_PRINTOUT( "openWriteFile error\n");
                 outDataAppend(0xFF); // NOT ok!
                 break;
             }
-            file_pos = 0;
+            ctx.file_pos = 0;
             outDataAppend(0x00); // ok, done
             break;
         }
         case 0x11: { // file size (non-ASCII)
-            pc.putc('s');pc.putc('1');
-            if ( file_pos != 0 ) {
+            consolePutc('s');consolePutc('1');
+            if ( ctx.file_pos != 0 ) {
                 // unexpected 0x11 here
                 ERR_PRINTOUT("unexpected 0x11 @%d");
-                if (fp != NULL ) fclose (fp);
+                closeLoadSaveFile ();
                 outDataAppend(0xFF); // return with error
                 break;
             }
@@ -471,67 +601,69 @@ void process_SAVE(int cmd) {
             // 3 : Size 2
             // 4 : Size 3
             // 5 : checksum 
-            file_size = (int)inDataBuf[2] + (int)(inDataBuf[3]<<8) + (int)(inDataBuf[4]<<16);
+            ctx.file_size = (int)ctx.inDataBuf[2] + (int)(ctx.inDataBuf[3]<<8) + (int)(ctx.inDataBuf[4]<<16);
             // debug_log (" 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X\n",
             //     inDataBuf[0],inDataBuf[1],inDataBuf[2],
             //     inDataBuf[3],inDataBuf[4],inDataBuf[5], inDataBuf[6] );
-            debug_log ("filesize: %d\n", file_size);
+            debug_log ("filesize: %d\n", ctx.file_size);
             outDataAppend(0x00); // ok, got size and file open
             // next command, without a device-code sequence
-            skipDeviceCode = 0xFF;
+            ctx.skipDeviceCode = 0xFF;
             break;
         }
         case 0x16: { // ASCII data stream
-            pc.putc('s');pc.putc('6');
+            consolePutc('s');consolePutc('6');
             outDataAppend(0x00); // ok, file open
-            file_pos = 0;
+            ctx.file_pos = 0;
             // next command, without a device-code sequence
-            skipDeviceCode = 0xFE;
+            ctx.skipDeviceCode = 0xFE;
             break;
         }
         case 0xFF: { // save file data block (non-ASCII)
-            pc.putc('.');
+            consolePutc('.');
             int buf_pos = 0;
-            skipDeviceCode = 0xFF; 
-            if ( fp == NULL ) {
+            ctx.skipDeviceCode = 0xFF; 
+            if ( ctx.fp == NULL ) {
                     ERR_PRINTOUT( "file not open\n");
                     outDataAppend(0xFF); // NOT ok!
                     break;
             }
-            debug_log ("inDataBuf size %d\n", inBufPosition);
-            while ( buf_pos < inBufPosition - 1 ) { // last byte is checksum
-                fputc ( (int)(inDataBuf[buf_pos]), fp) ;
-                buf_pos ++;
-                file_pos ++;
+            debug_log ("inDataBuf size %d\n", ctx.inBufPosition);
+            if ( ctx.inBufPosition > 1 ) { // last byte is checksum
+                buf_pos = storageWrite ( ctx.fp, (const uint8_t *)ctx.inDataBuf, ctx.inBufPosition - 1 );
+                if ( buf_pos > 0 ) 
+                    ctx.file_pos += buf_pos;
             }
-            debug_log ("file_pos %d file_size %d\n", file_pos, file_size);
-            if ( file_pos == file_size ) {
-                fclose (fp); // done
+            debug_log ("file_pos %d file_size %d\n", ctx.file_pos, ctx.file_size);
+            if ( ctx.file_pos == ctx.file_size ) {
+                closeLoadSaveFile (); // done
+                storageFileWritten ( (char*)ctx.FileName, 0, ctx.file_pos );
                 debug_log ("file done\n");
-                skipDeviceCode = 0x00;
+                ctx.skipDeviceCode = 0x00;
             }
             outDataAppend(0x00); // ok
             break;
         }
         
         case 0xFE: { // ASCII file block (one line)
-            pc.putc('.');
+            consolePutc('.');
             int buf_pos = 0;
-            if ( fp == NULL ) {
+            if ( ctx.fp == NULL ) {
                 ERR_PRINTOUT( "file not open\n");
                 outDataAppend(0xFF); // NOT ok!
                 break;
             }
             //debug_log ("<%s>\n", inDataBuf);
-            if ( inDataBuf[buf_pos] == 0x1A ) { // file end (to store it as well?)
+            if ( ctx.inDataBuf[buf_pos] == 0x1A ) { // file end (to store it as well?)
                 debug_log ("file done\n");
-                fclose (fp);
+                closeLoadSaveFile ();
+                storageFileWritten ( (char*)ctx.FileName, 0, ctx.file_pos );
             } else {
                 // store one line as is (including line termination 0x0D+0x0A)
-                while ( buf_pos < inBufPosition - 1 ) { // last byte is checksum
-                    fputc ((int)(inDataBuf[buf_pos]), fp) ;
-                    buf_pos ++;
-                    file_pos ++;
+                if ( ctx.inBufPosition > 1 ) { // last byte is checksum
+                    buf_pos = storageWrite ( ctx.fp, (const uint8_t *)ctx.inDataBuf, ctx.inBufPosition - 1 );
+                    if ( buf_pos > 0 ) 
+                        ctx.file_pos += buf_pos;
                 }
             }
             outDataAppend(0x00);
@@ -539,14 +671,14 @@ void process_SAVE(int cmd) {
         }
         default: {
             ERR_PRINTOUT("unknown SAVE sub-command\n");
-            if ( fp != NULL ) fclose ( fp );
+            closeLoadSaveFile ();
             break;
         }
     }
 }
 
 void process_DSKF(void) {
-        uint8_t dn = inDataBuf[1]; // N from command DSKF(N)
+        uint8_t dn = ctx.inDataBuf[1]; // N from command DSKF(N)
         uint32_t diskspace = 65535;
         debug_log ( "DSKF %d\n", dn ); 
 
@@ -554,18 +686,12 @@ void process_DSKF(void) {
             diskspace = 65535; 
             debug_log ("dummy diskspace %d\n", diskspace);
         } else {
-            FATFS* fs;
-            DWORD fre_clust;
-            debug_log ("retrieveing free clusters...\n");
-            f_getfree("0:",&fre_clust,&fs); 
-            debug_log ("free clusters %d; clust size %d\n", fs->free_clust, fs->csize);
-            uint64_t freeMb = (uint64_t)fs->csize * (uint64_t)fs->free_clust
-            #if _MAX_SS != 512
-                    *(fs->ssize)/1048576;
-            #else
-                    *512/1048576;
-            #endif
+            bool exact;
+            uint32_t clusters = storageFreeClusters ( &exact ); // cached
+            debug_log ("free clusters %d; clust size %d\n", clusters, storageClusterBytes());
+            uint64_t freeMb = (uint64_t)clusters * storageClusterBytes() / 1048576;
             diskspace = (uint32_t)freeMb; // disk free space
+            consolePrintf ("DSKF %u Mb (%s)\n", diskspace, exact ? "exact" : "estimated");
             debug_log ("SD free Mb %d\n", diskspace);
         }
         
@@ -573,29 +699,34 @@ void process_DSKF(void) {
         outDataAppend(CheckSum(diskspace & 0xff));  // number of bytes 
         outDataAppend(CheckSum((diskspace >> 8) & 0xff));  // number of 256Bytes free sectors
         outDataAppend(CheckSum((diskspace >> 16) & 0xff));
-        outDataAppend(out_checksum);      
+        outDataAppend(ctx.out_checksum);      
 }    
 
+// close an OPEN'ed file (array index), accounting for the space it took
+void closeOpenFile( int i ) {
+    if ( ctx.open_files[i].mode == 2 || ctx.open_files[i].mode == 3 ) 
+        storageFileWritten ( ctx.open_files[i].name, 
+            ctx.open_files[i].size, ctx.open_files[i].size + ctx.open_files[i].pos );
+    storageClose ( ctx.open_files[i].fp );
+    ctx.open_files[i].fp = NULL;
+    ctx.open_files[i].mode = 0;
+    ctx.open_files[i].pos = 0;
+}
+
 void process_CLOSE( void ) {
-        uint8_t fn = inDataBuf[1];
+        uint8_t fn = ctx.inDataBuf[1];
         debug_log ( "CLOSE 0x%02X\n", fn);
-        out_checksum = 0;
+        ctx.out_checksum = 0;
         // a CLOSE 0xFF (on all files) is issued also at RUN
         if ( fn == 0xFF )
             for  (int i=0; i<MAX_N_FILES; i++) {
-                if ( open_files[i].fp != NULL ) 
-                    fclose ( open_files[i].fp );
-                open_files[i].fp = NULL;
-                open_files[i].mode = 0;
-                open_files[i].pos = 0;
+                if ( ctx.open_files[i].fp != NULL ) 
+                    closeOpenFile ( i );
             }
         else {
             fn = fn - 2; // array index
-            if ( open_files[fn].fp != NULL ) {
-                fclose ( open_files[fn].fp );
-                open_files[fn].fp = NULL;
-                open_files[fn].mode = 0;
-                open_files[fn].pos = 0; 
+            if ( ctx.open_files[fn].fp != NULL ) {
+                closeOpenFile ( fn );
             }
             else
                 ERR_PRINTOUT("file not open");
@@ -604,40 +735,48 @@ void process_CLOSE( void ) {
 }  
 
 void process_OPEN( void ) {
-    FILE* fp;
-    uint8_t mode = inDataBuf[15]; // 1: input, 2: output, 3: append
-    uint8_t fn = inDataBuf[16]-2; // file#
+    FIL* fp = NULL;
+    uint32_t size = 0;
+    uint8_t mode = ctx.inDataBuf[15]; // 1: input, 2: output, 3: append
+    uint8_t fn = ctx.inDataBuf[16]-2; // file#
 
     getFileName();
-    debug_log ( "OPEN <%s> FOR '%d' AS #%d\n",FileName,mode,fn+2);
+    debug_log ( "OPEN <%s> FOR '%d' AS #%d\n",ctx.FileName,mode,fn+2);
 
     // file # from 2, used as file info array index
     if ( fn<0||fn>MAX_N_FILES ) {
         ERR_PRINTOUT( "Invalid file #\n");
         outDataAppend(0xFF); // NOT ok!
     }
-    if ( open_files[fn].fp != NULL ) 
-        fclose ( open_files[fn].fp ); // just in case...
+    if ( ctx.open_files[fn].fp != NULL ) 
+        closeOpenFile ( fn ); // just in case...
     switch ( mode ) {
         case 1:{
             // for 'input'          
-            fp = fopen((char*)FileName, "r"); // If the file exists already, contents overwritten
+            if ( !storageStat ( (char*)ctx.FileName, &size ) ) {
+                ERR_PRINTOUT("input no file\n");
+                break;
+            }
+            fp = storageOpen((char*)ctx.FileName, 'r');
             break;
         } 
         case 2:{
             // for 'output'
-            fp = fopen((char*)FileName, "w"); // If the file exists already, contents overwritten
+            uint32_t old = 0;
+            storageStat ( (char*)ctx.FileName, &old );
+            fp = storageOpen((char*)ctx.FileName, 'w'); // If the file exists already, contents overwritten
+            if ( fp != NULL ) 
+                storageFileWritten ( (char*)ctx.FileName, old, 0 );
             break;
         }         
         case 3:{
             // for 'append'
             // Sharp expects an error if file don't exists
-            if ( !file_exists ( (char*)FileName ) ) {
+            if ( !storageStat ( (char*)ctx.FileName, &size ) ) {
                 ERR_PRINTOUT("append no file\n");
-                outDataAppend(0xFF);
                 break;
             }
-            fp = fopen((char*)FileName, "a"); // appending to exisiting file (nee)
+            fp = storageOpen((char*)ctx.FileName, 'a'); // appending to exisiting file (nee)
             break;
         } 
     }
@@ -646,15 +785,17 @@ void process_OPEN( void ) {
         ERR_PRINTOUT("fopen error\n");
         outDataAppend(0xFF);
     } else {
-        open_files[fn].fp = fp;
-        open_files[fn].mode = mode;
-        open_files[fn].pos = 0;
+        ctx.open_files[fn].fp = fp;
+        ctx.open_files[fn].mode = mode;
+        ctx.open_files[fn].pos = 0;
+        ctx.open_files[fn].size = size;
+        strncpy ( ctx.open_files[fn].name, (char*)ctx.FileName + strlen(SD_HOME), 12 );
+        ctx.open_files[fn].name[12] = 0;
         // done
         outDataAppend(CheckSum(0x00));    
     }     
 }
 
-uint8_t cur_fn ;
 void process_PRINT( int cmd ) {
 
     debug_log ( "PRINT 0x%02X\n", cmd);
@@ -662,35 +803,36 @@ void process_PRINT( int cmd ) {
     switch (cmd) {
         case 0x15: { 
             // file for current command
-            cur_fn = inDataBuf[1]-2; // file# from 2
+            ctx.cur_fn = ctx.inDataBuf[1]-2; // file# from 2
             debug_log ( "file #%d 0x%02X '%d' @ %d\n", 
-                cur_fn+2, 
-                open_files[cur_fn].fp,
-                open_files[cur_fn].mode, 
-                open_files[cur_fn].pos);
+                ctx.cur_fn+2, 
+                ctx.open_files[ctx.cur_fn].fp,
+                ctx.open_files[ctx.cur_fn].mode, 
+                ctx.open_files[ctx.cur_fn].pos);
 
             // check if file mode is coherent with PRINT?
 
-            skipDeviceCode = 0xFD; // next PRINT sub-command
+            ctx.skipDeviceCode = 0xFD; // next PRINT sub-command
             outDataAppend(0x00); // ok, done
             break;
         }
         case 0xFD: {
             int buf_pos = 0;
-            debug_log ( " current file #%d\n", cur_fn+2); 
-            debug_log ( " inBufPosition %d\n", inBufPosition); 
+            debug_log ( " current file #%d\n", ctx.cur_fn+2); 
+            debug_log ( " inBufPosition %d\n", ctx.inBufPosition); 
             {
                 // similar to ascii-type SAVE
-                while ( buf_pos < inBufPosition - 2 ) { // omit 0x00+checksum
-                    fputc ((int)(inDataBuf[buf_pos]), open_files[cur_fn].fp) ;
+                while ( buf_pos < ctx.inBufPosition - 2 ) { // omit 0x00+checksum
+                    storagePutc ((int)(ctx.inDataBuf[buf_pos]), ctx.open_files[ctx.cur_fn].fp) ;
                     buf_pos ++;
-                    open_files[cur_fn].pos++; // store current file position in the array
+                    ctx.open_files[ctx.cur_fn].pos++; // store current file position in the array
                 }
-                if ( inDataBuf[inBufPosition-3] != 0x0A ) {
+                if ( ctx.inDataBuf[ctx.inBufPosition-3] != 0x0A ) {
                     // append line termination, when missing from the message
                     debug_log ( " buf_pos: %i; appending CFLF\n", buf_pos);
-                    fputc (0X0D, open_files[cur_fn].fp); 
-                    fputc (0X0A, open_files[cur_fn].fp);
+                    storagePutc (0X0D, ctx.open_files[ctx.cur_fn].fp); 
+                    storagePutc (0X0A, ctx.open_files[ctx.cur_fn].fp);
+                    ctx.open_files[ctx.cur_fn].pos += 2;
                 }
             }
             outDataAppend(CheckSum(0x00));
@@ -706,12 +848,12 @@ void process_PRINT( int cmd ) {
 void process_INPUT( int cmd ) {
     debug_log ( "INPUT 0x%02X\n", cmd);
     // file# for current command
-    cur_fn = inDataBuf[1]-2;
+    ctx.cur_fn = ctx.inDataBuf[1]-2;
     debug_log ( "file #%d 0x%02X '%d' @ %d\n", 
-        cur_fn+2, 
-        open_files[cur_fn].fp,
-        open_files[cur_fn].mode, 
-        open_files[cur_fn].pos);
+        ctx.cur_fn+2, 
+        ctx.open_files[ctx.cur_fn].fp,
+        ctx.open_files[ctx.cur_fn].mode, 
+        ctx.open_files[ctx.cur_fn].pos);
     // check if file mode is coherent with INPUT?
     // Similar to LOAD (ascii) - move common parts to functions?
     switch (cmd) {
@@ -719,37 +861,43 @@ void process_INPUT( int cmd ) {
         case 0x14: // single number
         { 
             outDataAppend(0x00);
-            char c;
-            char line [82]; // what for longer ones?
+            int c; // storageGetc: a byte, or EOF (0xFF is a byte)
+            char line [INPUT_LINE + 1];
             line[0]=0x00;
             // Similar to a 'LOAD ascii' (one line)
             do {
-                c=fgetc(open_files[cur_fn].fp);
-                if ( c == 0xFF ) {
-                    ERR_PRINTOUT( ">>fgetc 0xFF\n");
+                c=storageGetc(ctx.open_files[ctx.cur_fn].fp);
+                if ( c == EOF ) {
+                    ERR_PRINTOUT( ">>fgetc EOF\n");
                     outDataAppend(0xFF);
                     break;        
                 }
-                strncat (line,&c,1);
-                open_files[cur_fn].pos++;
-            } while ((c != EOF) && (c!=0x0A)); // line ends with 0D+0A
+                char b = c;
+                strncat (line,&b,1);
+                ctx.open_files[ctx.cur_fn].pos++; // (bytes read only: LOC)
+                if ( strlen(line) == INPUT_LINE ) {
+                    // longer ones: the rest with the next INPUT#
+                    debug_log ("line cut at %d\n", INPUT_LINE);
+                    consolePrintf ("INPUT# #%d: line cut at %d chars\n", ctx.cur_fn+2, INPUT_LINE);
+                    break;
+                }
+            } while (c!=0x0A); // line ends with 0D+0A
             if (c == EOF)
                 debug_log ("EOF!\n");
             else
                 debug_log ("line: <%s>\n", line);            
             sendString(line);
             outDataAppend(0x00);
-            outDataAppend(out_checksum);
+            outDataAppend(ctx.out_checksum);
             outDataAppend(0x00);
             break;
         }
         case 0x20: { // number array -- all in one string! 
             outDataAppend(0x00);
-            char c;
-            char line [82]; // what for longer ones?
+            char line [INPUT_LINE + 1];
             line[0]=0x00;
-            debug_log ("testing 0x%02X...", open_files[cur_fn].fp);
-            if ( ftell(open_files[cur_fn].fp) >= 0) {
+            debug_log ("testing 0x%02X...", ctx.open_files[ctx.cur_fn].fp);
+            if ( ctx.open_files[ctx.cur_fn].fp != NULL ) {
                 debug_log (" is open\n");
             } else {
                 ERR_PRINTOUT( "File is NOT open!\n");
@@ -758,20 +906,21 @@ void process_INPUT( int cmd ) {
             }
             int f;
             do {
-                f=fgetc(open_files[cur_fn].fp); // !!! RETURNING 0xFF at first read, why ???
+                f=storageGetc(ctx.open_files[ctx.cur_fn].fp); // !!! RETURNING 0xFF at first read, why ???
                 char c = char(f);
-                if (f != EOF) // skip this
+                if (f != EOF) { // skip this
                     outDataAppend(CheckSum(c));
+                    ctx.open_files[ctx.cur_fn].pos++;
+                }
                 strncat (line,&c,1);
-                if ( c == 0x0A ) {
+                if ( c == 0x0A || strlen(line) == sizeof(line) - 1 ) {
                     debug_log ("line: <%s>\n", line); 
                     line[0] = 0; // reset
                 }
-                open_files[cur_fn].pos++;
             } while ((f != EOF));
             debug_log ("EOF!\n");
             outDataAppend(0x00);
-            outDataAppend(out_checksum);
+            outDataAppend(ctx.out_checksum);
             outDataAppend(0x00);
             break;
         }
@@ -782,17 +931,68 @@ void process_INPUT( int cmd ) {
     }
 }
 
+// current position and length of an OPEN'ed file (array index),
+// as tracked by INPUT#/PRINT# - no SD card access
+uint32_t openFilePos( int i ) {
+    return ( ctx.open_files[i].mode == 3 ? ctx.open_files[i].size : 0 ) + ctx.open_files[i].pos;
+}
+
+uint32_t openFileLen( int i ) {
+    return ( ctx.open_files[i].mode == 2 ? 0 : ctx.open_files[i].size ) 
+        + ( ctx.open_files[i].mode == 1 ? 0 : ctx.open_files[i].pos );
+}
+
+// file# from the command, as array index (-1 if not open)
+int openFileIndex( void ) {
+    int fn = ctx.inDataBuf[1] - 2; // file# from 2
+    if ( fn < 0 || fn >= MAX_N_FILES || ctx.open_files[fn].fp == NULL ) {
+        ERR_PRINTOUT("file not open\n");
+        return -1;
+    }
+    return fn;
+}
+
+// EOF(n): 0xFF once all the file has been read, 0x00 otherwise
+void process_EOF( void ) {
+    int fn = openFileIndex();
+    debug_log ( "EOF #%d\n", fn+2 );
+    if ( fn < 0 ) {
+        outDataAppend(0xFF);
+        return;
+    }
+    bool eof = ( openFilePos(fn) >= openFileLen(fn) );
+    debug_log ( "pos %u len %u\n", openFilePos(fn), openFileLen(fn) );
+    outDataAppend(CheckSum(0x00));
+    outDataAppend(CheckSum(eof ? 0xFF : 0x00));
+    outDataAppend(ctx.out_checksum);
+}
+
+// LOC(n): 3 bytes, as the file size in LOAD
+void process_LOC( void ) {
+    int fn = openFileIndex();
+    debug_log ( "LOC #%d\n", fn+2 );
+    if ( fn < 0 ) {
+        outDataAppend(0xFF);
+        return;
+    }
+    uint32_t v = openFilePos(fn);
+    debug_log ( "pos %u\n", v );
+    outDataAppend(CheckSum(0x00));
+    outDataAppend(CheckSum(v & 0xff));
+    outDataAppend(CheckSum((v >> 8) & 0xff));
+    outDataAppend(CheckSum((v >> 16) & 0xff));
+    outDataAppend(ctx.out_checksum);
+}
+
 void process_KILL( void ) {
     uint8_t tmpFile[13];
     debug_log ( "process_KILL\n");
-    strncpy ((char*)tmpFile, (const char *)(inDataBuf+3), 12);
+    strncpy ((char*)tmpFile, (const char *)(ctx.inDataBuf+3), 12);
     tmpFile[12] = '\0'; // terminate
     trim (tmpFile); // remove blanks
-    sprintf ((char*)FileName, "%s%s", SD_HOME, tmpFile);
-    debug_log ( "KILL <%s>\n", FileName );
-    if ( file_exists ( (char*)FileName ) ) {
-        int r = remove ( (char*)FileName );
-        debug_log ("remove: %d\n", r);
+    sprintf ((char*)ctx.FileName, "%s%s", SD_HOME, tmpFile);
+    debug_log ( "KILL <%s>\n", ctx.FileName );
+    if ( storageRemove ( (char*)ctx.FileName ) ) {
         outDataAppend(CheckSum(0x00));
     } else {
         ERR_PRINTOUT("file not present\n");
@@ -800,16 +1000,79 @@ void process_KILL( void ) {
     }
 } 
 
+// NAME and COPY: the old name, as in KILL, then the new one the same way
+// ("X:NAME    .BAS" each); the old one into oldName, the new one into FileName
+bool getFileNames ( char *oldName ) {
+    uint8_t tmpFile[13];
+    if ( ctx.inBufPosition < 28 ) {
+        ERR_PRINTOUT("no new name\n");
+        return false;
+    }
+    getFileName();
+    strcpy ( oldName, (const char *)ctx.FileName );
+    // new name, after its drive prefix when there's one
+    int at = ( ctx.inDataBuf[16] == ':' ) ? 17 : 15;
+    strncpy ((char*)tmpFile, (const char *)(ctx.inDataBuf+at), 12);
+    tmpFile[12] = '\0'; // terminate
+    trim (tmpFile); // remove blanks
+    sprintf ((char*)ctx.FileName, "%s%s", SD_HOME, tmpFile);
+    debug_log ( "<%s> -> <%s>\n", oldName, ctx.FileName );
+    return ( tmpFile[0] != 0 );
+}
+
+// NAME "X:OLD.BAS" AS "X:NEW.BAS": a rename in the directory
+void process_NAME( void ) {
+    char oldName[17];
+    debug_log ( "process_NAME\n");
+    if ( !storageCardPresent() ) {
+        ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
+        outDataAppend(0xFF);
+        return;
+    }
+    if ( getFileNames ( oldName ) && storageRename ( oldName, (char*)ctx.FileName ) ) {
+        outDataAppend(CheckSum(0x00));
+    } else {
+        ERR_PRINTOUT("file not present, or new name taken\n");
+        outDataAppend(0xFF);
+    }
+}
+
+// COPY "X:OLD.BAS" TO "X:NEW.BAS": copied on the card, nothing goes
+// through the Sharp; two file handles (from and to), which a small pool
+// lacks while a file is OPEN'ed (FILE_POOL_SIZE 2 on the L053R8)
+void process_COPY( void ) {
+    char oldName[17];
+    debug_log ( "process_COPY\n");
+    if ( !storageCardPresent() ) {
+        ERR_PRINTOUT(ERR_SD_CARD_NOT_PRESENT);
+        outDataAppend(0xFF);
+        return;
+    }
+    if ( storageFilesFree() < 2 ) {
+        ERR_PRINTOUT(ERR_NO_FILE_HANDLE);
+        outDataAppend(0xFF);
+        return;
+    }
+    if ( getFileNames ( oldName ) && storageCopy ( oldName, (char*)ctx.FileName ) ) {
+        outDataAppend(CheckSum(0x00));
+    } else {
+        ERR_PRINTOUT("file not present, new name taken, or disk full\n");
+        outDataAppend(0xFF);
+    }
+}
+
 
 void ProcessCommand ( void ) {
 
-    out_checksum = 0;
-    cmdComplete = false;
+    PROFILE_BEGIN( tCmd );
+    ctx.out_checksum = 0;
+    ctx.cmdComplete = false;
 
-    uint8_t commandCode = inDataBuf[0];
-    if (skipDeviceCode != 0 )
-        commandCode = skipDeviceCode;
-    skipDeviceCode = 0;
+    uint8_t commandCode = ctx.inDataBuf[0];
+    if (ctx.skipDeviceCode != 0 )
+        commandCode = ctx.skipDeviceCode;
+    ctx.skipDeviceCode = 0;
+    storageCardCheck (); // pulled out (switch), first use, or after a sleep
 
     switch (commandCode) {
     case 0x03: process_OPEN();break;
@@ -822,9 +1085,9 @@ void ProcessCommand ( void ) {
     case 0x09: process_INIT(0x09);break;
     */
     case 0x0A: process_KILL();break;
-        //    case 0x0B: process_NAME(0x0B);break;
+    case 0x0B: process_NAME();break;
         //    case 0x0C: process_SET(0x0C);break;
-        //    case 0x0D: process_COPY(0x0D);break;
+    case 0x0D: process_COPY();break;
     case 0x0E: process_LOAD(0x0E);break;
     case 0x0F: process_LOAD(0x0F);break;
     case 0x10: process_SAVE(0x10);break;
@@ -838,18 +1101,19 @@ void ProcessCommand ( void ) {
     case 0x15: process_PRINT(0x15);break;
     case 0xFD: process_PRINT(0xfd);break; // next PRINT cmd
     case 0x17: process_LOAD(0x17);break;
-        //    case 0x1A: process_EOF(0x1A);break;
-        //    case 0x1C: process_LOC(0x1C);break;
+    case 0x1A: process_EOF();break;
+    case 0x1C: process_LOC();break;
     case 0x1D: process_DSKF(); break;
         //    case 0x1F: process_INPUT(0x1f);break;
     case 0x20: process_INPUT(0x20);break;
     default:
-        pc.printf(" command 0x%02X - ", inDataBuf[0]);
+        consolePrintf(" command 0x%02X - ", ctx.inDataBuf[0]);
         ERR_PRINTOUT( "Unsupported (yet...)\n" ); 
         outDataAppend(CheckSum(0x00));
         break;
     }
 
     // command complete
-    cmdComplete = true;
+    ctx.cmdComplete = true;
+    PROFILE_COMMAND( commandCode, tCmd );
 }
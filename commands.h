@@ -1,30 +1,79 @@
 #ifndef COMMANDS_H
 #define COMMANDS_H
 #include "mbed.h"
+#include "board.h"
+#include "console.h"
+#include "SDFileSystem.h"
 
 // #define ASYNCHOUT 1 // sending output data asynchronously - TO DEBUG!! 
 
 // communication data depth (max file size during LOAD)
-#if defined TARGET_NUCLEO_L432KC
-#define OUT_BUF_SIZE 40000
-#define IN_BUF_SIZE 2000
-#endif
-#if defined TARGET_NUCLEO_L053R8
-#define OUT_BUF_SIZE 256
-#define IN_BUF_SIZE 256
-#endif
+// Input, output and debug buffers share one static arena (see commands.cpp):
+// the debug log at its end (DEBUG_SIZE), the rest repartitioned per command
+// phase between the received command and the output to send back.
+// (sizes per board: see board.h)
+#define IN_BUF_SIZE (Board::ARENA_SIZE-Board::DEBUG_SIZE) // receive phase: all the shared region
 
-#define ERR_PRINTOUT(x) debug_log("ERR %s",x); pc.printf(x)
+#define ERR_PRINTOUT(x) do { debug_log("ERR %s",x); consolePrintf("%s",x); } while (0)
 #define ERR_SD_CARD_NOT_PRESENT "SD Card not present!\n"
+#define ERR_NO_FILE_HANDLE "No file handle left, CLOSE a file first!\n"
 #define SD_HOME "/sd/"
 #define MAX_N_FILES 6 
 
-extern volatile uint8_t     inDataBuf[];
-extern volatile uint8_t     outDataBuf[];
-extern volatile uint16_t    inBufPosition;
-extern volatile uint16_t    outDataPutPosition;
+// open file pointers
+typedef struct {
+    uint8_t fn;
+    uint8_t mode;
+    FIL* fp;
+    uint32_t pos;  // bytes read or written since OPEN
+    uint32_t size; // at OPEN time
+    char name[13]; // 8.3, on SD
+} finfo_t ;
+
+// FILES file spec, compiled into the fixed 8.3 fields
+// ('?' matches any char, '*' is expanded to '?' up to the field end)
+typedef struct {
+    char name[8];
+    char ext[3];
+} filespec_t;
+
+extern INSTANCE uint8_t     arena[Board::ARENA_SIZE];
+extern INSTANCE char       *debugBuf;
+
+// Command context: the in/out buffers, shared with the wire handlers of
+// main.cpp, and what the commands keep from one to the next (the LOAD/SAVE
+// file, the FILES listing, the OPEN'ed files), one per emulator (ctx).
+struct cmdctx_t {
+    // buffers (in the arena, see commands.cpp)
+    volatile uint8_t   *inDataBuf = arena;
+    volatile uint8_t   *outDataBuf = arena;
+    volatile uint16_t   outBufSize = IN_BUF_SIZE;
+    volatile uint16_t   inBufPosition;
+    volatile uint16_t   inBufStart;
+    volatile uint16_t   outDataPutPosition;
+    volatile uint16_t   outDataGetPosition; // next byte to send
+    volatile bool       cmdComplete;
+    volatile uint8_t    skipDeviceCode;     // code of the next command, sent without one
+    uint8_t             out_checksum;
+    // LOAD/SAVE file
+    FIL                *fp;
+    uint8_t             FileName[17];
+    int                 file_size;
+    int                 file_pos;
+    // FILES, FILES_LIST
+    int                 fileCount;
+    filespec_t          filesSpec;          // set by FILES, then used by FILES_LIST as well
+    // OPEN'ed files, and the one of PRINT#
+    finfo_t             open_files[MAX_N_FILES];
+    uint8_t             cur_fn;
+};
+
+extern INSTANCE cmdctx_t    ctx;
 
 void ProcessCommand ( void ) ;
+void arenaProcessPhase ( void ) ;
+void arenaTransmitPhase ( void ) ;
+void arenaReport ( void ) ;
 
 #endif
 
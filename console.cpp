@@ -0,0 +1,139 @@
+#include "console.h"
+
+// from other modules
+extern INSTANCE RawSerial pc;
+
+// Console output ring.
+// Text (and transfer frames) are copied into the ring, then the DMA channel
+// wired to the USART TX request sends the longest contiguous stretch
+// from the tail; its transfer-complete interrupt moves the tail and starts
+// the next one. Producers only hold interrupts off while copying,
+// so a Sharp transaction never waits for the 115200 bps line.
+// Targets with no DMA mapping below (and the host build, tools/host)
+// fall back to the blocking RawSerial.
+#if defined TARGET_NUCLEO_L432KC && !defined HOST_BUILD
+// USART2_TX: DMA1 channel 7, request 2
+#define CONSOLE_DMA        DMA1_Channel7
+#define CONSOLE_DMA_IRQ    DMA1_Channel7_IRQn
+#define CONSOLE_DMA_SEL    (2u << 24)
+#define CONSOLE_DMA_CLOCK  RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN
+#endif
+#if defined TARGET_NUCLEO_L053R8
+// USART2_TX: DMA1 channel 7, request 4
+#define CONSOLE_DMA        DMA1_Channel7
+#define CONSOLE_DMA_IRQ    DMA1_Channel4_5_6_7_IRQn
+#define CONSOLE_DMA_SEL    (4u << 24)
+#define CONSOLE_DMA_CLOCK  RCC->AHBENR |= RCC_AHBENR_DMAEN
+#endif
+
+INSTANCE char              consoleRing[Board::CONSOLE_RING];
+INSTANCE volatile uint16_t consoleHead = 0;     // next byte in
+INSTANCE volatile uint16_t consoleTail = 0;     // next byte out
+INSTANCE volatile uint16_t consoleSending = 0;  // bytes handed to the DMA
+INSTANCE volatile uint32_t consoleDrops = 0;
+INSTANCE bool              consoleDma = false;
+
+#ifdef CONSOLE_DMA
+// next DMA transfer, if idle and something's queued (interrupts off)
+void consoleKick ( void ) {
+    if ( consoleSending != 0 || consoleHead == consoleTail )
+        return;
+    uint16_t n = ( consoleHead > consoleTail ) ? consoleHead - consoleTail
+                                               : Board::CONSOLE_RING - consoleTail;
+    consoleSending = n;
+    CONSOLE_DMA->CCR &= ~DMA_CCR_EN;
+    CONSOLE_DMA->CMAR = (uint32_t)&consoleRing[consoleTail];
+    CONSOLE_DMA->CNDTR = n;
+    CONSOLE_DMA->CCR |= DMA_CCR_EN;
+}
+
+void consoleDmaIrq ( void ) {
+    if ( DMA1->ISR & DMA_ISR_TCIF7 ) {
+        DMA1->IFCR = DMA_IFCR_CGIF7;
+        CONSOLE_DMA->CCR &= ~DMA_CCR_EN;
+        consoleTail = ( consoleTail + consoleSending ) % Board::CONSOLE_RING;
+        consoleSending = 0;
+        consoleKick ();
+    }
+}
+#endif
+
+// after pc.baud(): the USART is set up by mbed, we take its TX over
+void consoleInit ( void ) {
+#ifdef CONSOLE_DMA
+    CONSOLE_DMA_CLOCK;
+    CONSOLE_DMA->CCR = 0;
+    DMA1_CSELR->CSELR = ( DMA1_CSELR->CSELR & ~DMA_CSELR_C7S ) | CONSOLE_DMA_SEL;
+    CONSOLE_DMA->CPAR = (uint32_t)&USART2->TDR;
+    // memory to peripheral, bytes, memory increment, interrupt when done
+    CONSOLE_DMA->CCR = DMA_CCR_DIR | DMA_CCR_MINC | DMA_CCR_TCIE;
+    NVIC_SetVector ( CONSOLE_DMA_IRQ, (uint32_t)&consoleDmaIrq );
+    NVIC_EnableIRQ ( CONSOLE_DMA_IRQ );
+    USART2->CR3 |= USART_CR3_DMAT;
+    consoleDma = true;
+#endif
+}
+
+uint16_t consoleWrite ( const char *buf, uint16_t len ) {
+    if ( !consoleDma ) {
+        for ( uint16_t i=0; i<len; i++ )
+            pc.putc ( buf[i] );
+        return len;
+    }
+    __disable_irq();
+    uint16_t room = ( consoleTail + Board::CONSOLE_RING - consoleHead - 1 ) % Board::CONSOLE_RING;
+    if ( len > room ) {
+        consoleDrops += len - room;
+        len = room;
+    }
+    for ( uint16_t i=0; i<len; i++ ) {
+        consoleRing[consoleHead] = buf[i];
+        consoleHead = ( consoleHead + 1 ) % Board::CONSOLE_RING;
+    }
+#ifdef CONSOLE_DMA
+    consoleKick ();
+#endif
+    __enable_irq();
+    return len;
+}
+
+// transfer frames: nothing dropped, wait for the DMA to make room
+void consoleWriteAll ( const uint8_t *buf, uint16_t len ) {
+    while ( len > 0 ) {
+        uint16_t room = ( consoleTail + Board::CONSOLE_RING - consoleHead - 1 ) % Board::CONSOLE_RING;
+        if ( room == 0 && consoleDma )
+            continue;
+        uint16_t n = ( len < room || !consoleDma ) ? len : room;
+        n = consoleWrite ( (const char *)buf, n );
+        buf += n;
+        len -= n;
+    }
+}
+
+void consolePutc ( char c ) {
+    consoleWrite ( &c, 1 );
+}
+
+void consolePrintf ( const char *fmt, ... ) {
+    char line[120];
+    va_list va;
+    va_start ( va, fmt );
+    int n = vsnprintf ( line, sizeof(line), fmt, va );
+    va_end ( va );
+    if ( n > (int)sizeof(line) - 1 )
+        n = sizeof(line) - 1;
+    if ( n > 0 )
+        consoleWrite ( line, n );
+}
+
+bool consoleBusy ( void ) {
+#ifdef CONSOLE_DMA
+    if ( consoleDma )
+        return consoleHead != consoleTail || !( USART2->ISR & USART_ISR_TC );
+#endif
+    return false;
+}
+
+uint32_t consoleDropped ( void ) {
+    return consoleDrops;
+}
@@ -0,0 +1,20 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+#include "mbed.h"
+#include "board.h"
+
+// Serial console output (see console.cpp).
+// Queued into a ring buffer, sent in the background by DMA:
+// safe to call from the interrupt handlers, never waits for the line.
+
+// output ring depth: Board::CONSOLE_RING (board.h)
+
+void     consoleInit ( void );
+uint16_t consoleWrite ( const char *buf, uint16_t len );  // what fits, the rest dropped
+void     consoleWriteAll ( const uint8_t *buf, uint16_t len ); // main loop only: waits for room
+void     consolePutc ( char c );
+void     consolePrintf ( const char *fmt, ... );
+bool     consoleBusy ( void );     // still sending
+uint32_t consoleDropped ( void );  // bytes dropped, ring full
+
+#endif
@@ -0,0 +1,79 @@
+#include "mbed.h"
+#include "console.h"
+#include "events.h"
+
+// from other modules
+extern INSTANCE Timer mainTimer;
+void commandTask ( void );
+void loadWatchdogTask ( void );
+
+// Deferred work.
+// Interrupt handlers only take the bus data and post an event, the work
+// behind it (command processing and its card accesses, the answer, which
+// is a polled handshake) is run by the main loop: the edge handlers of the
+// Sharp then never wait behind a FAT lookup, and the time spent at
+// interrupt level is bounded by the handlers themselves.
+// One flag per event (posting it again before it runs changes nothing),
+// the lowest number first. Post to start latency and run time are kept
+// per event, for the "evq" console command.
+void (* const eventHandler[EV_COUNT]) ( void ) = {
+    &commandTask,       // EV_COMMAND
+    &loadWatchdogTask,  // EV_LOAD_WD
+};
+const char *eventName[EV_COUNT] = { "command", "load wd" };
+
+INSTANCE volatile uint32_t eventFlags = 0;
+INSTANCE volatile uint32_t eventPostTime[EV_COUNT];
+INSTANCE uint32_t          eventPosts[EV_COUNT];
+INSTANCE uint32_t          eventLatencyMax[EV_COUNT];
+INSTANCE uint32_t          eventRunMax[EV_COUNT];
+
+void eventPost ( uint8_t ev ) {
+    uint32_t now = mainTimer.read_us();
+    __disable_irq();
+    if ( !( eventFlags & ( 1u << ev ) ) ) {
+        eventFlags |= 1u << ev;
+        eventPostTime[ev] = now;
+        eventPosts[ev]++;
+    }
+    __enable_irq();
+}
+
+void eventCancel ( uint8_t ev ) {
+    __disable_irq();
+    eventFlags &= ~( 1u << ev );
+    __enable_irq();
+}
+
+bool eventPending ( void ) {
+    return eventFlags != 0;
+}
+
+bool eventRun ( void ) {
+    uint8_t ev;
+    uint32_t start;
+    __disable_irq();
+    for ( ev = 0; ev < EV_COUNT && !( eventFlags & ( 1u << ev ) ); ev++ )
+        ;
+    if ( ev == EV_COUNT ) {
+        __enable_irq();
+        return false;
+    }
+    eventFlags &= ~( 1u << ev );
+    start = mainTimer.read_us();
+    if ( start - eventPostTime[ev] > eventLatencyMax[ev] )
+        eventLatencyMax[ev] = start - eventPostTime[ev];
+    __enable_irq();
+    eventHandler[ev] ();
+    uint32_t t = mainTimer.read_us() - start;
+    if ( t > eventRunMax[ev] )
+        eventRunMax[ev] = t;
+    return true;
+}
+
+void eventReport ( void ) {
+    consolePrintf ( "\nevent     posted  max wait  max run (us)\n" );
+    for ( int i=0; i<EV_COUNT; i++ )
+        consolePrintf ( "%-8s %8u %9u %8u\n", eventName[i],
+            eventPosts[i], eventLatencyMax[i], eventRunMax[i] );
+}
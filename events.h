@@ -0,0 +1,18 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+#include <stdint.h>
+
+// Deferred work (see events.cpp).
+// The bus handlers take the data off the lines and post an event; the main
+// loop runs the work behind it in thread context, lowest number first.
+#define EV_COMMAND  0 // command received (inDataReady): process, answer the Sharp
+#define EV_LOAD_WD  1 // ASCII LOAD watchdog (loadWatchdog): close the file
+#define EV_COUNT    2
+
+void eventPost ( uint8_t ev );    // from the handlers too
+void eventCancel ( uint8_t ev );
+bool eventPending ( void );
+bool eventRun ( void );           // main loop: the most urgent one, false if none
+void eventReport ( void );        // "evq" console command
+
+#endif
@@ -0,0 +1,328 @@
+#include "storage.h"
+#include "console.h"
+#include "flashcache.h"
+
+#ifdef FLASH_CACHE
+// Flash cache.
+// Board::CACHE_SLOTS slots of Board::CACHE_SLOT bytes from Board::CACHE_BASE,
+// each one a header (cachehdr_t) followed by the file content, read in
+// place: the RAM holds the list below only. The header is programmed last,
+// so a copy cut short by a reset leaves an empty slot; a copy no longer
+// valid gets its first double word programmed to zero (the one thing the
+// flash takes over bits not erased), so it doesn't come back after a reset.
+// The loads from the card are counted: a file loaded CACHE_MIN_LOADS times
+// gets a slot, an empty one or the one of the copy served the least (less
+// than that file was loaded). The copy is made by the main loop, a step at
+// a time (a page erased, or CACHE_CHUNK bytes programmed), while no file is
+// open and the bus has been idle for CARD_QUIET (main.cpp): the CPU, and
+// the bus handlers with it, stall while the flash is busy, for up to a page
+// erase (about 25 ms), which a session may then only meet at its start.
+// A copy not checked since the mount is served with the card known to be
+// out only (a mount failed): before the first mount, it isn't served.
+
+// from other modules
+extern void debug_log(const char *fmt, ...);
+
+// end of the firmware image in the flash (code and constants, then the
+// initial values of .data), from the linker: the slots must start above it
+#if defined HOST_BUILD
+#define CACHE_IMAGE_END  hostImageEnd
+#elif defined __ARMCC_VERSION
+extern uint32_t Load$$LR$$LR_IROM1$$Limit[];
+#define CACHE_IMAGE_END  ( (uint32_t)Load$$LR$$LR_IROM1$$Limit )
+#else // GCC_ARM: .data is loaded from __etext on
+extern uint32_t __etext[], __data_start__[], __data_end__[];
+#define CACHE_IMAGE_END  ( (uint32_t)__etext + ( (uint32_t)__data_end__ - (uint32_t)__data_start__ ) )
+#endif
+
+typedef struct {
+    uint32_t magic;    // with the next one, the double word zeroed when dropped
+    uint32_t spare;
+    char     name[16]; // 8.3, as in FILINFO
+    uint32_t size;
+    uint16_t fdate;    // the card's directory entry
+    uint16_t ftime;
+} cachehdr_t;          // 32 bytes: the data stays double word aligned
+
+typedef struct {
+    char     name[13]; // "": empty slot
+    bool     verified; // against the card, since mounted
+    uint16_t hits;     // loads served (since reset)
+    uint32_t size;
+} cacheentry_t;
+
+typedef struct {
+    char     name[13];
+    uint16_t loads;    // from the card (since reset)
+} cachetrack_t;
+
+#define FILL_IDLE    0
+#define FILL_START   1 // slot chosen
+#define FILL_ERASE   2 // source open, erasing its pages
+#define FILL_PROGRAM 3
+
+INSTANCE FlashIAP     cacheFlash;
+INSTANCE int8_t       cacheReady = 0;  // 1: slots read, -1: no flash for them
+INSTANCE cacheentry_t cacheEntry[Board::CACHE_SLOTS];
+INSTANCE cachetrack_t cacheTrack[CACHE_TRACK];
+// copy in progress
+INSTANCE uint8_t      fillState = FILL_IDLE;
+INSTANCE int          fillSlot;
+INSTANCE char         fillName[13];
+INSTANCE uint16_t     fillLoads;
+INSTANCE uint32_t     fillPos;  // bytes erased, then programmed
+INSTANCE cachehdr_t   fillHdr;
+INSTANCE FIL          fillFile;
+INSTANCE uint8_t      fillBuf[CACHE_CHUNK];
+
+uint32_t cacheSlotAddr ( int i ) {
+    return Board::CACHE_BASE + i * Board::CACHE_SLOT;
+}
+
+// the flash, memory mapped
+const uint8_t *cachePtr ( uint32_t addr ) {
+#ifdef HOST_BUILD
+    return hostFlashPtr ( addr );
+#else
+    return (const uint8_t*)addr;
+#endif
+}
+
+const cachehdr_t *cacheHdr ( int i ) {
+    return (const cachehdr_t*)cachePtr ( cacheSlotAddr(i) );
+}
+
+// the slots as found in the flash, on first use
+bool cacheOpen ( void ) {
+    if ( cacheReady )
+        return ( cacheReady > 0 );
+    cacheReady = -1;
+    if ( cacheFlash.init() != 0 )
+        return false;
+    uint32_t end = cacheSlotAddr ( Board::CACHE_SLOTS );
+    if ( Board::CACHE_BASE < cacheFlash.get_flash_start()
+      || end > cacheFlash.get_flash_start() + cacheFlash.get_flash_size() ) {
+        debug_log ("cache: no flash at 0x%08X\n", Board::CACHE_BASE);
+        return false;
+    }
+    if ( CACHE_IMAGE_END > Board::CACHE_BASE ) {
+        ERR_PRINTOUT ( "cache: firmware over CACHE_BASE, cache off\n" );
+        return false;
+    }
+    for ( int i=0; i<Board::CACHE_SLOTS; i++ ) {
+        const cachehdr_t *h = cacheHdr(i);
+        cacheEntry[i].name[0] = 0;
+        if ( h->magic != CACHE_MAGIC || h->size > Board::CACHE_SLOT - sizeof(cachehdr_t)
+          || memchr ( h->name, 0, sizeof(cacheEntry[i].name) ) == NULL )
+            continue;
+        strcpy ( cacheEntry[i].name, h->name );
+        cacheEntry[i].size = h->size;
+        cacheEntry[i].verified = false;
+        cacheEntry[i].hits = CACHE_MIN_LOADS; // as good as a new one
+    }
+    cacheReady = 1;
+    return true;
+}
+
+int cacheIndex ( const char *name ) {
+    for ( int i=0; i<Board::CACHE_SLOTS; i++ )
+        if ( cacheEntry[i].name[0] != 0 && strcmp(cacheEntry[i].name, name) == 0 )
+            return i;
+    return -1;
+}
+
+// copy no longer valid, for good
+void cacheDrop ( int i ) {
+    uint64_t zero = 0;
+    debug_log ("cache: %s dropped\n", cacheEntry[i].name);
+    cacheEntry[i].name[0] = 0;
+    cacheFlash.program ( &zero, cacheSlotAddr(i), sizeof(zero) );
+}
+
+void fillAbort ( void ) {
+    if ( fillState >= FILL_ERASE )
+        f_close ( &fillFile );
+    fillState = FILL_IDLE; // (no header: the slot reads as empty)
+}
+
+// content of the copy, NULL if none (or not the card's one any longer);
+// load: served for a LOAD (or OPEN), counted
+const uint8_t *flashCacheFind ( const char *name, uint32_t *size, bool load ) {
+    if ( !cacheOpen() )
+        return NULL;
+    int i = cacheIndex ( name );
+    if ( i < 0 )
+        return NULL;
+    cacheentry_t *e = &cacheEntry[i];
+    if ( !e->verified && !storageCardAbsent() ) {
+        // no card: the copy is what was there last; not mounted yet: unknown
+        if ( !storageCardPresent() )
+            return NULL;
+        const cachehdr_t *h = cacheHdr(i);
+        FILINFO fno;
+#if _USE_LFN
+        fno.lfname = NULL;
+        fno.lfsize = 0;
+#endif
+        if ( f_stat(fatPath(name), &fno) != FR_OK || fno.fsize != h->size
+          || fno.fdate != h->fdate || fno.ftime != h->ftime ) {
+            cacheDrop ( i );
+            return NULL;
+        }
+        e->verified = true;
+    }
+    if ( load )
+        e->hits++;
+    if ( size ) *size = e->size;
+    return cachePtr ( cacheSlotAddr(i) + sizeof(cachehdr_t) );
+}
+
+void flashCacheLoaded ( const char *name, uint32_t size ) {
+    int i, t = 0;
+    if ( size == 0 || size > Board::CACHE_SLOT - sizeof(cachehdr_t)
+      || strlen(name) >= sizeof(fillName) || !cacheOpen() )
+        return;
+    // count it, in place of the least loaded one if new
+    for ( i=0; i<CACHE_TRACK && strcmp(cacheTrack[i].name, name) != 0; i++ )
+        if ( cacheTrack[i].loads < cacheTrack[t].loads )
+            t = i;
+    if ( i == CACHE_TRACK ) {
+        i = t;
+        strcpy ( cacheTrack[i].name, name );
+        cacheTrack[i].loads = 0;
+    }
+    cacheTrack[i].loads++;
+    if ( cacheTrack[i].loads < CACHE_MIN_LOADS || fillState != FILL_IDLE || cacheIndex(name) >= 0 )
+        return;
+    // an empty slot, or the least served copy, if served less
+    int slot = -1;
+    for ( int s=0; s<Board::CACHE_SLOTS; s++ ) {
+        if ( cacheEntry[s].name[0] == 0 ) {
+            slot = s;
+            break;
+        }
+        if ( cacheEntry[s].hits < cacheTrack[i].loads
+          && ( slot < 0 || cacheEntry[s].hits < cacheEntry[slot].hits ) )
+            slot = s;
+    }
+    if ( slot < 0 )
+        return;
+    fillSlot = slot;
+    fillLoads = cacheTrack[i].loads;
+    strcpy ( fillName, name );
+    fillState = FILL_START;
+}
+
+void flashCacheForget ( const char *name ) {
+    if ( !cacheOpen() )
+        return;
+    int i = cacheIndex ( name );
+    if ( i >= 0 )
+        cacheDrop ( i );
+    if ( fillState != FILL_IDLE && strcmp(fillName, name) == 0 )
+        fillAbort ();
+}
+
+void flashCacheInvalidate ( void ) {
+    for ( int i=0; i<Board::CACHE_SLOTS; i++ )
+        cacheEntry[i].verified = false;
+    if ( fillState != FILL_IDLE )
+        fillAbort ();
+}
+
+// one step of the copy
+bool fillStep ( void ) {
+    uint32_t addr = cacheSlotAddr ( fillSlot );
+    switch ( fillState ) {
+    case FILL_START: {
+        if ( cacheEntry[fillSlot].name[0] != 0 )
+            cacheDrop ( fillSlot ); // the least served one
+        FILINFO fno;
+#if _USE_LFN
+        fno.lfname = NULL;
+        fno.lfsize = 0;
+#endif
+        if ( f_stat(fatPath(fillName), &fno) != FR_OK
+          || fno.fsize == 0 || fno.fsize > Board::CACHE_SLOT - sizeof(cachehdr_t)
+          || f_open(&fillFile, fatPath(fillName), FA_READ | FA_OPEN_EXISTING) != FR_OK )
+            return false;
+        memset ( &fillHdr, 0, sizeof(fillHdr) );
+        fillHdr.magic = CACHE_MAGIC;
+        strcpy ( fillHdr.name, fillName );
+        fillHdr.size = fno.fsize;
+        fillHdr.fdate = fno.fdate;
+        fillHdr.ftime = fno.ftime;
+        fillPos = 0;
+        fillState = FILL_ERASE;
+        return true;
+    }
+    case FILL_ERASE: {
+        uint32_t sector = cacheFlash.get_sector_size ( addr + fillPos );
+        if ( cacheFlash.erase ( addr + fillPos, sector ) != 0 )
+            return false;
+        fillPos += sector;
+        if ( fillPos >= sizeof(cachehdr_t) + fillHdr.size ) {
+            fillPos = 0;
+            fillState = FILL_PROGRAM;
+        }
+        return true;
+    }
+    case FILL_PROGRAM: {
+        UINT n = fillHdr.size - fillPos < CACHE_CHUNK ? fillHdr.size - fillPos : CACHE_CHUNK;
+        UINT br = 0;
+        if ( f_read ( &fillFile, fillBuf, n, &br ) != FR_OK || br != n )
+            return false;
+        uint32_t page = cacheFlash.get_page_size();
+        uint32_t len = ( n + page - 1 ) / page * page;
+        memset ( fillBuf + n, 0xFF, len - n );
+        if ( cacheFlash.program ( fillBuf, addr + sizeof(cachehdr_t) + fillPos, len ) != 0 )
+            return false;
+        fillPos += n;
+        if ( fillPos < fillHdr.size )
+            return true;
+        // all there: the header makes it valid
+        if ( cacheFlash.program ( &fillHdr, addr, sizeof(fillHdr) ) != 0 )
+            return false;
+        f_close ( &fillFile );
+        cacheentry_t *e = &cacheEntry[fillSlot];
+        strcpy ( e->name, fillName );
+        e->size = fillHdr.size;
+        e->verified = true;
+        e->hits = fillLoads;
+        fillState = FILL_IDLE;
+        debug_log ("cache: %s in slot %d (%u bytes)\n", fillName, fillSlot, fillHdr.size);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Called by the main loop: a step, when the flash may stall the CPU
+bool flashCacheTask ( void ) {
+    if ( fillState == FILL_IDLE || storageFilesOpen() )
+        return false;
+    storageLock();
+    if ( !fillStep() ) {
+        debug_log ("cache: %s not copied\n", fillName);
+        fillAbort ();
+    }
+    storageUnlock();
+    return ( fillState != FILL_IDLE );
+}
+
+void flashCacheReport ( void ) {
+    if ( !cacheOpen() ) {
+        consolePrintf ("\ncache: no flash\n");
+        return;
+    }
+    consolePrintf ("\ncache: %d slots of %u bytes at 0x%08X\n",
+        Board::CACHE_SLOTS, Board::CACHE_SLOT, Board::CACHE_BASE);
+    for ( int i=0; i<Board::CACHE_SLOTS; i++ )
+        if ( cacheEntry[i].name[0] != 0 )
+            consolePrintf ("%d %-12s %6u bytes, %u loads%s\n", i, cacheEntry[i].name,
+                cacheEntry[i].size, cacheEntry[i].hits, cacheEntry[i].verified ? "" : " (unchecked)");
+    if ( fillState != FILL_IDLE )
+        consolePrintf ("copying %s to slot %d\n", fillName, fillSlot);
+}
+#endif
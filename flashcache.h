@@ -0,0 +1,33 @@
+#ifndef FLASHCACHE_H
+#define FLASHCACHE_H
+#include <stdint.h>
+#include "board.h"
+
+// Flash cache (see flashcache.cpp).
+// Copies of the most loaded files in the internal flash left over by the
+// firmware, read in place of the card ones (storageOpen): a LOAD from
+// there needs no directory lookup nor card read. Each copy is checked
+// against the card's directory entry (size, date and time) once per mount,
+// forgotten as soon as the file is written or removed, and still served
+// when there's no card (once a mount failed, not before the first one).
+// Listed by the "cache" console command.
+#if defined TARGET_NUCLEO_L432KC && DEVICE_FLASH
+#define FLASH_CACHE 1 // Board::CACHE_SLOTS copies, Board::CACHE_SLOT bytes each
+#endif
+
+#define CACHE_MAGIC      0xCE140CAC
+#define CACHE_MIN_LOADS  2   // loads from the card before a copy is made
+#define CACHE_TRACK      16  // files whose loads are counted
+#define CACHE_CHUNK      256 // bytes copied per step
+
+#ifdef FLASH_CACHE
+// names within the home directory ("NAME.BAS"); load: counted as served
+const uint8_t *flashCacheFind ( const char *name, uint32_t *size, bool load );
+void flashCacheLoaded ( const char *name, uint32_t size ); // read from the card
+void flashCacheForget ( const char *name );  // written or removed
+void flashCacheInvalidate ( void );          // card changed: check them again
+bool flashCacheTask ( void );                // main loop: true while copying
+void flashCacheReport ( void );              // "cache" console command
+#endif
+
+#endif
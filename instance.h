@@ -0,0 +1,17 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+// Emulator state.
+// The globals of the modules are the state of one emulator: the board runs
+// one. The host tools may run several in the same process, one per thread
+// (tools/host/soak.cpp), each thread then with its own copy of them: the
+// mutable ones are declared INSTANCE (definitions and extern declarations
+// alike, function statics included).
+// No mbed in here: xfer.cpp, mbed-free, has state of its own too.
+#ifdef HOST_BUILD
+#define INSTANCE thread_local
+#else
+#define INSTANCE
+#endif
+
+#endif
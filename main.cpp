@@ -6,26 +6,26 @@
 //
 ////////////////////////////////////////////////////////
 #include "mbed.h"
+#include "board.h"
 #include "commands.h"
+#include "storage.h"
+#include "xfer.h"
+#include "console.h"
+#include "capture.h"
+#include "events.h"
+#include "profile.h"
+#include "memstat.h"
+#include "flashcache.h"
 
 #define DEBUG 1
 
-#if defined TARGET_NUCLEO_L432KC
-//#define BREADBOARD // prototype
-#define PCB_V1 // PCB make
-#define DEBUG_SIZE 10000 // debug buffer
-#define DEBUG_TIMEOUT 3000 // ms
+// serial console: text commands, debug output, and file transfers
+// (tools/ce140f_xfer, same speed: the ST-LINK virtual COM port goes higher)
+#define CONSOLE_BAUD 115200
 
-#endif
-#if defined TARGET_NUCLEO_L053R8
-#define DEBUG_SIZE 1000 // debug buffer
-#define DEBUG_TIMEOUT 2000 // ms
-#endif
-// about DEBUG_TIMEOUT:
-// should be fast enough to keep buffer empty,
-// but slow enough to allow for serial printf to complete
-// (1000 chars @ 9600 bps => about 0.9 s)
-// Possibily, increase serial speed...
+// about Board::DEBUG_TIMEOUT (board.h):
+// should be fast enough to keep buffer empty; each dump only
+// queues what fits in the console ring (see console.cpp)
 
 #define NIBBLE_DELAY_1 1000 // us
 #define NIBBLE_DELAY_2 1000 // us
@@ -38,127 +38,143 @@
 #define IN_DATAREADY_TIMEOUT 50000 // us
 #define OUT_NIBBLE_DELAY 500 // us
 
-#if defined TARGET_NUCLEO_L053R8
-// input ports
-DigitalIn   in_BUSY     (PC_0);    
-InterruptIn irq_BUSY    (PC_0);    
-DigitalIn   in_D_OUT    (PC_1);    
-InterruptIn irq_D_OUT   (PC_1);
-DigitalIn   in_X_OUT    (D6);     
-InterruptIn irq_X_OUT   (D6);
-DigitalIn   in_D_IN     (D7);  
-DigitalIn   in_SEL_1    (D9);
-DigitalIn   in_SEL_2    (D8); 
-// output ports  
-DigitalOut        out_ACK     (D10);  
-DigitalOut        out_D_OUT   (D11);     
-DigitalOut        out_D_IN    (D12);     
-DigitalOut        out_SEL_1   (D15);     
-DigitalOut        out_SEL_2   (D14);     
-// info led
-DigitalOut        infoLed    (LED1); // D13
-InterruptIn       user_BTN   (USER_BUTTON);
+// idle mode: STOP when the Sharp is idle or off, woken up by X_OUT
+// (NOTE - serial console input doesn't wake it up: push the button)
+#define IDLE_DEEPSLEEP 1
+#define IDLE_TIMEOUT 5000000 // us of bus inactivity, before deep sleep
+#define CARD_QUIET 100000 // us of bus inactivity, before the card is probed (storage.cpp)
+#define WAKE_BUDGET 10000 // us, wake-up to ACK (X_OUT+D_OUT stay high > 40 ms)
+#if defined IDLE_DEEPSLEEP && ( DEVICE_LOWPOWERTIMER || DEVICE_LPTICKER )
+#include "lp_ticker_api.h"
+#define WAKE_CALIBRATE 1 // STOP exit and clock restore, timed on the low power ticker
 #endif
 
-#if defined TARGET_NUCLEO_L432KC
-#if defined BREADBOARD
-// input ports
-DigitalIn         in_BUSY     (PA_8);    
-InterruptIn       irq_BUSY    (PA_8);    
-DigitalIn         in_D_OUT    (PA_11);    
-InterruptIn       irq_D_OUT   (PA_11);
-DigitalIn         in_X_OUT    (PA_0);     
-InterruptIn       irq_X_OUT   (PA_0);
-DigitalIn         in_D_IN     (PA_1);  
-DigitalIn         in_SEL_1    (PA_12);
-DigitalIn         in_SEL_2    (PB_0); 
-// output ports  
-DigitalOut        out_ACK     (PB_7);  
-DigitalOut        out_D_OUT   (PB_6); 
-DigitalOut        out_D_IN    (PB_1);     
-DigitalOut        out_SEL_1   (PA_9);   
-DigitalOut        out_SEL_2   (PA_10);     
-// others
-DigitalOut        infoLed     (LED1);
-InterruptIn       user_BTN    (PB_4);
-#endif
-#if defined PCB_V1
-// input ports
-DigitalIn         in_BUSY     (PA_9);    
-InterruptIn       irq_BUSY    (PA_9);    
-DigitalIn         in_D_OUT    (PA_10);    
-InterruptIn       irq_D_OUT   (PA_10);
-DigitalIn         in_SEL_2    (PB_6); 
-DigitalIn         in_SEL_1    (PB_1);
-DigitalIn         in_D_IN     (PA_1); 
-DigitalIn         in_X_OUT    (PA_0);     
-InterruptIn       irq_X_OUT   (PA_0);
-// output ports  
-DigitalOut        out_SEL_2   (PA_8); 
-DigitalOut        out_SEL_1   (PA_11);   
-DigitalOut        out_ACK     (PB_7);  
-DigitalOut        out_D_OUT   (PA_12); 
-DigitalOut        out_D_IN    (PB_0);     
-// others
-DigitalOut        infoLed     (LED1);
-InterruptIn       user_BTN    (PB_4);
-#endif
-#endif
+// fast re-select: within a session (a 0x41 select coming back shortly after
+// a command was answered, e.g. the lines of an ASCII LOAD), the device code
+// handshake goes edge to edge, with none of the fixed delays above.
+// Opt-in ("sel fast" on the console), tried on a single Sharp model so far;
+// after a failed one, back to the full handshake until a full one succeeds.
+#define FAST_SELECT 1
+#define SESSION_GAP 1000000 // us, command answered to next select, same session
+#define FAST_SETTLE 20 // us, D_OUT after BUSY up
+#define FAST_POLL 10 // us
+#define FAST_DATA_WAIT 1000 // us
+
+// input ports (pins: see board.h)
+INSTANCE LineIn<Board::BUSY>     in_BUSY;
+INSTANCE InterruptIn             irq_BUSY    (Board::BUSY);
+INSTANCE LineIn<Board::D_OUT>    in_D_OUT;
+INSTANCE InterruptIn             irq_D_OUT   (Board::D_OUT);
+INSTANCE LineIn<Board::X_OUT>    in_X_OUT;
+INSTANCE InterruptIn             irq_X_OUT   (Board::X_OUT);
+INSTANCE LineIn<Board::D_IN>     in_D_IN;
+INSTANCE LineIn<Board::SEL_1>    in_SEL_1;
+INSTANCE LineIn<Board::SEL_2>    in_SEL_2;
+// output ports
+INSTANCE LineOut<Board::ACK>     out_ACK;
+INSTANCE LineOut<Board::O_D_OUT> out_D_OUT;
+INSTANCE LineOut<Board::O_D_IN>  out_D_IN;
+INSTANCE LineOut<Board::O_SEL_1> out_SEL_1;
+INSTANCE LineOut<Board::O_SEL_2> out_SEL_2;
+// info led
+INSTANCE DigitalOut              infoLed     (Board::LED);
+INSTANCE InterruptIn             user_BTN    (Board::BUTTON);
 
 // timers
-Timer             mainTimer;
-Timeout           ackOffTimeout;
-Timeout           inDataReadyTimeout;
-Timer             testTimer;
-Ticker            debugOutTimeout;
+INSTANCE Timer             mainTimer;
+INSTANCE Timeout           ackOffTimeout;
+INSTANCE Timeout           inDataReadyTimeout;
+INSTANCE Timeout           selectTimeout;   // select handshake steps, no waits in the handlers
+INSTANCE Timer             testTimer;
+INSTANCE Ticker            debugOutTimeout;
 #ifdef ASYNCHOUT // under development ...
 Ticker            outDataTicker;       
 #endif     
 
 // PC comms
-RawSerial         pc(USBTX, USBRX); // D0, D1 ?
-
-volatile uint8_t  deviceCode;
-volatile uint8_t  bitCount;
-volatile bool     highNibbleIn = false;
-volatile bool     highNibbleOut = false;
-volatile uint8_t  dataInByte;
-volatile uint8_t  dataOutByte;
-volatile uint16_t outDataGetPosition;
-volatile uint8_t  checksum;
-volatile uint16_t debuglock = 0 ;
-
-extern volatile bool     cmdComplete;
-extern volatile uint8_t  skipDeviceCode;
+INSTANCE RawSerial         pc(USBTX, USBRX); // D0, D1 ?
+
+INSTANCE volatile uint8_t  deviceCode;
+INSTANCE volatile uint8_t  bitCount;
+INSTANCE volatile bool     highNibbleIn = false;
+INSTANCE volatile bool     highNibbleOut = false;
+INSTANCE volatile uint8_t  dataInByte;
+INSTANCE volatile uint8_t  dataOutByte;
+INSTANCE volatile uint8_t  checksum;
+INSTANCE volatile uint16_t debuglock = 0 ;
+INSTANCE volatile uint16_t debugPos = 0 ;  // debugBuf length
+INSTANCE volatile uint16_t debugSent = 0 ; // debugBuf bytes queued on the console
+INSTANCE volatile uint16_t debugPeak = 0 ; // high-water mark
+// idle mode
+INSTANCE volatile uint32_t lastActivity = 0;
+INSTANCE volatile bool     wokenUp = false;
+INSTANCE volatile uint32_t wakeTime;
+INSTANCE uint32_t          wakeCost = 0;  // us, wake-up event to deepsleep() returning
+INSTANCE uint32_t          wakeCount = 0;
+INSTANCE uint32_t          wakeLatencyMax = 0;
+INSTANCE bool              deepSleepOk = true;
+// select handshake (FAST_SELECT)
+INSTANCE volatile bool     fastSelect = false;  // this one
+INSTANCE bool              fastSelectOn = false; // console switch
+INSTANCE bool              fastSelectOk = true;  // false after a failed one, till a full one works
+INSTANCE volatile bool     sessionOpen = false;
+INSTANCE volatile uint32_t sessionMark;         // last command answered
+INSTANCE volatile uint32_t selectStart;
+INSTANCE volatile uint32_t selectPolls;         // line polls left in this step
+INSTANCE uint32_t          sessionSelects, sessionFast;
+INSTANCE uint32_t          sessionFullUs, sessionFastUs;
+INSTANCE uint32_t          allFull, allFullUs;  // since reset: the reference for the savings
 
 // prototypes
 void startDeviceCodeSeq ( void );
+void selectDoutWait ( void );
+void selectDeviceStart ( void );
+void selectBitArm ( void );
+void selectIdleWait ( void );
+void selectDataStart ( void );
+void bitAck ( void );
+void selectDone ( void );
+void selectSessionMark ( void );
 void inDataReady ( void );
 
 // code
 void  ResetACK ( void ) {
     out_ACK = 0; 
     infoLed = 0;
+    CAPTURE( CAP_ACK, 0 );
 }
 void  SetACK ( void ) {
     out_ACK = 1; 
     infoLed = 1;
+    CAPTURE( CAP_ACK, 1 );
     // watchdog on ack line high (might lock the Sharp-PC)
     ackOffTimeout.attach( &ResetACK, ACK_TIMEOUT ); 
 }
 
 #ifdef DEBUG
-volatile uint8_t  debugBuf[DEBUG_SIZE];
+// append to the debug buffer (its own region of the buffers arena),
+// dropping what doesn't fit
+void debug_append(const char *s)
+{
+    uint16_t len = strlen(s);
+    if ( debugPos + len >= Board::DEBUG_SIZE )
+        return;
+    memcpy(debugBuf + debugPos, s, len + 1);
+    debugPos += len;
+    if ( debugPos > debugPeak )
+        debugPeak = debugPos;
+}
+
 void debug_log(const char *fmt, ...)
 {
-    uint8_t debugLine[120];
+    char debugLine[120];
     va_list va;
     debuglock = 1;
     va_start (va, fmt);
-    sprintf((char*)debugLine,"%d ",mainTimer.read_us());
-    strcat((char*)debugBuf,(char*)debugLine);
-    vsprintf ((char*)debugLine, fmt, va);
-    strcat((char*)debugBuf,(char*)debugLine);
+    sprintf(debugLine,"%d ",mainTimer.read_us());
+    debug_append(debugLine);
+    vsnprintf (debugLine, sizeof(debugLine), fmt, va);
+    debug_append(debugLine);
     va_end (va);
     debuglock = 0;
 }
@@ -169,27 +185,33 @@ void debug_hex(volatile uint8_t *buf, volatile uint16_t len)
     char tmp[15];
     debuglock = 1;
     sprintf(tmp,"%d <",mainTimer.read_us(), len);
-    strcat((char*)debugBuf, tmp);
+    debug_append(tmp);
     for (j=0;j<len;j++) {
         sprintf(tmp, "%02X", (char)buf[j]);
-        strcat((char*)debugBuf, tmp);
+        debug_append(tmp);
     }
     sprintf(tmp,">\n");
-    strcat((char*)debugBuf, tmp);
+    debug_append(tmp);
     debuglock = 0;
 }
 
 // dumping periodically, by a timer-issued thread,
-// in order to de-sync from the main functions.
-// Much cleaner solution would be to use a circular buffer,
-// but it's complicated to format-write into it.
+// in order to de-sync from the main functions:
+// each time, as much of the log as the console ring takes 
+// (sent in the background), the buffer restarts once all queued.
 void outDebugDump (void ) {
-    while ( debuglock != 0 ) // semaphore
-        wait_us (100);
-    if ( debugBuf[0]!=0x00 ) {
+    if ( debuglock != 0 ) // semaphore: being written, next time
+        return;
+    if ( xferActive() ) // binary frames on the console, keep the log for later
+        return;
+    if ( debugSent < debugPos ) {
         debuglock = 1;
-        pc.printf ( "%s", (char*)debugBuf ); // slow serial comm
-        debugBuf[0]=0x00;
+        debugSent += consoleWrite ( debugBuf + debugSent, debugPos - debugSent );
+        if ( debugSent == debugPos ) {
+            debugBuf[0]=0x00;
+            debugPos = 0;
+            debugSent = 0;
+        }
     }
     debuglock = 0;
 }
@@ -198,13 +220,13 @@ void outDebugDump (void ) {
 void outDebugDumpManual( void ){
     uint8_t i = 20;
     while (i--) { infoLed =! infoLed; wait_ms(20); }
-    // printout debug buffers
-    pc.printf ( "%s", (char*)debugBuf );
+    // printout debug buffers (the rest follows with the periodic dump)
+    outDebugDump ();
     // reset status
     ResetACK();
     irq_BUSY.rise(NULL);
     irq_BUSY.fall(NULL);
-    sprintf ( (char*)debugBuf, "ok\n" ); 
+    debug_append ( "ok\n" ); 
 }
 #else
 void debug_log(const uint8_t *fmt, ...)
@@ -238,10 +260,10 @@ void sendNibble ( void )
     if ( highNibbleOut ) {
         highNibbleOut = false;
         t = (dataOutByte >> 4);
-        outDataGetPosition++; // done - next byte
+        ctx.outDataGetPosition++; // done - next byte
     } else {
         highNibbleOut = true;
-        dataOutByte = outDataBuf[outDataGetPosition];
+        dataOutByte = ctx.outDataBuf[ctx.outDataGetPosition];
         //debug_log ("%d: 0x%02X\n", outDataGetPosition, dataOutByte);
         t = (dataOutByte & 0x0F);
     }
@@ -288,20 +310,20 @@ void outDataEnd ( void ) {
 // Called by a ticker at OUT_NIBBLE_DELAY interval
 void outDataSpooler ( void ) {
 
-    if ( outDataGetPosition < outDataPutPosition )
+    if ( ctx.outDataGetPosition < ctx.outDataPutPosition )
         // something to send
         sendNibble( );
     
     if (   !highNibbleOut // byte complete
-        && outDataGetPosition == outDataPutPosition // data stream end reached
-        && outDataGetPosition > 0 ) {
-        pc.putc('p');
-        if ( !cmdComplete ) {
+        && ctx.outDataGetPosition == ctx.outDataPutPosition // data stream end reached
+        && ctx.outDataGetPosition > 0 ) {
+        consolePutc('p');
+        if ( !ctx.cmdComplete ) {
             // might have reached buffer end, but stream isn't complete yet
             // wait for the feeder to reset buffer position 
-            pc.putc('b');
+            consolePutc('b');
             uint32_t nTimeout = 5000; // max wait
-            while ( outDataGetPosition > 0 && (nTimeout--) )
+            while ( ctx.outDataGetPosition > 0 && (nTimeout--) )
                 wait_us (100);
             if (!nTimeout) {
                 outDataEnd();
@@ -309,7 +331,7 @@ void outDataSpooler ( void ) {
             }
         } else {
             // data stream complete
-            pc.putc('t');
+            consolePutc('t');
             outDataEnd();
             // last wait for BUSY to go DOWN
             uint32_t nTimeout = 50000; // max wait
@@ -348,8 +370,9 @@ void SendOutputData ( void ) {
 
     testTimer.reset(); 
     testTimer.start(); 
-    //pc.printf("outDataGetPosition %d outDataPutPosition %d ", outDataGetPosition, outDataPutPosition);
-    while ( outDataGetPosition < outDataPutPosition ) { // outDataPointer < outBufPosition
+    //consolePrintf("outDataGetPosition %d outDataPutPosition %d ", outDataGetPosition, outDataPutPosition);
+    while ( ctx.outDataGetPosition < ctx.outDataPutPosition ) { // outDataPointer < outBufPosition
+        PROFILE_BEGIN( tNib );
         wait_us (OUT_NIBBLE_DELAY); // here ?
 
         // wait for BUSY to go DOWN
@@ -362,16 +385,17 @@ void SendOutputData ( void ) {
             ResetACK();
             break;
         };
+        CAPTURE( CAP_SEEN, CAP_W_OUT_DOWN );
         //debug_log ( " %1X timeout 1 %d\n", (in_BUSY!=0), nTimeout);
 
         if ( highNibbleOut ) {
             highNibbleOut = false;
             t = (dataOutByte >> 4);
-            outDataGetPosition++;
+            ctx.outDataGetPosition++;
         } else {
             highNibbleOut = true;
-            dataOutByte = outDataBuf[outDataGetPosition];
-            //pc.putc('.');
+            dataOutByte = ctx.outDataBuf[ctx.outDataGetPosition];
+            //consolePutc('.');
             //debug_log (" %d: %02X\n", outDataGetPosition, dataOutByte); // debug ONLY (can fill up space)
             t = (dataOutByte & 0x0F);
         }
@@ -379,6 +403,7 @@ void SendOutputData ( void ) {
         out_SEL_2 = ((t&0x02)>>1);
         out_D_OUT = ((t&0x04)>>2);
         out_D_IN  = ((t&0x08)>>3);
+        CAPTURE( CAP_NIB_OUT, t );
         // nibble is ready for Sharp-PC to get it        
         wait_us (OUT_NIBBLE_DELAY); // here too?
         SetACK();
@@ -392,14 +417,19 @@ void SendOutputData ( void ) {
             ResetACK();
             break;
         };
+        CAPTURE( CAP_SEEN, CAP_W_OUT_UP );
         //debug_log ( " %1X timeout 2 %d\n", (in_BUSY!=0), nTimeout);
 
         ResetACK();
+        PROFILE_END( PROF_NIB_OUT, tNib, highNibbleOut ? 0 : 1 );
+#ifdef WIRE_CAPTURE
+        captureFlushNow(); // no main loop until the end of the output
+#endif
     } 
     testTimer.stop();
-    pc.putc('\n');
+    consolePutc('\n');
     debug_log ( "send complete\n" );
-    debug_log ( "avg output timing (ms/byte): %.2f\n", testTimer.read_us()/outDataGetPosition/1000.0); 
+    debug_log ( "avg output timing (ms/byte): %.2f\n", testTimer.read_us()/ctx.outDataGetPosition/1000.0); 
     //wait_us ( IN_DATAREADY_TIMEOUT );
     // set for INPUT mode
     in_D_OUT.mode(PullDown);
@@ -417,32 +447,40 @@ void SendOutputData ( void ) {
 #endif
 
 void inNibbleReady ( void ) {
+    PROFILE_BEGIN( tNib );
     // probe input lines and get nibble value
     uint8_t inNibble = ( in_SEL_1 + (in_SEL_2<<1) + (in_D_OUT<<2) + (in_D_IN<<3) );
+    CAPTURE( CAP_NIB_IN, inNibble );
     //debug_log ( "(%d) %01X \n", highNibbleIn, inNibble ) ; 
     if ( out_ACK == 0 ) {
         wait_us ( NIBBLE_DELAY_1 );
         SetACK();
         if ( highNibbleIn ) {
             highNibbleIn = false;
-            inDataBuf[inBufPosition] = (inNibble << 4) + inDataBuf[inBufPosition];
-            checksum = (inDataBuf[inBufPosition] + checksum) & 0xff;
+            ctx.inDataBuf[ctx.inBufPosition] = (inNibble << 4) + ctx.inDataBuf[ctx.inBufPosition];
+            checksum = (ctx.inDataBuf[ctx.inBufPosition] + checksum) & 0xff;
             debug_log(" %u:0x%02X [%02X]\n", 
-                inBufPosition, inDataBuf[inBufPosition], checksum ) ;
-            inBufPosition++; // should be circular for safety; may cut off data!
+                ctx.inBufPosition, ctx.inDataBuf[ctx.inBufPosition], checksum ) ;
+            if ( ctx.inBufPosition < IN_BUF_SIZE - 1 ) 
+                ctx.inBufPosition++; 
+            else
+                ERR_PRINTOUT( "input buffer full\n" ) ; // cutting off data!
             // Data processing starts after last byte (timeout reset after each byte received) 
             inDataReadyTimeout.attach_us( &inDataReady, IN_DATAREADY_TIMEOUT );
         } else {
             highNibbleIn = true;
-            inDataBuf[inBufPosition] = inNibble;
+            ctx.inDataBuf[ctx.inBufPosition] = inNibble;
             //debug_log ( " %01X\n", inDataBuf[inBufPosition] ) ; 
         }
     } else {
         ERR_PRINTOUT( "inNibbleReady out_ACK!=0\n" ) ;
     }
+    PROFILE_END( PROF_NIB_IN, tNib, highNibbleIn ? 0 : 1 ); // a byte with the high nibble
 }
 
 void inNibbleAck ( void ) {
+    PROFILE_BEGIN( tAck );
+    CAPTURE( CAP_NIB_ACK, 0 );
     // test lines
     // debug_log ( "ack (%01X)\n\r", ( in_SEL_1 + (in_SEL_2<<1) + (in_D_OUT<<2) + (in_D_IN<<3) )) ; 
     if ( out_ACK == 1 ) {
@@ -451,42 +489,54 @@ void inNibbleAck ( void ) {
     } else {
         ERR_PRINTOUT( "inNibbleAck out_ACK!=1\n" ); 
     }
+    PROFILE_END( PROF_NIB_ACK, tAck, 0 );
 }
 
 void SendErrorOut ( void ) {
-    outDataBuf[ 0 ] = 0xFF; // error ?
-    outDataPutPosition = 1;
+    ctx.outDataBuf[ 0 ] = 0xFF; // error ?
+    ctx.outDataPutPosition = 1;
     SendOutputData();
 }
 
+// receive complete (no BUSY edge for IN_DATAREADY_TIMEOUT):
+// the rest is main loop work (events.cpp)
 void inDataReady ( void ) {
-    pc.putc('c');
-    // receive complete
+    lastActivity = mainTimer.read_us();
     testTimer.stop();
-    debug_log ( "Processing...\n" ) ;
     // stop the BUSY triggers
     irq_BUSY.fall(NULL);
     irq_BUSY.rise(NULL);
-    if ( inBufPosition > 0 ) {
-        debug_log ( "in: %d bytes (first 40 below)\n", inBufPosition) ; 
-        debug_hex ( inDataBuf, (inBufPosition) < (40) ? (inBufPosition) : (40) );
+    eventPost ( EV_COMMAND );
+}
+
+// EV_COMMAND: check, process and answer the command received
+void commandTask ( void ) {
+    consolePutc('c');
+    debug_log ( "Processing...\n" ) ;
+    if ( ctx.inBufPosition > 0 ) {
+        debug_log ( "in: %d bytes (first 40 below)\n", ctx.inBufPosition) ; 
+        debug_hex ( ctx.inDataBuf, (ctx.inBufPosition) < (40) ? (ctx.inBufPosition) : (40) );
         debug_log ( "avg input timing (ms/byte): %.2f\n", 
-           (testTimer.read_us() - IN_DATAREADY_TIMEOUT) / inBufPosition/1000.0); 
+           (testTimer.read_us() - IN_DATAREADY_TIMEOUT) / ctx.inBufPosition/1000.0); 
         // Verify checksum
         checksum=0;
-        for (int i=0;i<inBufPosition-1;i++) {
-            checksum = (inDataBuf[i]+checksum) & 0xff;
+        for (int i=0;i<ctx.inBufPosition-1;i++) {
+            checksum = (ctx.inDataBuf[i]+checksum) & 0xff;
         }   
-        debug_log ( "checksum 0x%02X vs 0x%02X\n" ,  checksum, inDataBuf[inBufPosition-1]); 
-        if ( checksum == inDataBuf[inBufPosition-1] ) {
-            //pc.printf(" 0x%02X\n", inDataBuf[0]);
-            debug_log ( "command 0x%02X\n" , inDataBuf[0]); 
-            outDataGetPosition = 0;
-            outDataPutPosition = 0;
+        debug_log ( "checksum 0x%02X vs 0x%02X\n" ,  checksum, ctx.inDataBuf[ctx.inBufPosition-1]); 
+        if ( checksum == ctx.inDataBuf[ctx.inBufPosition-1] ) {
+            //consolePrintf(" 0x%02X\n", inDataBuf[0]);
+            debug_log ( "command 0x%02X\n" , ctx.inDataBuf[0]); 
+            CAPTURE( CAP_CMD, ctx.skipDeviceCode ? ctx.skipDeviceCode : ctx.inDataBuf[0] );
+            ctx.outDataGetPosition = 0;
+            ctx.outDataPutPosition = 0;
             highNibbleOut = false;
             // decode and process command - feeding the output buffer
+            arenaProcessPhase ();
             ProcessCommand ();  
-            inBufPosition = 0;
+            arenaTransmitPhase ();
+            CAPTURE( CAP_CMD_DONE, ctx.outDataPutPosition );
+            ctx.inBufPosition = 0;
 #ifdef ASYNCHOUT
             // set lines for OUTPUT
             in_D_OUT.mode(PullNone);
@@ -496,19 +546,20 @@ void inDataReady ( void ) {
             testTimer.start(); 
             outDataTicker.attach_us ( outDataSpooler, OUT_NIBBLE_DELAY );
 #else
-            if ( outDataPutPosition > 0 ) {
+            if ( ctx.outDataPutPosition > 0 ) {
                 // data ready for sending 
-                debug_log ( "out: %u bytes (first 40 below)\n" , outDataPutPosition);
-                debug_hex ( outDataBuf, (outDataPutPosition) < (40) ? (outDataPutPosition) : (40) );
+                debug_log ( "out: %u bytes (first 40 below)\n" , ctx.outDataPutPosition);
+                debug_hex ( ctx.outDataBuf, (ctx.outDataPutPosition) < (40) ? (ctx.outDataPutPosition) : (40) );
                 // Take control and send processed data to Sharp
-                pc.putc('o');
+                consolePutc('o');
                 SendOutputData(); 
+                selectSessionMark ();
                 // some commands do not have the device-code sequence
                 // so we directly receive next byte 
-                if ( skipDeviceCode != 0x00 ) {
-                    pc.putc('n');
-                    debug_log ( "next: 0x%02X\n", skipDeviceCode ) ;
-                    inBufPosition = 0;
+                if ( ctx.skipDeviceCode != 0x00 ) {
+                    consolePutc('n');
+                    debug_log ( "next: 0x%02X\n", ctx.skipDeviceCode ) ;
+                    ctx.inBufPosition = 0;
                     highNibbleIn = false;
                     checksum = 0;
                     testTimer.reset();
@@ -535,13 +586,15 @@ void inDataReady ( void ) {
 
 // Serial bit receive
 void bitReady ( void ) {
-    uint32_t nTimeout;
-    //pc.putc('b'); // debug 
+    PROFILE_BEGIN( tBit );
+    //consolePutc('b'); // debug 
+    CAPTURE( CAP_BIT_BUSY, bitCount );
     if ( out_ACK == 1 ) {
         bool bit;
-        wait_us ( BIT_DELAY_1 );
+        wait_us ( fastSelect ? FAST_SETTLE : BIT_DELAY_1 );
         bit = in_D_OUT; // get bit value
-        //pc.putc(0x30+bit);pc.putc(' ');
+        CAPTURE( CAP_BIT, bit );
+        //consolePutc(0x30+bit);consolePutc(' ');
         //sprintf ( (char*)debugLine, " bit %d: %d\n\r",  bitCount, bit ); 
         ResetACK(); // bit received
         deviceCode>>=1;
@@ -549,78 +602,187 @@ void bitReady ( void ) {
         if ((bitCount=(++bitCount)&7)==0) {
             // 8 bits received
             irq_BUSY.rise(NULL); // detach this IRQ
-            pc.printf("d 0x%02X\n",deviceCode);
+            irq_BUSY.fall(NULL);
+            consolePrintf("d 0x%02X\n",deviceCode);
+            CAPTURE( CAP_DEVICE, deviceCode );
             debug_log ( "Device ID 0x%02X\n", deviceCode ); 
             if ( deviceCode == 0x41 ) {
                 // Sharp-PC is looking for a CE140F (device code 0x41) - Here we are!
                 debug_log ( "CE140F\n" ) ;
-                inBufPosition = 0;
+                ctx.inBufPosition = 0;
                 highNibbleIn = false;
                 checksum = 0;
-                skipDeviceCode = 0;
-                // set data handshake triggers on the BUSY line
-                irq_BUSY.fall(&inNibbleAck);
-                irq_BUSY.rise(&inNibbleReady);
+                ctx.skipDeviceCode = 0;
                 testTimer.reset();
                 testTimer.start();
                 // check for both BUSY and X_OUT to go down, before starting data receive
-                nTimeout = 10000; // timeout: 1s
-                while ( ( in_X_OUT || in_BUSY ) && (nTimeout--) ) {
-                    wait_us (100);
-                }
-                if (nTimeout) {
-                    // trigger data handling
-                    SetACK();
-                    wait_us ( DATA_WAIT );
-                    ResetACK();
-                } else {
-                    ERR_PRINTOUT("bitReady Timeout!\n\r") ;
-                }
+                selectPolls = 10000; // timeout: 1s
+                selectIdleWait ();
             } 
-        } else {
-            wait_us ( BIT_DELAY_2 );
-            SetACK();
+        } else if ( !fastSelect ) {
+            selectTimeout.attach_us ( &SetACK, BIT_DELAY_2 ); // next bit
         }
     }
+    PROFILE_END( PROF_BIT, tBit, 0 );
+}
+
+// device code received: BUSY and X_OUT down (polled every 100 us), then
+// the ACK pulse that starts the data transfer
+void selectIdleWait ( void ) {
+    PROFILE_BEGIN( tSel );
+    if ( in_X_OUT || in_BUSY ) {
+        if ( selectPolls-- )
+            selectTimeout.attach_us ( &selectIdleWait, 100 );
+        else {
+            ERR_PRINTOUT("bitReady Timeout!\n\r") ;
+            if ( fastSelect )
+                fastSelectOk = false; // back to the full handshake
+        }
+    } else {
+        CAPTURE( CAP_SEEN, CAP_W_XOUT_BUSY );
+        // trigger data handling
+        SetACK();
+        selectTimeout.attach_us ( &selectDataStart, fastSelect ? FAST_DATA_WAIT : DATA_WAIT );
+    }
+    PROFILE_END( PROF_SELECT, tSel, 0 );
+}
+
+void selectDataStart ( void ) {
+    ResetACK();
+    selectDone ();
+    // set data handshake triggers on the BUSY line
+    irq_BUSY.fall(&inNibbleAck);
+    irq_BUSY.rise(&inNibbleReady);
+}
+
+// fast select: BUSY down, next bit please
+void bitAck ( void ) {
+    if ( out_ACK == 0 )
+        SetACK();
+}
+
+// select handshake time, for the savings of the fast one
+void selectDone ( void ) {
+    uint32_t t = mainTimer.read_us() - selectStart;
+    sessionSelects++;
+    if ( fastSelect ) {
+        sessionFast++;
+        sessionFastUs += t;
+    } else {
+        sessionFullUs += t;
+        allFull++;
+        allFullUs += t;
+        fastSelectOk = true;
+    }
+}
+
+// command answered: the next select may come as part of the same session
+void selectSessionMark ( void ) {
+    sessionMark = mainTimer.read_us();
+    sessionOpen = true;
+}
+
+void selectReport ( void ) {
+    uint32_t full = sessionSelects - sessionFast;
+    uint32_t fullAvg = allFull ? allFullUs / allFull : 0;
+    uint32_t fastAvg = sessionFast ? sessionFastUs / sessionFast : 0;
+    consolePrintf("\nsession: %u selects, %u fast (%s)\n", sessionSelects, sessionFast,
+        !fastSelectOn ? "off" : fastSelectOk ? "on" : "on, after a full one");
+    consolePrintf("select avg: full %u us (session %u), fast %u us\n", fullAvg,
+        full ? sessionFullUs / full : 0, fastAvg);
+    if ( sessionFast && fullAvg > fastAvg )
+        consolePrintf("saved %u ms\n", (uint32_t)( (uint64_t)( fullAvg - fastAvg ) * sessionFast / 1000 ));
 }
 
 void startDeviceCodeSeq ( void ) {
-    uint32_t nTimeout = 100;
+    PROFILE_BEGIN( tSel );
+    selectStart = lastActivity = mainTimer.read_us();
+    CAPTURE( CAP_XOUT, 0 );
     debug_log ( "startDeviceCodeSeq start\n" );
-    while ( ( in_D_OUT == 0 ) && (nTimeout--) ) {
-        wait_us (BIT_DELAY_1);
+#ifdef FAST_SELECT
+    fastSelect = fastSelectOn && fastSelectOk && sessionOpen 
+              && (uint32_t)( selectStart - sessionMark ) < SESSION_GAP;
+    sessionOpen = false; // until this command is answered
+    if ( !fastSelect ) {
+        // a new session
+        sessionSelects = sessionFast = 0;
+        sessionFullUs = sessionFastUs = 0;
     }
-    wait_us (BIT_DELAY_1);
-    //pc.putc('s'); // debug 
+#endif
+    selectPolls = 100; // D_OUT up within 100 ms
+    selectTimeout.detach(); // a select left over
+    selectDoutWait ();
+    PROFILE_END( PROF_SELECT, tSel, 0 );
+}
+
+// X_OUT up: D_OUT up too (polled), settled
+void selectDoutWait ( void ) {
+    uint32_t poll = fastSelect ? FAST_POLL : BIT_DELAY_1;
+    if ( in_D_OUT == 0 && selectPolls-- ) {
+        selectTimeout.attach_us ( &selectDoutWait, poll );
+        return;
+    }
+    CAPTURE( CAP_SEEN, CAP_W_DOUT );
+    selectTimeout.attach_us ( &selectDeviceStart, fastSelect ? FAST_SETTLE : BIT_DELAY_1 );
+}
+
+void selectDeviceStart ( void ) {
+    PROFILE_BEGIN( tSel );
+    //consolePutc('s'); // debug 
     debug_log ( "startDeviceCodeSeq in_D_OUT\n" );
     if ( in_D_OUT == 1 ) {
         // Device Code transfer starts with both X_OUT and DOUT high
         // (X_OUT high with DOUT low is for cassette write)
         SetACK();
+        if ( wokenUp ) {
+            // from deep sleep: check we're still in time for the Sharp
+            uint32_t latency = wakeCost + ( mainTimer.read_us() - wakeTime );
+            wokenUp = false;
+            if ( latency > wakeLatencyMax ) 
+                wakeLatencyMax = latency;
+            debug_log ( "wake-up latency %u us\n", latency );
+            if ( latency > WAKE_BUDGET ) {
+                deepSleepOk = false;
+                ERR_PRINTOUT( "wake-up too slow, deep sleep off\n" );
+            }
+        }
         bitCount = 0;
         deviceCode = 0;
         //debugBuf[0] = 0;  // with a periodic dump: buffer resets
-        inBufPosition = 0;
+        ctx.inBufPosition = 0;
         debug_log ("Device\n");
-        wait_us (ACK_DELAY) ;   //?? or, wait only AFTER enabling trigger ??
-        // serial bit trigger
-        irq_BUSY.rise(&bitReady);
-        irq_BUSY.fall(NULL);
-        wait_us (ACK_DELAY) ;
+#ifdef FAST_SELECT
+        if ( fastSelect ) {
+            // each bit acknowledged on its BUSY edges
+            irq_BUSY.rise(&bitReady);
+            irq_BUSY.fall(&bitAck);
+        } else
+#endif
+        // serial bit trigger, ACK_DELAY after ACK
+        selectTimeout.attach_us ( &selectBitArm, ACK_DELAY );
     }
+    PROFILE_END( PROF_SELECT, tSel, 0 );
+}
+
+void selectBitArm ( void ) {
+    irq_BUSY.rise(&bitReady);
+    irq_BUSY.fall(NULL);
 }
 
-char sio_buf [80];
-int sio_pos = 0;
+INSTANCE char sio_buf [80];
+INSTANCE int sio_pos = 0;
 
 // Here we could handle commands issued through the serial console
 void sio_callback() {
     // Note: you need to actually read from the serial to clear the RX interrupt
     char c = pc.getc();
+    lastActivity = mainTimer.read_us(); // no deep sleep while in use
+    if ( xferRxByte(c) ) // file transfer frame
+        return;
     
     // store char in buffer and process command on 'Enter'
     if ( sio_pos < 80 ) {
-        pc.putc(c);
+        consolePutc(c);
         sio_buf[sio_pos] = c;
         sio_pos++;
         if ( c == 0x0D) {
@@ -629,28 +791,130 @@ void sio_callback() {
             infoLed = !infoLed;
             
             // parse and process command in buffer
-            // ... TO DO ...
+            sio_buf[sio_pos-1] = 0x00;
+            if ( strcmp(sio_buf, "mem") == 0 )
+                arenaReport();
+            else if ( strcmp(sio_buf, "evq") == 0 )
+                eventReport();
+            else if ( strcmp(sio_buf, "sel") == 0 )
+                selectReport();
+            else if ( strcmp(sio_buf, "sel fast") == 0 )
+                fastSelectOn = true;
+            else if ( strcmp(sio_buf, "sel full") == 0 )
+                fastSelectOn = false;
+            else if ( strcmp(sio_buf, "idle") == 0 )
+                consolePrintf("\nwake-ups %u, max latency %u us (budget %u, wake-up %u), deep sleep %s\n",
+                    wakeCount, wakeLatencyMax, WAKE_BUDGET, wakeCost, deepSleepOk ? "on" : "off");
+#ifdef WIRE_PROFILE
+            else if ( strcmp(sio_buf, "prof") == 0 )
+                profileReport();
+            else if ( strcmp(sio_buf, "prof clear") == 0 )
+                profileClear();
+#endif
+#ifdef FLASH_CACHE
+            else if ( strcmp(sio_buf, "cache") == 0 )
+                flashCacheReport();
+#endif
+#ifdef WIRE_CAPTURE
+            else if ( strcmp(sio_buf, "cap on") == 0 )
+                captureRequest(true);  // into CAPTURE_FILE, see capture.cpp
+            else if ( strcmp(sio_buf, "cap off") == 0 )
+                captureRequest(false);
+#endif
+            else if ( sio_pos > 1 )
+                consolePrintf("\n?\n");
 
             sio_pos = 0;
         }
     }
 }
 
+// file transfer backend (see xfer.h)
+void xferSerialWrite ( const uint8_t *buf, uint16_t len ) {
+    consoleWriteAll ( buf, len );
+}
+
+uint32_t xferMicros ( void ) {
+    return mainTimer.read_us();
+}
+
+#ifdef IDLE_DEEPSLEEP
+// Deep sleep (STOP mode) while there's no transaction going on,
+// until the X_OUT rising edge of the next device code sequence.
+// Interrupts are held off until deepsleep() has restored the clocks, 
+// so that startDeviceCodeSeq runs at full speed, and measures 
+// the time from wake-up to ACK against WAKE_BUDGET: mainTimer from
+// deepsleep() returning, plus what deepsleep() took till then (wakeCost).
+bool idleSleep ( void ) {
+    if ( !deepSleepOk || debugPos != 0 || xferActive() || consoleBusy() 
+      || (uint32_t)(mainTimer.read_us() - lastActivity) < IDLE_TIMEOUT )
+        return false;
+#ifdef DEBUG
+    debugOutTimeout.detach(); // no periodic wake-ups
+#endif
+    __disable_irq();
+    if ( in_X_OUT == 0 && in_BUSY == 0 && !consoleBusy() && !eventPending()
+      && (uint32_t)(mainTimer.read_us() - lastActivity) >= IDLE_TIMEOUT ) {
+        deepsleep();
+        // clocks back, pending edge not handled yet
+        wakeTime = mainTimer.read_us();
+        wokenUp = true;
+        wakeCount++;
+        storageCardSuspect(); // no probe while asleep
+    }
+    lastActivity = mainTimer.read_us();
+    __enable_irq(); 
+    wokenUp = false; // X_OUT handled by now, if that's what woke us up
+#ifdef DEBUG
+    debugOutTimeout.attach_us( &outDebugDump, Board::DEBUG_TIMEOUT );
+#endif
+    return true;
+}
+
+#ifdef WAKE_CALIBRATE
+void wakeCalibrateDone ( void ) {
+}
+
+// What deepsleep() takes from the wake-up event to its return - STOP exit,
+// clocks and timers restored - out of sight of mainTimer, which stops in
+// STOP: woken up once by the low power ticker, which runs all along, at a
+// time known on its own clock.
+void wakeCalibrate ( void ) {
+    LowPowerTimeout lpt;
+    __disable_irq();
+    uint32_t start = lp_ticker_read();
+    lpt.attach_us ( &wakeCalibrateDone, 2000 );
+    deepsleep();
+    uint32_t slept = lp_ticker_read() - start;
+    __enable_irq();
+    lpt.detach();
+    if ( slept >= 2000 && slept < 2000 + WAKE_BUDGET )
+        wakeCost = slept - 2000;
+    debug_log ( "wake-up cost %u us\n", wakeCost );
+}
+#endif
+#endif
+
 int main(void) {
   uint8_t i = 20;
 
-  pc.baud(115200);
-  pc.printf("CE140F emulator init\n");
+  memInit(); // stack paint, before it's used (see "mem")
+  pc.baud(CONSOLE_BAUD);
+  consoleInit();
+  consolePrintf("CE140F emulator init\n");
   while (i--) {
     infoLed = !infoLed;
     wait_ms(20);
   }
 
-  inBufPosition = 0;
+  ctx.inBufPosition = 0;
+#ifdef WIRE_PROFILE
+  profileInit();
+#endif
 #ifdef DEBUG
   debugBuf[0] = 0;
   user_BTN.rise(&outDebugDumpManual);
-  debugOutTimeout.attach_us( &outDebugDump, DEBUG_TIMEOUT );
+  debugOutTimeout.attach_us( &outDebugDump, Board::DEBUG_TIMEOUT );
 #endif
 
   // default input pull-down
@@ -670,10 +934,13 @@ int main(void) {
 
   // initial triggers (device sequence handshake)
   irq_X_OUT.rise(&startDeviceCodeSeq);
-  pc.printf("ready\n");
+  consolePrintf("ready\n");
   debug_log("ready\n");
   mainTimer.reset();
   mainTimer.start();
+#ifdef WAKE_CALIBRATE
+  wakeCalibrate();
+#endif
 
 
 
@@ -682,9 +949,40 @@ int main(void) {
 
   while (1) {
      
-    // Sharp CE140F emulator logic is handled by interrupts and timers
-    
-    wait(1);
+    // Sharp CE140F emulator: the handshakes are handled by interrupts and
+    // timers, the commands they receive come back here (events.cpp)
+    if ( eventRun() )
+        continue;
+
+#ifdef WIRE_CAPTURE
+    // wire capture records to the card
+    captureTask();
+#endif
+    // file transfers over the serial console
+    if ( xferPoll() )
+        continue;
+    // card pulled out or swapped? looked at between sessions only
+    bool quiet = (uint32_t)(mainTimer.read_us() - lastActivity) >= CARD_QUIET;
+    if ( quiet )
+        storageCardProbe();
+    // background storage work (free space count after mount)
+    storageIdleTask();
+    if ( storageIdleBusy() )
+        continue;
+#ifdef FLASH_CACHE
+    // copies of the most loaded files to the internal flash, between
+    // sessions as well: the bus handlers stall while the flash is busy
+    if ( quiet && flashCacheTask() )
+        continue;
+#endif
+#ifdef IDLE_DEEPSLEEP
+    if ( idleSleep() )
+        continue;
+#endif
+    __disable_irq();
+    if ( !eventPending() )
+        sleep(); // until next interrupt (woken up by a pending one)
+    __enable_irq();
 
   }
 }
@@ -0,0 +1,72 @@
+#include "mbed.h"
+#include "console.h"
+#include "memstat.h"
+
+#ifdef MEM_STATS
+// RAM telemetry.
+// mbed 2: main() and the interrupt handlers share one stack (MSP), from the
+// top of RAM (the initial MSP, in the vector table) down towards the heap.
+// The gap in between is painted at startup, the lowest word no longer
+// holding the pattern is as deep as the stack went. The heap growing later
+// takes the bottom of the paint: the scan starts from its end, and what's
+// left in between is the real margin.
+#if defined __GNUC__ && !defined __ARMCC_VERSION
+#include <malloc.h>
+#include <unistd.h>
+#define MEM_MALLINFO 1 // newlib (GCC_ARM): heap end and free blocks
+#endif
+
+uint32_t *memLow;      // painted: memLow up to memTop
+uint32_t *memTop;
+uint32_t *memHeapMark; // heap end at startup, without MEM_MALLINFO
+
+// heap end: the bottom of the stack space (mbed 2)
+uint32_t *memHeapEnd ( void ) {
+#ifdef MEM_MALLINFO
+    return (uint32_t*)( ( (uintptr_t)sbrk ( 0 ) + 3 ) & ~3 );
+#else
+    return memHeapMark;
+#endif
+}
+
+void memInit ( void ) {
+#ifndef MEM_MALLINFO
+    void *probe = malloc ( 4 ); // the next block, near enough
+    memHeapMark = (uint32_t*)( ( (uintptr_t)probe + 16 ) & ~3 );
+    free ( probe );
+#endif
+    memLow = memHeapEnd();
+    memTop = *(uint32_t**)SCB->VTOR; // initial MSP
+    uint32_t *sp = (uint32_t*)( ( __get_MSP() - MEM_MARGIN ) & ~3 );
+    __disable_irq();
+    for ( uint32_t *p = memLow; p < sp && p < memTop; p++ )
+        *p = MEM_PAINT;
+    __enable_irq();
+}
+
+// first word overwritten, from the bottom
+uint32_t *memStackLow ( uint32_t *from ) {
+    uint32_t *p = from;
+    while ( p < memTop && *p == MEM_PAINT )
+        p++;
+    return p;
+}
+
+void memReport ( void ) {
+    uint32_t *heapEnd = memHeapEnd();
+    uint32_t *low = memStackLow ( heapEnd > memLow ? heapEnd : memLow );
+    consolePrintf ( "stack (main+irq): peak %u, %u left above the heap\n",
+        (unsigned)( memTop - low ) * 4, low > heapEnd ? (unsigned)( low - heapEnd ) * 4 : 0 );
+#ifdef MEM_MALLINFO
+    struct mallinfo mi = mallinfo();
+    consolePrintf ( "heap %u: in use %u, free %u in %u blocks\n",
+        mi.arena, mi.uordblks, mi.fordblks, mi.ordblks );
+#endif
+}
+#else
+void memInit ( void ) {
+}
+
+void memReport ( void ) {
+}
+#endif
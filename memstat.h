@@ -0,0 +1,22 @@
+#ifndef MEMSTAT_H
+#define MEMSTAT_H
+#include <stdint.h>
+#include "board.h"
+
+// RAM telemetry (see memstat.cpp).
+// Stack high-water marks, from a pattern painted at startup over the free
+// stack space, and the heap as the C library sees it. Printed by the "mem"
+// console command after the buffer peaks (arenaReport), to size the
+// buffers of a board (board.h) against what is actually left.
+// Nothing on the host build: its stacks aren't the device's.
+#ifndef HOST_BUILD
+#define MEM_STATS 1
+#endif
+
+#define MEM_PAINT  0xA5A5A5A5u
+#define MEM_MARGIN 64 // bytes under the stack pointer left alone when painting
+
+void memInit ( void );   // paint, first thing in main()
+void memReport ( void ); // "mem" console command
+
+#endif
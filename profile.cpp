@@ -0,0 +1,140 @@
+#include "mbed.h"
+#include "console.h"
+#include "profile.h"
+
+#ifdef WIRE_PROFILE
+// Hot path profiling.
+// A probe reads the cycle counter on the way in and out (a few cycles, no
+// call), the difference goes into the section totals and into its power of
+// two bucket. The handlers add to their own sections only, the main loop to
+// the other ones: no lock. The counter wraps after 53 s at 80 MHz, far more
+// than any section takes; it stops in deep sleep, which happens between
+// sections only. On the host, the probes see virtual time (the firmware
+// delays and the card latency of tools/host), turned into 80 MHz cycles.
+#ifdef HOST_BUILD
+#define PROF_MHZ 80
+#else
+#define PROF_MHZ ( SystemCoreClock / 1000000 )
+#endif
+
+typedef struct {
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t total;
+    uint32_t max;
+    uint32_t hist[PROF_BUCKETS];
+} profsec_t;
+
+typedef struct {
+    uint8_t  code;
+    uint32_t count;
+    uint64_t total;
+    uint32_t max;
+} profcmd_t;
+
+const char *profName[PROF_COUNT] = {
+    "bit", "nib in", "nib ack", "nib out", "command", "sd read", "sd write", "select"
+};
+INSTANCE profsec_t profSec[PROF_COUNT];
+INSTANCE profcmd_t profCmd[PROF_CODES];
+INSTANCE uint8_t   profCmdCount = 0;
+INSTANCE uint32_t  profCmdLost = 0;   // codes past PROF_CODES
+
+#ifdef HOST_BUILD
+uint32_t profileNow ( void ) {
+    return (uint32_t)( hostNow() * PROF_MHZ );
+}
+#endif
+
+void profileInit ( void ) {
+#ifndef HOST_BUILD
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+void profileAdd ( uint8_t sec, uint32_t cycles, uint32_t bytes ) {
+    profsec_t *s = &profSec[sec];
+    int b = 0;
+    if ( cycles >> ( PROF_SHIFT + 1 ) )
+        b = 31 - __builtin_clz ( cycles ) - PROF_SHIFT;
+    if ( b >= PROF_BUCKETS )
+        b = PROF_BUCKETS - 1;
+    s->hist[b]++;
+    s->count++;
+    s->bytes += bytes;
+    s->total += cycles;
+    if ( cycles > s->max )
+        s->max = cycles;
+}
+
+void profileCommand ( uint8_t code, uint32_t cycles ) {
+    int i;
+    profileAdd ( PROF_COMMAND, cycles, 0 );
+    for ( i=0; i<profCmdCount && profCmd[i].code != code; i++ )
+        ;
+    if ( i == profCmdCount ) {
+        if ( profCmdCount == PROF_CODES ) {
+            profCmdLost++;
+            return;
+        }
+        profCmd[i].code = code;
+        profCmdCount++;
+    }
+    profCmd[i].count++;
+    profCmd[i].total += cycles;
+    if ( cycles > profCmd[i].max )
+        profCmd[i].max = cycles;
+}
+
+void profileClear ( void ) {
+    __disable_irq();
+    memset ( profSec, 0, sizeof(profSec) );
+    memset ( profCmd, 0, sizeof(profCmd) );
+    profCmdCount = 0;
+    profCmdLost = 0;
+    __enable_irq();
+}
+
+// cycles per byte moved, 0 if none
+uint32_t profilePerByte ( uint64_t total, uint32_t bytes ) {
+    return bytes ? (uint32_t)( total / bytes ) : 0;
+}
+
+void profileReport ( void ) {
+    consolePrintf ( "\nsection    calls  avg cyc  max cyc  cyc/byte (%u MHz)\n", PROF_MHZ );
+    for ( int i=0; i<PROF_COUNT; i++ ) {
+        const profsec_t *s = &profSec[i];
+        if ( s->count == 0 )
+            continue;
+        consolePrintf ( "%-8s %7u %8u %8u %9u\n", profName[i], s->count,
+            (uint32_t)( s->total / s->count ), s->max, profilePerByte ( s->total, s->bytes ) );
+    }
+    // the whole handshake, per byte each way
+    const profsec_t *in = &profSec[PROF_NIB_IN];
+    const profsec_t *ack = &profSec[PROF_NIB_ACK];
+    const profsec_t *out = &profSec[PROF_NIB_OUT];
+    consolePrintf ( "wire in %u, out %u cyc/byte\n",
+        profilePerByte ( in->total + ack->total, in->bytes ),
+        profilePerByte ( out->total, out->bytes ) );
+    // histograms: "n:count", n the bucket's upper bound as a power of two
+    for ( int i=0; i<PROF_COUNT; i++ ) {
+        if ( profSec[i].count == 0 )
+            continue;
+        consolePrintf ( "%-8s", profName[i] );
+        for ( int b=0; b<PROF_BUCKETS; b++ )
+            if ( profSec[i].hist[b] )
+                consolePrintf ( " %s%d:%u", b == PROF_BUCKETS - 1 ? ">" : "",
+                    b == PROF_BUCKETS - 1 ? PROF_SHIFT + b : PROF_SHIFT + b + 1, profSec[i].hist[b] );
+        consolePrintf ( "\n" );
+    }
+    if ( profCmdCount )
+        consolePrintf ( "code  calls  avg cyc  max cyc\n" );
+    for ( int i=0; i<profCmdCount; i++ )
+        consolePrintf ( "0x%02X %6u %8u %8u\n", profCmd[i].code, profCmd[i].count,
+            (uint32_t)( profCmd[i].total / profCmd[i].count ), profCmd[i].max );
+    if ( profCmdLost )
+        consolePrintf ( "(%u more, codes past %d)\n", profCmdLost, PROF_CODES );
+}
+#endif
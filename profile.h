@@ -0,0 +1,54 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stdint.h>
+#include "board.h"
+
+// Hot path profiling (see profile.cpp).
+// Cycles spent in the bus handlers, in each nibble sent, in the command
+// processing (per command code too) and in the card reads and writes,
+// from the Cortex-M4 cycle counter (DWT CYCCNT), into one histogram per
+// section. Dumped by the "prof" console command, cleared by "prof clear".
+// The Cortex-M0+ of the L053R8 has no cycle counter: no probes there.
+#if defined TARGET_NUCLEO_L432KC
+#define WIRE_PROFILE 1 // comment out: the probes are compiled out
+#endif
+
+// sections
+#define PROF_BIT      0 // bitReady: one device code bit
+#define PROF_NIB_IN   1 // inNibbleReady: one nibble in
+#define PROF_NIB_ACK  2 // inNibbleAck
+#define PROF_NIB_OUT  3 // SendOutputData: one nibble out, handshake waits included
+#define PROF_COMMAND  4 // ProcessCommand
+#define PROF_SD_READ  5 // storageGetc / storageRead
+#define PROF_SD_WRITE 6 // storagePutc / storageWrite
+#define PROF_SELECT   7 // startDeviceCodeSeq and the select steps after it
+#define PROF_COUNT    8
+
+// histogram: bucket n counts the calls below 2^(PROF_SHIFT+n+1) cycles,
+// the last one all the longer ones
+#define PROF_BUCKETS  16
+#define PROF_SHIFT    6
+#define PROF_CODES    24 // command codes kept apart
+
+#ifdef WIRE_PROFILE
+#ifdef HOST_BUILD
+uint32_t profileNow ( void ); // virtual time, in cycles of the board's clock
+#else
+#define profileNow() ( DWT->CYCCNT )
+#endif
+void profileInit ( void );
+void profileAdd ( uint8_t sec, uint32_t cycles, uint32_t bytes );
+void profileCommand ( uint8_t code, uint32_t cycles );
+void profileReport ( void );  // "prof" console command
+void profileClear ( void );   // "prof clear"
+// scoped probes: t holds the start, bytes is what the call moved (per byte costs)
+#define PROFILE_BEGIN(t)           uint32_t t = profileNow()
+#define PROFILE_END(sec, t, bytes) profileAdd ( sec, profileNow() - (t), bytes )
+#define PROFILE_COMMAND(code, t)   profileCommand ( code, profileNow() - (t) )
+#else
+#define PROFILE_BEGIN(t)           do { } while (0)
+#define PROFILE_END(sec, t, bytes) do { } while (0)
+#define PROFILE_COMMAND(code, t)   do { } while (0)
+#endif
+
+#endif
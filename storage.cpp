@@ -0,0 +1,1517 @@
+#include "storage.h"
+#include "xfer.h"
+#include "profile.h"
+#include "flashcache.h"
+#include <ctype.h>
+
+// from other modules
+extern void debug_log(const char *fmt, ...);
+extern INSTANCE SDFileSystem sd;
+
+// Free space cache.
+// f_getfree() on a freshly mounted (large, FAT32) card scans the whole FAT,
+// which can take seconds, and DSKF runs while the Sharp waits for its answer.
+// Here the FAT is scanned once, in the background (main loop), one sector
+// at a time, then the count is kept up to date by FatFs itself
+// (fs->free_clust) and, until the scan is complete, estimated from
+// the file sizes written and removed by SAVE, PRINT# and KILL.
+#define  FREE_UNKNOWN   0 // nothing known yet
+#define  FREE_SCANNING  1 // background FAT scan in progress
+#define  FREE_ESTIMATED 2 // FSInfo value, or adjusted from file sizes
+#define  FREE_EXACT     3 // counted, now maintained by FatFs
+
+INSTANCE volatile uint8_t  freeState = FREE_UNKNOWN;
+INSTANCE volatile uint32_t freeClusters;
+INSTANCE volatile uint32_t freeWrites;   // incremented on each write/remove, and file write
+INSTANCE uint32_t freeScanClust;         // next cluster to check
+INSTANCE uint32_t freeScanCount;         // free clusters counted so far
+INSTANCE uint32_t freeScanWrites;        // freeWrites at scan start
+INSTANCE uint8_t  freeScanBuf[_MAX_SS];  // FAT sector, off the FatFs window
+
+// Card access lock.
+// Card accesses of the main loop tasks are flagged here. Sharp commands used
+// to run in interrupt context, and deferred themselves meanwhile; now they're
+// main loop work too (events.cpp), so accesses can't overlap any longer, but
+// SendOutputData still checks the flag before flushing the wire capture.
+INSTANCE volatile bool storageBusy = false;
+
+void storageLock ( void ) {
+    storageBusy = true;
+}
+
+void storageUnlock ( void ) {
+    storageBusy = false;
+}
+
+bool storageLocked ( void ) {
+    return storageBusy;
+}
+
+FATFS *storageFs ( void ) {
+    return &sd._fs;
+}
+
+// Card presence.
+// The card is mounted on first use, then checked again before each command
+// and by the main loop: with the socket switch wired (Board::SD_DETECT),
+// a pin read; otherwise its boot sector is read, CARD_PROBE_US apart at
+// most, for the volume serial number - by the main loop while the bus is
+// idle (storageCardProbe), so that a command doesn't wait for it: before a
+// command, a card known to be there is taken as it is, unless the board
+// slept meanwhile (storageCardSuspect). With no card, the mount is tried
+// again on the same terms: by the probe, CARD_PROBE_US apart, or by the
+// next command - never by the background tasks, whose card work waits
+// for one to be there (storageCardPresent). A card pulled out, or another one
+// put in, gets FatFs to mount again on the next access, and the caches to
+// start over (storageInvalidate); the files left open on the previous one
+// fail (FatFs tells them by the mount id), the flash cache copies don't.
+#define CARD_UNKNOWN  0 // not mounted yet
+#define CARD_ABSENT   1
+#define CARD_READY    2
+#define CARD_PROBE_US 2000000
+
+INSTANCE DigitalIn         cardDetect ( Board::SD_DETECT, PullUp );
+INSTANCE volatile uint8_t  cardState = CARD_UNKNOWN;
+INSTANCE uint32_t          cardId;       // volume serial number
+INSTANCE uint32_t          cardProbed;   // last read, us_ticker_read()
+INSTANCE bool              cardProbeDue = false; // before the next command, even if ready
+INSTANCE uint32_t          cardMounts = 0;
+
+// volume serial number, from the boot sector (in the free scan buffer:
+// neither of them keeps it across steps)
+bool cardVolumeId ( uint32_t *id ) {
+    FATFS *fs = storageFs();
+    const uint8_t *b = freeScanBuf;
+    if ( disk_read ( fs->drv, freeScanBuf, fs->volbase, 1 ) != RES_OK
+      || b[510] != 0x55 || b[511] != 0xAA )
+        return false;
+    b += ( fs->fs_type == FS_FAT32 ) ? 67 : 39;
+    *id = b[0] | (b[1]<<8) | (b[2]<<16) | ((uint32_t)b[3]<<24);
+    return true;
+}
+
+void cardGone ( void ) {
+    storageFs()->fs_type = 0;
+    storageInvalidate ();
+    cardState = CARD_ABSENT;
+    cardProbed = us_ticker_read() - CARD_PROBE_US; // mount as soon as it's back
+    debug_log ("card out\n");
+}
+
+// mount (again), whichever card is there
+bool cardMount ( void ) {
+    FATFS_DIR dir;
+    storageFs()->fs_type = 0; // FatFs: mount on the next access
+    storageInvalidate ();
+    sd.disk_initialize ();     // card init sequence
+    if ( f_opendir(&dir, "0:/") != FR_OK || !cardVolumeId ( &cardId ) ) {
+        cardState = CARD_ABSENT;
+        return false;
+    }
+    cardMounts++;
+    cardState = CARD_READY;
+    debug_log ("card mounted, volume %08X\n", cardId);
+    return true;
+}
+
+// probe: a card already mounted read again (its boot sector) as well
+bool cardCheck ( bool probe ) {
+    uint32_t id;
+    bool ok;
+    storageLock();
+    if ( Board::SD_DETECT != NC ) {
+        if ( cardDetect == 1 ) { // switch open
+            if ( cardState != CARD_ABSENT )
+                cardGone ();
+            storageUnlock();
+            return false;
+        }
+        if ( cardState == CARD_READY ) {
+            storageUnlock();
+            return true; // in all along
+        }
+    }
+    if ( cardState == CARD_READY && !probe && !cardProbeDue ) {
+        storageUnlock();
+        return true; // as last probed
+    }
+    if ( cardState != CARD_UNKNOWN && !cardProbeDue
+      && (uint32_t)( us_ticker_read() - cardProbed ) < CARD_PROBE_US ) {
+        storageUnlock();
+        return ( cardState == CARD_READY );
+    }
+    cardProbed = us_ticker_read();
+    cardProbeDue = false;
+    if ( cardState == CARD_READY && cardVolumeId ( &id ) && id == cardId )
+        ok = true; // same card
+    else
+        ok = cardMount (); // out, swapped, or not there yet
+    storageUnlock();
+    return ok;
+}
+
+bool storageCardCheck ( void ) {
+    return cardCheck ( false );
+}
+
+bool storageCardProbe ( void ) {
+    return cardCheck ( true );
+}
+
+void storageCardSuspect ( void ) {
+    cardProbeDue = true;
+}
+
+bool storageCardPresent ( void ) {
+    return ( cardState == CARD_READY );
+}
+
+bool storageCardAbsent ( void ) {
+    return ( cardState == CARD_ABSENT );
+}
+
+uint32_t storageClusterBytes ( void ) {
+    FATFS *fs = storageFs();
+#if _MAX_SS != 512
+    return (uint32_t)fs->csize * fs->ssize;
+#else
+    return (uint32_t)fs->csize * 512;
+#endif
+}
+
+const char *homeName ( const char *name );
+const char *aliasResolve ( const char *name );
+void aliasFlush ( void );
+
+const char *fatPath ( const char *name ) {
+    static INSTANCE char path[20];
+    const char *n = homeName(name);
+#ifdef NAME_ALIAS
+    const char *card = aliasResolve ( n );
+    if ( card != NULL )
+        n = card;
+#endif
+    sprintf(path, "0:/%s", n);
+    return path;
+}
+
+void storageSyncFiles ( void );
+
+// (re)start the count: the FAT sectors are read past the FatFs window, so
+// what the open files took is flushed first, and what they take from now
+// on shows in freeWrites (the count is done again)
+void freeScanStart ( void ) {
+    storageLock();
+    storageSyncFiles ();
+    storageUnlock();
+    freeScanClust = 0;
+    freeScanCount = 0;
+    freeScanWrites = freeWrites;
+}
+
+// scan the next FAT sector; false when the scan is complete
+bool freeScanStep ( void ) {
+    FATFS *fs = storageFs();
+    uint32_t entSize = ( fs->fs_type == FS_FAT32 ) ? 4 : 2;
+    uint32_t perSect = sizeof(freeScanBuf) / entSize;
+    uint32_t sect = fs->fatbase + freeScanClust / perSect;
+    uint32_t i = freeScanClust % perSect;
+
+    storageLock(); // (till parsed: the card probe reads into the same buffer)
+    DRESULT res = disk_read(fs->drv, freeScanBuf, sect, 1);
+    if ( res != RES_OK ) {
+        storageUnlock();
+        debug_log ("free scan read error %d @%u\n", res, sect);
+        freeState = FREE_UNKNOWN;
+        return false;
+    }
+    for ( ; i<perSect && freeScanClust<fs->n_fatent; i++, freeScanClust++ ) {
+        uint32_t e;
+        if ( entSize == 4 )
+            e = ( freeScanBuf[i*4] | (freeScanBuf[i*4+1]<<8) 
+                | (freeScanBuf[i*4+2]<<16) | ((uint32_t)freeScanBuf[i*4+3]<<24) ) & 0x0FFFFFFF;
+        else
+            e = freeScanBuf[i*2] | (freeScanBuf[i*2+1]<<8);
+        if ( e == 0 && freeScanClust >= 2 )
+            freeScanCount++;
+    }
+    storageUnlock();
+    return ( freeScanClust < fs->n_fatent );
+}
+
+// Called by the main loop (card accesses under storageLock). 
+void storageIdleTask ( void ) {
+    FATFS *fs = storageFs();
+
+    if ( !storageCardPresent() )
+        return; // no card? mounted by the probe, bus idle
+#ifdef NAME_ALIAS
+    aliasFlush ();
+#endif
+    switch ( freeState ) {
+    case FREE_UNKNOWN: {
+        if ( fs->free_clust <= fs->n_fatent - 2 ) {
+            // FAT32 FSInfo value: a good guess, until counted
+            freeClusters = fs->free_clust;
+            freeState = FREE_ESTIMATED;
+        }
+        if ( fs->fs_type == FS_FAT12 ) {
+            // small volume (12-bit entries span sectors) - plain count
+            DWORD n;
+            FATFS *f;
+            storageLock();
+            FRESULT res = f_getfree("0:", &n, &f);
+            storageUnlock();
+            if ( res == FR_OK ) {
+                freeClusters = n;
+                freeState = FREE_EXACT;
+            }
+            return;
+        }
+        debug_log ("free scan start (%u clusters)\n", fs->n_fatent - 2);
+        freeScanStart ();
+        if ( freeState == FREE_UNKNOWN )
+            freeState = FREE_SCANNING;
+        break;
+    }
+    case FREE_SCANNING:
+    case FREE_ESTIMATED: {
+        if ( freeScanStep() ) 
+            break; 
+        if ( freeState == FREE_UNKNOWN )
+            break; // read error: restart
+        __disable_irq();
+        if ( freeWrites == freeScanWrites ) {
+            // nothing changed on the card while scanning:
+            // hand the count over to FatFs, which keeps it updated
+            freeClusters = freeScanCount;
+            fs->free_clust = freeScanCount;
+            freeState = FREE_EXACT;
+        } else {
+            // files were written meanwhile - scan again
+            freeClusters = freeScanCount;
+            freeState = FREE_ESTIMATED;
+        }
+        __enable_irq();
+        if ( freeState == FREE_ESTIMATED )
+            freeScanStart ();
+        debug_log ("free scan done: %u clusters (%s)\n", freeClusters,
+            freeState == FREE_EXACT ? "exact" : "estimated");
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// true while the background task still has work to do
+bool storageIdleBusy ( void ) {
+    return ( freeState == FREE_SCANNING || freeState == FREE_ESTIMATED );
+}
+
+// free clusters: cached value, or counted now if nothing is known yet
+uint32_t storageFreeClusters ( bool *exact ) {
+    FATFS *fs = storageFs();
+    if ( freeState == FREE_EXACT && fs->free_clust <= fs->n_fatent - 2 ) {
+        *exact = true;
+        return fs->free_clust;
+    }
+    if ( freeState == FREE_ESTIMATED ) {
+        *exact = false;
+        return freeClusters;
+    }
+    if ( freeState == FREE_SCANNING ) {
+        // no waiting for the scan: what it found so far, over the whole FAT
+        uint32_t scanned = ( freeScanClust > 2 ) ? freeScanClust - 2 : 0;
+        *exact = false;
+        if ( scanned == 0 )
+            return 0;
+        return (uint32_t)( (uint64_t)freeScanCount * ( fs->n_fatent - 2 ) / scanned );
+    }
+    // blocking count (slow on large cards)
+    DWORD n;
+    FATFS *f;
+    debug_log ("retrieveing free clusters...\n");
+    if ( f_getfree("0:", &n, &f) != FR_OK ) {
+        *exact = false;
+        return 0;
+    }
+    freeClusters = n;
+    freeState = FREE_EXACT;
+    *exact = true;
+    return n;
+}
+
+// a file was written or removed: adjust the estimate
+// (once exact, FatFs updates its own count while allocating clusters)
+void freeSpaceResized ( uint32_t oldSize, uint32_t newSize ) {
+    uint32_t cb = storageClusterBytes();
+    freeWrites++;
+    if ( cb == 0 || freeState != FREE_ESTIMATED )
+        return;
+    uint32_t oldClust = (oldSize + cb - 1) / cb;
+    uint32_t newClust = (newSize + cb - 1) / cb;
+    if ( newClust > oldClust ) 
+        freeClusters -= ( newClust - oldClust < freeClusters ) ? newClust - oldClust : freeClusters;
+    else
+        freeClusters += oldClust - newClust;
+}
+
+// Directory index.
+// Name and size of the files in the SD home directory, collected
+// by a FILES listing, so that metadata queries (exists, size) are answered 
+// with no card access and FILES_LIST navigates without reading the directory.
+// It's kept up to date on file writes and removals; when the directory holds 
+// more files than Board::DIR_INDEX_SIZE, it's incomplete and misses go to f_stat(),
+// and it isn't built again (the listings read the directory) until a file is
+// removed or the card changes.
+typedef struct {
+    char     name[13]; // 8.3, as in FILINFO, or its alias
+    bool     alias;
+    uint32_t size;
+} dirindex_t;
+
+INSTANCE dirindex_t dirIndex[Board::DIR_INDEX_SIZE > 0 ? Board::DIR_INDEX_SIZE : 1];
+INSTANCE int      dirIndexCount = 0;
+INSTANCE bool     dirIndexComplete = false;
+INSTANCE bool     dirIndexOverflow = false; // more files than room
+
+// listing state
+INSTANCE bool      dirFromIndex;
+INSTANCE int       dirPos;
+INSTANCE FATFS_DIR dirFat;
+INSTANCE FILINFO   dirInfo;
+INSTANCE uint32_t  dirListGen = 0; // listings started and entries moved, so far
+
+dirindex_t *dirIndexFind ( const char *name ) {
+    for ( int i=0; i<dirIndexCount; i++ )
+        if ( strcmp(dirIndex[i].name, name) == 0 )
+            return &dirIndex[i];
+    return NULL;
+}
+
+// file name within the home directory ("/sd/NAME.BAS" -> "NAME.BAS")
+const char *homeName ( const char *name ) {
+    if ( strncmp(name, SD_HOME, strlen(SD_HOME)) == 0 )
+        name += strlen(SD_HOME);
+    return name;
+}
+
+#ifdef NAME_ALIAS
+// Name aliases.
+// The Sharp sends and shows 8.3 names of letters, digits and a few signs.
+// A file whose name doesn't fit - the "LONGNA~1.BAS" a PC made for a long
+// one, a long name itself with an LFN build of FatFs - gets an alias: up to
+// four letters or digits of its name, then its hash, and its extension
+// ("Long name.bas" -> "LONG3QK7.BAS"), the same on any card and after any
+// reset, another hash (salt) when taken. The aliases are kept on the card,
+// a fixed hash table keyed by the alias as the manifest's, held open: a
+// name from the Sharp is resolved by a record read, most often from the
+// sector buffer of the file, with no directory scan. No file, no alias:
+// no lookups either. A listing only reads the table: the new aliases it
+// shows wait in RAM (aliasPending, resolved from there meanwhile) for the
+// main loop to record them (aliasFlush), after checking no file has their
+// name; past ALIAS_QUEUE of them, the name is shown as is till next time.
+// With the FatFs of SDFileSystem as it is (_USE_LFN 0 in its ffconf.h),
+// the directory entries only give the 8.3 names: the aliases are then for
+// the "~1" short names a PC made (and the odd 8.3 name with a sign the
+// Sharp lacks), made from those, the long names never being seen.
+#define ALIAS_NAME    "0:/ALIAS.SYS"
+#define ALIAS_PROBES  16
+#define ALIAS_QUEUE   16
+
+#define ALIAS_UNKNOWN 0 // not looked for since mounted
+#define ALIAS_NONE    1 // no alias file on the card
+#define ALIAS_OPEN    2
+
+typedef struct {
+    char     alias[13];
+    char     card[13]; // 8.3 name on the card
+    uint8_t  used;     // 0 empty, 1 in use, 2 removed
+    uint8_t  spare;
+    uint32_t hash;     // of the name the alias is made from
+} alias_t; // 32 bytes, 16 per sector
+
+INSTANCE FIL      aliasFile;
+INSTANCE uint8_t  aliasState = ALIAS_UNKNOWN;
+INSTANCE alias_t  aliasPending[ALIAS_QUEUE];
+INSTANCE int      aliasPendingCount = 0;
+
+// a name the Sharp can type, as is
+bool aliasPlain ( const char *name ) {
+    const char *dot = strchr ( name, '.' );
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    if ( base == 0 || base > 8 || ( dot && ( strlen(dot + 1) > 3 || strchr(dot + 1, '.') ) ) )
+        return false;
+    for ( const char *p = name; *p; p++ ) {
+        if ( !( ( *p >= 'A' && *p <= 'Z' ) || ( *p >= '0' && *p <= '9' )
+              || ( *p != 0 && strchr ( ".!#$%&'()-@^_{}", *p ) ) ) )
+            return false;
+    }
+    return true;
+}
+
+bool aliasAlnum ( char c ) {
+    return ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' );
+}
+
+void aliasMake ( const char *from, uint32_t salt, char *alias ) {
+    static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+    uint32_t h = xferHash ( XFER_HASH_INIT + salt, (const uint8_t *)from, strlen(from) );
+    const char *dot = strrchr ( from, '.' );
+    int n = 0;
+    for ( const char *p = from; *p && p != dot && n < 4; p++ ) {
+        char c = toupper ( (unsigned char)*p );
+        if ( aliasAlnum(c) )
+            alias[n++] = c;
+    }
+    while ( n < 8 ) {
+        alias[n++] = digits[h & 31];
+        h >>= 5;
+    }
+    if ( dot ) {
+        alias[n++] = '.';
+        for ( const char *p = dot + 1; *p && n < 12; p++ ) {
+            char c = toupper ( (unsigned char)*p );
+            if ( aliasAlnum(c) )
+                alias[n++] = c;
+        }
+        if ( alias[n-1] == '.' )
+            n--;
+    }
+    alias[n] = 0;
+}
+
+// the alias file, opened on first use; created (hidden) with the first alias
+bool aliasOpen ( bool create ) {
+    if ( aliasState == ALIAS_OPEN )
+        return true;
+    if ( aliasState == ALIAS_NONE && !create )
+        return false;
+    aliasState = ALIAS_NONE;
+    if ( f_open ( &aliasFile, ALIAS_NAME, FA_READ | FA_WRITE
+         | ( create ? FA_OPEN_ALWAYS : FA_OPEN_EXISTING ) ) != FR_OK )
+        return false;
+    if ( aliasFile.fsize < Board::ALIAS_SLOTS * sizeof(alias_t) ) {
+        if ( !create ) {
+            // cut short: set up by the next aliasFlush (no writes while listing)
+            f_close ( &aliasFile );
+            aliasState = ALIAS_UNKNOWN;
+            return false;
+        }
+        // new (or cut short): all slots empty
+        alias_t empty;
+        UINT n;
+        memset ( &empty, 0, sizeof(empty) );
+        f_lseek ( &aliasFile, 0 );
+        for ( int s=0; s<Board::ALIAS_SLOTS; s++ ) {
+            if ( f_write ( &aliasFile, &empty, sizeof(empty), &n ) != FR_OK || n != sizeof(empty) ) {
+                f_close ( &aliasFile );
+                return false;
+            }
+        }
+        f_sync ( &aliasFile );
+        f_chmod ( ALIAS_NAME, AM_HID | AM_SYS, AM_HID | AM_SYS );
+        freeSpaceResized ( 0, Board::ALIAS_SLOTS * sizeof(alias_t) );
+        debug_log ("aliases created\n");
+    }
+    aliasState = ALIAS_OPEN;
+    return true;
+}
+
+// slot holding 'alias' (rec->used == 1), or else the first free one
+// on its probe sequence (-1: none)
+int aliasFind ( const char *alias, alias_t *rec ) {
+    uint32_t slot = xferHash ( XFER_HASH_INIT, (const uint8_t *)alias, strlen(alias) ) % Board::ALIAS_SLOTS;
+    int freeSlot = -1;
+    UINT n;
+    for ( int i=0; i<ALIAS_PROBES; i++ ) {
+        uint32_t s = ( slot + i ) % Board::ALIAS_SLOTS;
+        if ( f_lseek ( &aliasFile, s * sizeof(alias_t) ) != FR_OK
+          || f_read ( &aliasFile, rec, sizeof(*rec), &n ) != FR_OK || n != sizeof(*rec) )
+            return -1;
+        if ( rec->used == 1 && strncmp ( rec->alias, alias, sizeof(rec->alias) ) == 0 )
+            return s;
+        if ( rec->used != 1 && freeSlot < 0 )
+            freeSlot = s;
+        if ( rec->used == 0 )
+            break; // end of the probe sequence
+    }
+    rec->used = 0;
+    return freeSlot;
+}
+
+bool aliasWrite ( int s, alias_t *rec ) {
+    UINT n;
+    return f_lseek ( &aliasFile, s * sizeof(alias_t) ) == FR_OK
+        && f_write ( &aliasFile, rec, sizeof(*rec), &n ) == FR_OK && n == sizeof(*rec)
+        && f_sync ( &aliasFile ) == FR_OK;
+}
+
+// new alias waiting to be recorded, NULL if none
+alias_t *aliasQueued ( const char *alias ) {
+    for ( int i=0; i<aliasPendingCount; i++ )
+        if ( strcmp ( aliasPending[i].alias, alias ) == 0 )
+            return &aliasPending[i];
+    return NULL;
+}
+
+// name the Sharp sees for a directory entry: its own, or its alias
+// (queued when new: no card writes while listing)
+const char *aliasShown ( FILINFO *fno ) {
+    static INSTANCE char alias[13];
+    if ( aliasPlain ( fno->fname ) )
+        return fno->fname;
+    const char *from = fno->fname;
+#if _USE_LFN
+    if ( fno->lfname != NULL && fno->lfname[0] != 0 )
+        from = fno->lfname;
+#endif
+    uint32_t hash = xferHash ( XFER_HASH_INIT, (const uint8_t *)from, strlen(from) );
+    alias_t rec;
+    bool open = aliasOpen ( false );
+    for ( uint32_t salt=0; salt<ALIAS_PROBES; salt++ ) {
+        aliasMake ( from, salt, alias );
+        alias_t *q = aliasQueued ( alias );
+        if ( q != NULL ) {
+            if ( q->hash == hash && strcmp ( q->card, fno->fname ) == 0 )
+                return alias; // shown before, not recorded yet
+            continue;
+        }
+        if ( open && aliasFind ( alias, &rec ) < 0 )
+            continue; // no room on its probe sequence
+        if ( open && rec.used == 1 ) {
+            if ( rec.hash == hash && strcmp ( rec.card, fno->fname ) == 0 )
+                return alias; // known
+            continue; // another file's
+        }
+        if ( dirIndexFind ( alias ) != NULL )
+            continue; // a file of its own, listed already
+        if ( aliasPendingCount == ALIAS_QUEUE )
+            break;
+        q = &aliasPending[aliasPendingCount++];
+        memset ( q, 0, sizeof(*q) );
+        strcpy ( q->alias, alias );
+        strcpy ( q->card, fno->fname ); // 8.3, 13 bytes both
+        q->used = 1;
+        q->hash = hash;
+        return alias;
+    }
+    return fno->fname; // no room: as is
+}
+
+// main loop: the aliases shown since, recorded on the card (one whose name
+// turns out to be a file's is dropped: the next listing shows another one)
+void aliasFlush ( void ) {
+    if ( aliasPendingCount == 0 )
+        return;
+    storageLock();
+    for ( int i=0; i<aliasPendingCount; i++ ) {
+        alias_t *q = &aliasPending[i];
+        alias_t rec;
+        FILINFO other;
+#if _USE_LFN
+        other.lfname = NULL;
+        other.lfsize = 0;
+#endif
+        char path[4 + sizeof(q->alias)];
+        if ( snprintf ( path, sizeof(path), "0:/%s", q->alias ) >= (int)sizeof(path) )
+            continue; // (can't be: aliases are 8.3)
+        if ( f_stat ( path, &other ) == FR_OK ) {
+            debug_log ("alias %s: a file's name\n", q->alias);
+            continue;
+        }
+        if ( !aliasOpen ( true ) )
+            break;
+        int s = aliasFind ( q->alias, &rec );
+        if ( s < 0 || rec.used == 1 || !aliasWrite ( s, q ) )
+            continue;
+        debug_log ("alias %s: %s\n", q->alias, q->card);
+    }
+    aliasPendingCount = 0;
+    storageUnlock();
+}
+
+// name on the card for a name from the Sharp, NULL if not an alias
+const char *aliasResolve ( const char *name ) {
+    static INSTANCE char card[13];
+    alias_t rec;
+    if ( dirIndexComplete ) {
+        // the listing told the aliases apart
+        dirindex_t *e = dirIndexFind ( name );
+        if ( e == NULL || !e->alias )
+            return NULL;
+    }
+    alias_t *q = aliasQueued ( name );
+    if ( q != NULL )
+        rec = *q;
+    else if ( !aliasOpen ( false ) || aliasFind ( name, &rec ) < 0 || rec.used != 1 )
+        return NULL;
+    memcpy ( card, rec.card, sizeof(card) );
+    card[sizeof(card) - 1] = 0;
+    return card;
+}
+
+// file removed
+void aliasForget ( const char *name ) {
+    alias_t rec;
+    alias_t *q = aliasQueued ( name );
+    if ( q != NULL ) {
+        *q = aliasPending[--aliasPendingCount];
+        return;
+    }
+    if ( !aliasOpen ( false ) )
+        return;
+    int s = aliasFind ( name, &rec );
+    if ( s >= 0 && rec.used == 1 ) {
+        rec.used = 2;
+        aliasWrite ( s, &rec );
+    }
+}
+#endif
+
+bool storageStat ( const char *name, uint32_t *size ) {
+    dirindex_t *e = dirIndexFind ( homeName(name) );
+    if ( e != NULL ) {
+        if ( size ) *size = e->size;
+        return true;
+    }
+#ifdef FLASH_CACHE
+    if ( flashCacheFind ( homeName(name), size, false ) != NULL )
+        return true;
+#endif
+    if ( dirIndexComplete )
+        return false; // not in a complete index: not there
+    // single directory access
+    FILINFO fno;
+#if _USE_LFN
+    fno.lfname = NULL;
+    fno.lfsize = 0;
+#endif
+    if ( f_stat(fatPath(name), &fno) != FR_OK )
+        return false;
+    if ( size ) *size = fno.fsize;
+    return true;
+}
+
+void manifestTouched ( const char *name );
+
+// same as process_KILL expects: false if not there (or not removed)
+bool storageRemove ( const char *name ) {
+    uint32_t size;
+    if ( !storageStat ( name, &size ) )
+        return false;
+    const char *path = fatPath(name);
+    FRESULT res = f_unlink ( path );
+    debug_log ("f_unlink: %d\n", res);
+    if ( res != FR_OK )
+        return false;
+    freeSpaceResized ( size, 0 );
+    manifestTouched ( path + 3 ); // the name on the card
+#ifdef NAME_ALIAS
+    aliasForget ( homeName(name) );
+#endif
+#ifdef FLASH_CACHE
+    flashCacheForget ( homeName(name) );
+#endif
+    dirindex_t *e = dirIndexFind ( homeName(name) );
+    if ( e != NULL ) 
+        *e = dirIndex[--dirIndexCount];
+    dirIndexOverflow = false; // may fit now
+    dirListGen++;
+    return true;
+}
+
+// file created (oldSize 0), replaced, or grown
+void storageFileWritten ( const char *name, uint32_t oldSize, uint32_t newSize ) {
+    freeSpaceResized ( oldSize, newSize );
+    manifestTouched ( fatPath(name) + 3 ); // the name on the card
+#ifdef FLASH_CACHE
+    flashCacheForget ( homeName(name) );
+#endif
+    const char *n = homeName(name);
+    dirindex_t *e = dirIndexFind ( n );
+    if ( e == NULL && strlen(n) < sizeof(e->name) ) {
+        if ( dirIndexCount < Board::DIR_INDEX_SIZE ) {
+            e = &dirIndex[dirIndexCount++];
+            strcpy ( e->name, n );
+            e->alias = false; // (a new file: named by the Sharp)
+        } else {
+            dirIndexComplete = false; // no room
+            dirIndexOverflow = true;
+        }
+    }
+    if ( e != NULL )
+        e->size = newSize;
+}
+
+// NAME: false if not there, or the new name taken
+bool storageRename ( const char *name, const char *newName ) {
+    char path[20];
+    uint32_t size;
+    if ( !storageStat ( name, &size ) || storageStat ( newName, NULL ) )
+        return false;
+    strcpy ( path, fatPath(name) );
+    FRESULT res = f_rename ( path, fatPath(newName) );
+    debug_log ("f_rename: %d\n", res);
+    if ( res != FR_OK )
+        return false;
+    manifestTouched ( path + 3 ); // the name on the card
+    manifestTouched ( homeName(newName) );
+#ifdef NAME_ALIAS
+    aliasForget ( homeName(name) );
+#endif
+#ifdef FLASH_CACHE
+    flashCacheForget ( homeName(name) );
+#endif
+    dirindex_t *e = dirIndexFind ( homeName(name) );
+    if ( e != NULL ) {
+        if ( strlen(homeName(newName)) < sizeof(e->name) ) {
+            strcpy ( e->name, homeName(newName) );
+            e->alias = false;
+        } else {
+            *e = dirIndex[--dirIndexCount];
+            dirIndexComplete = false;
+            dirListGen++;
+        }
+    }
+    return true;
+}
+
+// COPY, on the card: false if not there, the new name taken,
+// or no room (the partial copy removed)
+bool storageCopy ( const char *name, const char *newName ) {
+    uint8_t chunk[128];
+    uint32_t size;
+    int n;
+    if ( !storageStat ( name, &size ) || storageStat ( newName, NULL ) )
+        return false;
+    FIL *from = storageOpen ( name, 'r' );
+    if ( from == NULL )
+        return false;
+    FIL *to = storageOpen ( newName, 'w' );
+    if ( to == NULL ) {
+        storageClose ( from );
+        return false;
+    }
+    uint32_t copied = 0;
+    do {
+        n = storageRead ( from, chunk, sizeof(chunk) );
+        if ( n > 0 && storageWrite ( to, chunk, n ) != n )
+            n = EOF;
+        if ( n > 0 )
+            copied += n;
+    } while ( n == sizeof(chunk) );
+    storageClose ( from );
+    if ( storageClose ( to ) == EOF )
+        n = EOF;
+    storageFileWritten ( newName, 0, copied );
+    debug_log ("copied %u of %u bytes\n", copied, size);
+    if ( n == EOF || copied != size ) {
+        storageRemove ( newName );
+        return false;
+    }
+    return true;
+}
+
+bool dirReadNext ( void ) {
+    while ( f_readdir(&dirFat, &dirInfo) == FR_OK && dirInfo.fname[0] != 0 ) {
+        if ( !(dirInfo.fattrib & (AM_DIR | AM_VOL | AM_HID | AM_SYS)) )
+            return true; // (the manifest and alias files are hidden)
+    }
+    return false;
+}
+
+bool dirOpenFat ( void ) {
+#if _USE_LFN && defined NAME_ALIAS
+    static INSTANCE char dirLong[_MAX_LFN + 1]; // the alias is made from the long name
+    dirInfo.lfname = dirLong;
+    dirInfo.lfsize = sizeof(dirLong);
+#elif _USE_LFN
+    dirInfo.lfname = NULL;
+    dirInfo.lfsize = 0;
+#endif
+    return ( f_opendir(&dirFat, "0:/") == FR_OK );
+}
+
+// Start a listing; the index is (re)built first, when missing
+bool storageDirOpen ( void ) {
+    if ( !dirIndexComplete && !dirIndexOverflow && Board::DIR_INDEX_SIZE > 0 ) {
+        if ( !dirOpenFat() )
+            return false;
+        dirIndexCount = 0;
+        dirIndexComplete = true;
+        while ( dirReadNext() ) {
+            if ( dirIndexCount == Board::DIR_INDEX_SIZE ) {
+                dirIndexComplete = false; // too many files
+                dirIndexOverflow = true;
+                break;
+            }
+            const char *name = dirInfo.fname;
+#ifdef NAME_ALIAS
+            name = aliasShown ( &dirInfo );
+#endif
+            strcpy ( dirIndex[dirIndexCount].name, name );
+            dirIndex[dirIndexCount].alias = ( name != dirInfo.fname );
+            dirIndex[dirIndexCount].size = dirInfo.fsize;
+            dirIndexCount++;
+        }
+        debug_log ("dir index: %d files%s\n", dirIndexCount, 
+            dirIndexComplete ? "" : " (incomplete)");
+    }
+    dirListGen++;
+    dirPos = 0;
+    dirFromIndex = dirIndexComplete;
+    if ( dirFromIndex )
+        return true;
+    return dirOpenFat();
+}
+
+const char *storageDirNext ( uint32_t *size ) {
+    if ( dirFromIndex ) {
+        if ( dirPos >= dirIndexCount )
+            return NULL;
+        if ( size ) *size = dirIndex[dirPos].size;
+        return dirIndex[dirPos++].name;
+    }
+    if ( !dirReadNext() )
+        return NULL;
+    if ( size ) *size = dirInfo.fsize;
+#ifdef NAME_ALIAS
+    return aliasShown ( &dirInfo );
+#else
+    return dirInfo.fname;
+#endif
+}
+
+void storageDirClose ( void ) {
+    // nothing to release (no f_closedir in this FatFs revision)
+}
+
+// File handle pool.
+// Statically allocated, so OPEN/CLOSE timing doesn't depend on the heap 
+// and the RAM needed for the files is known at build time.
+// A file read from the flash cache (flashcache.cpp) has a handle as well,
+// its position and size in the FIL, its content in the flash.
+INSTANCE FIL      filePool[FILE_POOL_SIZE];
+INSTANCE bool     filePoolUsed[FILE_POOL_SIZE];
+#ifdef FLASH_CACHE
+INSTANCE const uint8_t *filePoolCached[FILE_POOL_SIZE]; // NULL: on the card
+
+const uint8_t *fileCached ( FIL *f ) {
+    int i = f - filePool;
+    return ( i >= 0 && i < FILE_POOL_SIZE && filePoolUsed[i] ) ? filePoolCached[i] : NULL;
+}
+#endif
+
+FIL *storageOpen ( const char *name, char mode ) {
+    BYTE flags;
+    int i;
+    switch ( mode ) {
+        case 'r': flags = FA_READ | FA_OPEN_EXISTING; break;
+        case 'w': flags = FA_WRITE | FA_CREATE_ALWAYS; break;
+        case 'a': flags = FA_WRITE | FA_OPEN_EXISTING; break;
+        default:  return NULL;
+    }
+#ifdef FLASH_CACHE
+    uint32_t cachedSize = 0;
+    const uint8_t *cached = NULL;
+    if ( mode == 'r' )
+        cached = flashCacheFind ( homeName(name), &cachedSize, true );
+    else
+        flashCacheForget ( homeName(name) ); // to be written
+#endif
+    for ( i=0; i<FILE_POOL_SIZE && filePoolUsed[i]; i++ )
+        ;
+    if ( i == FILE_POOL_SIZE ) {
+        debug_log ("file pool exhausted\n");
+        return NULL;
+    }
+    FIL *f = &filePool[i];
+#ifdef FLASH_CACHE
+    filePoolCached[i] = cached;
+    if ( cached != NULL ) {
+        memset ( f, 0, sizeof(FIL) );
+        f->fsize = cachedSize;
+        filePoolUsed[i] = true;
+        return f;
+    }
+#endif
+    FRESULT res = f_open ( f, fatPath(name), flags );
+    if ( res == FR_OK && mode == 'a' )
+        res = f_lseek ( f, f->fsize );
+    if ( res != FR_OK ) {
+        debug_log ("f_open <%s> '%c': %d\n", name, mode, res);
+        return NULL;
+    }
+    filePoolUsed[i] = true;
+#ifdef FLASH_CACHE
+    if ( mode == 'r' )
+        flashCacheLoaded ( homeName(name), f->fsize );
+#endif
+    return f;
+}
+
+int storageClose ( FIL *f ) {
+    int i = f - filePool;
+    if ( f == NULL || i < 0 || i >= FILE_POOL_SIZE || !filePoolUsed[i] )
+        return EOF;
+    filePoolUsed[i] = false;
+#ifdef FLASH_CACHE
+    if ( filePoolCached[i] != NULL )
+        return 0;
+#endif
+    return ( f_close(f) == FR_OK ) ? 0 : EOF;
+}
+
+// the files being written, down on the card
+void storageSyncFiles ( void ) {
+    for ( int i=0; i<FILE_POOL_SIZE; i++ ) {
+#ifdef FLASH_CACHE
+        if ( filePoolCached[i] != NULL )
+            continue;
+#endif
+        if ( filePoolUsed[i] )
+            f_sync ( &filePool[i] );
+    }
+}
+
+bool storageFilesOpen ( void ) {
+    for ( int i=0; i<FILE_POOL_SIZE; i++ )
+        if ( filePoolUsed[i] )
+            return true;
+    return false;
+}
+
+int storageFilesFree ( void ) {
+    int n = 0;
+    for ( int i=0; i<FILE_POOL_SIZE; i++ )
+        if ( !filePoolUsed[i] )
+            n++;
+    return n;
+}
+
+int storageGetc ( FIL *f ) {
+    BYTE c;
+    UINT n = 0;
+    if ( f == NULL ) 
+        return EOF;
+#ifdef FLASH_CACHE
+    const uint8_t *data = fileCached ( f );
+    if ( data != NULL )
+        return ( f->fptr < f->fsize ) ? data[f->fptr++] : EOF;
+#endif
+    PROFILE_BEGIN( t );
+    FRESULT res = f_read ( f, &c, 1, &n );
+    PROFILE_END( PROF_SD_READ, t, n );
+    if ( res != FR_OK || n != 1 )
+        return EOF;
+    return c;
+}
+
+int storagePutc ( int c, FIL *f ) {
+    BYTE b = c;
+    UINT n = 0;
+    if ( f == NULL ) 
+        return EOF;
+#ifdef FLASH_CACHE
+    if ( fileCached ( f ) != NULL )
+        return EOF; // read only
+#endif
+    PROFILE_BEGIN( t );
+    FRESULT res = f_write ( f, &b, 1, &n );
+    PROFILE_END( PROF_SD_WRITE, t, n );
+    freeWrites++; // (a cluster may have been taken: see the free scan)
+    if ( res != FR_OK || n != 1 )
+        return EOF;
+    return c;
+}
+
+int storageRead ( FIL *f, uint8_t *buf, uint32_t len ) {
+    UINT n = 0;
+    if ( f == NULL )
+        return EOF;
+#ifdef FLASH_CACHE
+    const uint8_t *data = fileCached ( f );
+    if ( data != NULL ) {
+        n = ( f->fsize - f->fptr < len ) ? f->fsize - f->fptr : len;
+        memcpy ( buf, data + f->fptr, n );
+        f->fptr += n;
+        return n;
+    }
+#endif
+    PROFILE_BEGIN( t );
+    FRESULT res = f_read ( f, buf, len, &n );
+    PROFILE_END( PROF_SD_READ, t, n );
+    if ( res != FR_OK )
+        return EOF;
+    return n;
+}
+
+int storageSeek ( FIL *f, uint32_t pos ) {
+#ifdef FLASH_CACHE
+    if ( f != NULL && fileCached ( f ) != NULL ) {
+        f->fptr = ( pos < f->fsize ) ? pos : f->fsize;
+        return 0;
+    }
+#endif
+    if ( f == NULL || f_lseek ( f, pos ) != FR_OK )
+        return EOF;
+    return 0;
+}
+
+int storageWrite ( FIL *f, const uint8_t *buf, uint32_t len ) {
+    UINT n = 0;
+    if ( f == NULL )
+        return EOF;
+#ifdef FLASH_CACHE
+    if ( fileCached ( f ) != NULL )
+        return EOF; // read only
+#endif
+    PROFILE_BEGIN( t );
+    FRESULT res = f_write ( f, buf, len, &n );
+    PROFILE_END( PROF_SD_WRITE, t, n );
+    freeWrites++; // (clusters may have been taken: see the free scan)
+    if ( res != FR_OK )
+        return EOF;
+    return n;
+}
+
+// Content manifest.
+// Name, size and content hash of the files, kept on the card (a hidden file)
+// for the incremental sync of tools/ce140f_xfer: the hashes are computed once,
+// then only for the files changed since. A change is told by the size and
+// date in the directory entry, and by the names written or removed meanwhile
+// (the RAM list below: the date doesn't change when the clock isn't set).
+// The file is a fixed hash table of records, one sector read per lookup.
+#define MANIFEST_NAME  "0:/MANIFEST.SYS"
+#define MANIFEST_PROBES 16
+
+typedef struct {
+    char     name[13];
+    uint8_t  used;     // 0 empty, 1 in use, 2 removed
+    uint16_t fdate;
+    uint16_t ftime;
+    uint16_t spare;
+    uint32_t size;
+    uint32_t hash;
+    uint32_t spare2;
+} manifest_t; // 32 bytes, 16 per sector
+
+// names written or removed since the last listing
+INSTANCE char      manifestDirty[Board::MANIFEST_DIRTY][13];
+INSTANCE volatile int  manifestDirtyCount = 0;
+INSTANCE volatile bool manifestDirtyAll = true; // nothing known at power-up
+// listing in progress (xferFsSum*): the directory entries are taken
+// SUM_BATCH at a time, with the manifest open meanwhile only, so that it
+// doesn't hold a file handle while the files are read (the L053R8 has two)
+#define SUM_BATCH 8
+
+typedef struct {
+    char     name[13];
+    bool     known;    // hash from the manifest
+    uint16_t fdate;
+    uint16_t ftime;
+    uint32_t size;
+    uint32_t hash;
+} sumentry_t;
+
+INSTANCE char       sumStale[Board::MANIFEST_DIRTY][13];
+INSTANCE int        sumStaleCount;
+INSTANCE bool       sumStaleAll;
+INSTANCE FATFS_DIR  sumDir;
+INSTANCE FILINFO    sumInfo;
+INSTANCE sumentry_t sumBatch[SUM_BATCH];
+INSTANCE int        sumBatchCount;
+INSTANCE int        sumBatchPos;
+
+// called on each write or removal, also from the Sharp commands
+void manifestTouched ( const char *name ) {
+    for ( int i=0; i<manifestDirtyCount; i++ )
+        if ( strcmp ( manifestDirty[i], name ) == 0 )
+            return;
+    if ( manifestDirtyCount == Board::MANIFEST_DIRTY || strlen(name) > 12 ) {
+        manifestDirtyAll = true; // too many: check them all
+        return;
+    }
+    strcpy ( manifestDirty[manifestDirtyCount++], name );
+}
+
+bool manifestIsDirty ( const char *name ) {
+    if ( sumStaleAll || manifestDirtyAll )
+        return true;
+    for ( int i=0; i<sumStaleCount; i++ )
+        if ( strcmp ( sumStale[i], name ) == 0 )
+            return true;
+    for ( int i=0; i<manifestDirtyCount; i++ )
+        if ( strcmp ( manifestDirty[i], name ) == 0 )
+            return true;
+    return false;
+}
+
+uint32_t manifestSlot ( const char *name ) {
+    return xferHash ( XFER_HASH_INIT, (const uint8_t *)name, strlen(name) ) % Board::MANIFEST_SLOTS;
+}
+
+// the manifest, created (hidden) if missing
+FIL *manifestOpen ( void ) {
+    FIL *f = NULL;
+    int i;
+    for ( i=0; i<FILE_POOL_SIZE && filePoolUsed[i]; i++ )
+        ;
+    if ( i == FILE_POOL_SIZE )
+        return NULL;
+    f = &filePool[i];
+    if ( f_open ( f, MANIFEST_NAME, FA_READ | FA_WRITE | FA_OPEN_ALWAYS ) != FR_OK )
+        return NULL;
+    filePoolUsed[i] = true;
+    if ( f->fsize < Board::MANIFEST_SLOTS * sizeof(manifest_t) ) {
+        // new (or cut short): all slots empty
+        manifest_t empty;
+        UINT n;
+        memset ( &empty, 0, sizeof(empty) );
+        f_lseek ( f, 0 );
+        for ( int s=0; s<Board::MANIFEST_SLOTS; s++ ) {
+            if ( f_write ( f, &empty, sizeof(empty), &n ) != FR_OK || n != sizeof(empty) ) {
+                storageClose ( f );
+                return NULL;
+            }
+        }
+        f_sync ( f );
+        f_chmod ( MANIFEST_NAME, AM_HID | AM_SYS, AM_HID | AM_SYS );
+        freeSpaceResized ( 0, Board::MANIFEST_SLOTS * sizeof(manifest_t) );
+        debug_log ("manifest created\n");
+    }
+    return f;
+}
+
+// slot holding 'name' (rec->used == 1), or else the first free one 
+// on its probe sequence (-1: none)
+int manifestFind ( FIL *f, const char *name, manifest_t *rec ) {
+    uint32_t slot = manifestSlot ( name );
+    int freeSlot = -1;
+    UINT n;
+    for ( int i=0; i<MANIFEST_PROBES; i++ ) {
+        uint32_t s = ( slot + i ) % Board::MANIFEST_SLOTS;
+        if ( f_lseek ( f, s * sizeof(manifest_t) ) != FR_OK
+          || f_read ( f, rec, sizeof(*rec), &n ) != FR_OK || n != sizeof(*rec) )
+            return -1;
+        if ( rec->used == 1 && strncmp ( rec->name, name, sizeof(rec->name) ) == 0 )
+            return s;
+        if ( rec->used != 1 && freeSlot < 0 )
+            freeSlot = s;
+        if ( rec->used == 0 )
+            break; // end of the probe sequence
+    }
+    rec->used = 0;
+    return freeSlot;
+}
+
+void manifestWrite ( FIL *f, const char *name, uint32_t size, uint32_t hash, FILINFO *fno ) {
+    manifest_t rec;
+    UINT n;
+    int s = manifestFind ( f, name, &rec );
+    if ( s < 0 )
+        return; // no room: hashed again each time
+    memset ( &rec, 0, sizeof(rec) );
+    strncpy ( rec.name, name, sizeof(rec.name) - 1 );
+    rec.used  = 1;
+    rec.fdate = fno->fdate;
+    rec.ftime = fno->ftime;
+    rec.size  = size;
+    rec.hash  = hash;
+    if ( f_lseek ( f, s * sizeof(manifest_t) ) == FR_OK )
+        f_write ( f, &rec, sizeof(rec), &n );
+}
+
+// file written through the console transfer, hash known (card lock held)
+void manifestStore ( const char *name, uint32_t size, uint32_t hash ) {
+    FILINFO fno;
+#if _USE_LFN
+    fno.lfname = NULL;
+    fno.lfsize = 0;
+#endif
+    if ( f_stat ( fatPath(name), &fno ) != FR_OK )
+        return;
+    FIL *f = manifestOpen ();
+    if ( f == NULL )
+        return;
+    manifestWrite ( f, name, size, hash, &fno );
+    storageClose ( f );
+    // up to date now
+    __disable_irq();
+    for ( int i=0; i<manifestDirtyCount; i++ ) {
+        if ( strcmp ( manifestDirty[i], name ) == 0 ) {
+            strcpy ( manifestDirty[i], manifestDirty[--manifestDirtyCount] );
+            break;
+        }
+    }
+    __enable_irq();
+}
+
+// file removed through the console transfer (card lock held)
+void manifestForget ( const char *name ) {
+    manifest_t rec;
+    UINT n;
+    FIL *f = manifestOpen ();
+    if ( f == NULL )
+        return;
+    int s = manifestFind ( f, name, &rec );
+    if ( s >= 0 && rec.used == 1 ) {
+        rec.used = 2;
+        if ( f_lseek ( f, s * sizeof(manifest_t) ) == FR_OK )
+            f_write ( f, &rec, sizeof(rec), &n );
+    }
+    storageClose ( f );
+}
+
+bool xferFsSumOpen ( void ) {
+    storageLock();
+    // take over the names changed so far
+    __disable_irq();
+    memcpy ( sumStale, manifestDirty, sizeof(sumStale) );
+    sumStaleCount = manifestDirtyCount;
+    sumStaleAll = manifestDirtyAll;
+    manifestDirtyCount = 0;
+    manifestDirtyAll = false;
+    __enable_irq();
+#if _USE_LFN
+    sumInfo.lfname = NULL;
+    sumInfo.lfsize = 0;
+#endif
+    bool ok = ( f_opendir ( &sumDir, "0:/" ) == FR_OK );
+    sumBatchCount = 0;
+    sumBatchPos = 0;
+    storageUnlock();
+    return ok;
+}
+
+// next directory entries, with the hashes the manifest has for them
+void sumBatchRead ( void ) {
+    manifest_t rec;
+    FIL *m = manifestOpen ();
+    sumBatchCount = 0;
+    sumBatchPos = 0;
+    while ( sumBatchCount < SUM_BATCH
+      && f_readdir ( &sumDir, &sumInfo ) == FR_OK && sumInfo.fname[0] != 0 ) {
+        if ( sumInfo.fattrib & (AM_DIR | AM_VOL | AM_HID | AM_SYS) )
+            continue;
+        sumentry_t *e = &sumBatch[sumBatchCount++];
+        strcpy ( e->name, sumInfo.fname );
+        e->size  = sumInfo.fsize;
+        e->fdate = sumInfo.fdate;
+        e->ftime = sumInfo.ftime;
+        e->known = ( m != NULL && !manifestIsDirty ( e->name )
+          && manifestFind ( m, e->name, &rec ) >= 0 && rec.used == 1
+          && rec.size == e->size && rec.fdate == e->fdate && rec.ftime == e->ftime );
+        if ( e->known )
+            e->hash = rec.hash;
+    }
+    if ( m != NULL )
+        storageClose ( m );
+}
+
+// hash from the manifest when up to date, or else read from the file;
+// 1: an entry, 0: the end, -1: a file that couldn't be read (no handle
+// free, or a card error)
+int xferFsSumNext ( char *name, uint32_t *size, uint32_t *hash ) {
+    storageLock();
+    if ( sumBatchPos == sumBatchCount )
+        sumBatchRead ();
+    if ( sumBatchPos == sumBatchCount ) {
+        storageUnlock();
+        return 0;
+    }
+    sumentry_t *e = &sumBatch[sumBatchPos++];
+    storageUnlock();
+    strcpy ( name, e->name );
+    *size = e->size;
+    if ( e->known ) {
+        *hash = e->hash;
+        return 1;
+    }
+    // (re)compute, one chunk at a time so that the Sharp can get in between
+    char path[20];
+    sprintf ( path, SD_HOME "%s", name );
+    uint32_t h = XFER_HASH_INIT;
+    storageLock();
+    FIL *f = storageOpen ( path, 'r' );
+    storageUnlock();
+    if ( f == NULL ) {
+        manifestDirtyAll = true; // (the names taken over: check them next time)
+        return -1;
+    }
+    uint8_t chunk[64];
+    int n;
+    do {
+        storageLock();
+        n = storageRead ( f, chunk, sizeof(chunk) );
+        storageUnlock();
+        if ( n > 0 )
+            h = xferHash ( h, chunk, n );
+    } while ( n == sizeof(chunk) );
+    storageLock();
+    storageClose ( f );
+    if ( n != EOF ) {
+        FIL *m = manifestOpen ();
+        if ( m != NULL ) {
+            FILINFO fno;
+            fno.fdate = e->fdate;
+            fno.ftime = e->ftime;
+            manifestWrite ( m, name, e->size, h, &fno );
+            storageClose ( m );
+        }
+    }
+    storageUnlock();
+    if ( n == EOF ) {
+        manifestDirtyAll = true;
+        return -1;
+    }
+    *hash = h;
+    return 1;
+}
+
+void xferFsSumClose ( void ) {
+    sumBatchCount = 0;
+    sumBatchPos = 0;
+}
+
+// card changed (or unmounted): start over
+void storageInvalidate ( void ) {
+    freeState = FREE_UNKNOWN;
+    freeClusters = 0;
+    dirIndexCount = 0;
+    dirIndexComplete = false;
+    dirIndexOverflow = false;
+    dirListGen++;
+    manifestDirtyAll = true;
+#ifdef NAME_ALIAS
+    aliasState = ALIAS_UNKNOWN; // (the file object went with the mount)
+    aliasPendingCount = 0;
+#endif
+#ifdef FLASH_CACHE
+    flashCacheInvalidate ();
+#endif
+}
+
+// Console file transfer backend (see xfer.cpp), run by the main loop:
+// each call holds the card lock, so the Sharp commands wait for it
+// and see the same directory index and free space bookkeeping.
+const char *xferHomePath ( const char *name ) {
+    static INSTANCE char path[20];
+    sprintf(path, SD_HOME "%s", name);
+    return path;
+}
+
+void *xferFsOpen ( const char *name, char mode, uint32_t *size ) {
+    const char *path = xferHomePath(name);
+    uint32_t oldSize = 0;
+    FIL *f = NULL;
+    storageLock();
+    bool exists = storageStat ( path, &oldSize );
+    if ( mode == 'r' ) {
+        if ( exists ) 
+            f = storageOpen ( path, 'r' );
+        if ( f != NULL && size ) 
+            *size = f->fsize;
+    } else {
+        f = storageOpen ( path, 'w' ); // truncated
+        if ( f != NULL )
+            storageFileWritten ( path, oldSize, 0 );
+    }
+    storageUnlock();
+    return f;
+}
+
+int xferFsRead ( void *f, uint8_t *buf, uint32_t len ) {
+    storageLock();
+    int n = storageRead ( (FIL *)f, buf, len );
+    storageUnlock();
+    return n;
+}
+
+int xferFsWrite ( void *f, const uint8_t *buf, uint32_t len ) {
+    storageLock();
+    int n = storageWrite ( (FIL *)f, buf, len );
+    storageUnlock();
+    return n;
+}
+
+bool xferFsSeek ( void *f, uint32_t pos ) {
+    storageLock();
+    int r = storageSeek ( (FIL *)f, pos );
+    storageUnlock();
+    return ( r == 0 );
+}
+
+void xferFsClose ( void *f ) {
+    storageLock();
+    storageClose ( (FIL *)f );
+    storageUnlock();
+}
+
+void manifestStore ( const char *name, uint32_t size, uint32_t hash );
+
+bool xferFsCommit ( void *f, const char *name, uint32_t size, uint32_t hash ) {
+    storageLock();
+    int r = storageClose ( (FIL *)f );
+    storageFileWritten ( xferHomePath(name), 0, size );
+    if ( r == 0 )
+        manifestStore ( name, size, hash ); // hashed on the way in
+    storageUnlock();
+    return ( r == 0 );
+}
+
+void xferFsDiscard ( void *f, const char *name ) {
+    storageLock();
+    storageClose ( (FIL *)f );
+    storageRemove ( xferHomePath(name) );
+    storageUnlock();
+}
+
+void manifestForget ( const char *name );
+
+bool xferFsRemove ( const char *name ) {
+    storageLock();
+    bool r = storageRemove ( xferHomePath(name) ); // as process_KILL
+    if ( r )
+        manifestForget ( name );
+    storageUnlock();
+    return r;
+}
+
+// one entry per call, from a listing started over each time (from the index
+// when the directory fits in it), so the Sharp can run FILES in between
+// the listing is read on from the entry before, when still the one going
+// (no FILES_LIST, nor file removed, meanwhile): one pass for a whole DIR
+INSTANCE int      xferDirLast = -1;   // index of the entry returned last
+INSTANCE uint32_t xferDirGen;
+INSTANCE char     xferDirName[13];
+INSTANCE uint32_t xferDirSize;
+
+bool xferFsDirEntry ( int n, char *name, uint32_t *size ) {
+    const char *ent = NULL;
+    bool ok = true;
+    storageLock();
+    if ( xferDirLast < 0 || n < xferDirLast || xferDirGen != dirListGen ) {
+        xferDirLast = -1;
+        ok = storageDirOpen ();
+        xferDirGen = dirListGen;
+    }
+    while ( ok && xferDirLast < n ) {
+        ent = storageDirNext ( &xferDirSize );
+        if ( ent == NULL ) {
+            xferDirLast = -1; // end: from the start next time
+            ok = false;
+            break;
+        }
+        strcpy ( xferDirName, ent );
+        xferDirLast++;
+    }
+    if ( ok ) {
+        strcpy ( name, xferDirName );
+        *size = xferDirSize;
+    }
+    storageUnlock();
+    return ok;
+}
@@ -0,0 +1,65 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+#include "mbed.h"
+#include "commands.h"
+#include "SDFileSystem.h"
+
+// SD card storage helpers, on top of the FatFs layer of SDFileSystem
+
+// file handles, from a static pool of FatFs file objects
+// (each one with its own sector buffer): the LOAD/SAVE file
+// plus the OPEN'ed ones - no malloc, unlike stdio FILE
+#define FILE_POOL_SIZE (1+Board::OPEN_FILES)
+
+// names the Sharp can't type (a PC's "LONGNA~1.BAS") listed and reached
+// through an 8.3 alias, kept on the card (see storage.cpp)
+#if defined TARGET_NUCLEO_L432KC
+#define NAME_ALIAS 1 // Board::ALIAS_SLOTS aliases per card
+#endif
+
+// card access from the main loop (see storage.cpp)
+void     storageLock ( void );
+void     storageUnlock ( void );
+bool     storageLocked ( void );
+
+// card presence, mounted on first use (see storage.cpp)
+bool     storageCardCheck ( void );   // before a command: read the switch, or as last probed
+bool     storageCardProbe ( void );   // main loop, bus idle: the card read again
+void     storageCardSuspect ( void ); // may have been swapped unseen: probe before a command
+bool     storageCardPresent ( void ); // as last checked
+bool     storageCardAbsent ( void );  // known to be out (not merely not mounted yet)
+
+// free space bookkeeping (see storage.cpp)
+void     storageIdleTask ( void );
+bool     storageIdleBusy ( void );
+uint32_t storageFreeClusters ( bool *exact );
+uint32_t storageClusterBytes ( void );
+void     storageInvalidate ( void );
+
+// file metadata, answered from the directory index when cached
+bool     storageStat ( const char *name, uint32_t *size );
+bool     storageRemove ( const char *name );
+void     storageFileWritten ( const char *name, uint32_t oldSize, uint32_t newSize );
+bool     storageRename ( const char *name, const char *newName );
+bool     storageCopy ( const char *name, const char *newName ); // on the card, a block at a time (2 handles)
+
+// file access ('r'ead, 'w'rite - truncated, 'a'ppend - must exist)
+FIL     *storageOpen ( const char *name, char mode );
+int      storageClose ( FIL *f );
+int      storageGetc ( FIL *f );
+int      storagePutc ( int c, FIL *f );
+int      storageRead ( FIL *f, uint8_t *buf, uint32_t len );
+int      storageSeek ( FIL *f, uint32_t pos );
+int      storageWrite ( FIL *f, const uint8_t *buf, uint32_t len );
+bool     storageFilesOpen ( void );
+int      storageFilesFree ( void );  // handles left in the pool
+
+// directory listing (8.3 names, or their aliases), from the index when complete
+bool        storageDirOpen ( void );
+const char *storageDirNext ( uint32_t *size );
+void        storageDirClose ( void );
+
+// FatFs path ("0:/NAME.BAS") from the stdio one ("/sd/NAME.BAS"), aliases resolved
+const char *fatPath ( const char *name );
+
+#endif
@@ -0,0 +1,600 @@
+// CE-140F emulator - file transfer over the serial console (Linux host)
+//
+// Build:  g++ -O2 -o ce140f_xfer ce140f_xfer.cpp
+// Usage:  ce140f_xfer [-b baud] <tty> dir
+//         ce140f_xfer [-b baud] <tty> get NAME [local file]
+//         ce140f_xfer [-b baud] <tty> put <local file> [NAME]
+//         ce140f_xfer [-b baud] <tty> del NAME
+//         ce140f_xfer [-b baud] <tty> sums              (files, with content hash)
+//         ce140f_xfer [-b baud] <tty> pull <local dir>   (whole card)
+//         ce140f_xfer [-b baud] <tty> push <local dir>   (all files in dir)
+//         ce140f_xfer [-b baud] [-n] <tty> sync <local dir>
+//                     (card made the same as the folder: changed and missing
+//                      files only, by content hash; -n shows what it would do)
+//
+// The frames are described in protocol.md (section 4) and xfer.h;
+// the emulator keeps running meanwhile, and its console text (debug
+// output, traces) is skipped. Try it without a board: tools/xfer_sim.cpp.
+////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include "../xfer.h"
+
+#define REPLY_TIMEOUT  3000  // ms, the emulator may be busy with the Sharp
+#define DATA_TIMEOUT   15000 // ms of silence, during a GET or while hashing
+#define ACK_TIMEOUT    2000  // ms, during a PUT
+#define RETRIES        10
+
+// frame reader results
+#define RX_FRAME    0
+#define RX_TIMEOUT  1
+#define RX_BADCRC   2
+
+int      tty = -1;
+bool     verbose = false;
+bool     dryRun = false;
+uint32_t badFrames = 0;
+uint32_t resent = 0;
+
+uint32_t millis ( void ) {
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+speed_t baudConst ( int baud ) {
+    switch ( baud ) {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        default:      return 0;
+    }
+}
+
+bool openTty ( const char *dev, int baud ) {
+    struct termios t;
+    speed_t s = baudConst ( baud );
+    if ( s == 0 ) {
+        fprintf ( stderr, "unsupported baud rate %d\n", baud );
+        return false;
+    }
+    tty = open ( dev, O_RDWR | O_NOCTTY );
+    if ( tty < 0 || tcgetattr ( tty, &t ) != 0 ) {
+        fprintf ( stderr, "%s: %s\n", dev, strerror(errno) );
+        return false;
+    }
+    cfmakeraw ( &t );
+    cfsetispeed ( &t, s );
+    cfsetospeed ( &t, s );
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    tcsetattr ( tty, TCSANOW, &t );
+    tcflush ( tty, TCIOFLUSH );
+    return true;
+}
+
+void ttyWrite ( const uint8_t *buf, size_t len ) {
+    while ( len > 0 ) {
+        ssize_t n = write ( tty, buf, len );
+        if ( n < 0 ) {
+            if ( errno == EINTR || errno == EAGAIN )
+                continue;
+            perror ( "write" );
+            exit ( 2 );
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+void sendFrame ( uint8_t type, uint8_t seq, const uint8_t *data, uint16_t len ) {
+    std::vector<uint8_t> f;
+    f.push_back ( XFER_SOF );
+    f.push_back ( type );
+    f.push_back ( seq );
+    f.push_back ( len & 0xFF );
+    f.push_back ( len >> 8 );
+    f.insert ( f.end(), data, data + len );
+    uint16_t crc = xferCrc ( 0xFFFF, &f[1], f.size() - 1 );
+    f.push_back ( crc & 0xFF );
+    f.push_back ( crc >> 8 );
+    ttyWrite ( &f[0], f.size() );
+}
+
+// buffered input
+uint8_t  rxBuf[4096];
+size_t   rxLen = 0, rxPos = 0;
+
+int ttyGetc ( uint32_t deadline ) {
+    while ( rxPos == rxLen ) {
+        int32_t left = (int32_t)(deadline - millis());
+        if ( left <= 0 )
+            return -1;
+        struct pollfd p = { tty, POLLIN, 0 };
+        if ( poll ( &p, 1, left ) <= 0 )
+            continue;
+        ssize_t n = read ( tty, rxBuf, sizeof(rxBuf) );
+        if ( n > 0 ) {
+            rxLen = n;
+            rxPos = 0;
+        }
+    }
+    return rxBuf[rxPos++];
+}
+
+// next frame, skipping the console text around it
+int readFrame ( uint32_t timeout, uint8_t &type, uint8_t &seq, std::vector<uint8_t> &payload ) {
+    uint32_t deadline = millis() + timeout;
+    uint8_t hdr[XFER_HDR];
+    int c;
+
+    do {
+        c = ttyGetc ( deadline );
+        if ( c < 0 )
+            return RX_TIMEOUT;
+        if ( verbose && c != XFER_SOF )
+            fputc ( c, stderr ); // emulator console output
+    } while ( c != XFER_SOF );
+    hdr[0] = c;
+    for ( int i=1; i<XFER_HDR; i++ ) {
+        if ( (c = ttyGetc ( deadline )) < 0 )
+            return RX_TIMEOUT;
+        hdr[i] = c;
+    }
+    uint16_t len = hdr[3] | (hdr[4] << 8);
+    if ( len > 4096 ) {
+        badFrames++;
+        return RX_BADCRC;
+    }
+    payload.resize ( len + 2 );
+    for ( int i=0; i<len+2; i++ ) {
+        if ( (c = ttyGetc ( deadline )) < 0 )
+            return RX_TIMEOUT;
+        payload[i] = c;
+    }
+    uint16_t crc = xferCrc ( 0xFFFF, hdr+1, XFER_HDR-1 );
+    crc = xferCrc ( crc, &payload[0], len );
+    if ( crc != ( payload[len] | (payload[len+1] << 8) ) ) {
+        badFrames++;
+        return RX_BADCRC;
+    }
+    payload.resize ( len );
+    type = hdr[1];
+    seq = hdr[2];
+    return RX_FRAME;
+}
+
+std::string errText ( const std::vector<uint8_t> &p ) {
+    return std::string ( p.begin(), p.end() );
+}
+
+// send a request and wait for its first reply (OK, ERR or, for DIR, ENTRY/END)
+bool request ( uint8_t req, const std::vector<uint8_t> &args, uint8_t &type, uint8_t &seq, std::vector<uint8_t> &reply ) {
+    for ( int retry=0; retry<RETRIES; retry++ ) {
+        sendFrame ( req, 0, args.empty() ? NULL : &args[0], args.size() );
+        uint32_t deadline = millis() + REPLY_TIMEOUT;
+        while ( (int32_t)(deadline - millis()) > 0 ) {
+            int r = readFrame ( deadline - millis(), type, seq, reply );
+            if ( r == RX_TIMEOUT )
+                break;
+            if ( r == RX_BADCRC )
+                break; // lost: ask again
+            if ( type == XFER_OK || type == XFER_ERR
+              || ( req == XFER_DIR && ( type == XFER_ENTRY || type == XFER_END ) )
+              || ( req == XFER_SUMS && ( type == XFER_SUM || type == XFER_END ) ) )
+                return true;
+            // leftovers of a previous transfer
+        }
+    }
+    fprintf ( stderr, "no reply from the emulator\n" );
+    return false;
+}
+
+struct entry_t {
+    std::string name;
+    uint32_t    size;
+    uint32_t    hash;
+};
+
+// card listing: DIR, or SUMS (with content hashes)
+bool cmdDir ( std::vector<entry_t> &list, bool sums = false ) {
+    uint8_t req = sums ? XFER_SUMS : XFER_DIR;
+    uint8_t item = sums ? XFER_SUM : XFER_ENTRY;
+    size_t  off = sums ? 8 : 4;
+    for ( int retry=0; retry<RETRIES; retry++ ) {
+        uint8_t type, seq;
+        std::vector<uint8_t> p;
+        std::vector<uint8_t> none;
+        list.clear();
+        if ( !request ( req, none, type, seq, p ) )
+            return false;
+        while ( true ) {
+            if ( type == item && p.size() > off && seq == (uint8_t)list.size() ) {
+                entry_t e;
+                e.size = xferGet32 ( &p[0] );
+                e.hash = sums ? xferGet32 ( &p[4] ) : 0;
+                e.name.assign ( p.begin() + off, p.end() );
+                list.push_back ( e );
+            } else if ( type == XFER_END && p.size() == 4 ) {
+                if ( xferGet32 ( &p[0] ) == list.size() )
+                    return true;
+                break; // entries lost
+            } else if ( type == XFER_ERR ) {
+                fprintf ( stderr, "dir: %s\n", errText(p).c_str() );
+                return false;
+            } else {
+                break;
+            }
+            if ( readFrame ( sums ? DATA_TIMEOUT : REPLY_TIMEOUT, type, seq, p ) != RX_FRAME )
+                break;
+        }
+    }
+    fprintf ( stderr, "dir: failed\n" );
+    return false;
+}
+
+bool cmdGet ( const std::string &name, const std::string &local ) {
+    uint8_t type, seq;
+    std::vector<uint8_t> p, args ( name.begin(), name.end() );
+    if ( !request ( XFER_GET, args, type, seq, p ) )
+        return false;
+    if ( type != XFER_OK || p.size() < 7 ) {
+        fprintf ( stderr, "get %s: %s\n", name.c_str(), errText(p).c_str() );
+        return false;
+    }
+    uint32_t size = xferGet32 ( &p[0] );
+    uint32_t block = p[4] | (p[5] << 8);
+    uint32_t blocks = ( size + block - 1 ) / block;
+    std::vector<uint8_t> data;
+    uint32_t expected = 0;
+    bool naked = false;
+    uint32_t t0 = millis();
+
+    data.reserve ( size );
+    while ( true ) {
+        int r = readFrame ( DATA_TIMEOUT, type, seq, p );
+        if ( r == RX_TIMEOUT ) {
+            if ( expected == blocks )
+                break; // all here, END lost
+            fprintf ( stderr, "get %s: timeout\n", name.c_str() );
+            return false;
+        }
+        if ( r == RX_BADCRC ) {
+            if ( !naked )
+                sendFrame ( XFER_NAK, expected, NULL, 0 );
+            naked = true;
+            continue;
+        }
+        if ( type == XFER_END )
+            break;
+        if ( type == XFER_ERR ) {
+            fprintf ( stderr, "get %s: %s\n", name.c_str(), errText(p).c_str() );
+            return false;
+        }
+        if ( type != XFER_DATA )
+            continue;
+        uint32_t want = ( size - expected * block < block ) ? size - expected * block : block;
+        if ( seq == (uint8_t)expected && expected < blocks && p.size() == want ) {
+            data.insert ( data.end(), p.begin(), p.end() );
+            expected++;
+            naked = false;
+            sendFrame ( XFER_ACK, expected, NULL, 0 );
+        } else if ( (uint8_t)(seq - (uint8_t)expected) >= 0x80 || expected == blocks ) {
+            sendFrame ( XFER_ACK, expected, NULL, 0 ); // a resend: our ACK got lost
+        } else if ( !naked ) {
+            sendFrame ( XFER_NAK, expected, NULL, 0 );
+            naked = true;
+        }
+    }
+    if ( data.size() != size ) {
+        fprintf ( stderr, "get %s: %zu of %u bytes\n", name.c_str(), data.size(), size );
+        return false;
+    }
+    FILE *f = fopen ( local.c_str(), "wb" );
+    if ( f == NULL || fwrite ( data.data(), 1, size, f ) != size ) {
+        fprintf ( stderr, "%s: %s\n", local.c_str(), strerror(errno) );
+        if ( f ) fclose ( f );
+        return false;
+    }
+    fclose ( f );
+    uint32_t ms = millis() - t0 + 1;
+    printf ( "%-12s %8u bytes  %6.1f kB/s\n", name.c_str(), size, size / (float)ms );
+    return true;
+}
+
+bool readLocal ( const std::string &path, std::vector<uint8_t> &data ) {
+    FILE *f = fopen ( path.c_str(), "rb" );
+    uint8_t tmp[4096];
+    size_t n;
+    if ( f == NULL )
+        return false;
+    data.clear();
+    while ( (n = fread ( tmp, 1, sizeof(tmp), f )) > 0 )
+        data.insert ( data.end(), tmp, tmp + n );
+    fclose ( f );
+    return true;
+}
+
+bool cmdPut ( const std::string &local, const std::string &name ) {
+    std::vector<uint8_t> data;
+    if ( !readLocal ( local, data ) ) {
+        fprintf ( stderr, "%s: %s\n", local.c_str(), strerror(errno) );
+        return false;
+    }
+
+    uint8_t type, seq;
+    std::vector<uint8_t> p, args ( 4 );
+    xferPut32 ( &args[0], data.size() );
+    args.insert ( args.end(), name.begin(), name.end() );
+    if ( !request ( XFER_PUT, args, type, seq, p ) )
+        return false;
+    if ( type != XFER_OK || p.size() < 7 ) {
+        fprintf ( stderr, "put %s: %s\n", name.c_str(), errText(p).c_str() );
+        return false;
+    }
+    uint32_t size = data.size();
+    uint32_t block = p[4] | (p[5] << 8);
+    uint32_t window = p[6];
+    uint32_t blocks = ( size + block - 1 ) / block;
+    uint32_t base = 0, next = 0;
+    uint32_t lastProgress = millis();
+    int retries = 0;
+    uint32_t t0 = millis();
+
+    while ( true ) {
+        // keep the window full
+        while ( next < blocks && next < base + window ) {
+            uint32_t off = next * block;
+            uint32_t len = ( size - off < block ) ? size - off : block;
+            sendFrame ( XFER_DATA, next, &data[off], len );
+            next++;
+        }
+        int32_t wait = ACK_TIMEOUT - (int32_t)(millis() - lastProgress);
+        int r = ( wait > 0 ) ? readFrame ( wait, type, seq, p ) : RX_TIMEOUT;
+        if ( r == RX_TIMEOUT ) {
+            if ( ++retries > RETRIES ) {
+                fprintf ( stderr, "put %s: timeout\n", name.c_str() );
+                return false;
+            }
+            // go back (past the end: the last block again, to get END repeated)
+            next = ( base < blocks ) ? base : blocks - 1;
+            if ( blocks == 0 ) {
+                fprintf ( stderr, "put %s: no END\n", name.c_str() );
+                return false;
+            }
+            resent++;
+            lastProgress = millis();
+            continue;
+        }
+        if ( r != RX_FRAME )
+            continue;
+        if ( type == XFER_END )
+            break;
+        if ( type == XFER_ERR ) {
+            fprintf ( stderr, "put %s: %s\n", name.c_str(), errText(p).c_str() );
+            return false;
+        }
+        if ( type == XFER_ACK || type == XFER_NAK ) {
+            uint8_t acked = (uint8_t)(seq - (uint8_t)base);
+            if ( acked <= next - base && acked > 0 ) {
+                base += acked;
+                retries = 0;
+                lastProgress = millis();
+            }
+            if ( type == XFER_NAK && base < blocks ) {
+                next = base;
+                resent++;
+            }
+        }
+    }
+    uint32_t ms = millis() - t0 + 1;
+    printf ( "%-12s %8u bytes  %6.1f kB/s\n", name.c_str(), size, size / (float)ms );
+    return true;
+}
+
+bool cmdDel ( const std::string &name ) {
+    uint8_t type, seq;
+    std::vector<uint8_t> p, args ( name.begin(), name.end() );
+    if ( !request ( XFER_DEL, args, type, seq, p ) )
+        return false;
+    if ( type != XFER_OK ) {
+        fprintf ( stderr, "del %s: %s\n", name.c_str(), errText(p).c_str() );
+        return false;
+    }
+    return true;
+}
+
+// card names are 8.3, upper case
+std::string cardName ( const std::string &path ) {
+    std::string n = path.substr ( path.find_last_of('/') + 1 );
+    for ( size_t i=0; i<n.size(); i++ )
+        n[i] = toupper ( n[i] );
+    return n;
+}
+
+bool validName ( const std::string &n ) {
+    size_t dot = n.find('.');
+    if ( dot == std::string::npos )
+        return n.size() >= 1 && n.size() <= 8;
+    return dot >= 1 && dot <= 8 && n.size() - dot - 1 <= 3;
+}
+
+// card made the same as the local folder, sending only what differs
+bool cmdSync ( const std::string &dir ) {
+    std::vector<entry_t> card;
+    std::vector<std::string> local;
+    int sent = 0, same = 0, removed = 0;
+
+    DIR *d = opendir ( dir.c_str() );
+    struct dirent *e;
+    if ( d == NULL ) {
+        fprintf ( stderr, "%s: %s\n", dir.c_str(), strerror(errno) );
+        return false;
+    }
+    while ( (e = readdir ( d )) != NULL ) {
+        struct stat st;
+        std::string path = dir + "/" + e->d_name;
+        if ( stat ( path.c_str(), &st ) != 0 || !S_ISREG ( st.st_mode ) )
+            continue;
+        if ( !validName ( cardName ( path ) ) ) {
+            fprintf ( stderr, "%s: not an 8.3 name, skipped\n", e->d_name );
+            continue;
+        }
+        local.push_back ( e->d_name );
+    }
+    closedir ( d );
+    if ( !cmdDir ( card, true ) )
+        return false;
+
+    for ( size_t i=0; i<local.size(); i++ ) {
+        std::string path = dir + "/" + local[i];
+        std::string name = cardName ( path );
+        std::vector<uint8_t> data;
+        if ( !readLocal ( path, data ) ) {
+            fprintf ( stderr, "%s: %s\n", path.c_str(), strerror(errno) );
+            return false;
+        }
+        uint32_t hash = xferHash ( XFER_HASH_INIT, data.data(), data.size() );
+        const entry_t *c = NULL;
+        for ( size_t j=0; j<card.size(); j++ )
+            if ( strcasecmp ( card[j].name.c_str(), name.c_str() ) == 0 )
+                c = &card[j];
+        if ( c != NULL && c->size == data.size() && c->hash == hash ) {
+            same++;
+            continue;
+        }
+        printf ( "%s %s\n", c ? "update" : "add   ", name.c_str() );
+        if ( !dryRun && !cmdPut ( path, name ) )
+            return false;
+        sent++;
+    }
+    // files not in the folder any more: removed as by KILL
+    for ( size_t j=0; j<card.size(); j++ ) {
+        bool found = false;
+        for ( size_t i=0; i<local.size() && !found; i++ )
+            found = ( strcasecmp ( card[j].name.c_str(), cardName ( local[i] ).c_str() ) == 0 );
+        if ( found )
+            continue;
+        printf ( "remove %s\n", card[j].name.c_str() );
+        if ( !dryRun && !cmdDel ( card[j].name ) )
+            return false;
+        removed++;
+    }
+    printf ( "%d sent, %d removed, %d unchanged%s\n", sent, removed, same, 
+        dryRun ? " (dry run)" : "" );
+    return true;
+}
+
+int usage ( void ) {
+    fprintf ( stderr,
+        "usage: ce140f_xfer [-b baud] [-v] <tty> dir\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> get NAME [local file]\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> put <local file> [NAME]\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> del NAME\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> pull <local dir>\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> push <local dir>\n"
+        "       ce140f_xfer [-b baud] [-v] [-n] <tty> sync <local dir>\n"
+        "       ce140f_xfer [-b baud] [-v] <tty> sums\n" );
+    return 1;
+}
+
+int main ( int argc, char **argv ) {
+    int baud = 115200;
+    int opt;
+    while ( (opt = getopt ( argc, argv, "b:vn" )) != -1 ) {
+        switch ( opt ) {
+            case 'b': baud = atoi ( optarg ); break;
+            case 'v': verbose = true; break;
+            case 'n': dryRun = true; break;
+            default:  return usage();
+        }
+    }
+    if ( argc - optind < 2 )
+        return usage();
+    if ( !openTty ( argv[optind], baud ) )
+        return 2;
+    std::string cmd = argv[optind+1];
+    std::vector<std::string> args ( argv + optind + 2, argv + argc );
+    bool ok = false;
+
+    if ( cmd == "dir" && args.empty() ) {
+        std::vector<entry_t> list;
+        if ( (ok = cmdDir ( list )) ) {
+            for ( size_t i=0; i<list.size(); i++ )
+                printf ( "%-12s %8u\n", list[i].name.c_str(), list[i].size );
+            printf ( "%zu files\n", list.size() );
+        }
+    } else if ( cmd == "sums" && args.empty() ) {
+        std::vector<entry_t> list;
+        if ( (ok = cmdDir ( list, true )) ) {
+            for ( size_t i=0; i<list.size(); i++ )
+                printf ( "%-12s %8u  %08x\n", list[i].name.c_str(), list[i].size, list[i].hash );
+            printf ( "%zu files\n", list.size() );
+        }
+    } else if ( cmd == "sync" && args.size() == 1 ) {
+        ok = cmdSync ( args[0] );
+    } else if ( cmd == "get" && args.size() >= 1 && args.size() <= 2 ) {
+        ok = cmdGet ( args[0], args.size() > 1 ? args[1] : args[0] );
+    } else if ( cmd == "put" && args.size() >= 1 && args.size() <= 2 ) {
+        std::string name = args.size() > 1 ? args[1] : cardName ( args[0] );
+        if ( !validName ( name ) ) {
+            fprintf ( stderr, "%s: not an 8.3 name\n", name.c_str() );
+            return 1;
+        }
+        ok = cmdPut ( args[0], name );
+    } else if ( cmd == "del" && args.size() == 1 ) {
+        ok = cmdDel ( args[0] );
+    } else if ( cmd == "pull" && args.size() == 1 ) {
+        std::vector<entry_t> list;
+        mkdir ( args[0].c_str(), 0777 );
+        ok = cmdDir ( list );
+        for ( size_t i=0; ok && i<list.size(); i++ )
+            ok = cmdGet ( list[i].name, args[0] + "/" + list[i].name );
+    } else if ( cmd == "push" && args.size() == 1 ) {
+        DIR *d = opendir ( args[0].c_str() );
+        struct dirent *e;
+        if ( d == NULL ) {
+            fprintf ( stderr, "%s: %s\n", args[0].c_str(), strerror(errno) );
+            return 2;
+        }
+        ok = true;
+        while ( ok && (e = readdir ( d )) != NULL ) {
+            std::string path = args[0] + "/" + e->d_name;
+            struct stat st;
+            if ( stat ( path.c_str(), &st ) != 0 || !S_ISREG ( st.st_mode ) )
+                continue;
+            std::string name = cardName ( path );
+            if ( !validName ( name ) ) {
+                fprintf ( stderr, "%s: not an 8.3 name, skipped\n", e->d_name );
+                continue;
+            }
+            ok = cmdPut ( path, name );
+        }
+        closedir ( d );
+    } else {
+        return usage();
+    }
+    if ( verbose || badFrames || resent )
+        fprintf ( stderr, "%u bad frames, %u go-backs\n", badFrames, resent );
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,22 @@
+// CE-140F emulator - host build: the SD card is a local directory
+// (hostCardDir), or a FAT image (host_fat.h), through the FatFs subset
+// of host_ff.cpp
+////////////////////////////////////////////////////////
+#ifndef SDFILESYSTEM_H
+#define SDFILESYSTEM_H
+#include "mbed.h"
+#include "ff.h"
+
+extern thread_local const char *hostCardDir;
+
+class SDFileSystem {
+public:
+    SDFileSystem ( PinName mosi, PinName miso, PinName sclk, PinName cs, const char *name ) {
+        f_mount ( 0, &_fs );
+    }
+    int disk_initialize ( void ) { return 0; }
+    int disk_status ( void ) { return 0; }
+    FATFS _fs;
+};
+
+#endif
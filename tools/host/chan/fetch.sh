@@ -0,0 +1,34 @@
+#!/bin/sh
+# CE-140F emulator - host build: the ChaN FatFs of the firmware, for the
+# tools built with -DHOST_CHAN_FATFS (see ../ff.h, ../host_disk.cpp)
+#
+# Copies ff.cpp, ff.h, ffconf.h, integer.h and diskio.h from the ChaN folder
+# of the FATFileSystem library SDFileSystem is built on, at the revision
+# SDFileSystem.lib pins, into this folder: the FatFs code of the tools is
+# then the one of the board, only the disk layer being the host's.
+# The library is taken from the checkout the firmware is built from
+# (SDFileSystem/ at the repository root, as "mbed deploy" leaves it), or
+# cloned with Mercurial when there's none.
+#
+# Usage (from anywhere):  tools/host/chan/fetch.sh [SDFileSystem_dir]
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$here/../../..
+lib=${1:-$root/SDFileSystem}
+
+# url#revision, from a .lib file
+libUrl() { sed 's/#.*//' "$1" | tr -d '\r\n'; }
+libRev() { sed 's/.*#//' "$1" | tr -d '\r\n'; }
+
+if [ ! -d "$lib" ]; then
+    lib=$(mktemp -d)/SDFileSystem
+    hg clone -r "$(libRev "$root/SDFileSystem.lib")" "$(libUrl "$root/SDFileSystem.lib")" "$lib"
+fi
+fat=$lib/FATFileSystem
+if [ ! -d "$fat" ]; then
+    hg clone -r "$(libRev "$fat.lib")" "$(libUrl "$fat.lib")" "$fat"
+fi
+for f in ff.cpp ff.h ffconf.h integer.h diskio.h; do
+    cp "$fat/ChaN/$f" "$here/"
+done
+echo "ChaN FatFs copied from $fat/ChaN"
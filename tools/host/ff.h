@@ -0,0 +1,135 @@
+// CE-140F emulator - host build: the FatFs subset used by the firmware
+//
+// Same names and types as the FatFs revision of SDFileSystem (no LFN),
+// on top of a local directory standing for the card (hostCardDir):
+// 8.3 names only, matched regardless of case. Implemented in host_ff.cpp,
+// or in host_fat.cpp on a FAT image, sector by sector (host_fat.h).
+// Built with -DHOST_CHAN_FATFS, the ChaN FatFs of SDFileSystem itself
+// instead (in chan/, see chan/fetch.sh), on a FAT image only.
+////////////////////////////////////////////////////////
+#ifndef FF_H
+#define FF_H
+#ifdef HOST_CHAN_FATFS
+#include "chan/ff.h"
+#include "chan/diskio.h"
+#else
+#include <stdint.h>
+
+typedef unsigned char  BYTE;
+typedef unsigned short WORD;
+typedef uint32_t       DWORD;
+typedef unsigned int   UINT;
+typedef char           TCHAR;
+
+#define _MAX_SS  512
+#define _USE_LFN 0
+#define _VOLUMES 1
+
+typedef struct {
+    BYTE  fs_type;    // 0: not mounted
+    BYTE  drv;
+    BYTE  csize;      // sectors per cluster
+    DWORD n_fatent;   // clusters + 2
+    DWORD free_clust; // 0xFFFFFFFF: unknown
+    DWORD fatbase;
+    // FAT image only (host_fat.cpp)
+    DWORD volbase;    // boot sector
+    DWORD fsize;      // sectors per FAT
+    BYTE  n_fats;
+    WORD  n_rootdir;  // FAT16 root entries
+    DWORD dirbase;    // FAT16: root sector, FAT32: root cluster
+    DWORD database;
+    DWORD last_clust; // last allocated
+    DWORD fsi_sector; // FAT32 FSInfo
+    BYTE  fsi_flag;   // to be written
+    BYTE  wflag;      // window dirty
+    DWORD winsect;
+    BYTE  win[_MAX_SS];
+} FATFS;
+
+typedef struct {
+    FATFS *fs;
+    BYTE   flag;      // FA_READ / FA_WRITE
+    DWORD  fptr;
+    DWORD  fsize;
+    int    fd;        // host file
+    // FAT image only (host_fat.cpp)
+    DWORD  sclust;    // first cluster, 0: none
+    DWORD  clust;     // cluster of fptr
+    DWORD  dsect;     // sector in buf, 0: none
+    DWORD  dir_sect;  // directory entry
+    WORD   dir_index;
+    BYTE   buf[_MAX_SS];
+} FIL;
+
+typedef struct {
+    FATFS *fs;
+    WORD   index;     // (host) directory entries read so far
+    DWORD  ino;       // (host) inode of the last one returned, 0: none
+} FATFS_DIR;
+
+typedef struct {
+    DWORD fsize;
+    WORD  fdate;
+    WORD  ftime;
+    BYTE  fattrib;
+    TCHAR fname[13];
+} FILINFO;
+
+typedef enum {
+    FR_OK = 0, FR_DISK_ERR, FR_INT_ERR, FR_NOT_READY, FR_NO_FILE, FR_NO_PATH,
+    FR_INVALID_NAME, FR_DENIED, FR_EXIST, FR_INVALID_OBJECT, FR_WRITE_PROTECTED,
+    FR_INVALID_DRIVE, FR_NOT_ENABLED, FR_NO_FILESYSTEM, FR_MKFS_ABORTED,
+    FR_TIMEOUT, FR_LOCKED, FR_NOT_ENOUGH_CORE, FR_TOO_MANY_OPEN_FILES,
+    FR_INVALID_PARAMETER
+} FRESULT;
+
+#define FA_READ          0x01
+#define FA_OPEN_EXISTING 0x00
+#define FA_WRITE         0x02
+#define FA_CREATE_NEW    0x04
+#define FA_CREATE_ALWAYS 0x08
+#define FA_OPEN_ALWAYS   0x10
+
+#define FS_FAT12 1
+#define FS_FAT16 2
+#define FS_FAT32 3
+
+#define AM_RDO 0x01
+#define AM_HID 0x02
+#define AM_SYS 0x04
+#define AM_VOL 0x08
+#define AM_DIR 0x10
+#define AM_ARC 0x20
+
+FRESULT f_mount ( BYTE vol, FATFS *fs );
+FRESULT f_open ( FIL *fp, const TCHAR *path, BYTE mode );
+FRESULT f_close ( FIL *fp );
+FRESULT f_read ( FIL *fp, void *buff, UINT btr, UINT *br );
+FRESULT f_write ( FIL *fp, const void *buff, UINT btw, UINT *bw );
+FRESULT f_lseek ( FIL *fp, DWORD ofs );
+FRESULT f_truncate ( FIL *fp );
+FRESULT f_sync ( FIL *fp );
+FRESULT f_opendir ( FATFS_DIR *dj, const TCHAR *path );
+FRESULT f_readdir ( FATFS_DIR *dj, FILINFO *fno );
+FRESULT f_stat ( const TCHAR *path, FILINFO *fno );
+FRESULT f_unlink ( const TCHAR *path );
+FRESULT f_rename ( const TCHAR *path_old, const TCHAR *path_new );
+FRESULT f_chmod ( const TCHAR *path, BYTE value, BYTE mask );
+FRESULT f_getfree ( const TCHAR *path, DWORD *nclst, FATFS **fatfs );
+
+#define f_tell(fp) ((fp)->fptr)
+#define f_size(fp) ((fp)->fsize)
+#define f_eof(fp)  (((int)((fp)->fptr) == ((int)((fp)->fsize))) ? 1 : 0)
+
+// disk layer: the image sectors (host_fat.cpp); with a directory there's
+// no FAT behind it (the volume is reported as FAT12, so the free space
+// comes from f_getfree, see storageIdleTask), only a boot sector for the
+// card probe (storageCardCheck)
+typedef enum { RES_OK = 0, RES_ERROR, RES_WRPRT, RES_NOTRDY, RES_PARERR } DRESULT;
+typedef BYTE DSTATUS;
+DRESULT disk_read ( BYTE drv, BYTE *buff, DWORD sector, BYTE count );
+DRESULT disk_write ( BYTE drv, const BYTE *buff, DWORD sector, BYTE count );
+
+#endif // HOST_CHAN_FATFS
+#endif
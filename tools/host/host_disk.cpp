@@ -0,0 +1,109 @@
+// CE-140F emulator - host build: the disk layer under FatFs (see host_fat.h)
+//
+// The card's sectors: those of a FAT image mapped in memory, each one
+// costing hostReadUs / hostWriteUs of virtual time and counted. Under the
+// FatFs subset of this folder (host_ff.cpp, host_fat.cpp) only disk_read
+// and disk_write are called; built with -DHOST_CHAN_FATFS, this is the
+// whole diskio of the ChaN FatFs sources in chan/ (the firmware's own, see
+// chan/fetch.sh), which then do all the FAT work on the image.
+////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mbed.h"
+#include "host_fat.h"
+
+thread_local const char *hostCardDir = ".";
+thread_local bool        hostImage = false;
+uint32_t                 hostReadUs = 0;
+uint32_t                 hostWriteUs = 0;
+thread_local uint32_t    hostSectorsRead = 0;
+thread_local uint32_t    hostSectorsWritten = 0;
+thread_local BYTE       *imgMap = NULL;
+thread_local DWORD       imgSectors;
+
+bool hostImageOpen ( const char *name ) {
+    struct stat st;
+    int fd = open ( name, O_RDWR );
+    if ( fd < 0 || fstat ( fd, &st ) != 0 || st.st_size < _MAX_SS ) {
+        perror ( name );
+        return false;
+    }
+    void *m = mmap ( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close ( fd );
+    if ( m == MAP_FAILED ) {
+        perror ( name );
+        return false;
+    }
+    imgMap = (BYTE *)m;
+    imgSectors = st.st_size / _MAX_SS;
+    hostImage = true;
+    return true;
+}
+
+DRESULT disk_read ( BYTE drv, BYTE *buff, DWORD sector, BYTE count ) {
+    if ( imgMap == NULL ) {
+        // a directory: a boot sector for the card probe, nothing behind
+        if ( sector != 0 || count != 1 )
+            return RES_ERROR;
+        memset ( buff, 0, _MAX_SS );
+        memcpy ( buff + 39, "CARD", 4 ); // volume serial number
+        buff[510] = 0x55;
+        buff[511] = 0xAA;
+        return RES_OK;
+    }
+    if ( sector + count > imgSectors )
+        return RES_ERROR;
+    memcpy ( buff, imgMap + (size_t)sector * _MAX_SS, count * _MAX_SS );
+    hostSectorsRead += count;
+    if ( hostReadUs )
+        wait_us ( hostReadUs * count );
+    return RES_OK;
+}
+
+DRESULT disk_write ( BYTE drv, const BYTE *buff, DWORD sector, BYTE count ) {
+    if ( imgMap == NULL || sector + count > imgSectors )
+        return RES_ERROR;
+    memcpy ( imgMap + (size_t)sector * _MAX_SS, buff, count * _MAX_SS );
+    hostSectorsWritten += count;
+    if ( hostWriteUs )
+        wait_us ( hostWriteUs * count );
+    return RES_OK;
+}
+
+#ifdef HOST_CHAN_FATFS
+// the rest of the diskio FatFs expects: the image is the only drive
+DSTATUS disk_initialize ( BYTE drv ) {
+    return ( drv == 0 && imgMap != NULL ) ? 0 : STA_NOINIT;
+}
+
+DSTATUS disk_status ( BYTE drv ) {
+    return ( drv == 0 && imgMap != NULL ) ? 0 : STA_NOINIT;
+}
+
+DRESULT disk_ioctl ( BYTE drv, BYTE ctrl, void *buff ) {
+    if ( drv != 0 || imgMap == NULL )
+        return RES_NOTRDY;
+    switch ( ctrl ) {
+        case CTRL_SYNC:        return RES_OK; // MAP_SHARED: written through
+        case GET_SECTOR_COUNT: *(DWORD *)buff = imgSectors; return RES_OK;
+        case GET_SECTOR_SIZE:  *(WORD *)buff = _MAX_SS; return RES_OK;
+        case GET_BLOCK_SIZE:   *(DWORD *)buff = 1; return RES_OK;
+    }
+    return RES_PARERR;
+}
+
+// directory entry stamps, from the host clock (FATFileSystem: the RTC)
+DWORD get_fattime ( void ) {
+    time_t t = time ( NULL );
+    struct tm tm;
+    localtime_r ( &t, &tm );
+    return ( (DWORD)( tm.tm_year - 80 ) << 25 ) | ( (DWORD)( tm.tm_mon + 1 ) << 21 )
+         | ( (DWORD)tm.tm_mday << 16 ) | ( (DWORD)tm.tm_hour << 11 )
+         | ( (DWORD)tm.tm_min << 5 ) | ( (DWORD)tm.tm_sec >> 1 );
+}
+#endif
@@ -0,0 +1,750 @@
+// CE-140F emulator - host build: FatFs subset over a FAT image (see host_fat.h),
+// the sectors coming from host_disk.cpp; not built with -DHOST_CHAN_FATFS,
+// the ChaN FatFs itself taking over then
+//
+// Root directory only, 8.3 names, as the firmware uses it. Laid out the way
+// FatFs goes to the card, so that the sector traffic is comparable: FAT and
+// directory sectors through the one window of the volume (FATFS.win, the
+// FAT copies written along), file data through the sector buffer of each
+// file, whole sectors straight to and from the caller's buffer.
+////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "mbed.h"
+#include "host_fat.h"
+
+#define FA__WRITTEN 0x20
+#define FA__DIRTY   0x40
+
+#define DIR_SIZE    32
+#define DIR_ATTR    11
+#define DIR_CLUSTHI 20
+#define DIR_TIME    22
+#define DIR_DATE    24
+#define DIR_CLUSTLO 26
+#define DIR_FSIZE   28
+
+#define CLUST_EOC   0x0FFFFFFF
+#define CLUST_BAD   0xFFFFFFFF // chain error
+
+extern thread_local FATFS *hostVolume;
+
+static WORD ld16 ( const BYTE *p ) {
+    return p[0] | ( p[1] << 8 );
+}
+
+static DWORD ld32 ( const BYTE *p ) {
+    return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (DWORD)p[3] << 24 );
+}
+
+static void st16 ( BYTE *p, WORD v ) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+static void st32 ( BYTE *p, DWORD v ) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+// the window: FAT and directory sectors
+static bool syncWindow ( FATFS *fs ) {
+    if ( !fs->wflag )
+        return true;
+    if ( disk_write ( fs->drv, fs->win, fs->winsect, 1 ) != RES_OK )
+        return false;
+    fs->wflag = 0;
+    if ( fs->winsect >= fs->fatbase && fs->winsect < fs->fatbase + fs->fsize )
+        for ( BYTE n = 1; n < fs->n_fats; n++ )
+            disk_write ( fs->drv, fs->win, fs->winsect + n * fs->fsize, 1 );
+    return true;
+}
+
+static bool moveWindow ( FATFS *fs, DWORD sect ) {
+    if ( sect == fs->winsect )
+        return true;
+    if ( !syncWindow ( fs ) || disk_read ( fs->drv, fs->win, sect, 1 ) != RES_OK )
+        return false;
+    fs->winsect = sect;
+    return true;
+}
+
+// volume figures, at the first access (boot sector, or the first
+// partition of an MBR)
+static FRESULT imgMount ( void ) {
+    FATFS *fs = hostVolume;
+    if ( fs == NULL )
+        return FR_NOT_ENABLED;
+    if ( fs->fs_type != 0 )
+        return FR_OK;
+    fs->drv = 0;
+    fs->wflag = 0;
+    fs->winsect = 0xFFFFFFFF;
+    fs->volbase = 0;
+    if ( !moveWindow ( fs, 0 ) )
+        return FR_DISK_ERR;
+    if ( ld16 ( fs->win + 510 ) != 0xAA55 )
+        return FR_NO_FILESYSTEM;
+    if ( fs->win[0] != 0xEB && fs->win[0] != 0xE9 ) {
+        fs->volbase = ld32 ( fs->win + 446 + 8 );
+        if ( !moveWindow ( fs, fs->volbase ) || ld16 ( fs->win + 510 ) != 0xAA55 )
+            return FR_NO_FILESYSTEM;
+    }
+    BYTE *b = fs->win;
+    if ( ld16 ( b + 11 ) != _MAX_SS || b[13] == 0 || b[16] == 0 )
+        return FR_NO_FILESYSTEM;
+    DWORD fatSize = ld16 ( b + 22 ) ? ld16 ( b + 22 ) : ld32 ( b + 36 );
+    DWORD total = ld16 ( b + 19 ) ? ld16 ( b + 19 ) : ld32 ( b + 32 );
+    fs->csize = b[13];
+    fs->n_fats = b[16];
+    fs->fsize = fatSize;
+    fs->n_rootdir = ld16 ( b + 17 );
+    fs->fatbase = fs->volbase + ld16 ( b + 14 );
+    DWORD rootSectors = ( fs->n_rootdir * DIR_SIZE + _MAX_SS - 1 ) / _MAX_SS;
+    fs->database = fs->fatbase + fs->n_fats * fatSize + rootSectors;
+    DWORD clusters = ( total - ( fs->database - fs->volbase ) ) / fs->csize;
+    fs->n_fatent = clusters + 2;
+    fs->free_clust = 0xFFFFFFFF;
+    fs->last_clust = 0xFFFFFFFF;
+    fs->fsi_flag = 0;
+    if ( clusters < 4085 )
+        return FR_NO_FILESYSTEM; // FAT12: not here
+    if ( clusters < 65525 ) {
+        fs->fs_type = FS_FAT16;
+        fs->dirbase = fs->fatbase + fs->n_fats * fatSize;
+    } else {
+        fs->fs_type = FS_FAT32;
+        fs->dirbase = ld32 ( b + 44 );
+        fs->fsi_sector = fs->volbase + ld16 ( b + 48 );
+        if ( moveWindow ( fs, fs->fsi_sector ) && ld32 ( fs->win ) == 0x41615252
+          && ld32 ( fs->win + 484 ) == 0x61417272 ) {
+            fs->free_clust = ld32 ( fs->win + 488 );
+            fs->last_clust = ld32 ( fs->win + 492 );
+        }
+    }
+    return FR_OK;
+}
+
+static DWORD clustSect ( FATFS *fs, DWORD c ) {
+    return fs->database + ( c - 2 ) * fs->csize;
+}
+
+static DWORD getFat ( FATFS *fs, DWORD c ) {
+    if ( c < 2 || c >= fs->n_fatent )
+        return CLUST_BAD;
+    DWORD size = ( fs->fs_type == FS_FAT32 ) ? 4 : 2;
+    if ( !moveWindow ( fs, fs->fatbase + c * size / _MAX_SS ) )
+        return CLUST_BAD;
+    BYTE *p = fs->win + c * size % _MAX_SS;
+    if ( size == 2 ) {
+        DWORD v = ld16 ( p );
+        return ( v >= 0xFFF8 ) ? CLUST_EOC : v;
+    }
+    DWORD v = ld32 ( p ) & 0x0FFFFFFF;
+    return ( v >= 0x0FFFFFF8 ) ? CLUST_EOC : v;
+}
+
+static bool putFat ( FATFS *fs, DWORD c, DWORD v ) {
+    DWORD size = ( fs->fs_type == FS_FAT32 ) ? 4 : 2;
+    if ( c < 2 || c >= fs->n_fatent || !moveWindow ( fs, fs->fatbase + c * size / _MAX_SS ) )
+        return false;
+    BYTE *p = fs->win + c * size % _MAX_SS;
+    if ( size == 2 )
+        st16 ( p, v == CLUST_EOC ? 0xFFFF : v );
+    else
+        st32 ( p, ( ld32 ( p ) & 0xF0000000 ) | ( v & 0x0FFFFFFF ) );
+    fs->wflag = 1;
+    return true;
+}
+
+// a free cluster, linked after prev (0: new chain); 0 if the card is full
+static DWORD createChain ( FATFS *fs, DWORD prev ) {
+    DWORD start = ( fs->last_clust >= 2 && fs->last_clust < fs->n_fatent ) ? fs->last_clust : fs->n_fatent - 1;
+    DWORD c = start;
+    for (;;) {
+        if ( ++c >= fs->n_fatent )
+            c = 2;
+        DWORD v = getFat ( fs, c );
+        if ( v == 0 )
+            break;
+        if ( v == CLUST_BAD || c == start )
+            return 0;
+    }
+    if ( !putFat ( fs, c, CLUST_EOC ) || ( prev && !putFat ( fs, prev, c ) ) )
+        return 0;
+    fs->last_clust = c;
+    if ( fs->free_clust != 0xFFFFFFFF ) {
+        fs->free_clust--;
+        fs->fsi_flag = 1;
+    }
+    return c;
+}
+
+static bool removeChain ( FATFS *fs, DWORD c ) {
+    while ( c >= 2 && c < fs->n_fatent ) {
+        DWORD next = getFat ( fs, c );
+        if ( next == CLUST_BAD || !putFat ( fs, c, 0 ) )
+            return false;
+        if ( fs->free_clust != 0xFFFFFFFF ) {
+            fs->free_clust++;
+            fs->fsi_flag = 1;
+        }
+        c = next;
+    }
+    return true;
+}
+
+// root directory: sector of entry i, 0 past the end (extended when asked,
+// FAT32 only)
+static DWORD dirSect ( FATFS *fs, DWORD i, bool extend ) {
+    DWORD perSect = _MAX_SS / DIR_SIZE;
+    if ( fs->fs_type != FS_FAT32 )
+        return ( i < fs->n_rootdir ) ? fs->dirbase + i / perSect : 0;
+    DWORD c = fs->dirbase;
+    for ( DWORD n = i / ( perSect * fs->csize ); n > 0; n-- ) {
+        DWORD next = getFat ( fs, c );
+        if ( next == CLUST_EOC && extend ) {
+            next = createChain ( fs, c );
+            if ( next == 0 )
+                return 0;
+            for ( DWORD s = 0; s < fs->csize; s++ ) {
+                if ( !syncWindow ( fs ) )
+                    return 0;
+                memset ( fs->win, 0, _MAX_SS );
+                fs->winsect = clustSect ( fs, next ) + s;
+                fs->wflag = 1;
+            }
+        }
+        if ( next < 2 || next >= fs->n_fatent )
+            return 0;
+        c = next;
+    }
+    return clustSect ( fs, c ) + i / perSect % fs->csize;
+}
+
+static BYTE *dirEntry ( FATFS *fs, DWORD i, bool extend ) {
+    DWORD s = dirSect ( fs, i, extend );
+    if ( s == 0 || !moveWindow ( fs, s ) )
+        return NULL;
+    return fs->win + i % ( _MAX_SS / DIR_SIZE ) * DIR_SIZE;
+}
+
+// "0:/NAME.EXT" -> the 11 bytes of a directory entry
+static bool dirName ( const TCHAR *path, BYTE *sfn ) {
+    if ( path[0] && path[1] == ':' )
+        path += 2;
+    while ( *path == '/' )
+        path++;
+    memset ( sfn, ' ', 11 );
+    int i = 0, limit = 8;
+    for ( ; *path; path++ ) {
+        BYTE c = toupper ( (unsigned char)*path );
+        if ( c == '.' && limit == 8 && i > 0 ) {
+            i = 8;
+            limit = 11;
+            continue;
+        }
+        if ( c <= ' ' || c == '.' || c == '/' || strchr ( "\"*+,:;<=>?[\\]|", c ) || i >= limit )
+            return false;
+        sfn[i++] = c;
+    }
+    return i > 0;
+}
+
+static void dirInfo ( const BYTE *e, FILINFO *fno ) {
+    int n = 0;
+    for ( int i=0; i<8 && e[i] != ' '; i++ )
+        fno->fname[n++] = e[i];
+    if ( e[8] != ' ' ) {
+        fno->fname[n++] = '.';
+        for ( int i=8; i<11 && e[i] != ' '; i++ )
+            fno->fname[n++] = e[i];
+    }
+    fno->fname[n] = 0;
+    fno->fattrib = e[DIR_ATTR];
+    fno->fsize = ld32 ( e + DIR_FSIZE );
+    fno->fdate = ld16 ( e + DIR_DATE );
+    fno->ftime = ld16 ( e + DIR_TIME );
+}
+
+static DWORD dirClust ( FATFS *fs, const BYTE *e ) {
+    DWORD c = ld16 ( e + DIR_CLUSTLO );
+    if ( fs->fs_type == FS_FAT32 )
+        c |= (DWORD)ld16 ( e + DIR_CLUSTHI ) << 16;
+    return c;
+}
+
+static void dirSetClust ( BYTE *e, DWORD c ) {
+    st16 ( e + DIR_CLUSTLO, c );
+    st16 ( e + DIR_CLUSTHI, c >> 16 );
+}
+
+// index of the entry, -1 if not found, -2 on a disk error
+static long dirFind ( FATFS *fs, const BYTE *sfn ) {
+    for ( DWORD i = 0; ; i++ ) {
+        BYTE *e = dirEntry ( fs, i, false );
+        if ( e == NULL )
+            return ( dirSect ( fs, i, false ) == 0 ) ? -1 : -2;
+        if ( e[0] == 0 )
+            return -1;
+        if ( e[0] != 0xE5 && e[DIR_ATTR] != 0x0F && !( e[DIR_ATTR] & AM_VOL )
+          && memcmp ( e, sfn, 11 ) == 0 )
+            return i;
+    }
+}
+
+static long dirFree ( FATFS *fs ) {
+    for ( DWORD i = 0; ; i++ ) {
+        BYTE *e = dirEntry ( fs, i, true );
+        if ( e == NULL )
+            return -1;
+        if ( e[0] == 0 || e[0] == 0xE5 )
+            return i;
+    }
+}
+
+static void fatTime ( WORD *date, WORD *tim ) {
+    struct tm tm;
+    time_t t = time ( NULL );
+    localtime_r ( &t, &tm );
+    *date = ( ( tm.tm_year - 80 ) << 9 ) | ( ( tm.tm_mon + 1 ) << 5 ) | tm.tm_mday;
+    *tim = ( tm.tm_hour << 11 ) | ( tm.tm_min << 5 ) | ( tm.tm_sec / 2 );
+}
+
+// FAT32: free count and last cluster back into FSInfo
+static bool syncFs ( FATFS *fs ) {
+    if ( !syncWindow ( fs ) )
+        return false;
+    if ( fs->fs_type == FS_FAT32 && fs->fsi_flag ) {
+        if ( !moveWindow ( fs, fs->fsi_sector ) )
+            return false;
+        if ( ld32 ( fs->win ) == 0x41615252 ) {
+            st32 ( fs->win + 488, fs->free_clust );
+            st32 ( fs->win + 492, fs->last_clust );
+            fs->wflag = 1;
+        }
+        fs->fsi_flag = 0;
+        return syncWindow ( fs );
+    }
+    return true;
+}
+
+// file buffer back to the card
+static bool flushBuf ( FIL *fp ) {
+    if ( !( fp->flag & FA__DIRTY ) )
+        return true;
+    if ( disk_write ( fp->fs->drv, fp->buf, fp->dsect, 1 ) != RES_OK )
+        return false;
+    fp->flag &= ~FA__DIRTY;
+    return true;
+}
+
+FRESULT imgOpen ( FIL *fp, const TCHAR *path, BYTE mode ) {
+    BYTE sfn[11];
+    FRESULT res = imgMount ();
+    fp->fs = NULL;
+    if ( res != FR_OK )
+        return res;
+    if ( !dirName ( path, sfn ) )
+        return FR_INVALID_NAME;
+    FATFS *fs = hostVolume;
+    long i = dirFind ( fs, sfn );
+    if ( i == -2 )
+        return FR_DISK_ERR;
+    BYTE *e;
+    if ( i < 0 ) {
+        if ( !( mode & ( FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW ) ) )
+            return FR_NO_FILE;
+        i = dirFree ( fs );
+        if ( i < 0 || ( e = dirEntry ( fs, i, false ) ) == NULL )
+            return FR_DENIED; // directory full
+        WORD date, tim;
+        fatTime ( &date, &tim );
+        memset ( e, 0, DIR_SIZE );
+        memcpy ( e, sfn, 11 );
+        e[DIR_ATTR] = AM_ARC;
+        st16 ( e + DIR_DATE, date );
+        st16 ( e + DIR_TIME, tim );
+        fs->wflag = 1;
+        mode |= FA__WRITTEN;
+    } else {
+        if ( mode & FA_CREATE_NEW )
+            return FR_EXIST;
+        e = dirEntry ( fs, i, false );
+        if ( e == NULL )
+            return FR_DISK_ERR;
+        if ( e[DIR_ATTR] & AM_DIR )
+            return FR_NO_FILE;
+        if ( ( mode & FA_WRITE ) && ( e[DIR_ATTR] & AM_RDO ) )
+            return FR_DENIED;
+        if ( mode & FA_CREATE_ALWAYS ) {
+            DWORD c = dirClust ( fs, e );
+            dirSetClust ( e, 0 );
+            st32 ( e + DIR_FSIZE, 0 );
+            e[DIR_ATTR] |= AM_ARC;
+            fs->wflag = 1;
+            if ( c && !removeChain ( fs, c ) )
+                return FR_DISK_ERR;
+            if ( ( e = dirEntry ( fs, i, false ) ) == NULL )
+                return FR_DISK_ERR;
+            mode |= FA__WRITTEN;
+        }
+    }
+    fp->fs = fs;
+    fp->flag = mode & ( FA_READ | FA_WRITE | FA__WRITTEN );
+    fp->fptr = 0;
+    fp->fsize = ld32 ( e + DIR_FSIZE );
+    fp->sclust = dirClust ( fs, e );
+    fp->clust = 0;
+    fp->dsect = 0;
+    fp->dir_sect = fs->winsect;
+    fp->dir_index = i;
+    fp->fd = -1;
+    return FR_OK;
+}
+
+FRESULT imgSync ( FIL *fp ) {
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    FATFS *fs = fp->fs;
+    if ( !( fp->flag & FA__WRITTEN ) )
+        return FR_OK;
+    if ( !flushBuf ( fp ) || !moveWindow ( fs, fp->dir_sect ) )
+        return FR_DISK_ERR;
+    BYTE *e = fs->win + fp->dir_index % ( _MAX_SS / DIR_SIZE ) * DIR_SIZE;
+    WORD date, tim;
+    fatTime ( &date, &tim );
+    e[DIR_ATTR] |= AM_ARC;
+    st32 ( e + DIR_FSIZE, fp->fsize );
+    dirSetClust ( e, fp->sclust );
+    st16 ( e + DIR_DATE, date );
+    st16 ( e + DIR_TIME, tim );
+    fs->wflag = 1;
+    fp->flag &= ~FA__WRITTEN;
+    return syncFs ( fs ) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT imgClose ( FIL *fp ) {
+    FRESULT res = imgSync ( fp );
+    if ( res == FR_OK )
+        fp->fs = NULL;
+    return res;
+}
+
+// cluster holding fptr, for a transfer starting there (extended if asked)
+static bool followClust ( FIL *fp, bool extend ) {
+    FATFS *fs = fp->fs;
+    DWORD bytes = fs->csize * _MAX_SS;
+    if ( fp->fptr % bytes != 0 && fp->clust != 0 )
+        return true;
+    DWORD c;
+    if ( fp->fptr == 0 || fp->clust == 0 ) {
+        // from the start of the chain
+        c = fp->sclust;
+        if ( c == 0 ) {
+            if ( !extend || ( c = createChain ( fs, 0 ) ) == 0 )
+                return false;
+            fp->sclust = c;
+            fp->flag |= FA__WRITTEN;
+        }
+        for ( DWORD n = fp->fptr / bytes; n > 0; n-- ) {
+            DWORD next = getFat ( fs, c );
+            if ( next == CLUST_EOC && extend )
+                next = createChain ( fs, c );
+            if ( next < 2 || next >= fs->n_fatent )
+                return false;
+            c = next;
+        }
+    } else {
+        c = getFat ( fs, fp->clust );
+        if ( c == CLUST_EOC && extend )
+            c = createChain ( fs, fp->clust );
+        if ( c < 2 || c >= fs->n_fatent )
+            return false;
+    }
+    fp->clust = c;
+    return true;
+}
+
+FRESULT imgRead ( FIL *fp, void *buff, UINT btr, UINT *br ) {
+    BYTE *p = (BYTE *)buff;
+    *br = 0;
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( !( fp->flag & FA_READ ) )
+        return FR_DENIED;
+    FATFS *fs = fp->fs;
+    if ( btr > fp->fsize - fp->fptr )
+        btr = fp->fsize - fp->fptr;
+    while ( btr > 0 ) {
+        if ( !followClust ( fp, false ) )
+            return FR_INT_ERR;
+        DWORD inClust = fp->fptr / _MAX_SS % fs->csize;
+        DWORD sect = clustSect ( fs, fp->clust ) + inClust;
+        UINT n;
+        if ( fp->fptr % _MAX_SS == 0 && btr >= _MAX_SS ) {
+            // whole sectors: straight into the caller's buffer
+            UINT cc = btr / _MAX_SS;
+            if ( cc > fs->csize - inClust )
+                cc = fs->csize - inClust;
+            if ( ( fp->flag & FA__DIRTY ) && fp->dsect >= sect && fp->dsect < sect + cc && !flushBuf ( fp ) )
+                return FR_DISK_ERR;
+            if ( disk_read ( fs->drv, p, sect, cc ) != RES_OK )
+                return FR_DISK_ERR;
+            n = cc * _MAX_SS;
+        } else {
+            if ( fp->dsect != sect ) {
+                if ( !flushBuf ( fp ) || disk_read ( fs->drv, fp->buf, sect, 1 ) != RES_OK )
+                    return FR_DISK_ERR;
+                fp->dsect = sect;
+            }
+            n = _MAX_SS - fp->fptr % _MAX_SS;
+            if ( n > btr )
+                n = btr;
+            memcpy ( p, fp->buf + fp->fptr % _MAX_SS, n );
+        }
+        p += n;
+        fp->fptr += n;
+        *br += n;
+        btr -= n;
+    }
+    return FR_OK;
+}
+
+FRESULT imgWrite ( FIL *fp, const void *buff, UINT btw, UINT *bw ) {
+    const BYTE *p = (const BYTE *)buff;
+    *bw = 0;
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( !( fp->flag & FA_WRITE ) )
+        return FR_DENIED;
+    FATFS *fs = fp->fs;
+    while ( btw > 0 ) {
+        if ( !followClust ( fp, true ) )
+            break; // card full
+        DWORD inClust = fp->fptr / _MAX_SS % fs->csize;
+        DWORD sect = clustSect ( fs, fp->clust ) + inClust;
+        UINT n;
+        if ( fp->fptr % _MAX_SS == 0 && btw >= _MAX_SS ) {
+            UINT cc = btw / _MAX_SS;
+            if ( cc > fs->csize - inClust )
+                cc = fs->csize - inClust;
+            if ( disk_write ( fs->drv, p, sect, cc ) != RES_OK )
+                return FR_DISK_ERR;
+            if ( fp->dsect >= sect && fp->dsect < sect + cc ) {
+                // the buffered sector has just been overwritten
+                memcpy ( fp->buf, p + ( fp->dsect - sect ) * _MAX_SS, _MAX_SS );
+                fp->flag &= ~FA__DIRTY;
+            }
+            n = cc * _MAX_SS;
+        } else {
+            if ( fp->dsect != sect ) {
+                if ( !flushBuf ( fp ) )
+                    return FR_DISK_ERR;
+                // sector past the end of the file: nothing to read in
+                if ( fp->fptr - fp->fptr % _MAX_SS < fp->fsize
+                  && disk_read ( fs->drv, fp->buf, sect, 1 ) != RES_OK )
+                    return FR_DISK_ERR;
+                fp->dsect = sect;
+            }
+            n = _MAX_SS - fp->fptr % _MAX_SS;
+            if ( n > btw )
+                n = btw;
+            memcpy ( fp->buf + fp->fptr % _MAX_SS, p, n );
+            fp->flag |= FA__DIRTY;
+        }
+        p += n;
+        fp->fptr += n;
+        *bw += n;
+        btw -= n;
+        if ( fp->fptr > fp->fsize )
+            fp->fsize = fp->fptr;
+        fp->flag |= FA__WRITTEN;
+    }
+    return FR_OK;
+}
+
+// as FatFs: clipped to the file size when read only, or else the file grows
+FRESULT imgLseek ( FIL *fp, DWORD ofs ) {
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( ofs > fp->fsize && !( fp->flag & FA_WRITE ) )
+        ofs = fp->fsize;
+    fp->fptr = ofs;
+    fp->clust = 0;
+    if ( ofs == 0 )
+        return FR_OK;
+    // cluster of the last byte before ofs (the next one is followed on demand)
+    fp->fptr = ofs - 1;
+    bool ok = followClust ( fp, ofs > fp->fsize );
+    fp->fptr = ofs;
+    if ( !ok )
+        return ( ofs > fp->fsize ) ? FR_DENIED : FR_INT_ERR;
+    if ( ofs > fp->fsize ) {
+        fp->fsize = ofs;
+        fp->flag |= FA__WRITTEN;
+    }
+    return FR_OK;
+}
+
+FRESULT imgTruncate ( FIL *fp ) {
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( fp->fptr >= fp->fsize )
+        return FR_OK;
+    FATFS *fs = fp->fs;
+    fp->fsize = fp->fptr;
+    fp->flag |= FA__WRITTEN;
+    if ( fp->fptr == 0 ) {
+        DWORD c = fp->sclust;
+        fp->sclust = 0;
+        fp->clust = 0;
+        return removeChain ( fs, c ) ? FR_OK : FR_DISK_ERR;
+    }
+    DWORD next = getFat ( fs, fp->clust );
+    if ( next == CLUST_BAD )
+        return FR_DISK_ERR;
+    if ( next == CLUST_EOC )
+        return FR_OK;
+    return ( putFat ( fs, fp->clust, CLUST_EOC ) && removeChain ( fs, next ) ) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT imgOpendir ( FATFS_DIR *dj, const TCHAR *path ) {
+    FRESULT res = imgMount ();
+    if ( res != FR_OK )
+        return res;
+    dj->fs = hostVolume;
+    dj->index = 0;
+    return FR_OK;
+}
+
+// next entry (fname[0] == 0 at the end), long name parts and volume label skipped
+FRESULT imgReaddir ( FATFS_DIR *dj, FILINFO *fno ) {
+    if ( dj->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( fno == NULL ) {
+        dj->index = 0;
+        return FR_OK;
+    }
+    for (;;) {
+        BYTE *e = dirEntry ( dj->fs, dj->index, false );
+        if ( e == NULL ) {
+            if ( dirSect ( dj->fs, dj->index, false ) != 0 )
+                return FR_DISK_ERR;
+            fno->fname[0] = 0;
+            return FR_OK;
+        }
+        if ( e[0] == 0 ) {
+            fno->fname[0] = 0;
+            return FR_OK;
+        }
+        dj->index++;
+        if ( e[0] != 0xE5 && e[0] != '.' && e[DIR_ATTR] != 0x0F && !( e[DIR_ATTR] & AM_VOL ) ) {
+            dirInfo ( e, fno );
+            return FR_OK;
+        }
+    }
+}
+
+static FRESULT imgFind ( const TCHAR *path, long *index ) {
+    BYTE sfn[11];
+    FRESULT res = imgMount ();
+    if ( res != FR_OK )
+        return res;
+    if ( !dirName ( path, sfn ) )
+        return FR_INVALID_NAME;
+    *index = dirFind ( hostVolume, sfn );
+    return ( *index == -2 ) ? FR_DISK_ERR : ( *index < 0 ) ? FR_NO_FILE : FR_OK;
+}
+
+FRESULT imgStat ( const TCHAR *path, FILINFO *fno ) {
+    long i;
+    FRESULT res = imgFind ( path, &i );
+    if ( res != FR_OK )
+        return res;
+    BYTE *e = dirEntry ( hostVolume, i, false );
+    if ( e == NULL )
+        return FR_DISK_ERR;
+    dirInfo ( e, fno );
+    return FR_OK;
+}
+
+FRESULT imgUnlink ( const TCHAR *path ) {
+    long i;
+    FRESULT res = imgFind ( path, &i );
+    if ( res != FR_OK )
+        return res;
+    FATFS *fs = hostVolume;
+    BYTE *e = dirEntry ( fs, i, false );
+    if ( e == NULL )
+        return FR_DISK_ERR;
+    if ( e[DIR_ATTR] & ( AM_RDO | AM_DIR ) )
+        return FR_DENIED;
+    DWORD c = dirClust ( fs, e );
+    e[0] = 0xE5;
+    fs->wflag = 1;
+    if ( c && !removeChain ( fs, c ) )
+        return FR_DISK_ERR;
+    return syncFs ( fs ) ? FR_OK : FR_DISK_ERR;
+}
+
+// new name in the same entry
+FRESULT imgRename ( const TCHAR *path_old, const TCHAR *path_new ) {
+    BYTE sfn[11];
+    long i;
+    FRESULT res = imgFind ( path_old, &i );
+    if ( res != FR_OK )
+        return res;
+    if ( !dirName ( path_new, sfn ) )
+        return FR_INVALID_NAME;
+    FATFS *fs = hostVolume;
+    long j = dirFind ( fs, sfn );
+    if ( j >= 0 )
+        return FR_EXIST;
+    BYTE *e = dirEntry ( fs, i, false );
+    if ( j == -2 || e == NULL )
+        return FR_DISK_ERR;
+    memcpy ( e, sfn, 11 );
+    fs->wflag = 1;
+    return syncFs ( fs ) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT imgChmod ( const TCHAR *path, BYTE value, BYTE mask ) {
+    long i;
+    FRESULT res = imgFind ( path, &i );
+    if ( res != FR_OK )
+        return res;
+    FATFS *fs = hostVolume;
+    BYTE *e = dirEntry ( fs, i, false );
+    if ( e == NULL )
+        return FR_DISK_ERR;
+    mask &= AM_RDO | AM_HID | AM_SYS | AM_ARC;
+    e[DIR_ATTR] = ( e[DIR_ATTR] & ~mask ) | ( value & mask );
+    fs->wflag = 1;
+    return syncFs ( fs ) ? FR_OK : FR_DISK_ERR;
+}
+
+// as FatFs: the whole FAT read through, unless the count is known
+FRESULT imgGetfree ( const TCHAR *path, DWORD *nclst, FATFS **fatfs ) {
+    FRESULT res = imgMount ();
+    if ( res != FR_OK )
+        return res;
+    FATFS *fs = hostVolume;
+    *fatfs = fs;
+    if ( fs->free_clust <= fs->n_fatent - 2 ) {
+        *nclst = fs->free_clust;
+        return FR_OK;
+    }
+    DWORD n = 0;
+    for ( DWORD c = 2; c < fs->n_fatent; c++ ) {
+        DWORD v = getFat ( fs, c );
+        if ( v == CLUST_BAD )
+            return FR_DISK_ERR;
+        if ( v == 0 )
+            n++;
+    }
+    fs->free_clust = n;
+    fs->fsi_flag = 1;
+    *nclst = n;
+    return FR_OK;
+}
@@ -0,0 +1,40 @@
+// CE-140F emulator - host build: the card as a FAT16/FAT32 image file
+// (see host_fat.cpp)
+//
+// hostImageOpen() maps the image (host_disk.cpp); from then on the FatFs
+// subset of ff.h works on it, through sector reads and writes (disk_read /
+// disk_write), instead of on the hostCardDir directory - or the ChaN FatFs,
+// built with -DHOST_CHAN_FATFS. Each sector transferred costs hostReadUs /
+// hostWriteUs of virtual time, as a card would, and is counted.
+// Build one, e.g.: mkfs.fat -C -F 32 card.img 65536
+////////////////////////////////////////////////////////
+#ifndef HOST_FAT_H
+#define HOST_FAT_H
+#include <stdint.h>
+#include "ff.h"
+
+extern thread_local bool     hostImage;          // image open: f_* go to host_fat.cpp
+extern uint32_t              hostReadUs;         // per sector (all the threads)
+extern uint32_t              hostWriteUs;
+extern thread_local uint32_t hostSectorsRead;    // since start
+extern thread_local uint32_t hostSectorsWritten;
+
+bool hostImageOpen ( const char *name );
+
+// the FatFs calls, on the image (the subset, host_fat.cpp)
+FRESULT imgOpen ( FIL *fp, const TCHAR *path, BYTE mode );
+FRESULT imgClose ( FIL *fp );
+FRESULT imgRead ( FIL *fp, void *buff, UINT btr, UINT *br );
+FRESULT imgWrite ( FIL *fp, const void *buff, UINT btw, UINT *bw );
+FRESULT imgLseek ( FIL *fp, DWORD ofs );
+FRESULT imgTruncate ( FIL *fp );
+FRESULT imgSync ( FIL *fp );
+FRESULT imgOpendir ( FATFS_DIR *dj, const TCHAR *path );
+FRESULT imgReaddir ( FATFS_DIR *dj, FILINFO *fno );
+FRESULT imgStat ( const TCHAR *path, FILINFO *fno );
+FRESULT imgUnlink ( const TCHAR *path );
+FRESULT imgRename ( const TCHAR *path_old, const TCHAR *path_new );
+FRESULT imgChmod ( const TCHAR *path, BYTE value, BYTE mask );
+FRESULT imgGetfree ( const TCHAR *path, DWORD *nclst, FATFS **fatfs );
+
+#endif
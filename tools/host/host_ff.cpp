@@ -0,0 +1,375 @@
+// CE-140F emulator - host build: FatFs subset over a local directory (see ff.h),
+// or over a FAT image once one is open (host_fat.cpp)
+////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "ff.h"
+#include "host_fat.h"
+
+#define HOST_CLUSTER  4096 // bytes
+#define HOST_ATTRIBS  8    // f_chmod'ed files (not kept on the directory)
+
+extern thread_local const char *hostCardDir; // host_disk.cpp
+thread_local FATFS      *hostVolume = NULL;
+thread_local char        hostAttribName[HOST_ATTRIBS][13];
+thread_local BYTE        hostAttrib[HOST_ATTRIBS];
+
+FRESULT f_mount ( BYTE vol, FATFS *fs ) {
+    hostVolume = fs;
+    if ( fs )
+        fs->fs_type = 0;
+    return FR_OK;
+}
+
+// first access: volume figures from the host file system
+bool hostMount ( void ) {
+    struct statvfs sv;
+    if ( hostVolume == NULL )
+        return false;
+    if ( hostVolume->fs_type != 0 )
+        return true;
+    if ( statvfs ( hostCardDir, &sv ) != 0 )
+        return false;
+    uint64_t clusters = (uint64_t)sv.f_blocks * sv.f_frsize / HOST_CLUSTER;
+    if ( clusters > 0x0FFFFFF0 )
+        clusters = 0x0FFFFFF0;
+    hostVolume->fs_type = FS_FAT12;
+    hostVolume->drv = 0;
+    hostVolume->csize = HOST_CLUSTER / 512;
+    hostVolume->n_fatent = clusters + 2;
+    hostVolume->free_clust = 0xFFFFFFFF;
+    hostVolume->fatbase = 0;
+    return true;
+}
+
+// "0:/NAME.EXT" -> name within the card
+const char *hostName ( const TCHAR *path ) {
+    if ( path[0] && path[1] == ':' )
+        path += 2;
+    while ( *path == '/' )
+        path++;
+    return path;
+}
+
+// 8.3, upper case: false if the host name can't be seen as one
+bool hostShortName ( const char *name, char *out ) {
+    const char *dot = strchr ( name, '.' );
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    if ( base == 0 || base > 8 || ext > 3 || ( dot && strchr ( dot + 1, '.' ) ) )
+        return false;
+    for ( size_t i=0; name[i]; i++ ) {
+        if ( name[i] == ' ' || (unsigned char)name[i] < 0x20 )
+            return false;
+        out[i] = toupper ( (unsigned char)name[i] );
+    }
+    out[base + ( dot ? ext + 1 : 0 )] = 0;
+    return true;
+}
+
+// host path of a card file, the existing one whatever its case
+const char *hostPath ( const TCHAR *path, char *buf, size_t size ) {
+    const char *name = hostName ( path );
+    DIR *d = opendir ( hostCardDir );
+    struct dirent *de;
+    if ( d != NULL ) {
+        while ( ( de = readdir ( d ) ) != NULL ) {
+            if ( strcasecmp ( de->d_name, name ) == 0 ) {
+                name = de->d_name;
+                break;
+            }
+        }
+    }
+    snprintf ( buf, size, "%s/%s", hostCardDir, name );
+    if ( d != NULL )
+        closedir ( d );
+    return buf;
+}
+
+int hostAttribSlot ( const char *name ) {
+    for ( int i=0; i<HOST_ATTRIBS; i++ )
+        if ( hostAttribName[i][0] && strcasecmp ( hostAttribName[i], name ) == 0 )
+            return i;
+    return -1;
+}
+
+FRESULT hostError ( void ) {
+    switch ( errno ) {
+        case ENOENT: return FR_NO_FILE;
+        case EEXIST: return FR_EXIST;
+        case EACCES:
+        case EPERM:  return FR_DENIED;
+        default:     return FR_DISK_ERR;
+    }
+}
+
+void hostFileInfo ( const char *name, const struct stat *st, FILINFO *fno ) {
+    struct tm tm;
+    time_t t = st->st_mtime;
+    localtime_r ( &t, &tm );
+    fno->fsize = S_ISDIR(st->st_mode) ? 0 : (DWORD)st->st_size;
+    fno->fdate = ( ( tm.tm_year - 80 ) << 9 ) | ( ( tm.tm_mon + 1 ) << 5 ) | tm.tm_mday;
+    fno->ftime = ( tm.tm_hour << 11 ) | ( tm.tm_min << 5 ) | ( tm.tm_sec / 2 );
+    fno->fattrib = S_ISDIR(st->st_mode) ? AM_DIR : AM_ARC;
+    int a = hostAttribSlot ( name );
+    if ( a >= 0 )
+        fno->fattrib |= hostAttrib[a];
+}
+
+FRESULT f_open ( FIL *fp, const TCHAR *path, BYTE mode ) {
+    if ( hostImage )
+        return imgOpen ( fp, path, mode );
+    char buf[512];
+    int flags = ( mode & FA_WRITE ) ? ( ( mode & FA_READ ) ? O_RDWR : O_WRONLY ) : O_RDONLY;
+    if ( mode & FA_CREATE_ALWAYS ) flags |= O_CREAT | O_TRUNC;
+    if ( mode & FA_OPEN_ALWAYS )   flags |= O_CREAT;
+    if ( mode & FA_CREATE_NEW )    flags |= O_CREAT | O_EXCL;
+    fp->fs = NULL;
+    if ( !hostMount() )
+        return FR_NOT_READY;
+    int fd = open ( hostPath ( path, buf, sizeof(buf) ), flags, 0644 );
+    if ( fd < 0 )
+        return hostError();
+    struct stat st;
+    fstat ( fd, &st );
+    fp->fs = hostVolume;
+    fp->flag = mode & ( FA_READ | FA_WRITE );
+    fp->fptr = 0;
+    fp->fsize = st.st_size;
+    fp->fd = fd;
+    return FR_OK;
+}
+
+FRESULT f_close ( FIL *fp ) {
+    if ( hostImage )
+        return imgClose ( fp );
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    close ( fp->fd );
+    fp->fs = NULL;
+    return FR_OK;
+}
+
+FRESULT f_read ( FIL *fp, void *buff, UINT btr, UINT *br ) {
+    if ( hostImage )
+        return imgRead ( fp, buff, btr, br );
+    *br = 0;
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( !( fp->flag & FA_READ ) )
+        return FR_DENIED;
+    ssize_t n = pread ( fp->fd, buff, btr, fp->fptr );
+    if ( n < 0 )
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    *br = n;
+    return FR_OK;
+}
+
+FRESULT f_write ( FIL *fp, const void *buff, UINT btw, UINT *bw ) {
+    if ( hostImage )
+        return imgWrite ( fp, buff, btw, bw );
+    *bw = 0;
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( !( fp->flag & FA_WRITE ) )
+        return FR_DENIED;
+    ssize_t n = pwrite ( fp->fd, buff, btw, fp->fptr );
+    if ( n < 0 )
+        return FR_DISK_ERR;
+    fp->fptr += n;
+    if ( fp->fptr > fp->fsize )
+        fp->fsize = fp->fptr;
+    *bw = n;
+    return FR_OK;
+}
+
+// as FatFs: clipped to the file size when read only, or else the file grows
+FRESULT f_lseek ( FIL *fp, DWORD ofs ) {
+    if ( hostImage )
+        return imgLseek ( fp, ofs );
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( ofs > fp->fsize ) {
+        if ( !( fp->flag & FA_WRITE ) )
+            ofs = fp->fsize;
+        else if ( ftruncate ( fp->fd, ofs ) != 0 )
+            return FR_DISK_ERR;
+        else
+            fp->fsize = ofs;
+    }
+    fp->fptr = ofs;
+    return FR_OK;
+}
+
+FRESULT f_truncate ( FIL *fp ) {
+    if ( hostImage )
+        return imgTruncate ( fp );
+    if ( fp->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( ftruncate ( fp->fd, fp->fptr ) != 0 )
+        return FR_DISK_ERR;
+    fp->fsize = fp->fptr;
+    return FR_OK;
+}
+
+FRESULT f_sync ( FIL *fp ) {
+    if ( hostImage )
+        return imgSync ( fp );
+    return ( fp->fs == NULL ) ? FR_INVALID_OBJECT : FR_OK;
+}
+
+FRESULT f_opendir ( FATFS_DIR *dj, const TCHAR *path ) {
+    if ( hostImage )
+        return imgOpendir ( dj, path );
+    if ( !hostMount() )
+        return FR_NOT_READY;
+    DIR *d = opendir ( hostCardDir );
+    if ( d == NULL )
+        return FR_NO_PATH;
+    closedir ( d );
+    dj->fs = hostVolume;
+    dj->index = 0;
+    dj->ino = 0;
+    return FR_OK;
+}
+
+// next 8.3 entry (fname[0] == 0 at the end), the others skipped;
+// the host directory is opened each time, as FatFs keeps no handle
+// (listings dropped half way, with no f_closedir in this revision),
+// and read on from the entry returned last: a file created meanwhile
+// (the firmware's own ALIAS.SYS) doesn't move the others, as on FAT
+FRESULT f_readdir ( FATFS_DIR *dj, FILINFO *fno ) {
+    if ( hostImage )
+        return imgReaddir ( dj, fno );
+    struct dirent *de;
+    char buf[512];
+    if ( dj->fs == NULL )
+        return FR_INVALID_OBJECT;
+    if ( fno == NULL ) {
+        dj->index = 0;
+        dj->ino = 0;
+        return FR_OK;
+    }
+    DIR *d = opendir ( hostCardDir );
+    if ( d == NULL )
+        return FR_DISK_ERR;
+    de = NULL;
+    if ( dj->ino != 0 ) {
+        while ( ( de = readdir ( d ) ) != NULL && de->d_ino != dj->ino )
+            ;
+        if ( de == NULL )
+            rewinddir ( d ); // gone: by position then
+    }
+    if ( de == NULL ) {
+        for ( int i=0; i<dj->index && readdir ( d ) != NULL; i++ )
+            ;
+    }
+    bool found = false;
+    while ( !found && ( de = readdir ( d ) ) != NULL ) {
+        struct stat st;
+        dj->index++;
+        if ( de->d_name[0] == '.' || !hostShortName ( de->d_name, fno->fname ) )
+            continue;
+        snprintf ( buf, sizeof(buf), "%s/%s", hostCardDir, de->d_name );
+        if ( stat ( buf, &st ) == 0 ) {
+            hostFileInfo ( fno->fname, &st, fno );
+            dj->ino = de->d_ino;
+            found = true;
+        }
+    }
+    closedir ( d );
+    if ( !found )
+        fno->fname[0] = 0;
+    return FR_OK;
+}
+
+FRESULT f_stat ( const TCHAR *path, FILINFO *fno ) {
+    if ( hostImage )
+        return imgStat ( path, fno );
+    char buf[512];
+    struct stat st;
+    if ( !hostMount() )
+        return FR_NOT_READY;
+    if ( stat ( hostPath ( path, buf, sizeof(buf) ), &st ) != 0 )
+        return FR_NO_FILE;
+    if ( !hostShortName ( hostName(path), fno->fname ) )
+        return FR_INVALID_NAME;
+    hostFileInfo ( fno->fname, &st, fno );
+    return FR_OK;
+}
+
+FRESULT f_unlink ( const TCHAR *path ) {
+    if ( hostImage )
+        return imgUnlink ( path );
+    char buf[512];
+    if ( !hostMount() )
+        return FR_NOT_READY;
+    if ( unlink ( hostPath ( path, buf, sizeof(buf) ) ) != 0 )
+        return hostError();
+    int a = hostAttribSlot ( hostName(path) );
+    if ( a >= 0 )
+        hostAttribName[a][0] = 0;
+    return FR_OK;
+}
+
+FRESULT f_rename ( const TCHAR *path_old, const TCHAR *path_new ) {
+    if ( hostImage )
+        return imgRename ( path_old, path_new );
+    char from[512], to[512];
+    struct stat st;
+    if ( !hostMount() )
+        return FR_NOT_READY;
+    hostPath ( path_old, from, sizeof(from) );
+    hostPath ( path_new, to, sizeof(to) );
+    if ( stat ( from, &st ) != 0 )
+        return FR_NO_FILE;
+    if ( stat ( to, &st ) == 0 )
+        return FR_EXIST;
+    if ( rename ( from, to ) != 0 )
+        return hostError();
+    return FR_OK;
+}
+
+FRESULT f_chmod ( const TCHAR *path, BYTE value, BYTE mask ) {
+    if ( hostImage )
+        return imgChmod ( path, value, mask );
+    const char *name = hostName ( path );
+    int a = hostAttribSlot ( name );
+    if ( a < 0 && strlen(name) < sizeof(hostAttribName[0]) ) {
+        for ( a=0; a<HOST_ATTRIBS && hostAttribName[a][0]; a++ )
+            ;
+        if ( a == HOST_ATTRIBS )
+            return FR_DENIED;
+        strcpy ( hostAttribName[a], name );
+        hostAttrib[a] = 0;
+    }
+    if ( a < 0 )
+        return FR_INVALID_NAME;
+    mask &= AM_RDO | AM_HID | AM_SYS;
+    hostAttrib[a] = ( hostAttrib[a] & ~mask ) | ( value & mask );
+    return FR_OK;
+}
+
+FRESULT f_getfree ( const TCHAR *path, DWORD *nclst, FATFS **fatfs ) {
+    if ( hostImage )
+        return imgGetfree ( path, nclst, fatfs );
+    struct statvfs sv;
+    if ( !hostMount() || statvfs ( hostCardDir, &sv ) != 0 )
+        return FR_NOT_READY;
+    uint64_t n = (uint64_t)sv.f_bavail * sv.f_frsize / HOST_CLUSTER;
+    if ( n > hostVolume->n_fatent - 2 )
+        n = hostVolume->n_fatent - 2;
+    hostVolume->free_clust = n;
+    *nclst = n;
+    *fatfs = hostVolume;
+    return FR_OK;
+}
@@ -0,0 +1,299 @@
+// CE-140F emulator - host build: mbed 2 subset on virtual time (see mbed.h)
+////////////////////////////////////////////////////////
+#include "mbed.h"
+
+// one emulator per thread (see mbed.h): its pins, events and time
+thread_local uint64_t     hostTime = 0;
+thread_local uint8_t      hostLevel[HOST_PINS];
+thread_local InterruptIn *hostIrq[HOST_PINS];
+thread_local HostEvent   *hostEvents = NULL;
+thread_local uint32_t     hostIrqOrder = 0;
+thread_local int          hostHandler = 0;    // a handler is running
+thread_local bool         hostMasked = false; // __disable_irq
+
+thread_local void     (*hostPinHook) ( int pin, int level ) = NULL;
+thread_local uint64_t (*hostStimulusNext) ( void ) = NULL;
+thread_local void     (*hostStimulusApply) ( uint64_t now ) = NULL;
+thread_local void     (*hostIdle) ( void ) = NULL;
+FILE                   *hostConsole = NULL;
+
+uint64_t hostNow ( void ) {
+    return hostTime;
+}
+
+uint32_t us_ticker_read ( void ) {
+    return (uint32_t)hostTime;
+}
+
+int hostPinRead ( int pin ) {
+    return ( pin >= 0 && pin < HOST_PINS ) ? hostLevel[pin] : 0;
+}
+
+void hostPinWrite ( int pin, int level ) {
+    if ( pin < 0 || pin >= HOST_PINS || hostLevel[pin] == level )
+        return;
+    hostLevel[pin] = level;
+    if ( hostPinHook )
+        hostPinHook ( pin, level );
+}
+
+// an edge is pending if a handler is attached when it happens
+void hostPinDrive ( int pin, int level ) {
+    if ( pin < 0 || pin >= HOST_PINS || hostLevel[pin] == level )
+        return;
+    hostLevel[pin] = level;
+    InterruptIn *irq = hostIrq[pin];
+    if ( irq == NULL )
+        return;
+    if ( level && irq->_rise && !irq->_pendRise )
+        irq->_pendRise = ++hostIrqOrder;
+    if ( !level && irq->_fall && !irq->_pendFall )
+        irq->_pendFall = ++hostIrqOrder;
+}
+
+InterruptIn::InterruptIn ( PinName pin )
+    : _pin(pin), _rise(NULL), _fall(NULL), _pendRise(0), _pendFall(0) {
+    if ( pin >= 0 && pin < HOST_PINS )
+        hostIrq[pin] = this;
+}
+
+HostEvent::HostEvent ( void ) : _fptr(NULL), _due(0), _period(0), _armed(false) {
+    _next = hostEvents;
+    hostEvents = this;
+}
+
+void Timer::start ( void ) {
+    if ( !_running ) {
+        _start = hostTime;
+        _running = true;
+    }
+}
+
+void Timer::stop ( void ) {
+    if ( _running ) {
+        _elapsed += hostTime - _start;
+        _running = false;
+    }
+}
+
+void Timer::reset ( void ) {
+    _start = hostTime;
+    _elapsed = 0;
+}
+
+int Timer::read_us ( void ) {
+    return (int)( _elapsed + ( _running ? hostTime - _start : 0 ) );
+}
+
+HostEvent *hostNextEvent ( void ) {
+    HostEvent *next = NULL;
+    for ( HostEvent *e = hostEvents; e != NULL; e = e->_next )
+        if ( e->_armed && ( next == NULL || e->_due < next->_due ) )
+            next = e;
+    return next;
+}
+
+uint64_t hostNextDue ( void ) {
+    HostEvent *e = hostNextEvent();
+    return e ? e->_due : HOST_NEVER;
+}
+
+uint64_t hostNextStimulus ( void ) {
+    return hostStimulusNext ? hostStimulusNext() : HOST_NEVER;
+}
+
+bool hostPending ( void ) {
+    for ( int i=0; i<HOST_PINS; i++ )
+        if ( hostIrq[i] && ( hostIrq[i]->_pendRise || hostIrq[i]->_pendFall ) )
+            return true;
+    return hostNextDue() <= hostTime;
+}
+
+// run the pending handlers, one at a time: the pin edges first, in order
+// (lower IRQ numbers than the timer), then the callbacks due
+void hostDispatch ( void ) {
+    if ( hostHandler || hostMasked )
+        return;
+    for (;;) {
+        InterruptIn *irq = NULL;
+        uint32_t order = 0;
+        bool rise = false;
+        for ( int i=0; i<HOST_PINS; i++ ) {
+            InterruptIn *p = hostIrq[i];
+            if ( p == NULL )
+                continue;
+            if ( p->_pendRise && ( irq == NULL || p->_pendRise < order ) ) {
+                irq = p; order = p->_pendRise; rise = true;
+            }
+            if ( p->_pendFall && ( irq == NULL || p->_pendFall < order ) ) {
+                irq = p; order = p->_pendFall; rise = false;
+            }
+        }
+        void (*fptr)(void) = NULL;
+        if ( irq != NULL ) {
+            if ( rise ) {
+                irq->_pendRise = 0;
+                fptr = irq->_rise;
+            } else {
+                irq->_pendFall = 0;
+                fptr = irq->_fall;
+            }
+        } else {
+            HostEvent *e = hostNextEvent();
+            if ( e == NULL || e->_due > hostTime )
+                return;
+            fptr = e->_fptr;
+            if ( e->_period )
+                e->_due += e->_period;
+            else
+                e->_armed = false;
+        }
+        if ( fptr ) {
+            hostHandler++;
+            fptr ();
+            hostHandler--;
+        }
+    }
+}
+
+// move time on to 'until', with the outside events on the way
+// (and the handlers they trigger, unless within a handler already)
+void hostAdvance ( uint64_t until ) {
+    for (;;) {
+        bool irqs = !hostHandler && !hostMasked;
+        uint64_t ts = hostNextStimulus();
+        uint64_t tt = irqs ? hostNextDue() : HOST_NEVER;
+        uint64_t t = ( ts < tt ) ? ts : tt;
+        if ( t > until )
+            break;
+        if ( t > hostTime )
+            hostTime = t;
+        if ( ts <= hostTime && hostStimulusApply )
+            hostStimulusApply ( hostTime );
+        hostDispatch ();
+    }
+    if ( until > hostTime )
+        hostTime = until;
+    hostDispatch ();
+}
+
+void hostFinish ( void ) {
+    if ( hostIdle )
+        hostIdle ();
+    exit ( 0 );
+}
+
+void wait ( float s ) {
+    hostAdvance ( hostTime + (uint64_t)( s * 1000000.0f ) );
+}
+
+void wait_ms ( int ms ) {
+    hostAdvance ( hostTime + (uint64_t)ms * 1000 );
+}
+
+void wait_us ( int us ) {
+    hostAdvance ( hostTime + us );
+}
+
+// until the next event
+void sleep ( void ) {
+    hostDispatch ();
+    uint64_t ts = hostNextStimulus();
+    uint64_t tt = hostNextDue();
+    uint64_t t = ( ts < tt ) ? ts : tt;
+    if ( t == HOST_NEVER )
+        hostFinish ();
+    hostAdvance ( t );
+}
+
+// interrupts held off (see idleSleep): wakes up with an edge or a callback
+// pending, to be run by __enable_irq
+void deepsleep ( void ) {
+    while ( !hostPending() ) {
+        uint64_t ts = hostNextStimulus();
+        uint64_t tt = hostNextDue();
+        if ( ts == HOST_NEVER && tt == HOST_NEVER )
+            hostFinish ();
+        if ( tt <= ts ) {
+            if ( tt > hostTime )
+                hostTime = tt;
+            break;
+        }
+        if ( ts > hostTime )
+            hostTime = ts;
+        hostStimulusApply ( hostTime );
+    }
+}
+
+// internal flash: a double word is programmed once (or to zero) after
+// an erase, as on the STM32L4; about 22 ms a page erase, 90 us a double word
+thread_local uint8_t hostFlash[HOST_FLASH_SIZE];
+thread_local bool    hostFlashReady = false;
+uint32_t hostImageEnd = HOST_FLASH_START + 0x20000; // 128 KB of firmware
+
+const uint8_t *hostFlashPtr ( uint32_t addr ) {
+    return hostFlash + ( addr - HOST_FLASH_START );
+}
+
+bool hostFlashRange ( uint32_t addr, uint32_t size, uint32_t align ) {
+    return ( addr >= HOST_FLASH_START && addr - HOST_FLASH_START + size <= HOST_FLASH_SIZE
+      && addr % align == 0 && size % align == 0 );
+}
+
+// the CPU waits for the flash: time goes on, the handlers don't run
+void hostFlashStall ( uint64_t us ) {
+    bool masked = hostMasked;
+    hostMasked = true;
+    hostAdvance ( hostTime + us );
+    hostMasked = masked;
+    hostDispatch ();
+}
+
+int FlashIAP::init ( void ) {
+    if ( !hostFlashReady )
+        memset ( hostFlash, 0xFF, sizeof(hostFlash) );
+    hostFlashReady = true;
+    return 0;
+}
+
+int FlashIAP::read ( void *buf, uint32_t addr, uint32_t size ) {
+    if ( !hostFlashRange ( addr, size, 1 ) )
+        return -1;
+    memcpy ( buf, hostFlashPtr(addr), size );
+    return 0;
+}
+
+int FlashIAP::program ( const void *buf, uint32_t addr, uint32_t size ) {
+    if ( !hostFlashRange ( addr, size, 8 ) )
+        return -1;
+    uint8_t *d = hostFlash + ( addr - HOST_FLASH_START );
+    const uint8_t *s = (const uint8_t *)buf;
+    for ( uint32_t i=0; i<size; i+=8 ) {
+        uint64_t old, data;
+        memcpy ( &old, d + i, 8 );
+        memcpy ( &data, s + i, 8 );
+        if ( old != ~0ull && data != 0 )
+            return -1; // not erased
+        data &= old;
+        memcpy ( d + i, &data, 8 );
+    }
+    hostFlashStall ( size / 8 * 90 );
+    return 0;
+}
+
+int FlashIAP::erase ( uint32_t addr, uint32_t size ) {
+    if ( !hostFlashRange ( addr, size, HOST_FLASH_PAGE ) )
+        return -1;
+    memset ( hostFlash + ( addr - HOST_FLASH_START ), 0xFF, size );
+    hostFlashStall ( size / HOST_FLASH_PAGE * 22000 );
+    return 0;
+}
+
+void __disable_irq ( void ) {
+    hostMasked = true;
+}
+
+void __enable_irq ( void ) {
+    hostMasked = false;
+    hostDispatch ();
+}
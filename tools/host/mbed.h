@@ -0,0 +1,193 @@
+// CE-140F emulator - host build: the mbed 2 API subset used by the firmware
+//
+// Lets the firmware sources (main.cpp, commands.cpp, ...) run as a plain
+// program, driven by a tool in this folder (replay.cpp), on virtual time:
+// - pins are a table of levels; the tool drives the Sharp side inputs
+//   (hostPinDrive) and hears about the firmware outputs (hostPinHook)
+// - interrupts: the InterruptIn edges and the Timeout/Ticker callbacks run
+//   one at a time, never nested, as on the board (same priority); a handler
+//   waiting in a loop sees the lines change, while the others wait their turn
+// - time only moves with the waits (wait_us and the like) and the sleeps,
+//   which skip to the next event: the code itself takes no time
+// The firmware main() is renamed, the tool calls it (firmwareMain).
+// All of that state is per thread, as the firmware's (INSTANCE, instance.h):
+// a tool may run several emulators, one per thread (soak.cpp).
+// Implemented in host_mbed.cpp.
+////////////////////////////////////////////////////////
+#ifndef MBED_H
+#define MBED_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifndef HOST_BUILD
+#define HOST_BUILD 1
+#endif
+// pinout: NUCLEO-L432KC
+#if !defined TARGET_NUCLEO_L432KC
+#define TARGET_NUCLEO_L432KC 1
+#endif
+
+typedef enum {
+    PA_0 = 0x00, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7,
+    PA_8, PA_9, PA_10, PA_11, PA_12, PA_13, PA_14, PA_15,
+    PB_0 = 0x10, PB_1, PB_2, PB_3, PB_4, PB_5, PB_6, PB_7,
+    PB_8, PB_9, PB_10, PB_11, PB_12, PB_13, PB_14, PB_15,
+    PC_0 = 0x20, PC_1, PC_2, PC_3, PC_4, PC_5, PC_6, PC_7,
+    PC_8, PC_9, PC_10, PC_11, PC_12, PC_13, PC_14, PC_15,
+    LED1  = PB_3,
+    USBTX = PA_2,
+    USBRX = PA_15,
+    NC    = -1
+} PinName;
+#define HOST_PINS 0x30
+
+typedef enum { PullNone, PullUp, PullDown, OpenDrain } PinMode;
+
+// host side
+#define HOST_NEVER 0xFFFFFFFFFFFFFFFFull
+uint64_t hostNow ( void );                        // us
+uint32_t us_ticker_read ( void );                 // the mbed HAL's, from hostNow
+int      hostPinRead ( int pin );
+void     hostPinWrite ( int pin, int level );     // from the firmware
+void     hostPinDrive ( int pin, int level );     // from the outside (edges)
+extern thread_local void     (*hostPinHook) ( int pin, int level ); // firmware output changed
+extern thread_local uint64_t (*hostStimulusNext) ( void );     // next outside event, or HOST_NEVER
+extern thread_local void     (*hostStimulusApply) ( uint64_t now ); // all those due by now
+extern thread_local void     (*hostIdle) ( void );             // nothing left to wait for
+extern FILE     *hostConsole;                     // serial console output (NULL: none)
+int      firmwareMain ( void );
+
+class DigitalIn {
+public:
+    DigitalIn ( PinName pin ) : _pin(pin) {}
+    DigitalIn ( PinName pin, PinMode mode ) : _pin(pin) {}
+    int  read ( void ) { return hostPinRead ( _pin ); }
+    void mode ( PinMode mode ) {}
+    operator int() { return read(); }
+private:
+    PinName _pin;
+};
+
+class DigitalOut {
+public:
+    DigitalOut ( PinName pin ) : _pin(pin) { write ( 0 ); }
+    DigitalOut ( PinName pin, int value ) : _pin(pin) { write ( value ); }
+    void write ( int value ) { hostPinWrite ( _pin, value != 0 ); }
+    int  read ( void ) { return hostPinRead ( _pin ); }
+    DigitalOut &operator= ( int value ) { write ( value ); return *this; }
+    DigitalOut &operator= ( DigitalOut &rhs ) { write ( rhs.read() ); return *this; }
+    operator int() { return read(); }
+private:
+    PinName _pin;
+};
+
+class InterruptIn {
+public:
+    InterruptIn ( PinName pin );
+    void rise ( void (*fptr)(void) ) { _rise = fptr; _pendRise = 0; }
+    void fall ( void (*fptr)(void) ) { _fall = fptr; _pendFall = 0; }
+    void mode ( PinMode mode ) {}
+    int  read ( void ) { return hostPinRead ( _pin ); }
+    operator int() { return read(); }
+    void enable_irq ( void ) {}
+    void disable_irq ( void ) {}
+    // host side
+    PinName    _pin;
+    void     (*_rise)(void);
+    void     (*_fall)(void);
+    uint32_t   _pendRise;    // pending edge (order), 0: none
+    uint32_t   _pendFall;
+};
+
+class Timer {
+public:
+    Timer ( void ) : _running(false), _start(0), _elapsed(0) {}
+    void  start ( void );
+    void  stop ( void );
+    void  reset ( void );
+    int   read_us ( void );
+    int   read_ms ( void ) { return read_us() / 1000; }
+    float read ( void ) { return read_us() / 1000000.0f; }
+private:
+    bool     _running;
+    uint64_t _start;
+    uint64_t _elapsed;
+};
+
+// Timeout and Ticker callbacks, on the host event list
+class HostEvent {
+public:
+    HostEvent ( void );
+    void detach ( void ) { _armed = false; }
+    void   (*_fptr)(void);
+    uint64_t _due;
+    uint64_t _period; // 0: once
+    bool     _armed;
+    HostEvent *_next;
+};
+
+class Timeout : public HostEvent {
+public:
+    void attach ( void (*fptr)(void), float t ) { attach_us ( fptr, (uint64_t)(t * 1000000.0f) ); }
+    void attach_us ( void (*fptr)(void), uint64_t t ) {
+        _fptr = fptr; _due = hostNow() + t; _period = 0; _armed = true;
+    }
+};
+
+class Ticker : public HostEvent {
+public:
+    void attach ( void (*fptr)(void), float t ) { attach_us ( fptr, (uint64_t)(t * 1000000.0f) ); }
+    void attach_us ( void (*fptr)(void), uint64_t t ) {
+        _fptr = fptr; _period = t ? t : 1; _due = hostNow() + _period; _armed = true;
+    }
+};
+
+class RawSerial {
+public:
+    RawSerial ( PinName tx, PinName rx ) {}
+    void baud ( int baudrate ) {}
+    int  putc ( int c ) { if ( hostConsole ) fputc ( c, hostConsole ); return c; }
+    int  puts ( const char *s ) { while ( *s ) putc ( *s++ ); return 0; }
+    int  getc ( void ) { return -1; } // no console input
+    bool readable ( void ) { return false; }
+    bool writeable ( void ) { return true; }
+    void attach ( void (*fptr)(void) ) {}
+};
+
+// internal flash (FlashIAP): the L432KC's 256 KB, in host memory; the CPU
+// stalls while it's erased or programmed, interrupt handlers included
+#define DEVICE_FLASH 1
+#define HOST_FLASH_START 0x08000000u
+#define HOST_FLASH_SIZE  0x40000u
+#define HOST_FLASH_PAGE  2048
+const uint8_t *hostFlashPtr ( uint32_t addr ); // memory mapped
+extern uint32_t hostImageEnd;                  // the firmware's end in it
+
+class FlashIAP {
+public:
+    int init ( void );
+    int deinit ( void ) { return 0; }
+    int read ( void *buf, uint32_t addr, uint32_t size );
+    int program ( const void *buf, uint32_t addr, uint32_t size );
+    int erase ( uint32_t addr, uint32_t size );
+    uint32_t get_page_size ( void ) const { return 8; } // double words
+    uint32_t get_sector_size ( uint32_t addr ) const { return HOST_FLASH_PAGE; }
+    uint32_t get_flash_start ( void ) const { return HOST_FLASH_START; }
+    uint32_t get_flash_size ( void ) const { return HOST_FLASH_SIZE; }
+};
+
+void wait ( float s );
+void wait_ms ( int ms );
+void wait_us ( int us );
+void sleep ( void );
+void deepsleep ( void );
+void __disable_irq ( void );
+void __enable_irq ( void );
+
+// the firmware entry point, called by the host tool
+#define main firmwareMain
+
+#endif
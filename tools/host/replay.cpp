@@ -0,0 +1,516 @@
+// CE-140F emulator - wire capture replay
+//
+// Feeds a capture taken on the board ("cap on" / "cap off" on the console,
+// WIRE.CAP on the card, see capture.h) back through the firmware's own
+// handshake and command code (bitReady, inNibbleReady, inDataReady,
+// ProcessCommand, SendOutputData), built for the host with the mbed and
+// FatFs stand-ins of this folder, and matches each ACK edge of the replayed
+// firmware with the recorded one.
+//
+// The Sharp side is played back open loop, as recorded: BUSY and X_OUT
+// change at the first record showing the new level (the edge handlers record
+// on entry, the wait loops when they see it, within their 100 us polling;
+// a handler held up by another one records late, but its edge has been seen
+// by then), the data lines as early as the record before allows (the Sharp
+// sets them up before raising BUSY). The card is a directory: give it a copy
+// of the card the capture was taken with (SAVE and the like write into it);
+// or a FAT image of it (-i), where the card work goes through sectors, each
+// one taking the time given by -l (us, reads and writes) as on a slow card,
+// with a table of the sectors read and written per command at the end.
+//
+// For each ACK edge (us):
+//   lag     recorded - replayed: on the host only the firmware delays take
+//           time, so this is what the board spends on top of them (code,
+//           interrupt latency, card accesses)
+//   resp    recorded, from the Sharp edge it answers
+//   react   recorded, to the next Sharp edge
+//   margin  from the replayed edge to the next recorded Sharp edge: how much
+//           later the ACK could come (longer delays, slower code) and still
+//           fit the recorded Sharp - negative: it doesn't
+//
+// Waveforms (Value Change Dump, vcd.h), both on the capture time base, to
+// be laid side by side in GTKWave or PulseView:
+//   -r file  the capture itself: line levels as sampled by the records,
+//            ACK as written, command markers from the CMD / CMD_DONE ones
+//   -w file  the replayed run: every line change at its host time (data
+//            lines as the wired OR of both sides), command markers from the
+//            firmware around ProcessCommand (captureTap) - zero width here
+//            unless -l, code takes no host time: the recorded one has the
+//            real length
+//
+// Build (from the repository root):
+//   g++ -O2 -DHOST_BUILD -Itools/host -o replay tools/host/replay.cpp tools/host/vcd.cpp
+//       tools/host/host_mbed.cpp tools/host/host_disk.cpp tools/host/host_ff.cpp tools/host/host_fat.cpp
+//       main.cpp commands.cpp storage.cpp xfer.cpp console.cpp capture.cpp
+//       events.cpp profile.cpp memstat.cpp flashcache.cpp
+// or, on a FAT image only (-i), with the FatFs of the firmware itself
+// (copied into tools/host/chan by tools/host/chan/fetch.sh):
+//   g++ -O2 -DHOST_BUILD -DHOST_CHAN_FATFS -Itools/host -o replay tools/host/replay.cpp tools/host/vcd.cpp
+//       tools/host/host_mbed.cpp tools/host/host_disk.cpp tools/host/chan/ff.cpp
+//       main.cpp commands.cpp storage.cpp xfer.cpp console.cpp capture.cpp
+//       events.cpp profile.cpp memstat.cpp flashcache.cpp
+// Usage:  replay [-v] [-q] [-d card_dir | -i card.img [-l read_us[,write_us]]]
+//                [-r rec.vcd] [-w rep.vcd] WIRE.CAP
+//         (-v: firmware console output, on stderr; -q: summary only)
+////////////////////////////////////////////////////////
+#include "mbed.h"
+#undef main
+#include <unistd.h>
+#include <vector>
+#include "../../capture.h"
+#include "vcd.h"
+#include "host_fat.h"
+
+extern thread_local const char *hostCardDir;
+
+// pins of the host board (board.h)
+#define PIN_X_OUT Board::X_OUT
+#define PIN_BUSY  Board::BUSY
+#define PIN_D_OUT Board::D_OUT
+#define PIN_D_IN  Board::D_IN
+#define PIN_SEL_1 Board::SEL_1
+#define PIN_SEL_2 Board::SEL_2
+#define PIN_ACK   Board::ACK
+#define OUT_SEL_1 Board::O_SEL_1
+#define OUT_SEL_2 Board::O_SEL_2
+#define OUT_D_OUT Board::O_D_OUT
+#define OUT_D_IN  Board::O_D_IN
+
+#define REPLAY_START 1000000 // us of host time: firmware init done
+#define REPLAY_TAIL  1000000 // us after the last record
+
+struct Line { uint8_t bit; int pin; bool edges; };
+// bus lines in the waveforms: Sharp side input, emulator side output
+struct Wire { int signal; int pin; int out; };
+const Wire busWires[] = {
+    { VCD_X_OUT, PIN_X_OUT, -1 },        { VCD_BUSY,  PIN_BUSY,  -1 },
+    { VCD_D_OUT, PIN_D_OUT, OUT_D_OUT }, { VCD_D_IN,  PIN_D_IN,  OUT_D_IN },
+    { VCD_SEL_1, PIN_SEL_1, OUT_SEL_1 }, { VCD_SEL_2, PIN_SEL_2, OUT_SEL_2 },
+    { VCD_ACK,   -1,        PIN_ACK },
+};
+const uint8_t busBits[] = {
+    CAP_L_XOUT, CAP_L_BUSY, CAP_L_DOUT, CAP_L_DIN, CAP_L_SEL1, CAP_L_SEL2, CAP_L_ACK,
+};
+
+const Line sharpLines[] = {
+    { CAP_L_XOUT, PIN_X_OUT, true },  { CAP_L_BUSY, PIN_BUSY, true },
+    { CAP_L_DOUT, PIN_D_OUT, false }, { CAP_L_DIN,  PIN_D_IN, false },
+    { CAP_L_SEL1, PIN_SEL_1, false }, { CAP_L_SEL2, PIN_SEL_2, false },
+};
+
+struct Stim { uint64_t t; int pin; int level; };  // host time, pin -1: end
+struct Edge { uint64_t t; int level; int nibble; const char *phase; };
+struct Cmd  { uint64_t t; int code; int out; };
+
+const char         *capName;
+std::vector<caprec_t> recs;
+std::vector<uint64_t> recTime;    // unwrapped
+uint64_t            t0;           // first record
+std::vector<Stim>   stims;
+size_t              stimPos = 0;
+std::vector<uint64_t> sharpEdges; // BUSY / X_OUT changes, capture time
+std::vector<Edge>   recorded;
+std::vector<Edge>   replayed;
+std::vector<Cmd>    cmds;
+int                 sharpLevel[HOST_PINS];
+int                 outLevel[HOST_PINS];
+long                overrunAt = -1;
+bool                quiet = false;
+vcd_t               repVcd;
+// card sectors per command code (-i)
+struct CmdDisk { uint32_t count, rd, wr; uint64_t us; };
+CmdDisk             cmdDisk[256];
+int                 diskCmd = -1; // running
+uint32_t            diskRd0, diskWr0;
+uint64_t            diskT0;
+
+// capture time <-> host time
+uint64_t hostTime ( uint64_t t ) { return t - t0 + REPLAY_START; }
+uint64_t capTime ( uint64_t h ) { return h - REPLAY_START + t0; }
+
+void stim ( uint64_t t, int pin, int level ) {
+    if ( sharpLevel[pin] == level )
+        return;
+    sharpLevel[pin] = level;
+    Stim s = { hostTime(t), pin, level };
+    stims.push_back ( s );
+    if ( pin == PIN_BUSY || pin == PIN_X_OUT )
+        sharpEdges.push_back ( t );
+}
+
+const char *phaseOf ( uint8_t kind, uint16_t aux ) {
+    switch ( kind ) {
+        case CAP_XOUT:     return "device";
+        case CAP_BIT_BUSY:
+        case CAP_BIT:      return "bit";
+        case CAP_DEVICE:   return "start";
+        case CAP_NIB_IN:
+        case CAP_NIB_ACK:  return "in";
+        case CAP_CMD:
+        case CAP_CMD_DONE:
+        case CAP_NIB_OUT:  return "out";
+        case CAP_SEEN:
+            if ( aux == CAP_W_DOUT )      return "device";
+            if ( aux == CAP_W_XOUT_BUSY ) return "start";
+            return "out";
+        default:           return "-";
+    }
+}
+
+bool load ( const char *name ) {
+    FILE *f = fopen ( name, "rb" );
+    caphdr_t hdr;
+    caprec_t r;
+    if ( f == NULL ) {
+        perror ( name );
+        return false;
+    }
+    if ( fread ( &hdr, sizeof(hdr), 1, f ) != 1 || memcmp ( hdr.magic, CAPTURE_MAGIC, 8 ) != 0
+      || hdr.version != CAPTURE_VERSION || hdr.recSize != sizeof(caprec_t) ) {
+        fprintf ( stderr, "%s: not a capture (version %d)\n", name, CAPTURE_VERSION );
+        fclose ( f );
+        return false;
+    }
+    uint64_t t = 0;
+    while ( fread ( &r, sizeof(r), 1, f ) == 1 ) {
+        t = recs.empty() ? r.time : t + (uint32_t)( r.time - recs.back().time );
+        recs.push_back ( r );
+        recTime.push_back ( t );
+    }
+    fclose ( f );
+    if ( recs.empty() ) {
+        fprintf ( stderr, "%s: no records\n", name );
+        return false;
+    }
+    return true;
+}
+
+// Sharp side line changes and recorded ACK edges
+void prepare ( void ) {
+    uint8_t  lastKind = CAP_START;
+    uint16_t lastAux = 0;
+    int      ack = ( recs[0].lines & CAP_L_ACK ) ? 1 : 0;
+    int      nibble = -1;
+    t0 = recTime[0];
+    for ( size_t l=0; l<sizeof(sharpLines)/sizeof(sharpLines[0]); l++ ) {
+        sharpLevel[sharpLines[l].pin] = ( recs[0].lines & sharpLines[l].bit ) ? 1 : 0;
+        hostPinDrive ( sharpLines[l].pin, sharpLevel[sharpLines[l].pin] );
+    }
+    size_t i;
+    for ( i=1; i<recs.size(); i++ ) {
+        const caprec_t &r = recs[i];
+        uint64_t t = recTime[i];
+        uint64_t prev = recTime[i-1];
+        uint64_t early = ( prev + 1 < t ) ? prev + 1 : t;
+        if ( r.kind == CAP_OVERRUN ) {
+            overrunAt = i; // records missing: the rest can't be replayed
+            break;
+        }
+        for ( size_t l=0; l<sizeof(sharpLines)/sizeof(sharpLines[0]); l++ )
+            if ( !sharpLines[l].edges )
+                stim ( early, sharpLines[l].pin, ( r.lines & sharpLines[l].bit ) ? 1 : 0 );
+        for ( size_t l=0; l<sizeof(sharpLines)/sizeof(sharpLines[0]); l++ )
+            if ( sharpLines[l].edges )
+                stim ( t, sharpLines[l].pin, ( r.lines & sharpLines[l].bit ) ? 1 : 0 );
+
+        switch ( r.kind ) {
+        case CAP_ACK:
+            if ( r.aux != ack ) {
+                const char *phase = phaseOf ( lastKind, lastAux );
+                Edge e = { t, r.aux, ( r.aux && strcmp ( phase, "out" ) == 0 ) ? nibble : -1, phase };
+                recorded.push_back ( e );
+                ack = r.aux;
+            }
+            break;
+        case CAP_CMD: {
+            Cmd c = { t, r.aux, -1 };
+            cmds.push_back ( c );
+            break;
+        }
+        case CAP_CMD_DONE:
+            if ( !cmds.empty() )
+                cmds.back().out = r.aux;
+            break;
+        case CAP_NIB_OUT:
+            nibble = r.aux;
+            break;
+        }
+        if ( r.kind != CAP_ACK ) {
+            lastKind = r.kind;
+            lastAux = r.aux;
+        }
+    }
+    Stim end = { hostTime ( recTime[i-1] ) + REPLAY_TAIL, -1, 0 };
+    stims.push_back ( end );
+}
+
+// the capture as a waveform: what the board saw, at the record times
+bool writeRecordedVcd ( const char *name ) {
+    vcd_t v;
+    if ( !vcdOpen ( &v, name, t0, "recorded" ) ) {
+        perror ( name );
+        return false;
+    }
+    vcdSet ( &v, VCD_PROCESS, 0, t0 );
+    size_t end = ( overrunAt >= 0 ) ? (size_t)overrunAt : recs.size();
+    for ( size_t i=0; i<end; i++ ) {
+        const caprec_t &r = recs[i];
+        for ( size_t w=0; w<sizeof(busWires)/sizeof(busWires[0]); w++ )
+            if ( busWires[w].signal != VCD_ACK || r.kind != CAP_ACK )
+                vcdSet ( &v, busWires[w].signal, ( r.lines & busBits[w] ) ? 1 : 0, recTime[i] );
+        switch ( r.kind ) {
+        case CAP_ACK:
+            vcdSet ( &v, VCD_ACK, r.aux, recTime[i] );
+            break;
+        case CAP_CMD:
+            vcdSet ( &v, VCD_COMMAND, r.aux, recTime[i] );
+            vcdSet ( &v, VCD_PROCESS, 1, recTime[i] );
+            break;
+        case CAP_CMD_DONE:
+            vcdSet ( &v, VCD_PROCESS, 0, recTime[i] );
+            break;
+        }
+    }
+    vcdClose ( &v, recTime[end-1] );
+    return true;
+}
+
+struct Phase {
+    const char *name;
+    int      edges;
+    int64_t  lagMax, respMax, reactMin, marginMin;
+    int      late;
+};
+
+void report ( void ) {
+    Phase phases[] = {
+        { "device", 0, 0, 0, 0, 0, 0 }, { "bit", 0, 0, 0, 0, 0, 0 }, { "start", 0, 0, 0, 0, 0, 0 },
+        { "in", 0, 0, 0, 0, 0, 0 }, { "out", 0, 0, 0, 0, 0, 0 }, { "-", 0, 0, 0, 0, 0, 0 }
+    };
+    const int nPhases = sizeof(phases) / sizeof(phases[0]);
+    size_t n = recorded.size() > replayed.size() ? recorded.size() : replayed.size();
+    size_t c = 0, s = 0;
+    int dataDiff = 0, levelDiff = 0;
+
+    printf ( "%s: %u records, %.3f s%s\n", capName, (unsigned)recs.size(),
+        ( recTime.back() - t0 ) / 1000000.0,
+        overrunAt >= 0 ? ", records lost: replayed up to there" : "" );
+    if ( !quiet )
+        printf ( "%7s %10s %-6s %3s %3s %7s %7s %7s %7s\n",
+            "edge", "time", "phase", "ack", "nib", "lag", "resp", "react", "margin" );
+    for ( size_t k=0; k<n; k++ ) {
+        const Edge *rec = ( k < recorded.size() ) ? &recorded[k] : NULL;
+        const Edge *rep = ( k < replayed.size() ) ? &replayed[k] : NULL;
+        uint64_t t = rec ? rec->t : rep->t;
+        for ( ; c < cmds.size() && cmds[c].t <= t; c++ )
+            if ( !quiet )
+                printf ( "-- command 0x%02X at %llu, %d bytes out\n", cmds[c].code,
+                    (unsigned long long)( cmds[c].t - t0 ), cmds[c].out );
+        if ( rec == NULL || rep == NULL ) {
+            if ( !quiet )
+                printf ( "%7u %10llu %-6s %3d     %s\n", (unsigned)k + 1,
+                    (unsigned long long)( t - t0 ), rec ? rec->phase : "?",
+                    rec ? rec->level : rep->level, rec ? "not replayed" : "not recorded" );
+            continue;
+        }
+        // the Sharp edges around the recorded one
+        while ( s < sharpEdges.size() && sharpEdges[s] <= rec->t )
+            s++;
+        bool hasPrev = ( s > 0 );
+        bool hasNext = ( s < sharpEdges.size() );
+        int64_t lag = (int64_t)( rec->t - rep->t );
+        int64_t resp = hasPrev ? (int64_t)( rec->t - sharpEdges[s-1] ) : 0;
+        int64_t react = hasNext ? (int64_t)( sharpEdges[s] - rec->t ) : 0;
+        int64_t margin = hasNext ? (int64_t)sharpEdges[s] - (int64_t)rep->t : 0;
+        const char *note = "";
+        if ( rec->level != rep->level ) {
+            note = " LEVEL";
+            levelDiff++;
+        } else if ( rec->nibble >= 0 && rec->nibble != rep->nibble ) {
+            note = " DATA";
+            dataDiff++;
+        } else if ( hasNext && margin < 0 )
+            note = " LATE";
+        Phase *p = &phases[nPhases - 1];
+        for ( int i=0; i<nPhases; i++ )
+            if ( strcmp ( phases[i].name, rec->phase ) == 0 )
+                p = &phases[i];
+        if ( p->edges == 0 || lag > p->lagMax ) p->lagMax = lag;
+        if ( p->edges == 0 || resp > p->respMax ) p->respMax = resp;
+        if ( hasNext && ( p->edges == 0 || react < p->reactMin ) ) p->reactMin = react;
+        if ( hasNext && ( p->edges == 0 || margin < p->marginMin ) ) p->marginMin = margin;
+        if ( hasNext && margin < 0 ) p->late++;
+        p->edges++;
+        if ( quiet )
+            continue;
+        char nib[4] = "";
+        if ( rec->nibble >= 0 )
+            snprintf ( nib, sizeof(nib), "%X", rec->nibble & 0x0F ); // a nibble: one digit
+        printf ( "%7u %10llu %-6s %3d %3s %7lld %7lld ", (unsigned)k + 1,
+            (unsigned long long)( rec->t - t0 ), rec->phase, rec->level, nib,
+            (long long)lag, (long long)resp );
+        if ( hasNext )
+            printf ( "%7lld %7lld%s\n", (long long)react, (long long)margin, note );
+        else
+            printf ( "%7s %7s%s\n", "-", "-", note );
+    }
+    printf ( "\n%-6s %7s %7s %7s %7s %7s %5s\n",
+        "phase", "edges", "lag>", "resp>", "react<", "margin<", "late" );
+    for ( int i=0; i<nPhases; i++ ) {
+        if ( phases[i].edges == 0 )
+            continue;
+        printf ( "%-6s %7d %7lld %7lld %7lld %7lld %5d\n", phases[i].name, phases[i].edges,
+            (long long)phases[i].lagMax, (long long)phases[i].respMax,
+            (long long)phases[i].reactMin, (long long)phases[i].marginMin, phases[i].late );
+    }
+    printf ( "ACK edges: %u recorded, %u replayed; %d level and %d output nibble mismatches\n",
+        (unsigned)recorded.size(), (unsigned)replayed.size(), levelDiff, dataDiff );
+}
+
+// the replayed lines, after a change on either side
+void replayWires ( void ) {
+    uint64_t now = hostNow();
+    if ( repVcd.f == NULL || now < REPLAY_START )
+        return;
+    for ( size_t w=0; w<sizeof(busWires)/sizeof(busWires[0]); w++ ) {
+        const Wire &b = busWires[w];
+        int level = ( b.pin >= 0 ? hostPinRead ( b.pin ) : 0 ) | ( b.out >= 0 ? outLevel[b.out] : 0 );
+        vcdSet ( &repVcd, b.signal, level, capTime ( now ) );
+    }
+}
+
+void replayTap ( uint8_t kind, uint16_t aux ) {
+    uint64_t now = hostNow();
+    if ( now < REPLAY_START )
+        return;
+    if ( kind == CAP_CMD ) {
+        vcdSet ( &repVcd, VCD_COMMAND, aux, capTime ( now ) );
+        vcdSet ( &repVcd, VCD_PROCESS, 1, capTime ( now ) );
+        diskCmd = aux & 0xFF;
+        diskRd0 = hostSectorsRead;
+        diskWr0 = hostSectorsWritten;
+        diskT0 = now;
+    } else if ( kind == CAP_CMD_DONE ) {
+        vcdSet ( &repVcd, VCD_PROCESS, 0, capTime ( now ) );
+        if ( diskCmd >= 0 ) {
+            CmdDisk *d = &cmdDisk[diskCmd];
+            d->count++;
+            d->rd += hostSectorsRead - diskRd0;
+            d->wr += hostSectorsWritten - diskWr0;
+            d->us += now - diskT0;
+            diskCmd = -1;
+        }
+    }
+}
+
+void reportDisk ( void ) {
+    uint32_t rd = 0, wr = 0;
+    printf ( "\ncard image, %u / %u us per sector read / written\n", hostReadUs, hostWriteUs );
+    printf ( "%-6s %7s %9s %9s %10s\n", "cmd", "count", "read", "written", "us" );
+    for ( int c=0; c<256; c++ ) {
+        const CmdDisk *d = &cmdDisk[c];
+        if ( d->count == 0 )
+            continue;
+        printf ( "0x%02X   %7u %9u %9u %10llu\n", c, d->count, d->rd, d->wr, (unsigned long long)d->us );
+        rd += d->rd;
+        wr += d->wr;
+    }
+    printf ( "other  %7s %9u %9u\n", "", hostSectorsRead - rd, hostSectorsWritten - wr );
+}
+
+void finish ( void ) {
+    vcdClose ( &repVcd, capTime ( hostNow() ) );
+    report ();
+    if ( hostImage )
+        reportDisk ();
+}
+
+// host hooks (see mbed.h)
+uint64_t replayNext ( void ) {
+    return ( stimPos < stims.size() ) ? stims[stimPos].t : HOST_NEVER;
+}
+
+void replayApply ( uint64_t now ) {
+    while ( stimPos < stims.size() && stims[stimPos].t <= now ) {
+        const Stim &s = stims[stimPos++];
+        if ( s.pin < 0 ) {
+            finish ();
+            exit ( 0 );
+        }
+        hostPinDrive ( s.pin, s.level );
+    }
+    replayWires ();
+}
+
+void replayPin ( int pin, int level ) {
+    outLevel[pin] = level;
+    replayWires ();
+    if ( pin != PIN_ACK || hostNow() < REPLAY_START )
+        return;
+    int nibble = outLevel[OUT_SEL_1] | ( outLevel[OUT_SEL_2] << 1 )
+               | ( outLevel[OUT_D_OUT] << 2 ) | ( outLevel[OUT_D_IN] << 3 );
+    Edge e = { capTime ( hostNow() ), level, nibble, "" };
+    replayed.push_back ( e );
+}
+
+void replayIdle ( void ) {
+    finish ();
+}
+
+int main ( int argc, char **argv ) {
+    const char *usage = "usage: replay [-v] [-q] [-d card_dir | -i card.img [-l read_us[,write_us]]]\n"
+                        "              [-r rec.vcd] [-w rep.vcd] WIRE.CAP\n";
+    const char *recVcdName = NULL;
+    const char *repVcdName = NULL;
+    int opt;
+    while ( ( opt = getopt ( argc, argv, "vqd:i:l:r:w:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'v': hostConsole = stderr; break;
+            case 'q': quiet = true; break;
+            case 'd': hostCardDir = optarg; break;
+            case 'i':
+                if ( !hostImageOpen ( optarg ) )
+                    return 1;
+                break;
+            case 'l':
+                if ( sscanf ( optarg, "%u,%u", &hostReadUs, &hostWriteUs ) == 1 )
+                    hostWriteUs = hostReadUs;
+                break;
+            case 'r': recVcdName = optarg; break;
+            case 'w': repVcdName = optarg; break;
+            default:
+                fprintf ( stderr, "%s", usage );
+                return 2;
+        }
+    }
+    if ( optind != argc - 1 ) {
+        fprintf ( stderr, "%s", usage );
+        return 2;
+    }
+#ifdef HOST_CHAN_FATFS
+    if ( !hostImage ) {
+        fprintf ( stderr, "built with the ChaN FatFs: a card image (-i) only\n" );
+        return 2;
+    }
+#endif
+    capName = argv[optind];
+    if ( !load ( capName ) )
+        return 1;
+    prepare ();
+    if ( recVcdName && !writeRecordedVcd ( recVcdName ) )
+        return 1;
+    if ( repVcdName || hostImage ) {
+        if ( repVcdName && !vcdOpen ( &repVcd, repVcdName, t0, "replayed" ) ) {
+            perror ( repVcdName );
+            return 1;
+        }
+        vcdSet ( &repVcd, VCD_PROCESS, 0, t0 );
+        captureTap = replayTap;
+        captureOn = true; // the tap alone, no capture file
+    }
+    hostStimulusNext = replayNext;
+    hostStimulusApply = replayApply;
+    hostPinHook = replayPin;
+    hostIdle = replayIdle;
+    return firmwareMain ();
+}
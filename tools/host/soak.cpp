@@ -0,0 +1,792 @@
+// CE-140F emulator - soak test: many emulators, random Sharp sessions
+//
+// Runs a number of emulator instances side by side, each the whole host
+// build of the firmware (handshake, ProcessCommand, storage, events), its
+// own card and its own Sharp: a closed-loop model of the PC side driving
+// the bus lines as a Sharp does (device code 0x41, nibbles in, reply
+// nibbles out) and reacting to the ACK edges of the firmware.
+//
+// Each Sharp plays random transactions, as BASIC programs would:
+//   OPEN FOR OUTPUT / APPEND, PRINT# lines, CLOSE
+//   OPEN FOR INPUT, INPUT# lines, EOF / LOC, CLOSE
+//   SAVE (binary, 0x10 0x11 and the data blocks)
+//   LOAD (binary, 0x0E 0x17 0x0F)
+//   KILL, FILES and the FILES_LIST browsing
+// on a small pool of files (SOAKn.DAT / SOAKn.BAS), and checks every reply
+// against a shadow of the card kept on its side: any reply differing from
+// the expected bytes is a divergence, reported with the transaction it
+// happened in (once per transaction, the next ones go on).
+//
+// The instances are threads, each one with its card, seed and virtual time:
+// the state of the firmware and of the host layer is per thread (INSTANCE,
+// instance.h), the command context (ctx, commands.h) included, as is the
+// Sharp model's here. Each reports its counts at the end, the main thread
+// adds them up: transactions and commands per second (wall clock), bytes on
+// the wires, virtual time simulated, divergences. A crash ends the whole run.
+// With the ChaN FatFs (its volumes are globals of ff.cpp) the instances run
+// one after the other.
+//
+// The cards are directories under base_dir (soak0, soak1...), made empty
+// first, or copies of a FAT image (-i), where the card work goes through
+// sectors taking -l us each (reads, writes) as on a slow card; the files
+// already on the image are left alone (only counted, for FILES).
+//
+// Build (from the repository root):
+//   g++ -O2 -pthread -DHOST_BUILD -Itools/host -o soak tools/host/soak.cpp
+//       tools/host/host_mbed.cpp tools/host/host_disk.cpp tools/host/host_ff.cpp tools/host/host_fat.cpp
+//       main.cpp commands.cpp storage.cpp xfer.cpp console.cpp capture.cpp
+//       events.cpp profile.cpp memstat.cpp flashcache.cpp
+// or, on a FAT image only (-i), with the FatFs of the firmware itself
+// (copied into tools/host/chan by tools/host/chan/fetch.sh):
+//   g++ -O2 -pthread -DHOST_BUILD -DHOST_CHAN_FATFS -Itools/host -o soak tools/host/soak.cpp
+//       tools/host/host_mbed.cpp tools/host/host_disk.cpp tools/host/chan/ff.cpp
+//       main.cpp commands.cpp storage.cpp xfer.cpp console.cpp capture.cpp
+//       events.cpp profile.cpp memstat.cpp flashcache.cpp
+// Usage:  soak [-v] [-n instances] [-c transactions] [-s seed]
+//              [-d base_dir] [-i card.img [-l read_us[,write_us]]]
+//         (defaults: 4 instances, 200 transactions each, base_dir /tmp;
+//          -v: each divergence, not only the first one of an instance)
+////////////////////////////////////////////////////////
+#include "mbed.h"
+#undef main
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../board.h"
+#include "host_fat.h"
+
+extern thread_local const char *hostCardDir;
+
+// pins of the host board (board.h)
+#define PIN_X_OUT Board::X_OUT
+#define PIN_BUSY  Board::BUSY
+#define PIN_D_OUT Board::D_OUT
+#define PIN_D_IN  Board::D_IN
+#define PIN_SEL_1 Board::SEL_1
+#define PIN_SEL_2 Board::SEL_2
+#define PIN_ACK   Board::ACK
+#define OUT_SEL_1 Board::O_SEL_1
+#define OUT_SEL_2 Board::O_SEL_2
+#define OUT_D_OUT Board::O_D_OUT
+#define OUT_D_IN  Board::O_D_IN
+
+#define SOAK_START   1000000 // us of host time: firmware init done
+#define SHARP_REACT  40      // us from an ACK edge to the Sharp's answer
+#define SHARP_DEVICE 30000   // us from the ACK to the device code bits
+#define REPLY_END    200000  // us with no ACK edge: reply over
+#define POOL_FILES   6
+#define MAX_LINES    8
+#define MAX_SAVE     1500    // bytes
+#define MAX_BLOCK    200     // bytes per SAVE data block
+
+// Sharp side: one frame of a transaction, and the reply expected
+enum { CHECK_EXACT, CHECK_ANY, CHECK_LIST, CHECK_BASE };
+struct Frame {
+    std::vector<uint8_t> data;   // the checksum is added when sent
+    bool                 device; // device code sequence first
+    int                  check;
+    std::vector<uint8_t> expect;
+};
+
+// what an instance reports to the main thread
+struct Stats {
+    uint32_t transactions;
+    uint32_t commands;
+    uint32_t bytesIn;            // Sharp to emulator, checksums included
+    uint32_t bytesOut;
+    uint32_t divergences;
+    uint64_t virtualUs;
+    uint64_t wallUs;
+    uint32_t sectorsRead;
+    uint32_t sectorsWritten;
+    char     first[160];         // first divergence
+};
+
+// settings, for all the instances
+uint32_t            txCount = 200;
+bool                verbose = false;
+
+// the rest is per instance, i.e. per thread
+// the shadow card: pool files only
+struct Shadow { std::string data; bool text; };
+thread_local std::map<std::string, Shadow> card;
+thread_local int    baseFiles = 0;   // others on the card (FILES)
+thread_local std::map<std::string, bool> listed;  // FILES_LIST so far
+
+// Sharp model
+enum { A_DEVICE, A_BIT, A_BUSY_LOW, A_AFTER_BITS, A_NIBBLE, A_REPLY_READ, A_REPLY_BUSY_LOW };
+enum { SH_IDLE, SH_DEVICE, SH_BITS, SH_START, SH_NIBBLES, SH_REPLY };
+thread_local std::multimap<uint64_t, int> actions; // host time -> action
+thread_local int    sharpPhase = SH_IDLE;
+thread_local int    sharpBits = 0;
+thread_local size_t sharpNibbles = 0;
+thread_local std::vector<uint8_t> sharpWire; // frame being sent, with checksum
+thread_local std::vector<int> replyNibbles;
+thread_local int    outLevel[HOST_PINS];
+thread_local uint64_t lastAck = 0;
+
+thread_local std::deque<Frame> frames;
+thread_local Frame  current;
+thread_local const char *opName = "";
+thread_local bool   txDiverged = false;
+thread_local uint32_t txLeft;
+thread_local int    instance = 0;
+thread_local unsigned short randState[3]; // erand48
+thread_local Stats  stats;
+thread_local struct timespec wallStart;
+
+// the instance is over (firmwareMain never returns)
+struct Finished {};
+
+uint64_t wallNow ( void ) {
+    struct timespec t;
+    clock_gettime ( CLOCK_MONOTONIC, &t );
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+int pick ( int n ) {
+    return (int)( erand48 ( randState ) * n );
+}
+
+/////////////////////////////////////////////////////////////
+// transactions: frames and expected replies, from the shadow card
+
+// blank-padded "NAME    .EXT" field, at +3 in the frame
+void putName ( std::vector<uint8_t> &d, const std::string &name ) {
+    char field[13];
+    size_t dot = name.find ( '.' );
+    snprintf ( field, sizeof(field), "%-8s.%-3s",
+        name.substr ( 0, dot ).c_str(), name.substr ( dot + 1 ).c_str() );
+    d.push_back ( 'X' );
+    d.push_back ( ':' );
+    d.insert ( d.end(), field, field + 12 );
+}
+
+void frame ( const std::vector<uint8_t> &data, bool device, int check,
+             const std::vector<uint8_t> &expect ) {
+    Frame f;
+    f.data = data;
+    f.device = device;
+    f.check = check;
+    f.expect = expect;
+    frames.push_back ( f );
+}
+
+// reply: 0x00, then the bytes, with their checksum
+std::vector<uint8_t> answer ( const std::vector<uint8_t> &bytes ) {
+    std::vector<uint8_t> r ( 1, 0x00 );
+    uint8_t sum = 0;
+    for ( size_t i=0; i<bytes.size(); i++ ) {
+        r.push_back ( bytes[i] );
+        sum += bytes[i];
+    }
+    r.push_back ( sum );
+    return r;
+}
+
+std::vector<uint8_t> size3 ( uint32_t v ) {
+    std::vector<uint8_t> r;
+    r.push_back ( v & 0xff );
+    r.push_back ( ( v >> 8 ) & 0xff );
+    r.push_back ( ( v >> 16 ) & 0xff );
+    return r;
+}
+
+const std::vector<uint8_t> OK ( 1, 0x00 );
+const std::vector<uint8_t> FAIL ( 1, 0xFF );
+const std::vector<uint8_t> NONE;
+
+std::string poolName ( void ) {
+    char s[13];
+    int n = pick ( POOL_FILES );
+    snprintf ( s, sizeof(s), "SOAK%d.%s", n, ( n & 1 ) ? "BAS" : "DAT" );
+    return s;
+}
+
+std::string randomLine ( void ) {
+    const char *chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 ,.-";
+    std::string s;
+    int len = 1 + pick ( 60 );
+    for ( int i=0; i<len; i++ )
+        s += chars[pick ( strlen ( chars ) )];
+    return s;
+}
+
+bool present ( const std::string &name ) {
+    return card.find ( name ) != card.end();
+}
+
+// OPEN name FOR mode AS #fn
+std::vector<uint8_t> openFrame ( const std::string &name, int mode, int fn ) {
+    std::vector<uint8_t> d ( 1, 0x03 );
+    putName ( d, name );
+    d.push_back ( mode );
+    d.push_back ( fn );
+    return d;
+}
+
+std::vector<uint8_t> fileFrame ( uint8_t code, int fn ) {
+    std::vector<uint8_t> d ( 1, code );
+    d.push_back ( fn );
+    return d;
+}
+
+void txPrint ( bool append ) {
+    std::string name = poolName();
+    opName = append ? "APPEND" : "PRINT";
+    if ( append && !present ( name ) ) {
+        frame ( openFrame ( name, 3, 2 ), true, CHECK_EXACT, FAIL );
+        return;
+    }
+    frame ( openFrame ( name, append ? 3 : 2, 2 ), true, CHECK_EXACT, OK );
+    Shadow &s = card[name];
+    if ( !append ) {
+        s.data.clear();
+        s.text = true;
+    } // appended to binary data: still not for INPUT#
+    int lines = 1 + pick ( MAX_LINES );
+    for ( int i=0; i<lines; i++ ) {
+        std::string line = randomLine();
+        bool crlf = pick ( 2 ); // or added by the emulator
+        std::vector<uint8_t> d ( line.begin(), line.end() );
+        if ( crlf ) {
+            d.push_back ( 0x0D );
+            d.push_back ( 0x0A );
+        }
+        d.push_back ( 0x00 );
+        frame ( fileFrame ( 0x15, 2 ), true, CHECK_EXACT, OK );
+        frame ( d, false, CHECK_EXACT, OK );
+        s.data += line + "\r\n";
+    }
+    frame ( fileFrame ( 0x04, 2 ), true, CHECK_EXACT, OK );
+}
+
+void txInput ( void ) {
+    std::vector<std::string> texts;
+    for ( std::map<std::string, Shadow>::iterator i=card.begin(); i!=card.end(); i++ )
+        if ( i->second.text )
+            texts.push_back ( i->first );
+    opName = "INPUT";
+    if ( texts.empty() || pick ( 8 ) == 0 ) {
+        std::string name = poolName();
+        if ( !present ( name ) ) {
+            frame ( openFrame ( name, 1, 3 ), true, CHECK_EXACT, FAIL );
+            return;
+        }
+        if ( !card[name].text )
+            return; // INPUT# on binary data: not a text file
+        texts.push_back ( name );
+    }
+    std::string name = texts[pick ( texts.size() )];
+    const std::string &data = card[name].data;
+    frame ( openFrame ( name, 1, 3 ), true, CHECK_EXACT, OK );
+    // all the lines, or some and where it got
+    bool all = pick ( 2 );
+    size_t pos = 0;
+    while ( pos < data.size() && ( all || pick ( 3 ) ) ) {
+        size_t end = data.find ( '\n', pos ) + 1;
+        std::vector<uint8_t> line ( data.begin() + pos, data.begin() + end );
+        std::vector<uint8_t> r = answer ( line );
+        r.insert ( r.end() - 1, 0x00 ); // 0x00 after the line, before the checksum
+        r.push_back ( 0x00 );
+        frame ( fileFrame ( 0x13, 3 ), true, CHECK_EXACT, r );
+        pos = end;
+    }
+    std::vector<uint8_t> eof ( 1, pos >= data.size() ? 0xFF : 0x00 );
+    frame ( fileFrame ( 0x1A, 3 ), true, CHECK_EXACT, answer ( eof ) );
+    frame ( fileFrame ( 0x1C, 3 ), true, CHECK_EXACT, answer ( size3 ( pos ) ) );
+    frame ( fileFrame ( 0x04, 3 ), true, CHECK_EXACT, OK );
+}
+
+void txSave ( void ) {
+    std::string name = poolName();
+    uint32_t size = 1 + pick ( MAX_SAVE );
+    std::string data;
+    for ( uint32_t i=0; i<size; i++ )
+        data += (char)pick ( 256 );
+    opName = "SAVE";
+    std::vector<uint8_t> d ( 1, 0x10 );
+    putName ( d, name );
+    frame ( d, true, CHECK_EXACT, OK );
+    std::vector<uint8_t> s ( 1, 0x11 );
+    s.push_back ( 0x00 );
+    std::vector<uint8_t> n = size3 ( size );
+    s.insert ( s.end(), n.begin(), n.end() );
+    frame ( s, true, CHECK_EXACT, OK );
+    // data blocks, no device code
+    for ( uint32_t pos=0; pos<size; ) {
+        uint32_t len = 1 + pick ( MAX_BLOCK );
+        if ( len > size - pos )
+            len = size - pos;
+        frame ( std::vector<uint8_t> ( data.begin() + pos, data.begin() + pos + len ),
+            false, CHECK_EXACT, OK );
+        pos += len;
+    }
+    card[name].data = data;
+    card[name].text = false;
+}
+
+void txLoad ( void ) {
+    std::string name = poolName();
+    opName = "LOAD";
+    std::vector<uint8_t> d ( 1, 0x0E );
+    putName ( d, name );
+    if ( !present ( name ) || card[name].data.empty() ) {
+        frame ( d, true, CHECK_EXACT, FAIL ); // no reply: SendErrorOut
+        return;
+    }
+    const std::string &data = card[name].data;
+    std::vector<uint8_t> head ( 1, ' ' );
+    std::vector<uint8_t> n = size3 ( data.size() );
+    head.insert ( head.end(), n.begin(), n.end() );
+    frame ( d, true, CHECK_EXACT, answer ( head ) );
+    // first byte, then the rest in one go, a checksum every 256 bytes
+    frame ( std::vector<uint8_t> ( 1, 0x17 ), true, CHECK_EXACT,
+        answer ( std::vector<uint8_t> ( 1, (uint8_t)data[0] ) ) );
+    if ( data.size() < 2 )
+        return;
+    std::vector<uint8_t> r ( 1, 0x00 );
+    uint8_t sum = 0;
+    for ( size_t i=1; i<data.size(); i++ ) {
+        r.push_back ( data[i] );
+        sum += (uint8_t)data[i];
+        if ( i % 0x100 == 0 ) {
+            r.push_back ( sum );
+            sum = 0;
+        }
+    }
+    r.push_back ( sum );
+    r.push_back ( 0x00 );
+    frame ( std::vector<uint8_t> ( 1, 0x0F ), true, CHECK_EXACT, r );
+}
+
+void txKill ( void ) {
+    std::string name = poolName();
+    opName = "KILL";
+    std::vector<uint8_t> d ( 1, 0x0A );
+    putName ( d, name );
+    frame ( d, true, CHECK_EXACT, present ( name ) ? OK : FAIL );
+    card.erase ( name );
+}
+
+void txFiles ( void ) {
+    uint8_t n = baseFiles + card.size();
+    std::vector<uint8_t> r ( 1, 0x00 );
+    r.push_back ( n );
+    r.push_back ( n );
+    opName = "FILES";
+    listed.clear();
+    frame ( std::vector<uint8_t> ( 1, 0x05 ), true, CHECK_EXACT, r );
+    for ( int i=0; i<n; i++ )
+        frame ( std::vector<uint8_t> ( 1, 0x06 ), true, CHECK_LIST, NONE );
+    frame ( std::vector<uint8_t> ( 1, 0x06 ), true, CHECK_EXACT, FAIL ); // past the last one
+}
+
+// a clean start: no pool files, and how many others there are
+void txStart ( void ) {
+    for ( int i=0; i<POOL_FILES; i++ ) {
+        char s[13];
+        snprintf ( s, sizeof(s), "SOAK%d.%s", i, ( i & 1 ) ? "BAS" : "DAT" );
+        std::vector<uint8_t> d ( 1, 0x0A );
+        putName ( d, s );
+        frame ( d, true, CHECK_ANY, NONE );
+    }
+    frame ( std::vector<uint8_t> ( 1, 0x05 ), true, CHECK_BASE, NONE );
+    opName = "start";
+}
+
+void transaction ( void ) {
+    txDiverged = false;
+    switch ( pick ( 10 ) ) {
+        case 0: case 1: txPrint ( false ); break;
+        case 2:         txPrint ( true ); break;
+        case 3: case 4: txInput (); break;
+        case 5:         txSave (); break;
+        case 6: case 7: txLoad (); break;
+        case 8:         txKill (); break;
+        default:        txFiles (); break;
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// replies
+
+std::string hex ( const std::vector<uint8_t> &b ) {
+    std::string s;
+    char x[4];
+    for ( size_t i=0; i<b.size() && i<12; i++ ) {
+        snprintf ( x, sizeof(x), " %02X", b[i] );
+        s += x;
+    }
+    if ( b.size() > 12 )
+        s += " ...";
+    return s;
+}
+
+void diverge ( const char *what, const std::vector<uint8_t> &got ) {
+    char msg[sizeof(stats.first)];
+    snprintf ( msg, sizeof(msg), "tx %u %s, command 0x%02X: %s, got%s",
+        stats.transactions, opName, current.data[0], what, hex ( got ).c_str() );
+    if ( !txDiverged ) {
+        txDiverged = true;
+        if ( stats.divergences++ == 0 )
+            strcpy ( stats.first, msg );
+    }
+    if ( verbose )
+        fprintf ( stderr, "soak%d: %s\n", instance, msg );
+}
+
+// FILES_LIST: "X:NAME    .EXT " - a pool file on the card, once, or another
+void checkListEntry ( const std::vector<uint8_t> &r ) {
+    std::vector<uint8_t> body ( r.begin() + 1, r.end() - 1 );
+    if ( r.size() != 17 || r[0] != 0x00 || answer ( body ) != r ) {
+        diverge ( "not a file entry", r );
+        return;
+    }
+    std::string name ( body.begin() + 2, body.begin() + 10 );
+    name = name.substr ( 0, name.find ( ' ' ) ) + std::string ( body.begin() + 10, body.begin() + 14 );
+    if ( name.compare ( 0, 4, "SOAK" ) != 0 )
+        return;
+    if ( !present ( name ) || listed[name] )
+        diverge ( "unexpected file", r );
+    listed[name] = true;
+}
+
+void checkReply ( void ) {
+    std::vector<uint8_t> r;
+    for ( size_t i=0; i+1<replyNibbles.size(); i+=2 )
+        r.push_back ( replyNibbles[i] | ( replyNibbles[i+1] << 4 ) );
+    stats.bytesOut += r.size();
+    switch ( current.check ) {
+        case CHECK_EXACT:
+            if ( r != current.expect ) {
+                std::string e = "expected" + hex ( current.expect );
+                diverge ( e.c_str(), r );
+            }
+            break;
+        case CHECK_LIST:
+            checkListEntry ( r );
+            break;
+        case CHECK_BASE:
+            if ( r.size() == 3 && r[0] == 0x00 )
+                baseFiles = r[1];
+            else
+                diverge ( "no FILES count", r );
+            break;
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// Sharp model (host hooks, see mbed.h)
+
+void at ( uint64_t t, int a ) {
+    actions.insert ( std::make_pair ( t, a ) );
+}
+
+void setNibble ( int v ) {
+    hostPinDrive ( PIN_SEL_1, v & 1 );
+    hostPinDrive ( PIN_SEL_2, ( v >> 1 ) & 1 );
+    hostPinDrive ( PIN_D_OUT, ( v >> 2 ) & 1 );
+    hostPinDrive ( PIN_D_IN,  ( v >> 3 ) & 1 );
+}
+
+void finish ( void ) {
+    stats.virtualUs = hostNow() - SOAK_START;
+    stats.wallUs = wallNow() - ( (uint64_t)wallStart.tv_sec * 1000000 + wallStart.tv_nsec / 1000 );
+    stats.sectorsRead = hostSectorsRead;
+    stats.sectorsWritten = hostSectorsWritten;
+    throw Finished ();
+}
+
+// next frame of the transaction (or the next transaction), at 't'
+void nextFrame ( uint64_t t ) {
+    if ( frames.empty() ) {
+        if ( stats.transactions > 0 && --txLeft == 0 )
+            finish ();
+        stats.transactions++;
+        transaction ();
+        if ( frames.empty() ) { // nothing to do this time
+            nextFrame ( t );
+            return;
+        }
+    }
+    current = frames.front();
+    frames.pop_front();
+    sharpWire = current.data;
+    uint8_t sum = 0;
+    for ( size_t i=0; i<sharpWire.size(); i++ )
+        sum += sharpWire[i];
+    sharpWire.push_back ( sum );
+    stats.commands++;
+    stats.bytesIn += sharpWire.size();
+    sharpNibbles = 0;
+    sharpBits = 0;
+    replyNibbles.clear();
+    if ( current.device ) {
+        sharpPhase = SH_DEVICE;
+        at ( t, A_DEVICE );
+    } else {
+        sharpPhase = SH_NIBBLES; // the emulator expects it (skipDeviceCode)
+        at ( t, A_NIBBLE );
+    }
+}
+
+uint64_t soakNext ( void ) {
+    uint64_t t = actions.empty() ? HOST_NEVER : actions.begin()->first;
+    if ( sharpPhase == SH_REPLY && lastAck + REPLY_END < t )
+        t = lastAck + REPLY_END;
+    return t;
+}
+
+void soakApply ( uint64_t now ) {
+    if ( sharpPhase == SH_REPLY && now >= lastAck + REPLY_END ) {
+        sharpPhase = SH_IDLE;
+        checkReply ();
+        nextFrame ( now + 1000 + pick ( 20000 ) ); // the Sharp's own pace
+    }
+    while ( !actions.empty() && actions.begin()->first <= now ) {
+        int a = actions.begin()->second;
+        actions.erase ( actions.begin() );
+        switch ( a ) {
+            case A_DEVICE:
+                setNibble ( 0 );
+                hostPinDrive ( PIN_D_OUT, 1 );
+                hostPinDrive ( PIN_X_OUT, 1 );
+                break;
+            case A_BIT:
+                hostPinDrive ( PIN_D_OUT, ( 0x41 >> sharpBits ) & 1 );
+                hostPinDrive ( PIN_BUSY, 1 );
+                break;
+            case A_BUSY_LOW:
+            case A_REPLY_BUSY_LOW:
+                hostPinDrive ( PIN_BUSY, 0 );
+                break;
+            case A_AFTER_BITS:
+                hostPinDrive ( PIN_BUSY, 0 );
+                hostPinDrive ( PIN_X_OUT, 0 );
+                hostPinDrive ( PIN_D_OUT, 0 );
+                sharpPhase = SH_START;
+                break;
+            case A_NIBBLE: {
+                uint8_t b = sharpWire[sharpNibbles / 2];
+                setNibble ( ( sharpNibbles & 1 ) ? b >> 4 : b & 0x0F );
+                hostPinDrive ( PIN_BUSY, 1 );
+                sharpNibbles++;
+                break;
+            }
+            case A_REPLY_READ:
+                replyNibbles.push_back ( outLevel[OUT_SEL_1] | ( outLevel[OUT_SEL_2] << 1 )
+                    | ( outLevel[OUT_D_OUT] << 2 ) | ( outLevel[OUT_D_IN] << 3 ) );
+                hostPinDrive ( PIN_BUSY, 1 );
+                break;
+        }
+    }
+}
+
+void soakPin ( int pin, int level ) {
+    outLevel[pin] = level;
+    if ( pin != PIN_ACK )
+        return;
+    uint64_t t = hostNow();
+    lastAck = t;
+    switch ( sharpPhase ) {
+        case SH_DEVICE:
+            if ( level ) {
+                sharpPhase = SH_BITS;
+                at ( t + SHARP_DEVICE, A_BIT );
+            }
+            break;
+        case SH_BITS:
+            if ( level )
+                at ( t + SHARP_REACT, A_BIT );
+            else
+                at ( t + SHARP_REACT, ( ++sharpBits == 8 ) ? A_AFTER_BITS : A_BUSY_LOW );
+            break;
+        case SH_START:
+            if ( !level ) {
+                sharpPhase = SH_NIBBLES;
+                at ( t + SHARP_REACT, A_NIBBLE );
+            }
+            break;
+        case SH_NIBBLES:
+            if ( level )
+                at ( t + SHARP_REACT, A_BUSY_LOW );
+            else if ( sharpNibbles < sharpWire.size() * 2 )
+                at ( t + SHARP_REACT, A_NIBBLE );
+            else
+                sharpPhase = SH_REPLY;
+            break;
+        case SH_REPLY:
+            at ( t + SHARP_REACT, level ? A_REPLY_READ : A_REPLY_BUSY_LOW );
+            break;
+    }
+}
+
+// nothing scheduled any more: the firmware is stuck
+void soakIdle ( void ) {
+    diverge ( "no more activity", std::vector<uint8_t>() );
+    finish ();
+}
+
+/////////////////////////////////////////////////////////////
+// instances
+
+bool copyFile ( const char *from, const char *to ) {
+    char buf[65536];
+    ssize_t n;
+    int in = open ( from, O_RDONLY );
+    int out = open ( to, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    bool ok = ( in >= 0 && out >= 0 );
+    while ( ok && ( n = read ( in, buf, sizeof(buf) ) ) > 0 )
+        ok = ( write ( out, buf, n ) == n );
+    if ( in >= 0 )
+        close ( in );
+    if ( out >= 0 )
+        close ( out );
+    return ok;
+}
+
+// an empty directory for a card
+bool emptyDir ( const char *path ) {
+    mkdir ( path, 0755 );
+    DIR *d = opendir ( path );
+    struct dirent *e;
+    if ( d == NULL )
+        return false;
+    while ( ( e = readdir ( d ) ) != NULL ) {
+        std::string f = std::string ( path ) + "/" + e->d_name;
+        if ( e->d_name[0] != '.' )
+            unlink ( f.c_str() );
+    }
+    closedir ( d );
+    return true;
+}
+
+// thread: one emulator on its card, its counts in 'report' at the end
+void runInstance ( int i, std::string cardPath, bool image, long seed, Stats *report ) {
+    instance = i;
+    if ( image ? !hostImageOpen ( cardPath.c_str() ) : !emptyDir ( cardPath.c_str() ) ) {
+        perror ( cardPath.c_str() );
+        report->divergences = 1;
+        snprintf ( report->first, sizeof(report->first), "no card (%s)", cardPath.c_str() );
+        return;
+    }
+    if ( !image )
+        hostCardDir = cardPath.c_str();
+    randState[0] = 0x330E; // as srand48 ( seed )
+    randState[1] = seed & 0xFFFF;
+    randState[2] = ( seed >> 16 ) & 0xFFFF;
+    clock_gettime ( CLOCK_MONOTONIC, &wallStart );
+    txLeft = txCount;
+    txStart ();
+    stats.transactions = 0;
+    nextFrame ( SOAK_START );
+    hostStimulusNext = soakNext;
+    hostStimulusApply = soakApply;
+    hostPinHook = soakPin;
+    hostIdle = soakIdle;
+    try {
+        firmwareMain ();
+    } catch ( Finished & ) {
+    }
+    *report = stats;
+}
+
+int main ( int argc, char **argv ) {
+    const char *usage = "usage: soak [-v] [-n instances] [-c transactions] [-s seed]\n"
+                        "            [-d base_dir] [-i card.img [-l read_us[,write_us]]]\n";
+    const char *baseDir = "/tmp";
+    const char *imageName = NULL;
+    int  instances = 4;
+    long seed = time ( NULL );
+    int  opt;
+    while ( ( opt = getopt ( argc, argv, "vn:c:s:d:i:l:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'v': verbose = true; break;
+            case 'n': instances = atoi ( optarg ); break;
+            case 'c': txCount = atoi ( optarg ); break;
+            case 's': seed = atol ( optarg ); break;
+            case 'd': baseDir = optarg; break;
+            case 'i': imageName = optarg; break;
+            case 'l':
+                if ( sscanf ( optarg, "%u,%u", &hostReadUs, &hostWriteUs ) == 1 )
+                    hostWriteUs = hostReadUs;
+                break;
+            default:
+                fprintf ( stderr, "%s", usage );
+                return 2;
+        }
+    }
+    if ( optind != argc || instances < 1 || txCount < 1 ) {
+        fprintf ( stderr, "%s", usage );
+        return 2;
+    }
+#ifdef HOST_CHAN_FATFS
+    if ( imageName == NULL ) {
+        fprintf ( stderr, "built with the ChaN FatFs: a card image (-i) only\n" );
+        return 2;
+    }
+#endif
+    printf ( "%d instances, %u transactions each, seed %ld\n", instances, txCount, seed );
+    fflush ( stdout );
+
+    std::vector<Stats>       reports ( instances );
+    std::vector<std::thread> threads;
+    uint64_t t0 = wallNow();
+    for ( int i=0; i<instances; i++ ) {
+        char path[256];
+        if ( imageName ) {
+            snprintf ( path, sizeof(path), "%s/soak%d.img", baseDir, i );
+            if ( !copyFile ( imageName, path ) ) {
+                perror ( path );
+                return 1;
+            }
+        } else
+            snprintf ( path, sizeof(path), "%s/soak%d", baseDir, i );
+        threads.push_back ( std::thread ( runInstance, i, std::string ( path ), imageName != NULL,
+            seed + i, &reports[i] ) );
+#ifdef HOST_CHAN_FATFS
+        threads.back().join ();
+#endif
+    }
+    for ( int i=0; i<instances; i++ )
+        if ( threads[i].joinable() )
+            threads[i].join ();
+
+    Stats total;
+    memset ( &total, 0, sizeof(total) );
+    printf ( "inst       tx   cmds  bytes in bytes out  virtual s  wall s  cmds/s  div\n" );
+    for ( int i=0; i<instances; i++ ) {
+        const Stats &s = reports[i];
+        printf ( "%4d %8u %6u %9u %9u %10.1f %7.2f %7.0f %4u\n", i, s.transactions, s.commands,
+            s.bytesIn, s.bytesOut, s.virtualUs / 1e6, s.wallUs / 1e6,
+            s.wallUs ? s.commands * 1e6 / s.wallUs : 0.0, s.divergences );
+        if ( s.divergences )
+            printf ( "     %s\n", s.first );
+        total.transactions += s.transactions;
+        total.commands += s.commands;
+        total.bytesIn += s.bytesIn;
+        total.bytesOut += s.bytesOut;
+        total.divergences += s.divergences;
+        total.virtualUs += s.virtualUs;
+        total.sectorsRead += s.sectorsRead;
+        total.sectorsWritten += s.sectorsWritten;
+    }
+    double wall = ( wallNow() - t0 ) / 1e6;
+    printf ( "all  %8u %6u %9u %9u %10.1f %7.2f %7.0f %4u\n", total.transactions, total.commands,
+        total.bytesIn, total.bytesOut, total.virtualUs / 1e6, wall,
+        total.commands / wall, total.divergences );
+    printf ( "%.0f transactions/s, %.0f bytes/s on the wires, %.1f s simulated per s\n",
+        total.transactions / wall, ( total.bytesIn + total.bytesOut ) / wall,
+        total.virtualUs / 1e6 / wall );
+    if ( imageName )
+        printf ( "card sectors: %u read, %u written\n", total.sectorsRead, total.sectorsWritten );
+    return total.divergences ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+// CE-140F emulator - SUMS listing test, with the file handles running out
+//
+// Drives the firmware's SUMS backend (xferFsSumOpen/Next/Close, storage.cpp)
+// on a card directory of files with known content, while the Sharp side
+// holds file handles from the same pool (FILE_POOL_SIZE):
+//   1. all the handles taken: the listing must fail (-1) rather than give
+//      a hash it couldn't compute
+//   2. one handle left: all the hashes right, and that handle still free
+//      for the Sharp between any two entries (the manifest isn't held
+//      while the files are read)
+//   3. no handle taken: the hashes again, now from the manifest
+// Each step prints what it found; the exit status is the number of
+// failed ones.
+//
+// Build (from the repository root):
+//   g++ -O2 -DHOST_BUILD -Itools/host -o sums tools/host/sums.cpp
+//       tools/host/host_mbed.cpp tools/host/host_disk.cpp tools/host/host_ff.cpp tools/host/host_fat.cpp
+//       main.cpp commands.cpp storage.cpp xfer.cpp console.cpp capture.cpp
+//       events.cpp profile.cpp memstat.cpp flashcache.cpp
+// Usage:  sums [-n files] [card_dir]
+//         (defaults: 20 files, /tmp/sums_card - made empty first)
+////////////////////////////////////////////////////////
+#include "mbed.h"
+#undef main
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <map>
+#include <string>
+#include "../../storage.h"
+#include "../../xfer.h"
+
+extern thread_local const char *hostCardDir;
+
+std::map<std::string, uint32_t> expected; // name -> hash
+int failures = 0;
+
+#define SUM_FILES_MAX 100000 // SUM0.DAT to SUM99999.DAT: 8.3 names
+
+void check ( const char *step, bool ok, const char *what ) {
+    printf ( "%-28s %s%s%s\n", step, ok ? "ok" : "FAILED", ok ? "" : ": ", ok ? "" : what );
+    if ( !ok )
+        failures++;
+}
+
+// files of known content, the card made empty first
+bool makeCard ( const char *dir, int files ) {
+    mkdir ( dir, 0755 );
+    DIR *d = opendir ( dir );
+    struct dirent *e;
+    if ( d == NULL )
+        return false;
+    while ( ( e = readdir ( d ) ) != NULL ) {
+        std::string f = std::string ( dir ) + "/" + e->d_name;
+        if ( e->d_name[0] != '.' )
+            unlink ( f.c_str() );
+    }
+    closedir ( d );
+    for ( int i=0; i<files; i++ ) {
+        char name[20]; // as for any int; 8.3 below SUM_FILES_MAX
+        std::string data;
+        snprintf ( name, sizeof(name), "SUM%d.DAT", i );
+        for ( int j=0; j<37*i+5; j++ )
+            data += (char)( j * 7 + i );
+        FILE *f = fopen ( ( std::string ( dir ) + "/" + name ).c_str(), "wb" );
+        if ( f == NULL )
+            return false;
+        fwrite ( data.data(), 1, data.size(), f );
+        fclose ( f );
+        expected[name] = xferHash ( XFER_HASH_INIT, (const uint8_t *)data.data(), data.size() );
+    }
+    return true;
+}
+
+// a whole listing: -1 as soon as an entry fails, otherwise the entries
+// whose hash is wrong (or unknown); probe: a handle is taken and given
+// back between the entries, as a Sharp LOAD would
+int listing ( int *count, bool probe, bool *probeOk ) {
+    char name[13];
+    uint32_t size, hash;
+    int r, wrong = 0;
+    *count = 0;
+    if ( !xferFsSumOpen () )
+        return -1;
+    while ( ( r = xferFsSumNext ( name, &size, &hash ) ) > 0 ) {
+        (*count)++;
+        if ( expected.count ( name ) == 0 || expected[name] != hash )
+            wrong++;
+        if ( probe ) {
+            FIL *f = storageOpen ( "/sd/SUM0.DAT", 'r' );
+            if ( f == NULL )
+                *probeOk = false;
+            else
+                storageClose ( f );
+        }
+    }
+    xferFsSumClose ();
+    return ( r < 0 ) ? -1 : wrong;
+}
+
+int main ( int argc, char **argv ) {
+    const char *dir = "/tmp/sums_card";
+    int files = 20;
+    int opt;
+    while ( ( opt = getopt ( argc, argv, "n:" ) ) != -1 ) {
+        switch ( opt ) {
+            case 'n': files = atoi ( optarg ); break;
+            default:
+                fprintf ( stderr, "usage: sums [-n files] [card_dir]\n" );
+                return 2;
+        }
+    }
+    if ( optind < argc )
+        dir = argv[optind];
+    if ( files < 1 || files > SUM_FILES_MAX ) {
+        fprintf ( stderr, "sums: 1 to %d files\n", SUM_FILES_MAX );
+        return 2;
+    }
+    if ( !makeCard ( dir, files ) ) {
+        perror ( dir );
+        return 2;
+    }
+    hostCardDir = dir;
+    if ( !storageCardCheck () ) {
+        fprintf ( stderr, "%s: no card\n", dir );
+        return 2;
+    }
+
+    FIL *held[FILE_POOL_SIZE];
+    int n, count;
+    bool probeOk = true;
+    char what[80];
+    for ( n=0; n<FILE_POOL_SIZE && ( held[n] = storageOpen ( "/sd/SUM1.DAT", 'r' ) ) != NULL; n++ )
+        ;
+    int r = listing ( &count, false, &probeOk );
+    snprintf ( what, sizeof(what), "%d handles held, listing gave %d after %d entries", n, r, count );
+    check ( "no handle free: an error", n == FILE_POOL_SIZE && r == -1, what );
+
+    storageClose ( held[--n] );
+    r = listing ( &count, true, &probeOk );
+    snprintf ( what, sizeof(what), "%d of %d entries, %d hashes wrong", count, files, r );
+    check ( "one handle free: hashes", r == 0 && count == files, what );
+    check ( "one handle free: not held", probeOk, "no handle left for the Sharp" );
+
+    while ( n > 0 )
+        storageClose ( held[--n] );
+    r = listing ( &count, false, &probeOk );
+    snprintf ( what, sizeof(what), "%d of %d entries, %d hashes wrong", count, files, r );
+    check ( "from the manifest: hashes", r == 0 && count == files, what );
+    return failures;
+}
@@ -0,0 +1,79 @@
+// CE-140F emulator - Value Change Dump output of the bus (see vcd.h)
+////////////////////////////////////////////////////////
+#include <string.h>
+#include <time.h>
+#include "vcd.h"
+
+static const struct {
+    const char *name;
+    int         bits;
+} vcdSignals[VCD_SIGNALS] = {
+    { "X_OUT", 1 }, { "BUSY", 1 }, { "D_OUT", 1 }, { "D_IN", 1 },
+    { "SEL_1", 1 }, { "SEL_2", 1 }, { "ACK", 1 },
+    { "process", 1 }, { "command", 8 },
+};
+
+// identifier codes: printable ASCII from '!'
+static char vcdId ( int signal ) {
+    return '!' + signal;
+}
+
+static void vcdValue ( vcd_t *v, int signal, int value ) {
+    if ( vcdSignals[signal].bits == 1 ) {
+        fprintf ( v->f, "%c%c\n", value < 0 ? 'x' : '0' + ( value != 0 ), vcdId(signal) );
+        return;
+    }
+    fputc ( 'b', v->f );
+    for ( int b = vcdSignals[signal].bits - 1; b >= 0; b-- )
+        fputc ( value < 0 ? 'x' : '0' + ( ( value >> b ) & 1 ), v->f );
+    fprintf ( v->f, " %c\n", vcdId(signal) );
+}
+
+bool vcdOpen ( vcd_t *v, const char *name, uint64_t t0, const char *comment ) {
+    time_t now = time ( NULL );
+    memset ( v, 0, sizeof(*v) );
+    v->f = fopen ( name, "w" );
+    if ( v->f == NULL )
+        return false;
+    v->t0 = t0;
+    fprintf ( v->f, "$date\n  %s$end\n", ctime ( &now ) );
+    fprintf ( v->f, "$version\n  CE-140F emulator\n$end\n" );
+    if ( comment )
+        fprintf ( v->f, "$comment\n  %s\n$end\n", comment );
+    fprintf ( v->f, "$timescale 1us $end\n$scope module ce140f $end\n" );
+    for ( int i=0; i<VCD_SIGNALS; i++ ) {
+        fprintf ( v->f, "$var wire %d %c %s $end\n", vcdSignals[i].bits, vcdId(i), vcdSignals[i].name );
+        v->value[i] = -1;
+    }
+    fprintf ( v->f, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n" );
+    for ( int i=0; i<VCD_SIGNALS; i++ )
+        vcdValue ( v, i, -1 );
+    fprintf ( v->f, "$end\n" );
+    return true;
+}
+
+// times must not go back
+void vcdSet ( vcd_t *v, int signal, int value, uint64_t t ) {
+    if ( v->f == NULL || signal < 0 || signal >= VCD_SIGNALS || v->value[signal] == value )
+        return;
+    t = ( t > v->t0 ) ? t - v->t0 : 0;
+    if ( t < v->last )
+        t = v->last;
+    if ( !v->started || t != v->last ) {
+        fprintf ( v->f, "#%llu\n", (unsigned long long)t );
+        v->last = t;
+        v->started = true;
+    }
+    v->value[signal] = value;
+    vcdValue ( v, signal, value );
+}
+
+void vcdClose ( vcd_t *v, uint64_t t ) {
+    if ( v->f == NULL )
+        return;
+    t = ( t > v->t0 ) ? t - v->t0 : 0;
+    if ( t > v->last )
+        fprintf ( v->f, "#%llu\n", (unsigned long long)t );
+    fclose ( v->f );
+    v->f = NULL;
+}
@@ -0,0 +1,38 @@
+// CE-140F emulator - Value Change Dump output of the bus (see vcd.cpp)
+//
+// For GTKWave, sigrok / PulseView and the like: the seven handshake
+// lines, plus the command markers taken from ProcessCommand:
+// "command" (8 bits) holds the code of the last command received,
+// "process" is high while ProcessCommand runs (output prepared).
+// Timescale 1 us.
+////////////////////////////////////////////////////////
+#ifndef VCD_H
+#define VCD_H
+#include <stdio.h>
+#include <stdint.h>
+
+// signals
+#define VCD_X_OUT   0
+#define VCD_BUSY    1
+#define VCD_D_OUT   2
+#define VCD_D_IN    3
+#define VCD_SEL_1   4
+#define VCD_SEL_2   5
+#define VCD_ACK     6
+#define VCD_PROCESS 7
+#define VCD_COMMAND 8 // 8 bits
+#define VCD_SIGNALS 9
+
+typedef struct {
+    FILE    *f;
+    uint64_t t0;      // time 0 of the dump
+    uint64_t last;    // last time written
+    bool     started;
+    int      value[VCD_SIGNALS]; // -1: unknown
+} vcd_t;
+
+bool vcdOpen ( vcd_t *v, const char *name, uint64_t t0, const char *comment );
+void vcdSet ( vcd_t *v, int signal, int value, uint64_t t );
+void vcdClose ( vcd_t *v, uint64_t t );
+
+#endif
@@ -0,0 +1,217 @@
+// CE-140F emulator - console file transfer, simulated on a pty
+//
+// Runs the firmware transfer code (../xfer.cpp) on top of a local
+// directory, standing for the SD card, to try and test ce140f_xfer
+// with no board attached.
+//
+// Build:  g++ -O2 -o xfer_sim xfer_sim.cpp ../xfer.cpp
+// Usage:  xfer_sim [-l loss%] [-t] <dir>
+//         (prints the pty to give ce140f_xfer; -l drops bytes at random, e.g. 0.01,
+//          both ways, to exercise the retries; -t adds console text
+//          traces in between, as the firmware does)
+////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include "../xfer.h"
+
+int         master = -1;
+std::string home;
+double      lossPercent = 0;
+bool        traces = false;
+
+bool lost ( void ) {
+    return lossPercent > 0 && drand48() * 100 < lossPercent;
+}
+
+// backend (see xfer.h)
+void xferSerialWrite ( const uint8_t *buf, uint16_t len ) {
+    while ( len-- ) {
+        uint8_t c = *buf++;
+        if ( lost() )
+            continue;
+        while ( write ( master, &c, 1 ) < 0 && errno == EAGAIN )
+            usleep ( 100 );
+    }
+}
+
+uint32_t xferMicros ( void ) {
+    struct timespec ts;
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+std::string path ( const char *name ) {
+    return home + "/" + name;
+}
+
+void *xferFsOpen ( const char *name, char mode, uint32_t *size ) {
+    FILE *f = fopen ( path(name).c_str(), mode == 'r' ? "rb" : "wb" );
+    if ( f != NULL && size ) {
+        fseek ( f, 0, SEEK_END );
+        *size = ftell ( f );
+        fseek ( f, 0, SEEK_SET );
+    }
+    return f;
+}
+
+int xferFsRead ( void *f, uint8_t *buf, uint32_t len ) {
+    return fread ( buf, 1, len, (FILE *)f );
+}
+
+int xferFsWrite ( void *f, const uint8_t *buf, uint32_t len ) {
+    return fwrite ( buf, 1, len, (FILE *)f );
+}
+
+bool xferFsSeek ( void *f, uint32_t pos ) {
+    return fseek ( (FILE *)f, pos, SEEK_SET ) == 0;
+}
+
+void xferFsClose ( void *f ) {
+    fclose ( (FILE *)f );
+}
+
+bool xferFsCommit ( void *f, const char *name, uint32_t size, uint32_t hash ) {
+    (void)name; // no manifest here
+    (void)size;
+    (void)hash;
+    return fclose ( (FILE *)f ) == 0;
+}
+
+void xferFsDiscard ( void *f, const char *name ) {
+    fclose ( (FILE *)f );
+    unlink ( path(name).c_str() );
+}
+
+bool xferFsRemove ( const char *name ) {
+    return unlink ( path(name).c_str() ) == 0;
+}
+
+bool xferFsDirEntry ( int n, char *name, uint32_t *size ) {
+    DIR *d = opendir ( home.c_str() );
+    struct dirent *e;
+    bool found = false;
+    if ( d == NULL )
+        return false;
+    while ( (e = readdir ( d )) != NULL ) {
+        struct stat st;
+        if ( strlen ( e->d_name ) > 12 || stat ( path(e->d_name).c_str(), &st ) != 0
+          || !S_ISREG ( st.st_mode ) )
+            continue;
+        if ( n-- == 0 ) {
+            strcpy ( name, e->d_name );
+            *size = st.st_size;
+            found = true;
+            break;
+        }
+    }
+    closedir ( d );
+    return found;
+}
+
+// no manifest here: hashed on each listing
+DIR *sumDir;
+
+bool xferFsSumOpen ( void ) {
+    sumDir = opendir ( home.c_str() );
+    return sumDir != NULL;
+}
+
+int xferFsSumNext ( char *name, uint32_t *size, uint32_t *hash ) {
+    struct dirent *e;
+    while ( (e = readdir ( sumDir )) != NULL ) {
+        struct stat st;
+        if ( strlen ( e->d_name ) > 12 || stat ( path(e->d_name).c_str(), &st ) != 0
+          || !S_ISREG ( st.st_mode ) )
+            continue;
+        FILE *f = fopen ( path(e->d_name).c_str(), "rb" );
+        uint8_t buf[4096];
+        size_t n;
+        if ( f == NULL )
+            return -1;
+        *hash = XFER_HASH_INIT;
+        while ( (n = fread ( buf, 1, sizeof(buf), f )) > 0 )
+            *hash = xferHash ( *hash, buf, n );
+        fclose ( f );
+        strcpy ( name, e->d_name );
+        *size = st.st_size;
+        return 1;
+    }
+    return 0;
+}
+
+void xferFsSumClose ( void ) {
+    closedir ( sumDir );
+}
+
+int main ( int argc, char **argv ) {
+    int opt;
+    while ( (opt = getopt ( argc, argv, "l:t" )) != -1 ) {
+        switch ( opt ) {
+            case 'l': lossPercent = atof ( optarg ); break;
+            case 't': traces = true; break;
+            default:
+                fprintf ( stderr, "usage: xfer_sim [-l loss%%] [-t] <dir>\n" );
+                return 1;
+        }
+    }
+    if ( optind >= argc ) {
+        fprintf ( stderr, "usage: xfer_sim [-l loss%%] [-t] <dir>\n" );
+        return 1;
+    }
+    home = argv[optind];
+
+    master = posix_openpt ( O_RDWR | O_NOCTTY );
+    if ( master < 0 || grantpt ( master ) != 0 || unlockpt ( master ) != 0 ) {
+        perror ( "pty" );
+        return 2;
+    }
+    // raw, on the emulator side too
+    struct termios t;
+    int slave = open ( ptsname ( master ), O_RDWR | O_NOCTTY );
+    tcgetattr ( slave, &t );
+    cfmakeraw ( &t );
+    tcsetattr ( slave, TCSANOW, &t );
+    fcntl ( master, F_SETFL, O_NONBLOCK );
+    printf ( "%s\n", ptsname ( master ) );
+    fflush ( stdout );
+    srand48 ( time ( NULL ) );
+
+    uint32_t lastTrace = xferMicros();
+    while ( true ) {
+        uint8_t buf[256];
+        struct pollfd p = { master, POLLIN, 0 };
+        poll ( &p, 1, 1 );
+        ssize_t n = read ( master, buf, sizeof(buf) );
+        for ( ssize_t i=0; i<n; i++ ) {
+            if ( lost() )
+                continue;
+            if ( !xferRxByte ( buf[i] ) )
+                fputc ( buf[i], stderr ); // console text
+        }
+        while ( xferPoll() ) {
+            // keep pumping while a transfer runs, as the main loop does
+            n = read ( master, buf, sizeof(buf) );
+            for ( ssize_t i=0; i<n; i++ )
+                if ( !lost() )
+                    xferRxByte ( buf[i] );
+            if ( traces && (uint32_t)(xferMicros() - lastTrace) > 50000 ) {
+                // like pc.putc('c') from a Sharp command interrupt
+                const uint8_t c[] = "c\n";
+                write ( master, c, 2 );
+                lastTrace = xferMicros();
+            }
+            usleep ( 200 );
+        }
+    }
+}
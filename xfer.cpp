@@ -0,0 +1,429 @@
+#include <string.h>
+#include "xfer.h"
+
+// Console file transfer.
+// The serial interrupt only queues the frame bytes (xferRxByte), frames are
+// decoded and served by the main loop (xferPoll), between two Sharp commands
+// (run there too, see events.cpp).
+// Sliding window, go-back-N: the sender keeps up to a window of blocks
+// in flight, the receiver only takes them in order and acknowledges
+// cumulatively; on a NAK or an ACK timeout the sender goes back to the
+// first block not acknowledged - re-reading it from the file, no copies.
+
+#define XFER_IDLE      0
+#define XFER_SENDING   1 // GET
+#define XFER_RECEIVING 2 // PUT
+
+// receive ring, fed by the serial interrupt
+INSTANCE volatile uint8_t  xferRing[XFER_RING];
+INSTANCE volatile uint16_t xferRingHead = 0;
+INSTANCE volatile uint16_t xferRingTail = 0;
+INSTANCE volatile uint8_t  xferRxHdr = 0;    // frame bytes seen, up to the header end
+INSTANCE volatile uint8_t  xferRxLenLo;
+INSTANCE volatile uint16_t xferRxLeft;       // then frame bytes still expected
+INSTANCE volatile uint32_t xferRxCount = 0;  // bytes queued, ever
+INSTANCE volatile uint32_t xferOverruns = 0;
+
+// frame being decoded
+INSTANCE uint8_t  xferFrm[XFER_HDR + XFER_BLOCK + 2];
+INSTANCE uint16_t xferFrmPos = 0;
+INSTANCE uint32_t xferSeenCount = 0;
+INSTANCE uint32_t xferSeenTime = 0;
+INSTANCE uint32_t xferLastFrame;
+INSTANCE bool     xferEverActive = false;
+
+// transfer in progress
+INSTANCE uint8_t  xferState = XFER_IDLE;
+INSTANCE void    *xferFile;
+INSTANCE char     xferName[13];
+INSTANCE uint32_t xferSize;
+INSTANCE uint32_t xferBlocks;
+INSTANCE uint32_t xferBase;      // first block not acknowledged (GET) / expected (PUT)
+INSTANCE uint32_t xferNext;      // next block to send (GET)
+INSTANCE uint32_t xferFilePos;   // file position, to seek only when going back
+INSTANCE uint32_t xferHashRx;    // PUT: hash of the blocks received, for the manifest
+INSTANCE uint32_t xferTime;      // last progress
+INSTANCE uint8_t  xferRetries;
+INSTANCE bool     xferNaked;     // NAK sent, waiting for the sender to go back
+// last PUT, to repeat its END if that got lost
+INSTANCE bool     xferDoneValid = false;
+INSTANCE uint8_t  xferDoneSeq;
+INSTANCE uint32_t xferDoneSize;
+
+bool xferRxByte ( uint8_t c ) {
+    if ( xferRxHdr == 0 ) {
+        if ( c != XFER_SOF )
+            return false; // console text
+        xferRxHdr = 1;
+    } else if ( xferRxHdr < XFER_HDR ) {
+        if ( ++xferRxHdr == XFER_HDR - 1 )
+            xferRxLenLo = c;
+        if ( xferRxHdr == XFER_HDR ) {
+            uint16_t len = xferRxLenLo | (c << 8);
+            xferRxLeft = len + 2;
+            if ( len > XFER_BLOCK )
+                xferRxHdr = 0; // bad length, dropped by the decoder
+        }
+    } else if ( --xferRxLeft == 0 ) {
+        xferRxHdr = 0;
+    }
+    uint16_t next = (xferRingHead + 1) % XFER_RING;
+    if ( next == xferRingTail ) {
+        xferOverruns++; // frame lost, recovered by a retry
+    } else {
+        xferRing[xferRingHead] = c;
+        xferRingHead = next;
+    }
+    xferRxCount++;
+    return true;
+}
+
+void xferSend ( uint8_t type, uint8_t seq, const uint8_t *data, uint16_t len ) {
+    uint8_t hdr[XFER_HDR] = { XFER_SOF, type, seq, (uint8_t)len, (uint8_t)(len >> 8) };
+    uint16_t crc = xferCrc ( 0xFFFF, hdr+1, XFER_HDR-1 );
+    crc = xferCrc ( crc, data, len );
+    uint8_t t[2] = { (uint8_t)crc, (uint8_t)(crc >> 8) };
+    xferLastFrame = xferMicros(); // console busy with frames, sending too
+    xferSerialWrite ( hdr, XFER_HDR );
+    if ( len > 0 )
+        xferSerialWrite ( data, len );
+    xferSerialWrite ( t, 2 );
+}
+
+void xferSendError ( const char *reason ) {
+    xferSend ( XFER_ERR, 0, (const uint8_t *)reason, strlen(reason) );
+}
+
+// OK reply to GET and PUT: size, block size and window
+void xferSendOk ( uint32_t size ) {
+    uint8_t p[7];
+    xferPut32 ( p, size );
+    p[4] = XFER_BLOCK & 0xFF;
+    p[5] = XFER_BLOCK >> 8;
+    p[6] = XFER_WINDOW;
+    xferSend ( XFER_OK, 0, p, sizeof(p) );
+}
+
+void xferSendEnd ( uint8_t seq, uint32_t value ) {
+    uint8_t p[4];
+    xferPut32 ( p, value );
+    xferSend ( XFER_END, seq, p, sizeof(p) );
+}
+
+uint16_t xferBlockLen ( uint32_t block ) {
+    uint32_t left = xferSize - block * XFER_BLOCK;
+    return ( left < XFER_BLOCK ) ? left : XFER_BLOCK;
+}
+
+// 8.3 names, home directory only
+bool xferNameOk ( const uint8_t *p, uint16_t len ) {
+    if ( len < 1 || len > 12 )
+        return false;
+    for ( int i=0; i<len; i++ )
+        if ( p[i] <= ' ' || p[i] >= 0x7F || strchr ( "/\\:*?\"<>|", p[i] ) != NULL )
+            return false;
+    return true;
+}
+
+void xferAbort ( void ) {
+    if ( xferState == XFER_SENDING )
+        xferFsClose ( xferFile );
+    if ( xferState == XFER_RECEIVING )
+        xferFsDiscard ( xferFile, xferName );
+    xferState = XFER_IDLE;
+}
+
+// GET: send block xferNext, reading it straight from the file
+bool xferSendBlock ( void ) {
+    uint32_t pos = xferNext * XFER_BLOCK;
+    uint16_t len = xferBlockLen ( xferNext );
+    uint8_t hdr[XFER_HDR] = { XFER_SOF, XFER_DATA, (uint8_t)xferNext, (uint8_t)len, (uint8_t)(len >> 8) };
+    uint8_t chunk[64];
+    bool ok = true;
+
+    if ( xferFilePos != pos && !xferFsSeek ( xferFile, pos ) )
+        return false;
+    xferFilePos = pos;
+    xferLastFrame = xferMicros();
+    uint16_t crc = xferCrc ( 0xFFFF, hdr+1, XFER_HDR-1 );
+    xferSerialWrite ( hdr, XFER_HDR );
+    while ( len > 0 ) {
+        uint16_t n = ( len < sizeof(chunk) ) ? len : sizeof(chunk);
+        if ( ok && xferFsRead ( xferFile, chunk, n ) != n )
+            ok = false; // complete the frame anyway, with a bad CRC
+        if ( !ok )
+            memset ( chunk, 0, n );
+        crc = xferCrc ( crc, chunk, n );
+        xferSerialWrite ( chunk, n );
+        xferFilePos += n;
+        len -= n;
+    }
+    if ( !ok )
+        crc = ~crc;
+    uint8_t t[2] = { (uint8_t)crc, (uint8_t)(crc >> 8) };
+    xferSerialWrite ( t, 2 );
+    return ok;
+}
+
+void xferDir ( void ) {
+    uint8_t p[4 + 13];
+    uint32_t size;
+    int n = 0;
+    while ( xferFsDirEntry ( n, (char *)p+4, &size ) ) {
+        xferPut32 ( p, size );
+        xferSend ( XFER_ENTRY, n, p, 4 + strlen((char *)p+4) );
+        n++;
+    }
+    xferSendEnd ( n, n );
+}
+
+// listing with content hashes, for the incremental sync (tools/ce140f_xfer):
+// slow where the hashes are not in the card manifest yet, and read from the files
+void xferSums ( void ) {
+    uint8_t p[8 + 13];
+    uint32_t size, hash;
+    int n = 0;
+    if ( !xferFsSumOpen () ) {
+        xferSendError ( "no card" );
+        return;
+    }
+    int r;
+    while ( ( r = xferFsSumNext ( (char *)p+8, &size, &hash ) ) > 0 ) {
+        xferPut32 ( p, size );
+        xferPut32 ( p+4, hash );
+        xferSend ( XFER_SUM, n, p, 8 + strlen((char *)p+8) );
+        n++;
+    }
+    xferFsSumClose ();
+    if ( r < 0 ) {
+        xferSendError ( "read error" ); // no hash made up for it
+        return;
+    }
+    xferSendEnd ( n, n );
+}
+
+void xferRequest ( uint8_t type, const uint8_t *p, uint16_t len ) {
+    xferAbort (); // a new request cancels any transfer left over
+    xferDoneValid = false;
+    switch ( type ) {
+        case XFER_DIR:
+            xferDir ();
+            return;
+        case XFER_SUMS:
+            xferSums ();
+            return;
+        case XFER_DEL:
+        case XFER_GET:
+            if ( !xferNameOk ( p, len ) ) {
+                xferSendError ( "bad name" );
+                return;
+            }
+            memcpy ( xferName, p, len );
+            xferName[len] = 0;
+            break;
+        case XFER_PUT:
+            if ( len < 4 || !xferNameOk ( p+4, len-4 ) ) {
+                xferSendError ( "bad name" );
+                return;
+            }
+            memcpy ( xferName, p+4, len-4 );
+            xferName[len-4] = 0;
+            break;
+        default:
+            xferSendError ( "unknown request" );
+            return;
+    }
+    if ( type == XFER_DEL ) {
+        if ( xferFsRemove ( xferName ) )
+            xferSend ( XFER_OK, 0, NULL, 0 );
+        else
+            xferSendError ( "not found" );
+        return;
+    }
+    xferBase = 0;
+    xferNext = 0;
+    xferFilePos = 0;
+    xferRetries = 0;
+    xferNaked = false;
+    xferHashRx = XFER_HASH_INIT;
+    xferTime = xferMicros();
+    if ( type == XFER_GET ) {
+        xferFile = xferFsOpen ( xferName, 'r', &xferSize );
+        if ( xferFile == NULL ) {
+            xferSendError ( "not found" );
+            return;
+        }
+        xferState = XFER_SENDING;
+    } else {
+        xferSize = xferGet32 ( p );
+        xferFile = xferFsOpen ( xferName, 'w', NULL );
+        if ( xferFile == NULL ) {
+            xferSendError ( "cannot create" );
+            return;
+        }
+        xferState = XFER_RECEIVING;
+    }
+    xferBlocks = ( xferSize + XFER_BLOCK - 1 ) / XFER_BLOCK;
+    xferSendOk ( xferSize );
+    if ( xferBlocks == 0 ) {
+        // empty file: done already
+        if ( type == XFER_GET )
+            xferFsClose ( xferFile );
+        else
+            xferFsCommit ( xferFile, xferName, 0, xferHashRx );
+        xferState = XFER_IDLE;
+        xferSendEnd ( 0, 0 );
+    }
+}
+
+// GET: ACK / NAK from the host
+void xferAcknowledged ( uint8_t type, uint8_t seq ) {
+    uint8_t acked = (uint8_t)(seq - (uint8_t)xferBase);
+    if ( acked > xferNext - xferBase )
+        return; // stale
+    if ( acked > 0 ) {
+        xferBase += acked;
+        xferRetries = 0;
+        xferTime = xferMicros();
+    }
+    if ( type == XFER_NAK )
+        xferNext = xferBase; // go back
+    if ( xferBase == xferBlocks ) {
+        xferFsClose ( xferFile );
+        xferState = XFER_IDLE;
+        xferSendEnd ( xferBlocks, xferSize );
+    }
+}
+
+// PUT: block from the host
+void xferReceived ( uint8_t seq, const uint8_t *p, uint16_t len ) {
+    uint8_t ahead = (uint8_t)(seq - (uint8_t)xferBase);
+    xferTime = xferMicros();
+    if ( ahead != 0 || len != xferBlockLen ( xferBase ) ) {
+        if ( ahead >= 0x80 ) {
+            // resent, already here: the ACK got lost
+            xferSend ( XFER_ACK, xferBase, NULL, 0 );
+        } else if ( !xferNaked ) {
+            // one missing: NAK once, then wait for the sender to go back
+            xferSend ( XFER_NAK, xferBase, NULL, 0 );
+            xferNaked = true;
+        }
+        return;
+    }
+    if ( xferFsWrite ( xferFile, p, len ) != len ) {
+        xferFsDiscard ( xferFile, xferName );
+        xferState = XFER_IDLE;
+        xferSendError ( "write error" );
+        return;
+    }
+    xferHashRx = xferHash ( xferHashRx, p, len );
+    xferBase++;
+    xferNaked = false;
+    xferSend ( XFER_ACK, xferBase, NULL, 0 );
+    if ( xferBase == xferBlocks ) {
+        xferState = XFER_IDLE;
+        if ( !xferFsCommit ( xferFile, xferName, xferSize, xferHashRx ) ) {
+            xferSendError ( "close error" );
+            return;
+        }
+        xferDoneValid = true;
+        xferDoneSeq = seq;
+        xferDoneSize = xferSize;
+        xferSendEnd ( xferBlocks, xferSize );
+    }
+}
+
+void xferFrame ( uint8_t type, uint8_t seq, const uint8_t *p, uint16_t len ) {
+    xferLastFrame = xferMicros();
+    xferEverActive = true;
+    if ( type < XFER_DATA ) {
+        xferRequest ( type, p, len );
+    } else if ( xferState == XFER_SENDING && ( type == XFER_ACK || type == XFER_NAK ) ) {
+        xferAcknowledged ( type, seq );
+    } else if ( xferState == XFER_RECEIVING && type == XFER_DATA ) {
+        xferReceived ( seq, p, len );
+    } else if ( xferState == XFER_IDLE && type == XFER_DATA
+             && xferDoneValid && seq == xferDoneSeq ) {
+        // last block again: the final END was lost
+        xferSend ( XFER_ACK, seq + 1, NULL, 0 );
+        xferSendEnd ( seq + 1, xferDoneSize );
+    }
+}
+
+// decode the queued bytes
+void xferDecode ( void ) {
+    while ( xferRingTail != xferRingHead ) {
+        uint8_t c = xferRing[xferRingTail];
+        xferRingTail = (xferRingTail + 1) % XFER_RING;
+        if ( xferFrmPos == 0 && c != XFER_SOF )
+            continue; // resync
+        xferFrm[xferFrmPos++] = c;
+        if ( xferFrmPos < XFER_HDR )
+            continue;
+        uint16_t len = xferFrm[3] | (xferFrm[4] << 8);
+        if ( len > XFER_BLOCK ) {
+            xferFrmPos = 0;
+            continue;
+        }
+        if ( xferFrmPos < XFER_HDR + len + 2 )
+            continue;
+        xferFrmPos = 0;
+        uint16_t crc = xferCrc ( 0xFFFF, xferFrm+1, XFER_HDR-1 + len );
+        if ( crc != ( xferFrm[XFER_HDR+len] | (xferFrm[XFER_HDR+len+1] << 8) ) ) {
+            if ( xferState == XFER_RECEIVING && !xferNaked ) {
+                xferSend ( XFER_NAK, xferBase, NULL, 0 );
+                xferNaked = true;
+            }
+            continue;
+        }
+        xferFrame ( xferFrm[1], xferFrm[2], xferFrm+XFER_HDR, len );
+    }
+}
+
+bool xferPoll ( void ) {
+    uint32_t now;
+
+    xferDecode ();
+    now = xferMicros();
+    // a frame cut short: stop swallowing console input after a while
+    if ( xferRxCount != xferSeenCount ) {
+        xferSeenCount = xferRxCount;
+        xferSeenTime = now;
+    } else if ( ( xferRxHdr != 0 || xferFrmPos != 0 )
+             && (uint32_t)(now - xferSeenTime) > XFER_RETRY_US ) {
+        xferRxHdr = 0;
+        xferFrmPos = 0;
+    }
+    switch ( xferState ) {
+        case XFER_SENDING:
+            if ( (uint32_t)(now - xferTime) > XFER_RETRY_US ) {
+                if ( ++xferRetries > XFER_RETRIES ) {
+                    xferAbort ();
+                    xferSendError ( "timeout" );
+                    break;
+                }
+                xferNext = xferBase; // resend the window
+                xferTime = now;
+            }
+            // one block per call, so that ACKs are handled in between
+            if ( xferNext < xferBlocks && xferNext < xferBase + XFER_WINDOW ) {
+                if ( !xferSendBlock () ) {
+                    xferAbort ();
+                    xferSendError ( "read error" );
+                    break;
+                }
+                xferNext++;
+            }
+            break;
+        case XFER_RECEIVING:
+            if ( (uint32_t)(now - xferTime) > XFER_ABORT_US )
+                xferAbort (); // the host is gone
+            break;
+    }
+    return ( xferState != XFER_IDLE );
+}
+
+bool xferActive ( void ) {
+    return xferState != XFER_IDLE || xferRxHdr != 0
+        || ( xferEverActive && (uint32_t)(xferMicros() - xferLastFrame) < XFER_QUIET_US );
+}
@@ -0,0 +1,98 @@
+#ifndef XFER_H
+#define XFER_H
+#include <stdint.h>
+#include "instance.h"
+
+// File transfer over the serial console (protocol in protocol.md, section 4)
+// No mbed in here: the same code runs in the host simulator (tools/xfer_sim.cpp),
+// the backend functions at the bottom being provided by the firmware
+// (main.cpp, storage.cpp) or by the simulator.
+
+// frame: SOF type seq lenLo lenHi payload[len] crcLo crcHi
+// (CRC-16/CCITT, init 0xFFFF, over type..payload)
+#define XFER_SOF   0xA5 // never found in the console text commands
+#define XFER_HDR   5    // SOF to lenHi
+// requests (host to emulator)
+#define XFER_DIR   0x01 // -                     -> ENTRY... END(count)
+#define XFER_GET   0x02 // name                  -> OK(size,block,window) DATA... END(size)
+#define XFER_PUT   0x03 // size, name            -> OK(size,block,window), then DATA from the host
+#define XFER_DEL   0x04 // name                  -> OK / ERR
+#define XFER_SUMS  0x05 // -                     -> SUM... END(count)
+// transfer frames
+#define XFER_DATA  0x10 // seq = block number (mod 256)
+#define XFER_ACK   0x11 // seq = next block expected (cumulative)
+#define XFER_NAK   0x12 // seq = next block expected, go back to it
+#define XFER_OK    0x13
+#define XFER_ERR   0x14 // payload: reason (text)
+#define XFER_END   0x15
+#define XFER_ENTRY 0x16 // payload: size (4 bytes), 8.3 name
+#define XFER_SUM   0x17 // payload: size (4 bytes), hash (4 bytes), 8.3 name
+
+// block size, window (blocks in flight) and receive ring size
+#if defined TARGET_NUCLEO_L053R8
+#define XFER_BLOCK  128
+#define XFER_WINDOW 2
+#define XFER_RING   384
+#else
+#define XFER_BLOCK  512
+#define XFER_WINDOW 3
+#define XFER_RING   2048
+#endif
+
+#define XFER_RETRY_US 1000000  // no ACK progress: resend the window
+#define XFER_RETRIES  8
+#define XFER_ABORT_US 10000000 // host gone silent: drop the transfer
+#define XFER_QUIET_US 2000000  // console kept binary after the last frame
+
+inline uint16_t xferCrc ( uint16_t crc, const uint8_t *p, uint32_t len ) {
+    while ( len-- ) {
+        crc ^= (uint16_t)(*p++) << 8;
+        for ( int i=0; i<8; i++ )
+            crc = ( crc & 0x8000 ) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+inline void xferPut32 ( uint8_t *p, uint32_t v ) {
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+inline uint32_t xferGet32 ( const uint8_t *p ) {
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// file content hash (FNV-1a, 32 bits), as kept in the card manifest
+#define XFER_HASH_INIT 2166136261u
+
+inline uint32_t xferHash ( uint32_t h, const uint8_t *p, uint32_t len ) {
+    while ( len-- ) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// serial interrupt side: true if the byte belongs to a frame
+bool     xferRxByte ( uint8_t c );
+// main loop side: true while a transfer is in progress
+bool     xferPoll ( void );
+// true while the console is used for transfers (no text output, no deep sleep)
+bool     xferActive ( void );
+
+// backend
+void     xferSerialWrite ( const uint8_t *buf, uint16_t len );
+uint32_t xferMicros ( void );
+void    *xferFsOpen ( const char *name, char mode, uint32_t *size ); // 'r' / 'w'
+int      xferFsRead ( void *f, uint8_t *buf, uint32_t len );
+int      xferFsWrite ( void *f, const uint8_t *buf, uint32_t len );
+bool     xferFsSeek ( void *f, uint32_t pos );
+void     xferFsClose ( void *f );                                    // read
+bool     xferFsCommit ( void *f, const char *name, uint32_t size, uint32_t hash ); // written
+void     xferFsDiscard ( void *f, const char *name );                // incomplete
+bool     xferFsRemove ( const char *name );
+bool     xferFsDirEntry ( int n, char *name, uint32_t *size );       // n-th file
+bool     xferFsSumOpen ( void );                                     // listing, with hashes
+int      xferFsSumNext ( char *name, uint32_t *size, uint32_t *hash ); // 1, 0 end, EOF error
+void     xferFsSumClose ( void );
+
+#endif